@@ -46,8 +46,8 @@ static void restore(void *arg)
 
 static plugin_t plugin = {
 	.name = __FILE__,
-	.hook[HOOK_BASEFS_UP] = { .cb  = restore },
-	.hook[HOOK_SHUTDOWN]  = { .cb  = save    }
+	.hook[HOOK_BASEFS_UP] = { .cb  = restore, .async = 10000 },
+	.hook[HOOK_SHUTDOWN]  = { .cb  = save,    .async = 10000 }
 };
 
 PLUGIN_INIT(plugin_init)
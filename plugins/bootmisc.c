@@ -21,44 +21,55 @@
  * THE SOFTWARE.
  */
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <ftw.h>
-#include <mntent.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <lite/lite.h>
 
 #include "config.h"
 #include "finit.h"
 #include "helpers.h"
 #include "plugin.h"
+#include "sig.h"
 #include "utmp-api.h"
 
+#define CLEAN_WORKERS     4
+#define CLEAN_SUFFIX      "-bootclean"
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_CLASS_SHIFT 13
+
+struct clean_dirent {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
+
 static int is_tmpfs(char *path)
 {
 	int tmpfs = 0;
-	FILE *fp;
-	char *dir;
-	struct mntent *mnt;
+	char *dir, *type;
 
 	/* If path is a symlink, check what it resolves to */
 	dir = realpath(path, NULL);
 	if (!dir)
 		return 0;	/* Outlook not so good */
 
-	fp = setmntent("/proc/mounts", "r");
-	if (!fp) {
-		free(dir);
-		return 0;	/* Dunno, maybe not */
-	}
-
-	while ((mnt = getmntent(fp))) {
-		if (!strcmp(dir, mnt->mnt_dir))
-			break;
-	}
-
-	if (mnt && !strcmp("tmpfs", mnt->mnt_type))
+	type = mnttype(dir);
+	if (type && !strcmp("tmpfs", type))
 		tmpfs = 1;
-
-	endmntent(fp);
 	free(dir);
 
 	return tmpfs;
@@ -75,6 +86,245 @@ static int do_clean(const char *fpath, const struct stat *sb, int tflag, struct
 	return 0;
 }
 
+/*
+ * Remove everything in directory @dfd.  At the top level the entries
+ * are split between @workers processes on a hash of their name.  The
+ * directory is re-read until a pass finds nothing to remove, since
+ * removing entries while reading a directory may skip some.
+ */
+static void rmtree(int dfd, int worker, int workers)
+{
+	char buf[8192];
+	int found;
+
+	do {
+		long len;
+
+		found = 0;
+		lseek(dfd, 0, SEEK_SET);
+		while ((len = syscall(SYS_getdents64, dfd, buf, sizeof(buf))) > 0) {
+			for (long pos = 0; pos < len; ) {
+				struct clean_dirent *d = (struct clean_dirent *)&buf[pos];
+				unsigned int hash = 5381;
+				char *name = d->d_name;
+				int type = d->d_type;
+				struct stat st;
+
+				pos += d->d_reclen;
+				if (!strcmp(name, ".") || !strcmp(name, ".."))
+					continue;
+
+				if (workers > 1) {
+					for (char *ptr = name; *ptr; ptr++)
+						hash = hash * 33 + *ptr;
+					if (hash % workers != (unsigned int)worker)
+						continue;
+				}
+
+				if (type == DT_UNKNOWN) {
+					if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW))
+						continue;
+					if (S_ISDIR(st.st_mode))
+						type = DT_DIR;
+				}
+
+				if (type == DT_DIR) {
+					int fd;
+
+					fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+					if (fd != -1) {
+						rmtree(fd, 0, 1);
+						close(fd);
+					}
+					if (!unlinkat(dfd, name, AT_REMOVEDIR))
+						found = 1;
+				} else if (!unlinkat(dfd, name, 0)) {
+					found = 1;
+				}
+			}
+		}
+	} while (found);
+}
+
+/* Is @name an old directory renamed aside by bootclean() for @base? */
+static int is_aside(const char *name, const char *base)
+{
+	size_t len = strlen(base);
+
+	return name[0] == '.' && !strncmp(&name[1], base, len) &&
+		string_match(&name[len + 1], CLEAN_SUFFIX "-");
+}
+
+/* Remove all old @base directories renamed aside in @path */
+static void clean_aside(const char *path, const char *base, int workers)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((d = readdir(dir))) {
+		pid_t pids[CLEAN_WORKERS];
+		int fd;
+
+		if (!is_aside(d->d_name, base))
+			continue;
+
+		fd = openat(dirfd(dir), d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+
+		for (int w = 0; w < workers; w++) {
+			pids[w] = fork();
+			if (pids[w] == 0) {
+				rmtree(fd, w, workers);
+				_exit(0);
+			}
+		}
+		for (int w = 0; w < workers; w++) {
+			if (pids[w] > 0)
+				waitpid(pids[w], NULL, 0);
+		}
+
+		/* Anything a failed fork left behind */
+		rmtree(fd, 0, 1);
+		close(fd);
+
+		if (unlinkat(dirfd(dir), d->d_name, AT_REMOVEDIR))
+			_pe("Failed removing %s/%s", path, d->d_name);
+		else
+			_d("Removed %s/%s", path, d->d_name);
+	}
+	closedir(dir);
+}
+
+/*
+ * Remove all old directories renamed aside by bootclean(), including
+ * any left from an earlier boot that was cut short.  Runs in the
+ * background at idle priority, with a few worker processes per tree.
+ */
+static void cleaner(char *dirs[], int num)
+{
+	int workers;
+
+	sig_unblock();
+	setsid();
+	setpriority(PRIO_PROCESS, 0, 19);
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1)
+		workers = 1;
+	if (workers > CLEAN_WORKERS)
+		workers = CLEAN_WORKERS;
+
+	for (int i = 0; i < num; i++) {
+		char *parent, *base;
+
+		base = strrchr(dirs[i], '/');
+		if (!base || !base[1])
+			continue;
+		parent = strndupa(dirs[i], base - dirs[i]);
+		base++;
+
+		/* Renamed aside in the parent, or moved into a subdirectory */
+		clean_aside(parent[0] ? parent : "/", base, workers);
+		clean_aside(dirs[i], base, workers);
+	}
+
+	_exit(0);
+}
+
+/*
+ * Rename @dir aside, to .NAME-bootclean-N in the same parent directory,
+ * and create a new empty one with the same owner and mode.  If @dir is
+ * a mount point it cannot be renamed, instead its contents are moved
+ * into a .NAME-bootclean-N subdirectory of it, which is as fast since
+ * rename does not care about the size of what is moved.
+ */
+static int rename_aside(char *dir)
+{
+	char old[PATH_MAX], *parent, *base;
+	struct stat st;
+	int fd, rc = -1;
+
+	if (stat(dir, &st))
+		return -1;
+
+	base = strrchr(dir, '/');
+	if (!base || !base[1])
+		return -1;
+	parent = strndupa(dir, base - dir);
+	base++;
+
+	for (int i = 0; i < 100; i++) {
+		snprintf(old, sizeof(old), "%s/.%s%s-%d", parent, base, CLEAN_SUFFIX, i);
+		if (!rename(dir, old)) {
+			if (mkdir(dir, 0)) {
+				_pe("Failed recreating %s", dir);
+				rename(old, dir);
+				return -1;
+			}
+			chown(dir, st.st_uid, st.st_gid);
+			chmod(dir, st.st_mode & 07777);
+			return 0;
+		}
+
+		if (errno == EBUSY || errno == EXDEV)
+			break;
+		if (errno != EEXIST && errno != ENOTEMPTY)
+			return -1;
+	}
+
+	/* Mount point, move everything to a subdirectory instead */
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	for (int i = 0; i < 100; i++) {
+		snprintf(old, sizeof(old), ".%s%s-%d", base, CLEAN_SUFFIX, i);
+		if (!mkdirat(fd, old, 0700)) {
+			rc = 0;
+			break;
+		}
+		if (errno != EEXIST)
+			break;
+	}
+
+	while (!rc) {
+		char buf[8192];
+		int moved = 0;
+		long len;
+
+		lseek(fd, 0, SEEK_SET);
+		while ((len = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+			for (long pos = 0; pos < len; ) {
+				struct clean_dirent *d = (struct clean_dirent *)&buf[pos];
+				char path[PATH_MAX];
+
+				pos += d->d_reclen;
+				if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..") ||
+				    is_aside(d->d_name, base))
+					continue;
+
+				snprintf(path, sizeof(path), "%s/%s", old, d->d_name);
+				if (renameat(fd, d->d_name, fd, path))
+					rc = -1;
+				else
+					moved = 1;
+			}
+		}
+
+		if (!moved)
+			break;
+	}
+	close(fd);
+
+	return rc;
+}
+
 /* We can safely skip tmpfs, nothing to clean from previous boot there */
 static void bootclean(void)
 {
@@ -84,13 +334,44 @@ static void bootclean(void)
 		"/var/lock/",
 		NULL
 	};
+	char *clean[NELEMS(dir)];
+	int num = 0;
 
 	for (int i = 0; dir[i]; i++) {
+		char *path;
+
 		if (is_tmpfs(dir[i]))
 			continue;
 
-		nftw(dir[i], do_clean, 20, FTW_DEPTH);
+		path = realpath(dir[i], NULL);
+		if (!path)
+			continue;
+
+		/*
+		 * Boot does not wait for the old files to be removed, they
+		 * are renamed aside and removed in the background.  Fall
+		 * back to removing them here if that fails.
+		 */
+		if (rename_aside(path)) {
+			_d("Cannot rename %s aside, cleaning it now", path);
+			nftw(dir[i], do_clean, 20, FTW_DEPTH);
+		}
+
+		clean[num++] = path;
 	}
+
+	if (num > 0) {
+		pid_t pid;
+
+		pid = fork();
+		if (pid == 0)
+			cleaner(clean, num);
+		if (pid == -1)
+			_pe("Failed starting background cleaner");
+	}
+
+	while (num > 0)
+		free(clean[--num]);
 }
 
 /*
@@ -191,6 +472,7 @@ static plugin_t plugin = {
 	.hook[HOOK_BASEFS_UP] = {
 		.cb  = setup
 	},
+	.bootonly = 1
 };
 
 PLUGIN_INIT(plugin_init)
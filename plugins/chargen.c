@@ -29,6 +29,12 @@
 
 #define NAME    "chargen"
 #define PATTERN "!\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~ "
+#define WIDTH   72
+#define LINE    (WIDTH + 2)
+#define LINES   (sizeof(PATTERN) - 1)
+
+/* All lines of the pattern, pre-generated for the fast path */
+static char ring[LINES * LINE];
 
 static char *generator(char *buf, size_t buflen)
 {
@@ -95,15 +101,61 @@ static int cb(int type)
 	return send_peer(sd, buf, sizeof(buf), (struct sockaddr *)&sa, sa_len);
 }
 
+/* Copy whole lines from the ring, continuing where the last call ended */
+static size_t ring_fill(char *buf, size_t size)
+{
+	static size_t pos = 0;
+	size_t num, len = size - size % LINE;
+
+	for (num = 0; num < len; ) {
+		size_t chunk = sizeof(ring) - pos;
+
+		if (chunk > len - num)
+			chunk = len - num;
+		memcpy(&buf[num], &ring[pos], chunk);
+		num += chunk;
+		pos  = (pos + chunk) % sizeof(ring);
+	}
+
+	return len;
+}
+
+/*
+ * In-process fast path, UDP gets one line per datagram, TCP clients
+ * get as many lines as fits in @buf each time the socket is writable.
+ */
+static ssize_t reply(int type, char *buf, size_t len, size_t size)
+{
+	if (type == SOCK_DGRAM)
+		return ring_fill(buf, LINE);
+	if (len)
+		return 0;	/* Input is discarded */
+
+	return ring_fill(buf, size);
+}
+
 static plugin_t plugin = {
 	.name  = NAME,		/* Must match the inetd /etc/services entry */
 	.inetd = {
-		.cmd = cb
+		.cmd   = cb,
+		.reply = reply,
+		.flags = INETD_REPLY_FLOOD
 	},
 };
 
 PLUGIN_INIT(plugin_init)
 {
+	const char pattern[] = PATTERN;
+
+	for (size_t i = 0; i < LINES; i++) {
+		char *line = &ring[i * LINE];
+
+		for (size_t j = 0; j < WIDTH; j++)
+			line[j] = pattern[(i + j) % LINES];
+		line[WIDTH]     = '\r';
+		line[WIDTH + 1] = '\n';
+	}
+
 	plugin_register(&plugin);
 }
 
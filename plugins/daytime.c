@@ -77,10 +77,18 @@ static int cb(int type)
 	return send_peer(sd, buf, sizeof(buf), (struct sockaddr *)&sa, sa_len);
 }
 
+/* In-process fast path, TCP clients get one reply on connect */
+static ssize_t reply(int type, char *buf, size_t len, size_t size)
+{
+	return strlen(daytime(buf, size));
+}
+
 static plugin_t plugin = {
 	.name  = NAME,		/* Must match the inetd /etc/services entry */
 	.inetd = {
-		.cmd = cb
+		.cmd   = cb,
+		.reply = reply,
+		.flags = INETD_REPLY_ONCE
 	}
 };
 
@@ -42,10 +42,17 @@ static int cb(int type)
 	return 0;
 }
 
+/* In-process fast path, never a reply */
+static ssize_t reply(int type, char *buf, size_t len, size_t size)
+{
+	return 0;
+}
+
 static plugin_t plugin = {
 	.name  = "discard",	/* Must match the inetd /etc/services entry */
 	.inetd = {
-		.cmd = cb
+		.cmd   = cb,
+		.reply = reply
 	},
 };
 
@@ -31,15 +31,31 @@
  *             "     | xargs -0 sort -u -z"
  *             "     | xargs -0 modprobe -abq");
  *
+ * Instead of calling modprobe for each alias, the aliases are resolved
+ * using modules.alias, which usually brings hundreds of aliases down
+ * to a handful of modules.  These are then loaded, along with their
+ * dependencies from modules.dep, using finit_module() from a few worker
+ * processes.  Modules that need anything more than options from the
+ * modprobe.d configuration, e.g. install or softdep, or that cannot be
+ * loaded directly, are left to modprobe.  Without modules.alias we fall
+ * back to calling modprobe with all the aliases.
+ *
  * Note: BusyBox must *not* be built with CONFIG_MODPROBE_SMALL
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <fnmatch.h>
 #include <ftw.h>
+#include <glob.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>		/* gettimeofday() */
 #include <sys/types.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
 #include <lite/lite.h>
 
 #include "config.h"
@@ -47,23 +63,68 @@
 #include "helpers.h"
 #include "plugin.h"
 
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE 4
+#endif
+
+#define MODPROBE_WORKERS 4	/* Max number of parallel loaders */
+#define MODPROBE_BATCH   64	/* Max aliases per modprobe call */
+#define ALIAS_BUCKETS    64
+
+#ifndef COMMAND_LINE_SIZE
+#define COMMAND_LINE_SIZE 4096	/* Largest of all arches, see asm/setup.h */
+#endif
+
+/* Device alias, from /sys/devices */
+struct modalias {
+	TAILQ_ENTRY(modalias) link;
+	char *alias;
+};
+
+/* Pattern from modules.alias, hashed on the part before ':', or modprobe.d */
+struct alias {
+	LIST_ENTRY(alias) link;
+	char  *pattern;
+	size_t fixed;		/* Length of pattern before any wildcard */
+	char  *module;
+};
+
+/* Module to load, with its dependencies from modules.dep */
 struct module {
 	TAILQ_ENTRY(module) link;
-	char *alias;
+	char *name;
+	char *path;
+	char *deps;
+};
+
+/* Anything we know about a module from modprobe.d and /proc/cmdline */
+struct modconf {
+	TAILQ_ENTRY(modconf) link;
+	char *name;
+	char *options;
+	int   blacklist;
+	int   modprobe;
 };
 
-static TAILQ_HEAD(, module) modules  = TAILQ_HEAD_INITIALIZER(modules);
+static TAILQ_HEAD(, modalias) aliases = TAILQ_HEAD_INITIALIZER(aliases);
+static TAILQ_HEAD(, module)   modules = TAILQ_HEAD_INITIALIZER(modules);
+static TAILQ_HEAD(, modconf)  confs   = TAILQ_HEAD_INITIALIZER(confs);
 
-static int modprobe(char *alias)
+static LIST_HEAD(, alias) alias_index[ALIAS_BUCKETS + 1]; /* Last is for wildcards */
+static LIST_HEAD(, alias) alias_conf = LIST_HEAD_INITIALIZER(); /* modprobe.d */
+
+static char moddir[PATH_MAX];
+
+static int modprobe(char *opt, char *names[], int num)
 {
-	char *args[] = {
-		"modprobe",
-		"-abq",
-		alias,
-		NULL,
-	};
+	char *args[num + 3];
 	pid_t pid;
 
+	args[0] = "modprobe";
+	args[1] = opt;
+	memcpy(&args[2], names, num * sizeof(char *));
+	args[num + 2] = NULL;
+
 	pid = fork();
 	switch (pid) {
 	case -1:
@@ -71,19 +132,32 @@ static int modprobe(char *alias)
 		return 1;
 	case 0:
 		execvp(args[0], args);
-		break;
+		_exit(1);
 	default:
 		if (!complete(args[0], pid))
-			_d("Successful modprobe of %s", alias);
+			_d("Successful modprobe of %s%s", names[0], num > 1 ? " ..." : "");
 		break;
 	}
 
 	return 0;
 }
 
+/* Module names use '_' in the kernel, but either in file names */
+static char *modname(char *name)
+{
+	char *ptr;
+
+	for (ptr = name; *ptr; ptr++) {
+		if (*ptr == '-')
+			*ptr = '_';
+	}
+
+	return name;
+}
+
 static void alias_add(char *alias)
 {
-	struct module *m;
+	struct modalias *m;
 
 	m = malloc(sizeof(*m));
 	if (!m)
@@ -94,21 +168,21 @@ static void alias_add(char *alias)
 		return;
 	}
 
-	TAILQ_INSERT_TAIL(&modules, m, link);
+	TAILQ_INSERT_TAIL(&aliases, m, link);
 }
 
-static void alias_remove(struct module *m)
+static void alias_remove(struct modalias *m)
 {
-	TAILQ_REMOVE(&modules, m, link);
+	TAILQ_REMOVE(&aliases, m, link);
 	free(m->alias);
 	free(m);
-}	
+}
 
 static int alias_exist(char *alias)
 {
-	struct module *m;
+	struct modalias *m;
 
-	TAILQ_FOREACH(m, &modules, link) {
+	TAILQ_FOREACH(m, &aliases, link) {
 		if (!strcmp(m->alias, alias))
 			return 1;
 	}
@@ -137,9 +211,544 @@ static int scan_alias(const char *path, const struct stat *st, int flag, struct
 	return 0;
 }
 
+/* Bucket for pci:v00008086d..., patterns with wildcards in the prefix last */
+static int index_hash(const char *alias)
+{
+	unsigned int hash = 5381;
+	const char *ptr;
+
+	for (ptr = alias; *ptr && *ptr != ':'; ptr++) {
+		if (strchr("*?[", *ptr))
+			return ALIAS_BUCKETS;
+		hash = hash * 33 + *ptr;
+	}
+
+	return hash % ALIAS_BUCKETS;
+}
+
+static struct alias *alias_new(char *pattern, char *module)
+{
+	struct alias *a;
+
+	a = malloc(sizeof(*a));
+	if (!a)
+		return NULL;
+
+	a->pattern = strdup(pattern);
+	a->fixed   = strcspn(pattern, "*?[");
+	a->module  = strdup(modname(module));
+	if (!a->pattern || !a->module) {
+		free(a->pattern);
+		free(a->module);
+		free(a);
+		return NULL;
+	}
+
+	return a;
+}
+
+static void alias_free(struct alias *a)
+{
+	LIST_REMOVE(a, link);
+	free(a->pattern);
+	free(a->module);
+	free(a);
+}
+
+/* Read modules.alias into memory, lines are: alias PATTERN MODULE */
+static int index_load(void)
+{
+	char file[PATH_MAX];
+	char buf[512];
+	FILE *fp;
+
+	for (int i = 0; i <= ALIAS_BUCKETS; i++)
+		LIST_INIT(&alias_index[i]);
+
+	snprintf(file, sizeof(file), "%s/modules.alias", moddir);
+	fp = fopen(file, "r");
+	if (!fp)
+		return -1;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		char *pattern, *module, *ptr = buf;
+		struct alias *a;
+
+		if (strcmp(strsep(&ptr, " \t\n") ?: "", "alias"))
+			continue;
+		pattern = strsep(&ptr, " \t\n");
+		module  = strsep(&ptr, " \t\n");
+		if (!pattern || !module || !*pattern || !*module)
+			continue;
+
+		a = alias_new(pattern, module);
+		if (!a)
+			break;
+
+		LIST_INSERT_HEAD(&alias_index[index_hash(pattern)], a, link);
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+static void index_free(void)
+{
+	for (int i = 0; i <= ALIAS_BUCKETS; i++) {
+		struct alias *a, *tmp;
+
+		LIST_FOREACH_SAFE(a, &alias_index[i], link, tmp)
+			alias_free(a);
+	}
+}
+
+static struct modconf *conf_find(char *name, int create)
+{
+	struct modconf *c;
+
+	TAILQ_FOREACH(c, &confs, link) {
+		if (!strcmp(c->name, name))
+			return c;
+	}
+
+	if (!create)
+		return NULL;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->name = strdup(name);
+	if (!c->name) {
+		free(c);
+		return NULL;
+	}
+	TAILQ_INSERT_TAIL(&confs, c, link);
+
+	return c;
+}
+
+static void conf_options(struct modconf *c, char *options)
+{
+	char *opts;
+
+	if (!c->options) {
+		c->options = strdup(options);
+		return;
+	}
+
+	opts = malloc(strlen(c->options) + strlen(options) + 2);
+	if (!opts)
+		return;
+	sprintf(opts, "%s %s", c->options, options);
+	free(c->options);
+	c->options = opts;
+}
+
+/*
+ * Read the modprobe.d configuration, only alias, options and blacklist
+ * are handled here.  Modules with install, remove, or softdep commands,
+ * or options on the kernel command line, are left to modprobe.
+ */
+static void conf_load(void)
+{
+	char *dirs[] = { "/etc/modprobe.d", "/run/modprobe.d", "/lib/modprobe.d", NULL };
+	char buf[512], *line = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	for (int i = 0; dirs[i]; i++) {
+		char pattern[64];
+		glob_t gl;
+
+		snprintf(pattern, sizeof(pattern), "%s/*.conf", dirs[i]);
+		if (glob(pattern, 0, NULL, &gl))
+			continue;
+
+		for (size_t j = 0; j < gl.gl_pathc; j++) {
+			fp = fopen(gl.gl_pathv[j], "r");
+			if (!fp)
+				continue;
+
+			while (fgets(buf, sizeof(buf), fp)) {
+				char *cmd, *name, *ptr = buf;
+				struct modconf *c;
+
+				cmd  = strsep(&ptr, " \t\n");
+				name = strsep(&ptr, " \t\n");
+				if (!cmd || !name || !*name)
+					continue;
+
+				/* alias PATTERN MODULE, name is the pattern */
+				if (!strcmp(cmd, "alias")) {
+					char *module = strsep(&ptr, " \t\n");
+					struct alias *a;
+
+					if (!module || !*module)
+						continue;
+
+					a = alias_new(name, module);
+					if (a)
+						LIST_INSERT_HEAD(&alias_conf, a, link);
+					continue;
+				}
+
+				c = conf_find(modname(name), 1);
+				if (!c)
+					continue;
+
+				if (!strcmp(cmd, "blacklist"))
+					c->blacklist = 1;
+				else if (!strcmp(cmd, "options") && ptr)
+					conf_options(c, chomp(ptr));
+				else if (!strcmp(cmd, "install") || !strcmp(cmd, "remove") ||
+					 !strcmp(cmd, "softdep"))
+					c->modprobe = 1;
+			}
+			fclose(fp);
+		}
+		globfree(&gl);
+	}
+
+	fp = fopen("/proc/cmdline", "r");
+	if (!fp)
+		return;
+
+	/* Sized to the command line, the kernel caps it at COMMAND_LINE_SIZE */
+	if (getline(&line, &len, fp) != -1) {
+		char *arg, *ptr = line;
+
+		if (strlen(line) >= COMMAND_LINE_SIZE)
+			line[COMMAND_LINE_SIZE - 1] = 0;
+
+		while ((arg = strsep(&ptr, " \t\n"))) {
+			struct modconf *c;
+			char *dot;
+
+			if (string_match(arg, "modprobe.blacklist=")) {
+				char *name, *list = &arg[19];
+
+				while ((name = strsep(&list, ","))) {
+					c = conf_find(modname(name), 1);
+					if (c)
+						c->blacklist = 1;
+				}
+				continue;
+			}
+
+			dot = strchr(arg, '.');
+			if (!dot || dot == arg || strchr(arg, '=') < dot)
+				continue;
+			*dot = 0;
+
+			c = conf_find(modname(arg), 1);
+			if (c)
+				c->modprobe = 1;
+		}
+	}
+	free(line);
+	fclose(fp);
+}
+
+static void conf_free(void)
+{
+	struct modconf *c, *tmp;
+	struct alias *a, *next;
+
+	LIST_FOREACH_SAFE(a, &alias_conf, link, next)
+		alias_free(a);
+
+	TAILQ_FOREACH_SAFE(c, &confs, link, tmp) {
+		TAILQ_REMOVE(&confs, c, link);
+		free(c->options);
+		free(c->name);
+		free(c);
+	}
+}
+
+static void module_add(char *name)
+{
+	struct modconf *c;
+	struct module *m;
+	char path[PATH_MAX];
+
+	TAILQ_FOREACH(m, &modules, link) {
+		if (!strcmp(m->name, name))
+			return;
+	}
+
+	c = conf_find(name, 0);
+	if (c && c->blacklist) {
+		_d("Skipping blacklisted module %s", name);
+		return;
+	}
+
+	snprintf(path, sizeof(path), "/sys/module/%s", name);
+	if (fexist(path))
+		return;		/* Already loaded */
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return;
+	m->name = strdup(name);
+	if (!m->name) {
+		free(m);
+		return;
+	}
+
+	TAILQ_INSERT_TAIL(&modules, m, link);
+}
+
+static void module_remove(struct module *m)
+{
+	TAILQ_REMOVE(&modules, m, link);
+	free(m->deps);
+	free(m->path);
+	free(m->name);
+	free(m);
+}
+
+/* Matching aliases in modprobe.d, added like modules.alias ones */
+static int resolve_conf(struct modalias *ma)
+{
+	struct alias *a;
+	int found = 0;
+
+	LIST_FOREACH(a, &alias_conf, link) {
+		if (!fnmatch(a->pattern, ma->alias, 0)) {
+			module_add(a->module);
+			found = 1;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Resolve all device aliases to a set of unique modules.  Like modprobe,
+ * aliases in modprobe.d take precedence over those in modules.alias.
+ */
+static void resolve(void)
+{
+	struct modalias *ma, *tmp;
+
+	TAILQ_FOREACH_SAFE(ma, &aliases, link, tmp) {
+		int buckets[] = { index_hash(ma->alias), ALIAS_BUCKETS };
+
+		if (resolve_conf(ma)) {
+			alias_remove(ma);
+			continue;
+		}
+
+		for (size_t i = 0; i < NELEMS(buckets); i++) {
+			struct alias *a;
+
+			LIST_FOREACH(a, &alias_index[buckets[i]], link) {
+				if (strncmp(a->pattern, ma->alias, a->fixed))
+					continue;
+				if (!fnmatch(a->pattern, ma->alias, 0))
+					module_add(a->module);
+			}
+		}
+
+		alias_remove(ma);
+	}
+}
+
+/* Find path and dependencies of all modules, lines are: PATH: [DEP ...] */
+static void resolve_deps(void)
+{
+	char file[PATH_MAX];
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	snprintf(file, sizeof(file), "%s/modules.dep", moddir);
+	fp = fopen(file, "r");
+	if (!fp)
+		return;
+
+	while (getline(&buf, &len, fp) != -1) {
+		char name[64], *path, *deps, *ptr;
+		struct module *m;
+
+		deps = buf;
+		path = strsep(&deps, ":");
+		if (!deps)
+			continue;
+
+		ptr = strrchr(path, '/');
+		strlcpy(name, ptr ? ptr + 1 : path, sizeof(name));
+		ptr = strstr(name, ".ko");
+		if (ptr)
+			*ptr = 0;
+		modname(name);
+
+		TAILQ_FOREACH(m, &modules, link) {
+			if (strcmp(m->name, name))
+				continue;
+
+			m->path = strdup(path);
+			m->deps = strdup(chomp(deps));
+			break;
+		}
+	}
+	free(buf);
+	fclose(fp);
+}
+
+/* Load a single module file, relative to moddir, without dependencies */
+static int load(char *path)
+{
+	struct modconf *c;
+	char file[PATH_MAX];
+	char name[64], *ptr;
+	int flags = 0;
+	int fd, rc;
+
+	ptr = strrchr(path, '/');
+	strlcpy(name, ptr ? ptr + 1 : path, sizeof(name));
+	ptr = strstr(name, ".ko");
+	if (!ptr)
+		return -1;
+	if (ptr[3])
+		flags = MODULE_INIT_COMPRESSED_FILE;
+	*ptr = 0;
+
+	c = conf_find(modname(name), 0);
+	if (c && c->modprobe)
+		return -1;
+
+	snprintf(file, sizeof(file), "%s/%s", moddir, path);
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	rc = syscall(SYS_finit_module, fd, c && c->options ? c->options : "", flags);
+	if (rc && errno == EEXIST)
+		rc = 0;
+	close(fd);
+
+	return rc;
+}
+
+/*
+ * Load a module and its dependencies.  Deps in modules.dep are listed
+ * with the most basic last, so they are loaded in reverse order.  Two
+ * workers sharing a dependency is fine, the kernel lets the second one
+ * wait for the first and then returns EEXIST.
+ */
+static int load_module(struct module *m)
+{
+	char *deps[64];
+	size_t num = 0;
+	char *ptr;
+
+	if (!m->path)
+		goto fallback;
+
+	ptr = m->deps;
+	while (ptr && num < NELEMS(deps)) {
+		char *dep = strsep(&ptr, " \t");
+
+		if (*dep)
+			deps[num++] = dep;
+	}
+	if (ptr)
+		goto fallback;
+
+	while (num > 0) {
+		if (load(deps[--num]))
+			goto fallback;
+	}
+
+	if (load(m->path))
+		goto fallback;
+
+	_d("Loaded module %s", m->name);
+	return 0;
+fallback:
+	_d("Cannot load %s directly, calling modprobe", m->name);
+	return modprobe("-bq", &m->name, 1);
+}
+
+/*
+ * Split the modules between a few worker processes, the bulk of the
+ * time loading a module is spent in its init function, probing the
+ * hardware, and most modules here are for different devices.
+ */
+static int load_all(void)
+{
+	pid_t pids[MODPROBE_WORKERS];
+	struct module *m;
+	int num = 0, workers;
+	int rc = 0;
+
+	TAILQ_FOREACH(m, &modules, link)
+		num++;
+	if (!num)
+		return 0;
+
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1)
+		workers = 1;
+	if (workers > MODPROBE_WORKERS)
+		workers = MODPROBE_WORKERS;
+	if (workers > num)
+		workers = num;
+
+	for (int w = 0; w < workers; w++) {
+		pids[w] = fork();
+		if (pids[w] == -1) {
+			_pe("Failed forking module loader");
+			rc++;
+			continue;
+		}
+
+		if (pids[w] == 0) {
+			int i = 0;
+
+			TAILQ_FOREACH(m, &modules, link) {
+				if (i++ % workers == w)
+					rc += load_module(m);
+			}
+			_exit(rc);
+		}
+	}
+
+	for (int w = 0; w < workers; w++) {
+		if (pids[w] > 0)
+			rc += complete("module loader", pids[w]);
+	}
+
+	return rc;
+}
+
+/* No modules.alias, call modprobe with the unique aliases instead */
+static int load_aliases(void)
+{
+	struct modalias *m, *tmp;
+	char *names[MODPROBE_BATCH];
+	int num = 0;
+	int rc = 0;
+
+	TAILQ_FOREACH(m, &aliases, link) {
+		names[num++] = m->alias;
+		if (num == MODPROBE_BATCH || !TAILQ_NEXT(m, link)) {
+			rc += modprobe("-abq", names, num);
+			num = 0;
+		}
+	}
+
+	TAILQ_FOREACH_SAFE(m, &aliases, link, tmp)
+		alias_remove(m);
+
+	return rc;
+}
+
 static void coldplug(void *arg)
 {
 	struct module *m, *tmp;
+	struct utsname uts;
 	int rc = 0;
 
 	if (!fismnt("/sys")) {
@@ -149,20 +758,36 @@ static void coldplug(void *arg)
 
 	print_desc("Cold plugging system", NULL);
 	rc = nftw("/sys/devices", scan_alias, 200, FTW_DEPTH | FTW_PHYS);
-	if (!rc) {
-		TAILQ_FOREACH_SAFE(m, &modules, link, tmp) {
-			rc += modprobe(m->alias);
-			alias_remove(m);
-		}
+	if (rc)
+		goto done;
+
+	uname(&uts);
+	snprintf(moddir, sizeof(moddir), "/lib/modules/%s", uts.release);
+	if (index_load()) {
+		_d("No modules.alias in %s, calling modprobe for all aliases", moddir);
+		rc = load_aliases();
+		goto done;
 	}
 
+	conf_load();
+	resolve();
+	index_free();
+	resolve_deps();
+
+	rc = load_all();
+
+	TAILQ_FOREACH_SAFE(m, &modules, link, tmp)
+		module_remove(m);
+	conf_free();
+done:
 	print_result(rc);
 }
 
 static plugin_t plugin = {
 	.name = __FILE__,
 	.hook[HOOK_BASEFS_UP] = { .cb  = coldplug },
-	.depends = { "bootmisc", }
+	.depends = { "bootmisc", },
+	.bootonly = 1
 };
 
 PLUGIN_INIT(plugin_init)
@@ -87,6 +87,7 @@ static plugin_t plugin = {
 	.hook[HOOK_BASEFS_UP] = {
 		.cb  = load
 	},
+	.bootonly = 1
 };
 
 PLUGIN_INIT(plugin_init)
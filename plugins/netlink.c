@@ -23,6 +23,8 @@
 #include <linux/types.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <lite/lite.h>
+#include <lite/queue.h>
 #include <unistd.h>
 
 #include "finit.h"
@@ -30,30 +32,88 @@
 #include "helpers.h"
 #include "plugin.h"
 
-static int nlmsg_validate(struct nlmsghdr *nh, size_t len)
+#ifndef NL_RCVBUF
+#define NL_RCVBUF  (1024 * 1024)
+#endif
+#define NL_BUCKETS 64
+#define NL_FLAGS   (IFF_UP | IFF_RUNNING)
+
+/*
+ * Last known state of each interface and default route, used to only
+ * touch conditions on actual transitions, and to reconcile after the
+ * kernel has dropped messages on us (ENOBUFS).
+ */
+struct nl_iface {
+	LIST_ENTRY(nl_iface) link;
+	int           ifindex;
+	unsigned int  flags;	/* IFF_UP | IFF_RUNNING */
+	unsigned int  gen;	/* Last resync seen in */
+	char          ifname[IFNAMSIZ];
+};
+
+struct nl_route {
+	LIST_ENTRY(nl_route) link;
+	unsigned int  table;
+	unsigned int  metric;
+	int           oif;
+	int           gw;
+	unsigned int  gen;
+};
+
+static LIST_HEAD(, nl_iface) iface_list[NL_BUCKETS];
+static LIST_HEAD(, nl_route) route_list = LIST_HEAD_INITIALIZER(route_list);
+
+/* Resync state machine: dump links, then routes, then sweep stale */
+enum { DUMP_NONE, DUMP_LINK, DUMP_ROUTE };
+static int          dump;
+static int          dump_again;
+static unsigned int dump_seq;
+static unsigned int gen;
+
+static void net_cond_set(char *ifname, char *cond, int set)
 {
-	if (!NLMSG_OK(nh, len))
-		return 1;
+	char msg[MAX_ARG_LEN];
 
-	if (nh->nlmsg_type == NLMSG_DONE) {
-		_d("Done with netlink messages.");
-		return 1;
-	}
+	snprintf(msg, sizeof(msg), "net/%s/%s", ifname, cond);
+	if (set)
+		cond_set(msg);
+	else
+		cond_clear(msg);
+}
+
+static void route_update(int had)
+{
+	int has = !LIST_EMPTY(&route_list);
+
+	if (had == has)
+		return;
 
-	if (nh->nlmsg_type == NLMSG_ERROR) {
-		_d("Netlink reports error.");
-		return 1;
+	if (has)
+		cond_set("net/route/default");
+	else
+		cond_clear("net/route/default");
+}
+
+static struct nl_route *route_find(struct nl_route *key)
+{
+	struct nl_route *rt;
+
+	LIST_FOREACH(rt, &route_list, link) {
+		if (rt->table == key->table && rt->metric == key->metric &&
+		    rt->oif == key->oif && rt->gw == key->gw)
+			return rt;
 	}
 
-	return 0;
+	return NULL;
 }
 
 static void nl_route(struct nlmsghdr *nlmsg)
 {
+	struct nl_route key = { 0 }, *rt;
 	struct rtmsg *r;
 	struct rtattr *a;
-	int la;
-	int gw = 0, dst = 0, mask = 0, idx = 0;
+	int la, had;
+	int dst = 0, mask = 0;
 
 	if (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg))) {
 		_e("Packet too small or truncated!");
@@ -63,54 +123,92 @@ static void nl_route(struct nlmsghdr *nlmsg)
 	r  = NLMSG_DATA(nlmsg);
 	a  = RTM_RTA(r);
 	la = RTM_PAYLOAD(nlmsg);
+	key.table = r->rtm_table;
 	while (RTA_OK(a, la)) {
 		void *data = RTA_DATA(a);
 		switch (a->rta_type) {
 		case RTA_GATEWAY:
-			gw = *((int *)data);
-			//_d("GW: 0x%04x", gw);
+			key.gw = *((int *)data);
 			break;
 
 		case RTA_DST:
 			dst = *((int *)data);
 			mask = r->rtm_dst_len;
-			//_d("MASK: 0x%04x", mask);
 			break;
 
 		case RTA_OIF:
-			idx = *((int *)data);
-			//_d("IDX: 0x%04x", idx);
+			key.oif = *((int *)data);
+			break;
+
+		case RTA_PRIORITY:
+			key.metric = *((unsigned int *)data);
+			break;
+
+		case RTA_TABLE:
+			key.table = *((unsigned int *)data);
 			break;
 		}
 
 		a = RTA_NEXT(a, la);
 	}
 
-	if ((!dst && !mask) && (gw || idx)) {
-		if (nlmsg->nlmsg_type == RTM_DELROUTE)
-			cond_clear("net/route/default");
-		else
-			cond_set("net/route/default");
+	if (dst || mask || (!key.gw && !key.oif))
+		return;
+
+	had = !LIST_EMPTY(&route_list);
+	rt  = route_find(&key);
+	if (nlmsg->nlmsg_type == RTM_DELROUTE) {
+		if (rt) {
+			LIST_REMOVE(rt, link);
+			free(rt);
+		}
+	} else {
+		if (!rt) {
+			rt = malloc(sizeof(*rt));
+			if (!rt) {
+				_pe("Failed allocating default route");
+				return;
+			}
+			*rt = key;
+			LIST_INSERT_HEAD(&route_list, rt, link);
+		}
+		rt->gen = gen;
 	}
+	route_update(had);
 }
 
-static void net_cond_set(char *ifname, char *cond, int set)
+static struct nl_iface *iface_find(int ifindex)
 {
-	char msg[MAX_ARG_LEN];
+	struct nl_iface *iface;
 
-	snprintf(msg, sizeof(msg), "net/%s/%s", ifname, cond);
-	if (set)
-		cond_set(msg);
-	else
-		cond_clear(msg);
+	LIST_FOREACH(iface, &iface_list[ifindex % NL_BUCKETS], link) {
+		if (iface->ifindex == ifindex)
+			return iface;
+	}
+
+	return NULL;
+}
+
+static void iface_del(struct nl_iface *iface)
+{
+	/* NOTE: Interface has disappeared, not link down ... */
+	_d("%s: Delete link", iface->ifname);
+	net_cond_set(iface->ifname, "exist",   0);
+	net_cond_set(iface->ifname, "up",      0);
+	net_cond_set(iface->ifname, "running", 0);
+
+	LIST_REMOVE(iface, link);
+	free(iface);
 }
 
 static void nl_link(struct nlmsghdr *nlmsg)
 {
 	int la;
-	char ifname[IFNAMSIZ + 1];
+	char ifname[IFNAMSIZ] = { 0 };
+	struct nl_iface *iface;
 	struct rtattr *a;
 	struct ifinfomsg *i;
+	unsigned int flags, changed;
 
 	if (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg))) {
 		_e("Packet too small or truncated!");
@@ -122,69 +220,201 @@ static void nl_link(struct nlmsghdr *nlmsg)
 	la = NLMSG_PAYLOAD(nlmsg, sizeof(struct ifinfomsg));
 
 	while (RTA_OK(a, la)) {
-		if (a->rta_type == IFLA_IFNAME) {
+		if (a->rta_type == IFLA_IFNAME)
 			strlcpy(ifname, RTA_DATA(a), sizeof(ifname));
-			switch (nlmsg->nlmsg_type) {
-			case RTM_NEWLINK:
-				/*
-				 * New interface has appeared, or interface flags has changed.
-				 * Check ifi_flags here to see if the interface is UP/DOWN
-				 */
-				_d("%s: New link, flags 0x%x, change 0x%x", ifname, i->ifi_flags, i->ifi_change);
-				net_cond_set(ifname, "exist",   1);
-				net_cond_set(ifname, "up",      i->ifi_flags & IFF_UP);
-				net_cond_set(ifname, "running", i->ifi_flags & IFF_RUNNING);
-				break;
-
-			case RTM_DELLINK:
-				/* NOTE: Interface has disappeared, not link down ... */
-				_d("%s: Delete link", ifname);
-				net_cond_set(ifname, "exist",   0);
-				net_cond_set(ifname, "up",      0);
-				net_cond_set(ifname, "running", 0);
-				break;
-
-			case RTM_NEWADDR:
-				_d("%s: New Address", ifname);
-				break;
-
-			case RTM_DELADDR:
-				_d("%s: Deconfig Address", ifname);
-				break;
-
-			default:
-				_d("%s: Msg 0x%x", ifname, nlmsg->nlmsg_type);
-				break;
-			}
+		a = RTA_NEXT(a, la);
+	}
+	if (!ifname[0])
+		return;
+
+	iface = iface_find(i->ifi_index);
+	switch (nlmsg->nlmsg_type) {
+	case RTM_NEWLINK:
+		/*
+		 * New interface has appeared, or interface flags has changed.
+		 * Only conditions for flags that differ from what we already
+		 * know about this ifindex are touched.
+		 */
+		_d("%s: New link, flags 0x%x, change 0x%x", ifname, i->ifi_flags, i->ifi_change);
+		if (iface && strcmp(iface->ifname, ifname)) {
+			_d("%s: Renamed to %s", iface->ifname, ifname);
+			iface_del(iface);
+			iface = NULL;
 		}
 
-		a = RTA_NEXT(a, la);
+		flags = i->ifi_flags & NL_FLAGS;
+		if (!iface) {
+			iface = calloc(1, sizeof(*iface));
+			if (!iface) {
+				_pe("Failed allocating %s", ifname);
+				return;
+			}
+			iface->ifindex = i->ifi_index;
+			strlcpy(iface->ifname, ifname, sizeof(iface->ifname));
+			LIST_INSERT_HEAD(&iface_list[iface->ifindex % NL_BUCKETS], iface, link);
+
+			net_cond_set(ifname, "exist", 1);
+			changed = flags;
+		} else
+			changed = iface->flags ^ flags;
+
+		if (changed & IFF_UP)
+			net_cond_set(ifname, "up",      flags & IFF_UP);
+		if (changed & IFF_RUNNING)
+			net_cond_set(ifname, "running", flags & IFF_RUNNING);
+
+		iface->flags = flags;
+		iface->gen   = gen;
+		break;
+
+	case RTM_DELLINK:
+		if (iface)
+			iface_del(iface);
+		break;
+
+	default:
+		_d("%s: Msg 0x%x", ifname, nlmsg->nlmsg_type);
+		break;
 	}
 }
 
-static void nl_callback(void *arg, int sd, int events)
+static int nl_request(int sd, int type, int family)
 {
-	ssize_t len;
-	static char buf[4096];
-	struct nlmsghdr *nh;
-
-	memset(buf, 0, sizeof(buf));
-	len = recv(sd, buf, sizeof(buf), 0);
-	if (len < 0) {
-		if (errno != EINTR)	/* Signal */
-			_pe("recv()");
+	struct {
+		struct nlmsghdr nh;
+		struct rtgenmsg g;
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len   = NLMSG_LENGTH(sizeof(req.g));
+	req.nh.nlmsg_type  = type;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq   = ++dump_seq;
+	req.g.rtgen_family = family;
+
+	if (send(sd, &req, req.nh.nlmsg_len, 0) < 0) {
+		_pe("Failed requesting netlink dump");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Start over with a full dump of all links and routes.  Anything in
+ * the cache not seen in the dump is swept when it completes.  Only one
+ * dump at a time can be in flight on a netlink socket.
+ */
+static void nl_resync(int sd)
+{
+	if (dump != DUMP_NONE) {
+		dump_again = 1;
 		return;
 	}
 
-	for (nh = (struct nlmsghdr *)buf; !nlmsg_validate(nh, len); nh = NLMSG_NEXT(nh, len)) {
-		//_d("Well formed netlink message received. type %d ...", nh->nlmsg_type);
-		if (nh->nlmsg_type == RTM_NEWROUTE || nh->nlmsg_type == RTM_DELROUTE)
+	gen++;
+	dump_again = 0;
+	if (!nl_request(sd, RTM_GETLINK, AF_UNSPEC))
+		dump = DUMP_LINK;
+}
+
+static void nl_dump_done(int sd)
+{
+	struct nl_iface *iface, *tmp;
+	struct nl_route *rt, *next;
+	int i, had;
+
+	switch (dump) {
+	case DUMP_LINK:
+		for (i = 0; i < NL_BUCKETS; i++) {
+			LIST_FOREACH_SAFE(iface, &iface_list[i], link, tmp) {
+				if (iface->gen != gen)
+					iface_del(iface);
+			}
+		}
+
+		dump = DUMP_NONE;
+		if (!nl_request(sd, RTM_GETROUTE, AF_INET))
+			dump = DUMP_ROUTE;
+		break;
+
+	case DUMP_ROUTE:
+		had = !LIST_EMPTY(&route_list);
+		LIST_FOREACH_SAFE(rt, &route_list, link, next) {
+			if (rt->gen != gen) {
+				LIST_REMOVE(rt, link);
+				free(rt);
+			}
+		}
+		route_update(had);
+
+		dump = DUMP_NONE;
+		if (dump_again)
+			nl_resync(sd);
+		break;
+	}
+}
+
+static void nl_msg(int sd, struct nlmsghdr *nh, size_t len)
+{
+	for (; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+		switch (nh->nlmsg_type) {
+		case NLMSG_DONE:
+			if (nh->nlmsg_seq == dump_seq)
+				nl_dump_done(sd);
+			break;
+
+		case NLMSG_ERROR:
+			_d("Netlink reports error.");
+			if (dump != DUMP_NONE && nh->nlmsg_seq == dump_seq) {
+				dump = DUMP_NONE;
+				dump_again = 1;
+			}
+			break;
+
+		case RTM_NEWROUTE:
+		case RTM_DELROUTE:
 			nl_route(nh);
-		else
+			break;
+
+		case RTM_NEWLINK:
+		case RTM_DELLINK:
 			nl_link(nh);
+			break;
+		}
 	}
 }
 
+static void nl_callback(void *arg, int sd, int events)
+{
+	static char buf[32768];
+	ssize_t len;
+
+	/* Step affected services once per wakeup, not once per message */
+	cond_batch_begin();
+	while (1) {
+		len = recv(sd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				logit(LOG_WARNING, "Netlink socket overrun, resynchronizing.");
+				dump_again = 1;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				_pe("recv()");
+			break;
+		}
+
+		nl_msg(sd, (struct nlmsghdr *)buf, len);
+	}
+
+	if (dump_again)
+		nl_resync(sd);
+	cond_batch_commit();
+}
+
 static void nl_reconf(void *arg)
 {
 	cond_reassert("net/");
@@ -199,9 +429,38 @@ static plugin_t plugin = {
 	},
 };
 
+/* netlink.rcvbuf=BYTES on the kernel command line overrides NL_RCVBUF */
+static int nl_rcvbuf(void)
+{
+	char buf[512], *arg, *ptr = buf;
+	const char *errstr;
+	int val = NL_RCVBUF;
+	FILE *fp;
+
+	fp = fopen("/proc/cmdline", "r");
+	if (!fp)
+		return val;
+
+	if (fgets(buf, sizeof(buf), fp)) {
+		while ((arg = strsep(&ptr, " \t\n"))) {
+			if (!string_match(arg, "netlink.rcvbuf="))
+				continue;
+
+			val = strtonum(&arg[15], 4096, INT_MAX, &errstr);
+			if (errstr) {
+				_w("Invalid netlink.rcvbuf=%s, %s", &arg[15], errstr);
+				val = NL_RCVBUF;
+			}
+		}
+	}
+	fclose(fp);
+
+	return val;
+}
+
 PLUGIN_INIT(plugin_init)
 {
-	int sd;
+	int sd, val;
 	struct sockaddr_nl sa;
 
 	sd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
@@ -210,6 +469,12 @@ PLUGIN_INIT(plugin_init)
 		return;
 	}
 
+	/* Bursts of link and route events must not overrun the socket */
+	val = nl_rcvbuf();
+	if (setsockopt(sd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)) &&
+	    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)))
+		_pe("Failed setting netlink receive buffer to %d bytes", val);
+
 	memset(&sa, 0, sizeof(sa));
 	sa.nl_family = AF_NETLINK;
 	sa.nl_groups = RTMGRP_IPV4_ROUTE | RTMGRP_LINK; // | RTMGRP_NOTIFY | RTMGRP_IPV4_IFADDR;
@@ -221,6 +486,9 @@ PLUGIN_INIT(plugin_init)
 		return;
 	}
 
+	/* Populate cache with links that exist already, replies handled in nl_callback() */
+	nl_resync(sd);
+
 	plugin.io.fd = sd;
 	plugin_register(&plugin);
 }
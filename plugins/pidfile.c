@@ -29,11 +29,14 @@
 #include <sys/inotify.h>
 
 #include "finit.h"
+#include "admit.h"
+#include "boot.h"
 #include "cond.h"
 #include "helpers.h"
 #include "pid.h"
 #include "plugin.h"
 #include "service.h"
+#include "shm.h"
 
 struct wd_entry {
 	TAILQ_ENTRY(wd_entry) link;
@@ -120,16 +123,24 @@ static void update_conds(char *dir, char *name, uint32_t mask)
 
 	_d("pidfile: Found svc %s for %s with pid %d", svc->name, fn, svc->pid);
 
+	/* Readiness is signaled using the notify socket instead */
+	if (svc->notify)
+		return;
+
 	mkcond(svc, cond, sizeof(cond));
 	if (mask & (IN_CREATE | IN_ATTRIB | IN_MODIFY | IN_MOVED_TO)) {
 		svc_started(svc);
+		boot_job_ready(svc);
+		admit_done(svc);
+		shm_svc(svc);
 		if (svc_is_forking(svc)) {
 			pid_t pid;
 
 			pid = pid_file_read(pid_file(svc));
 			_d("Forking service %s changed PID from %d to %d",
 			   svc->cmd, svc->pid, pid);
-			svc->pid = pid;
+			svc_set_pid(svc, pid);
+			service_schedule(svc);
 		}
 
 		cond_set(cond);
@@ -223,6 +234,7 @@ static void pidfile_callback(void *arg, int fd, int events)
 	_d("pidfile: Read %zd bytes, processing ...", sz);
 
 	off = 0;
+	cond_batch_begin();
 	for (off = 0; off < sz; off += sizeof(*ev) + ev->len) {
 		struct wd_entry *wde;
 
@@ -251,6 +263,7 @@ static void pidfile_callback(void *arg, int fd, int events)
 		if (ev->mask & (IN_CREATE | IN_ATTRIB | IN_MODIFY | IN_MOVED_TO))
 			update_conds(wde->path, ev->name, ev->mask);
 	}
+	cond_batch_commit();
 done:
 	free(buf);
 }
@@ -278,14 +291,13 @@ static void pidfile_reconf(void *arg)
 		if (cond_get(cond) == COND_ON)
 			continue;
 
-		cond_set_path(cond_path(cond), COND_ON);
+		cond_set_noupdate(cond);
 	}
 
 	/*
-	 * This will call service_step(), which in turn will schedule itself
-	 * as long as stepped services change state.  Services going from
-	 * WAITING to RUNNING will reassert their conditions in that loop,
-	 * which in turn may unlock other services, and so on.
+	 * This will call service_step() for all services.  Services going
+	 * from WAITING to RUNNING will reassert their conditions, which in
+	 * turn queues the services depending on them, and so on.
 	 */
 	service_step_all(SVC_TYPE_SERVICE | SVC_TYPE_RUNTASK | SVC_TYPE_INETD);
 }
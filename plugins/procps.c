@@ -54,6 +54,7 @@ static plugin_t plugin = {
 		.cb  = setup
 	},
 	.depends = { "bootmisc", },
+	.bootonly = 1
 };
 
 PLUGIN_INIT(plugin_init)
@@ -0,0 +1,316 @@
+/* Boot readahead, prefetch files used by services at the previous boot
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * At the end of every boot, when the system is up, the files mapped by
+ * each running service are recorded from /proc/PID/maps, i.e., its
+ * binary, the ELF interpreter, and all shared libraries actually used.
+ * For run/task only the command is known, it has already exited.  The
+ * list is in the order services were started, without duplicates, and
+ * only written if it has changed, to spare flash media.
+ *
+ * Early at the next boot, when the root file system is up, a child of
+ * PID 1 at the lowest CPU and idle I/O priority reads the list and
+ * calls readahead() on each file.  So service starts find their files
+ * in the page cache, without competing with them for the disk.  If the
+ * list is on a file system mounted from /etc/fstab, prefetch starts
+ * when all file systems are mounted instead.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "helpers.h"
+#include "plugin.h"
+#include "prio.h"
+#include "svc.h"
+
+#ifndef READAHEAD_LIST
+#define READAHEAD_LIST   "/var/lib/finit/readahead"
+#endif
+#define READAHEAD_MAX    2048		/* Files */
+#define READAHEAD_HASH   4096		/* Open addressing, > READAHEAD_MAX */
+
+struct list {
+	char   *file[READAHEAD_MAX];
+	int     num;
+	char   *hash[READAHEAD_HASH];
+};
+
+static int prefetched;
+
+static unsigned int hash(const char *str)
+{
+	unsigned int h = 5381;
+
+	while (*str)
+		h = h * 33 + (unsigned char)*str++;
+
+	return h;
+}
+
+static void add(struct list *l, const char *file)
+{
+	unsigned int i;
+
+	if (l->num >= READAHEAD_MAX || file[0] != '/')
+		return;
+
+	for (i = hash(file) % READAHEAD_HASH; l->hash[i]; i = (i + 1) % READAHEAD_HASH) {
+		if (!strcmp(l->hash[i], file))
+			return;
+	}
+
+	l->hash[i] = strdup(file);
+	if (l->hash[i])
+		l->file[l->num++] = l->hash[i];
+}
+
+/* Binary and all files mapped by a running process */
+static void add_maps(struct list *l, pid_t pid)
+{
+	char path[32], line[512];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	/* 7f2c4a3e1000-7f2c4a3e3000 r--p 00000000 b3:02 1234   /lib/libc.so.6 */
+	while (fgets(line, sizeof(line), fp)) {
+		char *file;
+
+		file = strchr(chomp(line), '/');
+		if (!file || strstr(file, " (deleted)"))
+			continue;
+
+		add(l, file);
+	}
+
+	fclose(fp);
+}
+
+/* Start order, from the boot profiler's point of view */
+static int order(const void *a, const void *b)
+{
+	const svc_t *x = *(const svc_t **)a, *y = *(const svc_t **)b;
+
+	if (x->start_time != y->start_time)
+		return x->start_time < y->start_time ? -1 : 1;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Returns 1 if @buf is already what is in READAHEAD_LIST */
+static int unchanged(const char *buf, size_t len)
+{
+	struct stat st;
+	int same = 0;
+	char *old;
+	FILE *fp;
+
+	if (stat(READAHEAD_LIST, &st) || (size_t)st.st_size != len)
+		return 0;
+
+	fp = fopen(READAHEAD_LIST, "r");
+	if (!fp)
+		return 0;
+
+	old = malloc(len + 1);
+	if (old) {
+		same = fread(old, 1, len, fp) == len && !memcmp(old, buf, len);
+		free(old);
+	}
+	fclose(fp);
+
+	return same;
+}
+
+static void save(struct list *l)
+{
+	char tmp[sizeof(READAHEAD_LIST) + 4], *buf = NULL, *dir;
+	size_t len = 0;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &len);
+	if (!fp)
+		return;
+	for (int i = 0; i < l->num; i++)
+		fprintf(fp, "%s\n", l->file[i]);
+	fclose(fp);
+
+	if (!buf || unchanged(buf, len))
+		goto done;
+
+	strlcpy(tmp, READAHEAD_LIST, sizeof(tmp));
+	dir = dirname(tmp);
+	if (makepath(dir) && errno != EEXIST) {
+		_pe("Failed creating %s", dir);
+		goto done;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.new", READAHEAD_LIST);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		_pe("Failed saving readahead list %s", tmp);
+		goto done;
+	}
+	if (fwrite(buf, 1, len, fp) != len || fclose(fp) || rename(tmp, READAHEAD_LIST)) {
+		_pe("Failed saving readahead list %s", READAHEAD_LIST);
+		remove(tmp);
+	} else
+		_d("Saved %d files to readahead list %s", l->num, READAHEAD_LIST);
+done:
+	free(buf);
+}
+
+/* When the system is up, record what services use for the next boot */
+static void record(void *arg)
+{
+	svc_t *svc, *iter = NULL, **all;
+	struct list *l;
+	int num = 0;
+
+	if (rescue)
+		return;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0))
+		num++;
+	if (!num)
+		return;
+
+	all = calloc(num, sizeof(svc_t *));
+	l = calloc(1, sizeof(*l));
+	if (!all || !l)
+		goto done;
+
+	num = 0;
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (svc->pid > 0 || (svc_is_runtask(svc) && svc->once))
+			all[num++] = svc;
+	}
+	qsort(all, num, sizeof(svc_t *), order);
+
+	for (int i = 0; i < num; i++) {
+		if (all[i]->pid > 0)
+			add_maps(l, all[i]->pid);
+		else
+			add(l, all[i]->cmd);
+	}
+
+	if (l->num)
+		save(l);
+
+	for (int i = 0; i < l->num; i++)
+		free(l->file[i]);
+done:
+	free(all);
+	free(l);
+}
+
+/* Runs in the child, only uses spare disk bandwidth */
+static void prefetch_all(FILE *fp)
+{
+	struct svc_prio prio = { 0 };
+	char nice[] = "nice:19", io[] = "ioprio:idle";
+	char file[PATH_MAX];
+	int num = 0;
+
+	prio_parse(&prio, nice);
+	prio_parse(&prio, io);
+	prio_apply(&prio, 0);
+
+	while (fgets(file, sizeof(file), fp)) {
+		struct stat st;
+		int fd;
+
+		fd = open(chomp(file), O_RDONLY | O_NOATIME | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode) && !readahead(fd, 0, st.st_size))
+			num++;
+		close(fd);
+	}
+
+	_d("Prefetched %d files", num);
+}
+
+static void prefetch(void *arg)
+{
+	FILE *fp;
+	pid_t pid;
+
+	if (prefetched || rescue)
+		return;
+
+	fp = fopen(READAHEAD_LIST, "r");
+	if (!fp)
+		return;		/* First boot, or not mounted yet */
+	prefetched = 1;
+
+	/* Not a service, collected as an unknown PID */
+	pid = fork();
+	if (!pid) {
+		prefetch_all(fp);
+		_exit(0);
+	}
+	if (pid == -1)
+		_pe("Failed starting readahead");
+
+	fclose(fp);
+}
+
+static plugin_t plugin = {
+	.name = __FILE__,
+	.hook[HOOK_ROOTFS_UP] = { .cb = prefetch },
+	.hook[HOOK_BASEFS_UP] = { .cb = prefetch },
+	.hook[HOOK_SYSTEM_UP] = { .cb = record   },
+};
+
+PLUGIN_INIT(plugin_init)
+{
+	plugin_register(&plugin);
+}
+
+PLUGIN_EXIT(plugin_exit)
+{
+	plugin_unregister(&plugin);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -51,6 +51,7 @@ static plugin_t plugin = {
 		.cb  = setup
 	},
 	.depends = { "bootmisc", },
+	.bootonly = 1
 };
 
 PLUGIN_INIT(plugin_init)
@@ -166,10 +166,12 @@ out:
 static plugin_t plugin = {
 	.name = __FILE__,
 	.hook[HOOK_BASEFS_UP] = {
-		.cb  = rtc_restore
+		.cb    = rtc_restore,
+		.async = 5000
 	},
 	.hook[HOOK_SHUTDOWN] = {
-		.cb  = rtc_save
+		.cb    = rtc_save,
+		.async = 5000
 	}
 };
 
@@ -0,0 +1,666 @@
+/* Built-in device manager, replaces mdev on systems without udev
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Instead of forking 'mdev -s' at boot, and the kernel forking mdev
+ * again for every hotplug event, this plugin listens for uevents on a
+ * netlink socket in PID 1.  Coldplug reads the uevent file of every
+ * device node the kernel knows about, in /sys/dev/{block,char}, which
+ * holds the same MAJOR/MINOR/DEVNAME as the 'add' event we would get
+ * if we wrote to it, without the round trip through the kernel.
+ *
+ * Nodes are created unless devtmpfs already has them, and owner and
+ * mode are set from a subset of the mdev.conf syntax:
+ *
+ *     [-]<regex> <user>:<group> <mode> [=<path>|><path>|!]
+ *
+ * The regex must match the whole DEVNAME, or SUBSYSTEM/DEVNAME if it
+ * contains a slash.  First match wins, unless the rule starts with a
+ * '-'.  With =path the node is created there instead, a trailing slash
+ * keeps the name, >path also adds a symlink from the kernel name, and
+ * ! skips the node.  Rules for @major,minor or $ENV, and commands, are
+ * mdev specific and are skipped.
+ *
+ * Every device node also gets a dev/<DEVNAME> condition, which services
+ * can depend on, e.g. <dev/ttyUSB0> or <dev/input/event0>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <regex.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <linux/netlink.h>
+#include <lite/lite.h>
+#include <lite/queue.h>
+
+#include "finit.h"
+#include "cond.h"
+#include "helpers.h"
+#include "plugin.h"
+
+#ifndef UEVENT_RULES
+#define UEVENT_RULES  "/etc/mdev.conf"
+#endif
+#ifndef UEVENT_RCVBUF
+#define UEVENT_RCVBUF (2 * 1024 * 1024)
+#endif
+#define UEVENT_BUCKETS 64
+#define UEVENT_MODE    0660
+
+struct rule {
+	TAILQ_ENTRY(rule) link;
+	regex_t re;
+	int     full;		/* Match SUBSYSTEM/DEVNAME */
+	int     cont;		/* '-' keep looking for a match */
+	uid_t   uid;
+	gid_t   gid;
+	mode_t  mode;
+	char    op;		/* '=', '>', '!' or 0 */
+	char   *path;
+};
+
+/* Parsed uevent, all strings point into the receive buffer */
+struct uevent {
+	char *action;
+	char *subsystem;
+	char *devname;
+	int   major;
+	int   minor;
+	int   blk;
+};
+
+/* Device node we know about, for remove and resync after overrun */
+struct device {
+	LIST_ENTRY(device) link;
+	dev_t         devno;
+	int           blk;
+	int           made;	/* We created the node, not devtmpfs */
+	unsigned int  gen;
+	char         *node;	/* Full path of node */
+	char         *symlink;	/* Kernel name, if > rule */
+	char          name[];	/* DEVNAME, for the condition */
+};
+
+static TAILQ_HEAD(, rule) rules = TAILQ_HEAD_INITIALIZER(rules);
+static LIST_HEAD(, device) devices[UEVENT_BUCKETS];
+static unsigned int gen;
+static int resync;
+
+static void rules_free(void)
+{
+	struct rule *r, *tmp;
+
+	TAILQ_FOREACH_SAFE(r, &rules, link, tmp) {
+		TAILQ_REMOVE(&rules, r, link);
+		regfree(&r->re);
+		if (r->path)
+			free(r->path);
+		free(r);
+	}
+}
+
+static int owner(char *arg, uid_t *uid, gid_t *gid)
+{
+	struct passwd *pw;
+	struct group *gr;
+	char *grp;
+
+	grp = strchr(arg, ':');
+	if (!grp)
+		return -1;
+	*grp++ = 0;
+
+	if (isdigit(*arg))
+		*uid = atoi(arg);
+	else if ((pw = getpwnam(arg)))
+		*uid = pw->pw_uid;
+	else
+		return -1;
+
+	if (isdigit(*grp))
+		*gid = atoi(grp);
+	else if ((gr = getgrnam(grp)))
+		*gid = gr->gr_gid;
+	else
+		return -1;
+
+	return 0;
+}
+
+static void rules_load(void)
+{
+	char buf[256], *line;
+	int lineno = 0;
+	FILE *fp;
+
+	rules_free();
+
+	fp = fopen(UEVENT_RULES, "r");
+	if (!fp)
+		return;
+
+	while ((line = fgets(buf, sizeof(buf), fp))) {
+		char *match, *own, *mode, *target;
+		struct rule *r;
+
+		lineno++;
+		match  = strtok(line, " \t\n");
+		own    = strtok(NULL, " \t\n");
+		mode   = strtok(NULL, " \t\n");
+		target = strtok(NULL, " \t\n");
+		if (!match || match[0] == '#')
+			continue;
+
+		if (!own || !mode || strchr("@$", match[match[0] == '-'])) {
+			_w("%s:%d: unsupported rule, skipping.", UEVENT_RULES, lineno);
+			continue;
+		}
+
+		r = calloc(1, sizeof(*r));
+		if (!r) {
+			_pe("Failed allocating rule");
+			break;
+		}
+
+		if (*match == '-') {
+			r->cont = 1;
+			match++;
+		}
+		r->full = !!strchr(match, '/');
+		r->mode = strtoul(mode, NULL, 8) & 07777;
+		if (owner(own, &r->uid, &r->gid)) {
+			_w("%s:%d: unknown user or group, skipping.", UEVENT_RULES, lineno);
+			free(r);
+			continue;
+		}
+
+		if (regcomp(&r->re, match, REG_EXTENDED)) {
+			_w("%s:%d: invalid regex %s, skipping.", UEVENT_RULES, lineno, match);
+			free(r);
+			continue;
+		}
+
+		/* Commands (@ $ *) are mdev specific, keep the rest of the rule */
+		if (target && strchr("=>!", target[0])) {
+			r->op = target[0];
+			if (target[1])
+				r->path = strdup(&target[1]);
+		}
+
+		TAILQ_INSERT_TAIL(&rules, r, link);
+	}
+	fclose(fp);
+}
+
+static int rule_match(struct rule *r, struct uevent *ev)
+{
+	char full[PATH_MAX], *str = ev->devname;
+	regmatch_t m;
+
+	if (r->full) {
+		snprintf(full, sizeof(full), "%s/%s", ev->subsystem ?: "", ev->devname);
+		str = full;
+	}
+
+	if (regexec(&r->re, str, 1, &m, 0))
+		return 0;
+
+	return m.rm_so == 0 && m.rm_eo == (regoff_t)strlen(str);
+}
+
+/* Owner and mode from all matching rules, node placement from the last */
+static struct rule *rule_find(struct uevent *ev, uid_t *uid, gid_t *gid, mode_t *mode)
+{
+	struct rule *r, *found = NULL;
+
+	*uid  = 0;
+	*gid  = 0;
+	*mode = UEVENT_MODE;
+
+	TAILQ_FOREACH(r, &rules, link) {
+		if (!rule_match(r, ev))
+			continue;
+
+		*uid  = r->uid;
+		*gid  = r->gid;
+		*mode = r->mode;
+		found = r;
+		if (!r->cont)
+			break;
+	}
+
+	return found;
+}
+
+static struct device *dev_find(dev_t devno, int blk)
+{
+	struct device *dev;
+
+	LIST_FOREACH(dev, &devices[devno % UEVENT_BUCKETS], link) {
+		if (dev->devno == devno && dev->blk == blk)
+			return dev;
+	}
+
+	return NULL;
+}
+
+static void dev_cond(char *name, int set)
+{
+	char cond[MAX_ARG_LEN];
+
+	snprintf(cond, sizeof(cond), "dev/%s", name);
+	if (set)
+		cond_set_oneshot(cond);
+	else
+		cond_clear(cond);
+}
+
+static void dev_del(struct device *dev)
+{
+	_d("%s: removed", dev->name);
+	if (dev->symlink) {
+		unlink(dev->symlink);
+		free(dev->symlink);
+	}
+	if (dev->made && dev->node)
+		unlink(dev->node);
+	if (dev->node)
+		free(dev->node);
+
+	dev_cond(dev->name, 0);
+	LIST_REMOVE(dev, link);
+	free(dev);
+}
+
+static char *node_path(struct rule *r, char *devname)
+{
+	char path[PATH_MAX];
+
+	if (!r || !r->path || !strchr("=>", r->op))
+		snprintf(path, sizeof(path), "/dev/%s", devname);
+	else if (fisslashdir(r->path))
+		snprintf(path, sizeof(path), "/dev/%s%s", r->path, basename(devname));
+	else
+		snprintf(path, sizeof(path), "/dev/%s", r->path);
+
+	return strdup(path);
+}
+
+static void dev_add(struct uevent *ev)
+{
+	struct device *dev;
+	struct rule *r;
+	struct stat st;
+	dev_t devno;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	char *dir;
+
+	devno = makedev(ev->major, ev->minor);
+	dev = dev_find(devno, ev->blk);
+	if (dev && strcmp(dev->name, ev->devname)) {
+		dev_del(dev);
+		dev = NULL;
+	}
+
+	if (dev) {
+		dev->gen = gen;
+		if (!ev->action || strcmp(ev->action, "change"))
+			return;
+	} else {
+		dev = calloc(1, sizeof(*dev) + strlen(ev->devname) + 1);
+		if (!dev) {
+			_pe("Failed allocating %s", ev->devname);
+			return;
+		}
+		strcpy(dev->name, ev->devname);
+		dev->devno = devno;
+		dev->blk   = ev->blk;
+		dev->gen   = gen;
+		LIST_INSERT_HEAD(&devices[devno % UEVENT_BUCKETS], dev, link);
+		dev_cond(dev->name, 1);
+	}
+
+	r = rule_find(ev, &uid, &gid, &mode);
+	if (r && r->op == '!')
+		return;
+
+	if (!dev->node)
+		dev->node = node_path(r, ev->devname);
+	if (!dev->node)
+		return;
+
+	if (stat(dev->node, &st)) {
+		dir = strrchr(dev->node, '/');
+		if (dir && dir != dev->node) {
+			*dir = 0;
+			mkpath(dev->node, 0755);
+			*dir = '/';
+		}
+
+		if (mknod(dev->node, (ev->blk ? S_IFBLK : S_IFCHR) | mode, devno)) {
+			if (errno != EEXIST) {
+				_pe("%s: failed creating device node", dev->node);
+				return;
+			}
+		} else
+			dev->made = 1;
+	}
+
+	if (chown(dev->node, uid, gid) && errno != ENOENT)
+		_pe("%s: failed setting owner", dev->node);
+	if (chmod(dev->node, mode) && errno != ENOENT)
+		_pe("%s: failed setting mode", dev->node);
+
+	if (r && r->op == '>' && !dev->symlink) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "/dev/%s", ev->devname);
+		if (strcmp(path, dev->node)) {
+			unlink(path);
+			if (symlink(dev->node, path))
+				_pe("%s: failed creating symlink", path);
+			else
+				dev->symlink = strdup(path);
+		}
+	}
+}
+
+/*
+ * Parse KEY=VAL pairs separated by @sep, the first line of a netlink
+ * message is "ACTION@DEVPATH" and is skipped, as are unknown keys.
+ */
+static int uevent_parse(char *buf, size_t len, char sep, struct uevent *ev)
+{
+	char *end = buf + len, *ptr = buf;
+
+	memset(ev, 0, sizeof(*ev));
+	ev->major = -1;
+	ev->minor = -1;
+
+	while (ptr < end) {
+		char *val, *next;
+
+		next = memchr(ptr, sep, end - ptr);
+		if (next)
+			*next++ = 0;
+		else
+			next = end;
+
+		val = strchr(ptr, '=');
+		if (val) {
+			*val++ = 0;
+			if (!strcmp(ptr, "ACTION"))
+				ev->action = val;
+			else if (!strcmp(ptr, "SUBSYSTEM"))
+				ev->subsystem = val;
+			else if (!strcmp(ptr, "DEVNAME"))
+				ev->devname = val;
+			else if (!strcmp(ptr, "MAJOR"))
+				ev->major = atoi(val);
+			else if (!strcmp(ptr, "MINOR"))
+				ev->minor = atoi(val);
+		}
+
+		ptr = next;
+	}
+
+	/* Only events for device nodes are of interest */
+	if (!ev->devname || ev->major < 0 || ev->minor < 0)
+		return -1;
+
+	/* No tricks with the names, they end up in paths */
+	if (strstr(ev->devname, "..") || ev->devname[0] == '/')
+		return -1;
+
+	if (ev->subsystem && !strcmp(ev->subsystem, "block"))
+		ev->blk = 1;
+
+	return 0;
+}
+
+static void uevent(struct uevent *ev)
+{
+	struct device *dev;
+
+	if (!ev->action)
+		return;
+
+	_d("%s %s %d:%d", ev->action, ev->devname, ev->major, ev->minor);
+	if (!strcmp(ev->action, "add") || !strcmp(ev->action, "change")) {
+		dev_add(ev);
+	} else if (!strcmp(ev->action, "remove")) {
+		dev = dev_find(makedev(ev->major, ev->minor), ev->blk);
+		if (dev)
+			dev_del(dev);
+	}
+}
+
+/* Read one /sys/dev/{block,char}/MAJ:MIN/uevent, call from coldplug */
+static void coldplug_one(char *dir, char *entry, int blk)
+{
+	char path[PATH_MAX], link[PATH_MAX], buf[1024];
+	struct uevent ev;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s/uevent", dir, entry);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	buf[len] = 0;
+
+	if (uevent_parse(buf, len, '\n', &ev))
+		return;
+
+	ev.action = "add";
+	ev.blk    = blk;
+
+	/* The subsystem is only needed for rules matching SUBSYSTEM/DEVNAME */
+	snprintf(path, sizeof(path), "%s/%s/subsystem", dir, entry);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len > 0) {
+		link[len] = 0;
+		ev.subsystem = basename(link);
+	}
+
+	dev_add(&ev);
+}
+
+/*
+ * Walk all device nodes the kernel knows about, anything we have not
+ * seen in this generation has been removed while we were not looking.
+ */
+static void coldplug(void)
+{
+	char *dirs[] = { "/sys/dev/block", "/sys/dev/char" };
+	struct device *dev, *tmp;
+	size_t i;
+
+	gen++;
+	resync = 0;
+
+	cond_batch_begin();
+	for (i = 0; i < NELEMS(dirs); i++) {
+		struct dirent *d;
+		DIR *dp;
+
+		dp = opendir(dirs[i]);
+		if (!dp) {
+			_pe("Failed opening %s", dirs[i]);
+			continue;
+		}
+
+		while ((d = readdir(dp))) {
+			if (d->d_name[0] == '.')
+				continue;
+			coldplug_one(dirs[i], d->d_name, i == 0);
+		}
+		closedir(dp);
+	}
+
+	for (i = 0; i < UEVENT_BUCKETS; i++) {
+		LIST_FOREACH_SAFE(dev, &devices[i], link, tmp) {
+			if (dev->gen != gen)
+				dev_del(dev);
+		}
+	}
+	cond_batch_commit();
+}
+
+static void uevent_callback(void *arg, int sd, int events)
+{
+	static char buf[8192 + 1];
+	struct sockaddr_nl sa;
+	struct uevent ev;
+	socklen_t salen;
+	ssize_t len;
+
+	cond_batch_begin();
+	while (1) {
+		salen = sizeof(sa);
+		len = recvfrom(sd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&sa, &salen);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				logit(LOG_WARNING, "Uevent socket overrun, rescanning devices.");
+				resync = 1;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				_pe("recv()");
+			break;
+		}
+
+		/* Only trust the kernel, user space (udev) sends on other groups */
+		if (sa.nl_pid != 0)
+			continue;
+
+		buf[len] = 0;
+		if (!uevent_parse(buf, len, 0, &ev))
+			uevent(&ev);
+	}
+
+	if (resync)
+		coldplug();
+	cond_batch_commit();
+}
+
+/*
+ * Runs before any file systems in /etc/fstab are mounted, same place as
+ * 'mdev -s' used to.  Also called again after switch-root.
+ */
+static void uevent_coldplug(void *arg)
+{
+	FILE *fp;
+
+	/* The kernel must not fork a helper per event behind our back */
+	fp = fopen("/proc/sys/kernel/hotplug", "w");
+	if (fp) {
+		fputs("\n", fp);
+		fclose(fp);
+	}
+
+	rules_load();
+	coldplug();
+}
+
+static void uevent_reconf(void *arg)
+{
+	rules_load();
+}
+
+static plugin_t plugin = {
+	.name = __FILE__,
+	.hook[HOOK_ROOTFS_UP]  = { .cb = uevent_coldplug },
+	.hook[HOOK_SVC_RECONF] = { .cb = uevent_reconf },
+	.io = {
+		.cb    = uevent_callback,
+		.flags = PLUGIN_IO_READ,
+	},
+};
+
+PLUGIN_INIT(plugin_init)
+{
+	struct sockaddr_nl sa;
+	int sd, val;
+
+	if (whichp("udevd") || whichp("/lib/systemd/systemd-udevd")) {
+		_d("System has udev, uevent plugin disabled.");
+		return;
+	}
+
+	sd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (sd < 0) {
+		_pe("socket()");
+		return;
+	}
+
+	/* Coldplug of USB hubs and such can cause a flood of events */
+	val = UEVENT_RCVBUF;
+	if (setsockopt(sd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)) &&
+	    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)))
+		_pe("Failed setting uevent receive buffer to %d bytes", val);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = 1;	/* Kernel events */
+	sa.nl_pid    = getpid();
+
+	if (bind(sd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		_pe("bind()");
+		close(sd);
+		return;
+	}
+
+	plugin.io.fd = sd;
+	plugin_register(&plugin);
+}
+
+PLUGIN_EXIT(plugin_exit)
+{
+	plugin_unregister(&plugin);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -21,9 +21,15 @@
  * THE SOFTWARE.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <linux/random.h>	/* RNDADDENTROPY */
+#include <sys/ioctl.h>
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>		/* getrandom() */
+#endif
 #include <sys/stat.h>
-#include <sys/time.h>		/* gettimeofday() */
 #include <sys/types.h>
 #include <lite/lite.h>
 
@@ -32,45 +38,169 @@
 #include "helpers.h"
 #include "plugin.h"
 
+#ifdef RANDOMSEED
+/*
+ * A seed read from getrandom() after the kernel pool was initialized is
+ * saved as RANDOMSEED_CREDIT, and credited as entropy on next boot with
+ * RNDADDENTROPY.  Any other seed, e.g. from an older Finit, is only
+ * mixed in.  Either is removed when read, so a seed is never reused,
+ * and a new one saved at boot, periodically, and at shutdown.
+ */
+#define RANDOMSEED_CREDIT RANDOMSEED ".credit"
+#define SEED_SIZE         512
+#define SEED_REFRESH      (3600 * 1000)	/* msec */
+
+static uev_t timer;
+
+/* Returns number of bytes, sets *@credit if safe to credit as entropy */
+static ssize_t seed_get(char *buf, size_t len, int *credit)
+{
+	ssize_t num;
+	int fd;
+
+#ifdef HAVE_GETRANDOM
+	num = getrandom(buf, len, GRND_NONBLOCK);
+	if (num == (ssize_t)len) {
+		*credit = 1;
+		return num;
+	}
+#endif
+
+	*credit = 0;
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	num = read(fd, buf, len);
+	close(fd);
+
+	return num;
+}
+
+/* Write a new seed, atomically, replacing any previous seed */
+static int seed_save(void)
+{
+	char buf[SEED_SIZE], tmp[sizeof(RANDOMSEED_CREDIT) + 4];
+	const char *file;
+	int fd, credit, rc;
+	ssize_t num;
+
+	num = seed_get(buf, sizeof(buf), &credit);
+	if (num <= 0)
+		return 1;
+
+	file = credit ? RANDOMSEED_CREDIT : RANDOMSEED;
+	snprintf(tmp, sizeof(tmp), "%s.new", file);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return 1;
+
+	rc = write(fd, buf, num) != num || fsync(fd);
+	rc |= close(fd);
+	if (rc || rename(tmp, file)) {
+		erase(tmp);
+		return 1;
+	}
+
+	/* Only one of them, the other one is stale */
+	erase(credit ? RANDOMSEED : RANDOMSEED_CREDIT);
+
+	return 0;
+}
+
+/* Read and remove a seed, returns number of bytes */
+static ssize_t seed_load(const char *file, char *buf, size_t len, int *credit)
+{
+	ssize_t num;
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd == -1)
+		return -1;
+
+	num = read(fd, buf, len);
+	close(fd);
+
+	/* Never credit the same seed twice, e.g. on a read-only /var */
+	if (erase(file))
+		*credit = 0;
+
+	return num;
+}
+
+static int seed_add(char *seed, ssize_t len, int credit)
+{
+	struct {
+		struct rand_pool_info info;
+		char buf[SEED_SIZE];
+	} entropy;
+	int fd, rc = 0;
+
+	fd = open("/dev/urandom", O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+		return 1;
+
+	if (credit) {
+		entropy.info.entropy_count = len * 8;
+		entropy.info.buf_size      = len;
+		memcpy(entropy.buf, seed, len);
+		if (!ioctl(fd, RNDADDENTROPY, &entropy))
+			goto done;
+		_pe("Failed crediting random seed, mixing it in");
+	}
+
+	rc = write(fd, seed, len) != len;
+done:
+	close(fd);
+	return rc;
+}
+
+static void refresh(uev_t *w, void *arg, int events)
+{
+	if (UEV_ERROR == events)
+		return;
+
+	if (seed_save())
+		_pe("Failed refreshing random seed %s", RANDOMSEED);
+}
+#endif /* RANDOMSEED */
+
 static void setup(void *arg)
 {
 #ifdef RANDOMSEED
-	if (!fexist(RANDOMSEED)) {
-		int ret = 1;
-		FILE *fp;
-
-		print_desc("Bootstrapping random seed", NULL);
-		umask(077);
-		fp = fopen(RANDOMSEED, "w");
-		if (fp) {
-			int iter = 128;
-			struct timeval tv;
-
-			gettimeofday(&tv, NULL);
-			srandom(tv.tv_sec % 3600);
-			while (iter--) {
-				uint32_t i, prng = random();
-
-				for (i = 0; i < sizeof(prng); i++)
-					fputc((prng >> (i * CHAR_BIT)) & UCHAR_MAX, fp);
-			}
-			ret = fclose(fp);
-		}
-		print_result(ret);
-		umask(0);
+	char seed[SEED_SIZE];
+	int credit = 1;
+	ssize_t len;
+
+	umask(077);
+	len = seed_load(RANDOMSEED_CREDIT, seed, sizeof(seed), &credit);
+	if (len <= 0) {
+		credit = 0;
+		len = seed_load(RANDOMSEED, seed, sizeof(seed), &credit);
+	}
+
+	if (len > 0) {
+		print_desc(credit ? "Crediting random seed" : "Initializing random number generator", NULL);
+		print_result(seed_add(seed, len, credit));
 	}
 
-	print_desc("Initializing random number generator", NULL);
-	print_result(512 != copyfile(RANDOMSEED, "/dev/urandom", 0, 0));
+	/* Replace the seed we removed, before anything can go wrong */
+	print_desc("Saving new random seed", NULL);
+	print_result(seed_save());
+	umask(0);
+
+	if (ctx)
+		uev_timer_init(ctx, &timer, refresh, NULL, SEED_REFRESH, SEED_REFRESH);
+	explicit_bzero(seed, sizeof(seed));
 #endif
 }
 
 static void save(void *arg)
 {
 #ifdef RANDOMSEED
+	uev_timer_stop(&timer);
 	umask(077);
 	print_desc("Saving random seed", NULL);
-	print_result(512 != copyfile("/dev/urandom", RANDOMSEED, 512, 0));
+	print_result(seed_save());
 	umask(0);
 #endif
 }
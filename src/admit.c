@@ -0,0 +1,268 @@
+/* Start admission control, limits starts in flight
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <lite/lite.h>
+#include <uev/uev.h>
+
+#include "finit.h"
+#include "admit.h"
+#include "boot.h"
+#include "log.h"
+#include "service.h"
+#include "shm.h"
+
+#define ADMIT_TICK      250		/* msec, sweep of starts in flight */
+#define ADMIT_TIMEOUT   10000		/* msec, max time a start holds a slot */
+
+int admit_max   = 0;
+int admit_delay = 0;
+
+static uev_t timer;
+static int   armed;
+static int   inflight;			/* Slots taken, see take() */
+
+static void sweep_cb(uev_t *w, void *arg, int events);
+
+static void arm(void)
+{
+	if (armed)
+		return;
+
+	if (uev_timer_init(ctx, &timer, sweep_cb, NULL, ADMIT_TICK, ADMIT_TICK)) {
+		_pe("Failed starting admission timer");
+		return;
+	}
+	armed = 1;
+}
+
+/*
+ * Admit @svc, it holds a slot until it is ready, or has exited.  A slot
+ * is also held by a service admitted by the sweep, until it is started.
+ */
+static void take(svc_t *svc)
+{
+	svc->admit_wait = 0;
+	if (svc->admit_slot)
+		return;
+
+	svc->admit_slot = 1;
+	svc->admit_time = boot_usec();
+	inflight++;
+	arm();
+}
+
+static void release(svc_t *svc)
+{
+	if (!svc->admit_slot)
+		return;
+
+	svc->admit_slot = 0;
+	inflight--;
+}
+
+/*
+ * Start of @svc still in flight?  Ready is when the PID file is created,
+ * or READY=1 from notify:systemd, for run/task when it exits.  A start
+ * that never becomes ready gives up its slot after ADMIT_TIMEOUT.
+ */
+static int in_flight(svc_t *svc, long long now)
+{
+	if (now - svc->admit_time > ADMIT_TIMEOUT * 1000LL) {
+		_d("%s: not ready after %d msec, releasing start slot", svc->name, ADMIT_TIMEOUT);
+		return 0;
+	}
+
+	/* Admitted by sweep, not stepped yet */
+	if (svc->state == SVC_READY_STATE)
+		return 1;
+
+	return svc->pid > 0 && svc_is_starting(svc);
+}
+
+/*
+ * Next queued service of @class to admit, the one that took the longest
+ * to start, with everything waiting for it, at the previous boot.  Ties
+ * are in the order services were registered.
+ */
+static svc_t *next(int class, long long now)
+{
+	svc_t *svc, *best = NULL, *iter = NULL;
+	long long weight = -1;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (!svc->admit_wait || svc->admit != class)
+			continue;
+
+		if (class == ADMIT_LOW && now - svc->admit_time < admit_delay * 1000LL)
+			continue;
+
+		if (boot_learned(svc) > weight) {
+			weight = boot_learned(svc);
+			best = svc;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Periodic check of starts in flight, while there are any or some are
+ * queued.  Free slots are handed out to queued services by class, high
+ * before normal and low, see next().  A low class service is only admitted after
+ * start-delay, and when no normal class service is queued.
+ */
+static void sweep_cb(uev_t *w, void *arg, int events)
+{
+	int order[] = { ADMIT_HIGH, ADMIT_NORMAL, ADMIT_LOW };
+	int queued[3] = { 0 };
+	long long now = boot_usec();
+	svc_t *svc, *iter = NULL;
+	int avail;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (svc->admit_slot && !in_flight(svc, now))
+			release(svc);
+		if (svc->admit_wait)
+			queued[svc->admit]++;
+	}
+
+	avail = admit_max ? admit_max - inflight : INT_MAX;
+	for (size_t i = 0; i < NELEMS(order) && avail > 0; i++) {
+		int class = order[i];
+
+		if (!queued[class])
+			continue;
+
+		if (class == ADMIT_LOW && queued[ADMIT_NORMAL])
+			break;
+
+		while (avail > 0 && (svc = next(class, now))) {
+			_d("%s: admitted, %d starts in flight", svc->name, inflight + 1);
+			take(svc);
+			queued[class]--;
+			avail--;
+			service_schedule(svc);
+		}
+	}
+
+	if (inflight || queued[ADMIT_NORMAL] || queued[ADMIT_LOW])
+		return;
+
+	uev_timer_stop(&timer);
+	armed = 0;
+}
+
+/**
+ * admit_parse - Parse admit:CLASS option of a service
+ * @svc: Pointer to &svc_t
+ * @arg: Argument to admit:, high, normal, or low, or %NULL for normal
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int admit_parse(svc_t *svc, char *arg)
+{
+	svc->admit = ADMIT_NORMAL;
+	if (!arg)
+		return 0;
+
+	if (!strcasecmp(arg, "high"))
+		svc->admit = ADMIT_HIGH;
+	else if (!strcasecmp(arg, "low"))
+		svc->admit = ADMIT_LOW;
+	else if (strcasecmp(arg, "normal")) {
+		logit(LOG_WARNING, "%s: invalid admit:%s, using normal", svc->cmd, arg);
+		return errno = EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * admit_hold - Check if a ready service should wait for a start slot
+ * @svc: Pointer to &svc_t
+ *
+ * Called by service_step() right before @svc is started.  With
+ * start-jobs, at most that many starts are in flight, the rest are
+ * queued and admitted by the sweep as slots are released.  A high
+ * class service is never queued, but still holds a slot.
+ *
+ * Returns:
+ * Non-zero if @svc should not be started yet.
+ */
+int admit_hold(svc_t *svc)
+{
+	if (!admit_max && !admit_delay)
+		return 0;
+
+	/* Started on demand by a client, queueing only adds latency */
+	if (svc_is_inetd(svc) || svc_is_inetd_conn(svc))
+		return 0;
+
+	if (svc->admit_slot)
+		return 0;
+
+	if (svc->admit != ADMIT_HIGH) {
+		if (!svc->admit_wait) {
+			svc->admit_wait = 1;
+			svc->admit_time = boot_usec();
+			shm_svc(svc);
+			arm();
+		}
+
+		/* Only admitted by the sweep, after start-delay */
+		if (svc->admit == ADMIT_LOW)
+			return 1;
+
+		if (admit_max && inflight >= admit_max) {
+			_d("%s: start queued, %d in flight", svc->name, inflight);
+			return 1;
+		}
+	}
+
+	take(svc);
+	return 0;
+}
+
+/**
+ * admit_done - Release start slot of a service
+ * @svc: Pointer to &svc_t, ready or about to be removed
+ *
+ * Queued services are admitted at the next sweep.
+ */
+void admit_done(svc_t *svc)
+{
+	svc->admit_wait = 0;
+	release(svc);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,51 @@
+/* Start admission control, limits starts in flight
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_ADMIT_H_
+#define FINIT_ADMIT_H_
+
+#include "svc.h"
+
+/* Priority class of a service, admit:high|normal|low */
+typedef enum {
+	ADMIT_NORMAL = 0,
+	ADMIT_HIGH,
+	ADMIT_LOW,
+} admit_class_t;
+
+extern int admit_max;		/* start-jobs N, 0: unlimited */
+extern int admit_delay;		/* start-delay MSEC, for admit:low */
+
+int  admit_parse (svc_t *svc, char *arg);
+int  admit_hold  (svc_t *svc);
+void admit_done  (svc_t *svc);
+
+#endif /* FINIT_ADMIT_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -24,22 +24,31 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <lite/lite.h>
+#include <lite/queue.h>
 #include <uev/uev.h>
 
 #include "config.h"
 #include "finit.h"
+#include "boot.h"
 #include "cond.h"
 #include "conf.h"
 #include "helpers.h"
+#include "kexec.h"
+#include "lazy.h"
 #include "log.h"
+#include "metrics.h"
 #include "plugin.h"
+#include "pool.h"
+#include "prio.h"
 #include "private.h"
+#include "reexec.h"
 #include "sig.h"
 #include "service.h"
 #include "util.h"
@@ -47,18 +56,74 @@
 extern svc_t *wdog;
 static uev_t api_watcher;
 
-static int call(int (*action)(svc_t *), char *buf, size_t len)
-{
-	return svc_parse_jobstr(buf, len, action, NULL);
-}
+#define API_TIMEOUT     5000	/* msec, idle clients are dropped */
+#define API_MAX_CLIENTS 32
+#define API_REPLY_MIN   8192	/* Reply data to framed requests */
+
+/*
+ * Each client connection is a small state machine driven by its own
+ * watcher: receive a request, send the reply, and then either wait for
+ * the next request, close, or hand over the socket.  Nothing blocks,
+ * a slow or stuck client only holds up itself.
+ */
+enum {
+	API_NEXT = 0,		/* Wait for next request */
+	API_CLOSE,		/* Close after reply */
+	API_FOLLOW,		/* Hand over to logmux_follow() */
+	API_SUBSCRIBE,		/* Hand over to subscribers */
+	API_REEXEC,		/* Hand over to reexec() */
+};
+
+struct api_client {
+	TAILQ_ENTRY(api_client) link;
+	uev_t  io;
+	uev_t  timer;
+
+	union {
+		struct init_request rq;
+		struct init_frame   hdr;
+	} u;
+	size_t rlen;		/* Bytes of request, incl. header, so far */
+	char  *data;		/* Data of framed request, or u.rq.data */
+	size_t dlen;
+	int    framed;
+
+	char  *wbuf;		/* Reply header and data */
+	size_t wlen;
+	size_t wpos;
+	FILE  *spool;		/* Streamed reply, sent after wbuf */
+
+	int    after;
+	int    mask;		/* INIT_EV_* for API_SUBSCRIBE */
+	char   job[sizeof(((struct init_request *)0)->data)];
+};
 
+static TAILQ_HEAD(, api_client) clients = TAILQ_HEAD_INITIALIZER(clients);
+static int num_clients;
+static svc_t *iter;		/* INIT_CMD_SVC_ITER */
+
+/* Clients of INIT_CMD_SUBSCRIBE, kept across restarts of the API socket */
+struct subscriber {
+	TAILQ_ENTRY(subscriber) link;
+	uev_t watcher;
+	int   mask;
+};
+
+static TAILQ_HEAD(, subscriber) subscribers = TAILQ_HEAD_INITIALIZER(subscribers);
+static int subscribed;		/* Union of all masks, for the fast path */
+
+/*
+ * The service actions only update the state of a service, it is then
+ * stepped by the service worker.  So a batch of many services is acted
+ * on in one worker pass, instead of one pass per service.
+ */
 static int stop(svc_t *svc)
 {
 	if (!svc)
 		return 1;
 
 	svc_stop(svc);
-	service_step(svc);
+	service_schedule(svc);
 
 	return 0;
 }
@@ -69,7 +134,8 @@ static int start(svc_t *svc)
 		return 1;
 
 	svc_start(svc);
-	service_step(svc);
+	lazy_demand(svc);
+	service_schedule(svc);
 
 	return 0;
 }
@@ -83,15 +149,11 @@ static int restart(svc_t *svc)
 		svc_start(svc);
 
 	svc_mark_dirty(svc);
-	service_step(svc);
+	service_schedule(svc);
 
 	return 0;
 }
 
-static int do_start  (char *buf, size_t len) { return call(start,   buf, len); }
-static int do_stop   (char *buf, size_t len) { return call(stop,    buf, len); }
-static int do_restart(char *buf, size_t len) { return call(restart, buf, len); }
-
 static char query_buf[368];
 static int missing(char *job, char *id)
 {
@@ -108,11 +170,79 @@ static int missing(char *job, char *id)
 	return 1;
 }
 
+/* Services matched by a batch request, each only once */
+static svc_t **batch;
+static size_t  batch_num;
+static size_t  batch_max;
+
+static int batch_add(svc_t *svc)
+{
+	size_t i;
+
+	for (i = 0; i < batch_num; i++) {
+		if (batch[i] == svc)
+			return 0;
+	}
+
+	if (batch_num == batch_max) {
+		size_t num = batch_max ? batch_max * 2 : 64;
+		svc_t **ptr;
+
+		ptr = reallocarray(batch, num, sizeof(svc_t *));
+		if (!ptr)
+			return 1;
+		batch     = ptr;
+		batch_max = num;
+	}
+	batch[batch_num++] = svc;
+
+	return 0;
+}
+
+/*
+ * Start, stop, or restart all jobs in @buf, a space separated list of
+ * job specs, with shell wildcards in names allowed.  All are looked up
+ * first, if any is missing, nothing is changed and @buf is replaced by
+ * the list of missing jobs.  Otherwise @buf is replaced with one line
+ * per service acted on: "JOB[:ID] NAME ok", truncated if too long.
+ */
+static int call(int (*action)(svc_t *), char *buf, size_t len)
+{
+	size_t i, pos = 0;
+
+	batch_num = 0;
+	memset(query_buf, 0, sizeof(query_buf));
+	if (svc_parse_jobstr(buf, len, batch_add, missing)) {
+		strlcpy(buf, query_buf, len);
+		return 1;
+	}
+
+	buf[0] = 0;
+	for (i = 0; i < batch_num; i++) {
+		svc_t *svc = batch[i];
+		int n;
+
+		n = snprintf(&buf[pos], len - pos, "%d%s%s %s %s\n", svc->job,
+			     svc->id[0] ? ":" : "", svc->id, svc->name,
+			     action(svc) ? "failed" : "ok");
+		if (n > 0 && (size_t)n < len - pos)
+			pos += n;
+		else
+			buf[pos] = 0;
+	}
+
+	return 0;
+}
+
+static int do_start  (char *buf, size_t len) { return call(start,   buf, len); }
+static int do_stop   (char *buf, size_t len) { return call(stop,    buf, len); }
+static int do_restart(char *buf, size_t len) { return call(restart, buf, len); }
+
 static int do_query(char *buf, size_t len)
 {
 	memset(query_buf, 0, sizeof(query_buf));
 	if (svc_parse_jobstr(buf, len, NULL, missing)) {
-		memcpy(buf, query_buf, len);
+		strlcpy(buf, query_buf, len);
 		return 1;
 	}
 
@@ -167,10 +297,102 @@ static int do_query_inetd(char *buf, size_t len)
 	if (!svc || !svc_is_inetd(svc))
 		return 1;
 
-	return inetd_filter_str(&svc->inetd, buf, len);
+	return inetd_filter_str(svc->inetd, buf, len);
 }
 #endif /* INETD_ENABLED */
 
+/*
+ * JOB[:ID] followed by any stanza options for CPU and I/O scheduling,
+ * see prio_set().  @buf is replaced with the settings, or the error.
+ */
+static int do_prio(char *buf, size_t len)
+{
+	char job[MAX_ARG_LEN + MAX_ID_LEN], opts[256] = "", *ptr;
+	svc_t *svc;
+
+	ptr = strchr(buf, ' ');
+	if (ptr) {
+		*ptr++ = 0;
+		strlcpy(opts, ptr, sizeof(opts));
+	}
+	strlcpy(job, buf, sizeof(job));
+
+	svc = do_find(job, sizeof(job));
+	if (!svc) {
+		snprintf(buf, len, "no such job %s", job);
+		return 1;
+	}
+
+	return prio_set(svc, opts, buf, len);
+}
+
+/*
+ * Only user conditions can be changed from the outside, net/, pid/ and
+ * svc/ are owned by Finit and its plugins.
+ */
+static int emit_ok(const char *cond)
+{
+	if (strncmp(cond, "usr/", 4) || !cond[4])
+		return 0;
+	if (strstr(cond, ".."))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Space separated list of conditions to set, or clear if prefixed with
+ * '-', all in one batch so affected services are only stepped once.
+ */
+static int do_emit(char *buf, size_t len)
+{
+	char *cond;
+	int result = 0;
+
+	cond_batch_begin();
+	for (cond = strtok(buf, " "); cond; cond = strtok(NULL, " ")) {
+		int clear = cond[0] == '-';
+
+		if (clear)
+			cond++;
+		if (!emit_ok(cond)) {
+			logit(LOG_WARNING, "Cannot change %s, only usr/ conditions allowed.", cond);
+			result = 1;
+			continue;
+		}
+
+		if (clear)
+			cond_clear(cond);
+		else
+			cond_set(cond);
+	}
+	cond_batch_commit();
+
+	return result;
+}
+
+/* One line per pool, truncated if it does not fit in @buf */
+static int do_pool_stats(char *buf, size_t len)
+{
+	struct pool *pool;
+	size_t pos = 0;
+
+	buf[0] = 0;
+	for (pool = pool_iterator(1); pool; pool = pool_iterator(0)) {
+		int n;
+
+		n = snprintf(&buf[pos], len - pos, "%s %zu %u %u %u %u %lu\n",
+			     pool->name, pool->size, pool->slabs,
+			     (unsigned int)(pool->slabs * pool->per_slab),
+			     pool->used, pool->peak, pool->allocs);
+		if (n < 0 || (size_t)n >= len - pos)
+			break;
+		pos += n;
+	}
+
+	return 0;
+}
+
 typedef struct {
 	char *event;
 	void (*cb)(void);
@@ -181,206 +403,803 @@ ev_t ev_list[] = {
 	{ NULL, NULL }
 };
 
-static void send_svc(int sd, svc_t *svc)
+static int rec_add(char *buf, size_t *pos, int type, const void *data, size_t len)
 {
-	svc_t empty;
-	size_t len;
+	struct svc_tlv tlv = {
+		.type = type,
+		.len  = len,
+	};
 
-	if (!svc) {
-		empty.pid = -1;
-		svc = &empty;
+	if (*pos + sizeof(tlv) + len > SVC_REC_MAX)
+		return 1;
+
+	memcpy(&buf[*pos], &tlv, sizeof(tlv));
+	*pos += sizeof(tlv);
+	memcpy(&buf[*pos], data, len);
+	*pos += len;
+
+	return 0;
+}
+
+static void rec_int(char *buf, size_t *pos, uint32_t mask, int type, int32_t val)
+{
+	if (mask & SVC_FIELD(type))
+		rec_add(buf, pos, type, &val, sizeof(val));
+}
+
+static void rec_str(char *buf, size_t *pos, uint32_t mask, int type, const char *str)
+{
+	if (mask & SVC_FIELD(type))
+		rec_add(buf, pos, type, str, strlen(str));
+}
+
+/*
+ * Pack the fields in @mask of @svc into a struct svc_rec, a %NULL @svc
+ * is packed as the end of list marker.  Returns the size of the record.
+ */
+static size_t rec_pack(svc_t *svc, uint32_t mask, char *buf)
+{
+	struct svc_rec rec = { .version = SVC_REC_VERSION };
+	size_t pos = sizeof(rec);
+
+	if (svc) {
+		char args[CMD_SIZE];
+		int64_t start_time = svc->start_time;
+
+		rec_int(buf, &pos, mask, SVC_FIELD_JOB,         svc->job);
+		rec_str(buf, &pos, mask, SVC_FIELD_ID,          svc->id);
+		rec_int(buf, &pos, mask, SVC_FIELD_PID,         svc->pid);
+		rec_int(buf, &pos, mask, SVC_FIELD_STATE,       svc->state);
+		rec_int(buf, &pos, mask, SVC_FIELD_BLOCK,       svc->block);
+		rec_int(buf, &pos, mask, SVC_FIELD_TYPE,        svc->type);
+		rec_int(buf, &pos, mask, SVC_FIELD_RUNLEVELS,   svc->runlevels);
+		if (mask & SVC_FIELD(SVC_FIELD_START_TIME))
+			rec_add(buf, &pos, SVC_FIELD_START_TIME, &start_time, sizeof(start_time));
+		rec_int(buf, &pos, mask, SVC_FIELD_RESTART_CNT, svc->restart_cnt);
+		rec_str(buf, &pos, mask, SVC_FIELD_NAME,        svc->name);
+		rec_str(buf, &pos, mask, SVC_FIELD_CMD,         svc->cmd);
+		if (mask & SVC_FIELD(SVC_FIELD_ARGS))
+			rec_str(buf, &pos, mask, SVC_FIELD_ARGS, svc_args_str(svc, 1, args, sizeof(args)));
+		rec_str(buf, &pos, mask, SVC_FIELD_DESC,        svc->config->desc);
+		rec_str(buf, &pos, mask, SVC_FIELD_COND,        svc->config->cond);
+		rec_str(buf, &pos, mask, SVC_FIELD_NOTIFY_MSG,  svc->notify_msg ? svc->notify_msg : "");
+		if (mask & SVC_FIELD(SVC_FIELD_PRIO))
+			rec_str(buf, &pos, mask, SVC_FIELD_PRIO, prio_str(svc->prio, args, sizeof(args)));
+		rec_int(buf, &pos, mask, SVC_FIELD_ADMIT,       svc->admit_wait);
+		if ((mask & SVC_FIELD(SVC_FIELD_STAMPS)) && svc->stats)
+			rec_add(buf, &pos, SVC_FIELD_STAMPS, svc->stats->stamp, sizeof(svc->stats->stamp));
+		if (mask & SVC_FIELD(SVC_FIELD_HISTORY)) {
+			struct svc_hist hist[SVC_HIST_MAX];
+			int num;
+
+			num = svc_history_get(svc, hist);
+			rec_add(buf, &pos, SVC_FIELD_HISTORY, hist, num * sizeof(hist[0]));
+		}
 	}
 
-	len = write(sd, svc, sizeof(*svc));
-	if (len != sizeof(*svc))
-		_d("Failed sending svc_t to client");
+	rec.len = pos - sizeof(rec);
+	memcpy(buf, &rec, sizeof(rec));
+
+	return pos;
 }
 
+/*
+ * Reply to INIT_CMD_SVC_ITER and INIT_CMD_SVC_FIND with all fields of
+ * @svc, or the end of list marker if @svc is %NULL.
+ */
+static void send_svc(int sd, svc_t *svc)
+{
+	char buf[SVC_REC_MAX];
+	size_t len;
+
+	len = rec_pack(svc, ~0, buf);
+	if (write(sd, buf, len) != (ssize_t)len)
+		_d("Failed sending svc record to client");
+}
 
 /*
- * In contrast to the SysV compat handling in plugins/initctl.c, when
- * `initctl runlevel 0` is issued we default to POWERDOWN the system
- * instead of just halting.
+ * Stream all services to the client in one go, instead of one
+ * connection for each service with INIT_CMD_SVC_ITER.
  */
-static void api_cb(uev_t *w, void *arg, int events)
+static void send_svc_list(int sd, uint32_t mask)
 {
-	int sd, lvl;
-	svc_t *svc;
-	static svc_t *iter = NULL;
-	struct init_request rq;
+	char buf[SVC_REC_MAX];
+	svc_t *svc, *iter = NULL;
+	size_t len;
 
-	sd = accept(w->fd, NULL, NULL);
-	if (sd < 0) {
-		_pe("Failed serving API request");
-		goto error;
+	/* Job is always sent, a record without fields marks the end */
+	if (!mask)
+		mask = ~0;
+	mask |= SVC_FIELD(SVC_FIELD_JOB);
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		len = rec_pack(svc, mask, buf);
+		if (write(sd, buf, len) != (ssize_t)len) {
+			_d("Failed sending service list to client");
+			return;
+		}
 	}
 
-	while (1) {
-		int result = 0;
-		ssize_t len;
+	len = rec_pack(NULL, mask, buf);
+	if (write(sd, buf, len) != (ssize_t)len)
+		_d("Failed sending end of service list to client");
+}
 
-		len = read(sd, &rq, sizeof(rq));
-		if (len <= 0) {
-			if (-1 == len) {
-				if (EINTR == errno)
-					continue;
+static void subscriber_close(struct subscriber *sub)
+{
+	struct subscriber *s;
 
-				if (EAGAIN == errno)
-					break;
+	uev_io_stop(&sub->watcher);
+	close(sub->watcher.fd);
+	TAILQ_REMOVE(&subscribers, sub, link);
+	free(sub);
 
-				_e("Failed reading initctl request, error %d: %s", errno, strerror(errno));
-			}
+	subscribed = 0;
+	TAILQ_FOREACH(s, &subscribers, link)
+		subscribed |= s->mask;
+}
 
-			break;
+/* Client is not expected to send anything, only to hang up */
+static void subscriber_cb(uev_t *w, void *arg, int events)
+{
+	subscriber_close((struct subscriber *)arg);
+}
+
+static int subscribe(int sd, int mask)
+{
+	struct subscriber *sub;
+	int flags;
+
+	sub = calloc(1, sizeof(*sub));
+	if (!sub)
+		return 1;
+
+	flags = fcntl(sd, F_GETFL);
+	if (flags == -1 || fcntl(sd, F_SETFL, flags | O_NONBLOCK) ||
+	    fcntl(sd, F_SETFD, FD_CLOEXEC) ||
+	    uev_io_init(ctx, &sub->watcher, subscriber_cb, sub, sd, UEV_READ)) {
+		free(sub);
+		return 1;
+	}
+
+	sub->mask = mask ? mask : ~0;
+	TAILQ_INSERT_TAIL(&subscribers, sub, link);
+	subscribed |= sub->mask;
+
+	return 0;
+}
+
+/**
+ * api_event - Push an event to INIT_CMD_SUBSCRIBE clients
+ * @ev:  One of INIT_EV_*
+ * @fmt: Event line, without newline, see finit.h for the format
+ *
+ * Cheap when nobody has subscribed to @ev.  Finit never blocks on a
+ * client, if its socket is full it is disconnected instead of silently
+ * losing events.
+ */
+void api_event(int ev, const char *fmt, ...)
+{
+	struct subscriber *sub, *tmp;
+	char buf[MAX_COND_LEN + 32];
+	va_list ap;
+	int len;
+
+	if (!(subscribed & ev))
+		return;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len > (int)sizeof(buf) - 2)
+		len = sizeof(buf) - 2;
+	buf[len++] = '\n';
+
+	TAILQ_FOREACH_SAFE(sub, &subscribers, link, tmp) {
+		if (!(sub->mask & ev))
+			continue;
+
+		if (write(sub->watcher.fd, buf, len) != len) {
+			_d("Dropping slow or closed subscriber");
+			subscriber_close(sub);
+		}
+	}
+}
+
+static void client_close(struct api_client *c)
+{
+	uev_io_stop(&c->io);
+	uev_timer_stop(&c->timer);
+	if (c->io.fd >= 0)
+		close(c->io.fd);
+	if (c->spool)
+		fclose(c->spool);
+	if (c->framed)
+		free(c->data);
+	free(c->wbuf);
+	TAILQ_REMOVE(&clients, c, link);
+	num_clients--;
+	free(c);
+}
+
+/* Socket has been passed on, to logmux or subscribers, free the rest */
+static void client_release(struct api_client *c)
+{
+	c->io.fd = -1;
+	client_close(c);
+}
+
+/* Get ready for the next request on the same connection */
+static void client_reset(struct api_client *c)
+{
+	if (c->framed)
+		free(c->data);
+	c->data   = NULL;
+	c->dlen   = 0;
+	c->framed = 0;
+	c->rlen   = 0;
+	c->wlen   = 0;
+	c->wpos   = 0;
+}
+
+static int client_queue(struct api_client *c, const void *buf, size_t len)
+{
+	char *ptr;
+
+	ptr = realloc(c->wbuf, c->wlen + len);
+	if (!ptr)
+		return 1;
+
+	memcpy(&ptr[c->wlen], buf, len);
+	c->wbuf  = ptr;
+	c->wlen += len;
+
+	return 0;
+}
+
+/* Streamed replies are written to a spool file, sent when complete */
+static int client_spool(struct api_client *c)
+{
+	if (!c->spool) {
+		c->spool = tempfile();
+		if (!c->spool) {
+			_pe("Failed creating API reply spool");
+			return -1;
 		}
+	}
+
+	return fileno(c->spool);
+}
 
-		if (rq.magic != INIT_MAGIC || len != sizeof(rq)) {
+/*
+ * Receive more of a request, legacy fixed size struct init_request or
+ * a struct init_frame followed by its data.  Returns 1 when complete,
+ * 0 if more is needed, and -1 on error or when the client hangs up.
+ */
+static int client_recv(struct api_client *c)
+{
+	struct init_frame *hdr = &c->u.hdr;
+	size_t want;
+	ssize_t num;
+	char *ptr;
+
+	while (1) {
+		ptr = (char *)&c->u + c->rlen;
+		if (c->rlen < sizeof(hdr->magic)) {
+			want = sizeof(hdr->magic) - c->rlen;
+		} else if (hdr->magic == INIT_MAGIC) {
+			want = sizeof(c->u.rq) - c->rlen;
+			if (!want) {
+				c->data = c->u.rq.data;
+				c->dlen = sizeof(c->u.rq.data);
+				return 1;
+			}
+		} else if (hdr->magic == INIT_MAGIC_FRAME) {
+			if (c->rlen < sizeof(*hdr)) {
+				want = sizeof(*hdr) - c->rlen;
+			} else {
+				size_t off = c->rlen - sizeof(*hdr);
+
+				if (!c->data) {
+					if (hdr->len > INIT_FRAME_MAX) {
+						_e("Too large API request, %u bytes", hdr->len);
+						return -1;
+					}
+
+					/* Room for a reply to a batch request, and a NUL */
+					c->dlen = hdr->len > API_REPLY_MIN ? hdr->len : API_REPLY_MIN;
+					c->dlen++;
+					c->data = calloc(1, c->dlen);
+					if (!c->data)
+						return -1;
+					c->framed = 1;
+				}
+
+				want = hdr->len - off;
+				if (!want)
+					return 1;
+				ptr = &c->data[off];
+			}
+		} else {
 			_e("Invalid initctl request");
-			break;
+			return -1;
 		}
 
-		switch (rq.cmd) {
-		case INIT_CMD_RUNLVL:
-			switch (rq.runlevel) {
-			case 's':
-			case 'S':
-				rq.runlevel = '1'; /* Single user mode */
-				/* fallthrough */
-
-			case '0'...'9':
-				_d("Setting new runlevel %c", rq.runlevel);
-				lvl = rq.runlevel - '0';
-				if (lvl == 0)
-					halt = SHUT_OFF;
-				if (lvl == 6)
-					halt = SHUT_REBOOT;
-				service_runlevel(lvl);
-				break;
-
-			default:
-				_d("Unsupported runlevel: %d", rq.runlevel);
-				break;
+		num = read(c->io.fd, ptr, want);
+		if (num <= 0) {
+			if (num == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN)
+					return 0;
+				_e("Failed reading initctl request, error %d: %s", errno, strerror(errno));
 			}
-			break;
+			return -1;
+		}
+		c->rlen += num;
+	}
+}
 
-		case INIT_CMD_DEBUG:
-			_d("debug");
-			log_debug();
-			break;
+static int client_reply(struct api_client *c, int result)
+{
+	struct init_frame hdr;
 
-		case INIT_CMD_RELOAD: /* 'init q' and 'initctl reload' */
-			_d("reload");
-			service_reload_dynamic();
-			break;
+	c->u.rq.cmd = result ? INIT_CMD_NACK : INIT_CMD_ACK;
+	if (!c->framed)
+		return client_queue(c, &c->u.rq, sizeof(c->u.rq));
 
-		case INIT_CMD_START_SVC:
-			_d("start %s", rq.data);
-			strterm(rq.data, sizeof(rq.data));
-			result = do_start(rq.data, sizeof(rq.data));
-			break;
+	hdr = c->u.hdr;
+	hdr.len = strnlen(c->data, c->dlen);
 
-		case INIT_CMD_STOP_SVC:
-			_d("stop %s", rq.data);
-			strterm(rq.data, sizeof(rq.data));
-			result = do_stop(rq.data, sizeof(rq.data));
+	return client_queue(c, &hdr, sizeof(hdr)) || client_queue(c, c->data, hdr.len);
+}
+
+/*
+ * Handle a complete request, streamed replies are spooled.
+ *
+ * In contrast to the SysV compat handling in plugins/initctl.c, when
+ * `initctl runlevel 0` is issued we default to POWERDOWN the system
+ * instead of just halting.
+ */
+static void client_request(struct api_client *c)
+{
+	struct init_request *rq = &c->u.rq;
+	char *data = c->data;
+	size_t len = c->dlen;
+	struct logring *ring;
+	int result = 0, lvl;
+	svc_t *svc;
+	int sd;
+
+	switch (rq->cmd) {
+	case INIT_CMD_RUNLVL:
+		switch (rq->runlevel) {
+		case 's':
+		case 'S':
+			rq->runlevel = '1'; /* Single user mode */
+			/* fallthrough */
+
+		case '0'...'9':
+			_d("Setting new runlevel %c", rq->runlevel);
+			lvl = rq->runlevel - '0';
+			if (lvl == 0)
+				halt = SHUT_OFF;
+			if (lvl == 6)
+				halt = SHUT_REBOOT;
+			service_runlevel(lvl);
 			break;
 
-		case INIT_CMD_RESTART_SVC:
-			_d("restart %s", rq.data);
-			strterm(rq.data, sizeof(rq.data));
-			result = do_restart(rq.data, sizeof(rq.data));
+		default:
+			_d("Unsupported runlevel: %d", rq->runlevel);
 			break;
+		}
+		break;
+
+	case INIT_CMD_DEBUG:
+		_d("debug");
+		log_debug();
+		break;
+
+	case INIT_CMD_RELOAD: /* 'init q' and 'initctl reload' */
+		_d("reload");
+		service_reload_dynamic();
+		break;
+
+	case INIT_CMD_START_SVC:
+		strterm(data, len);
+		_d("start %s", data);
+		result = do_start(data, len);
+		break;
+
+	case INIT_CMD_STOP_SVC:
+		strterm(data, len);
+		_d("stop %s", data);
+		result = do_stop(data, len);
+		break;
+
+	case INIT_CMD_RESTART_SVC:
+		strterm(data, len);
+		_d("restart %s", data);
+		result = do_restart(data, len);
+		break;
 
 #ifdef INETD_ENABLED
-		case INIT_CMD_QUERY_INETD:
-			_d("query inetd");
-			strterm(rq.data, sizeof(rq.data));
-			result = do_query_inetd(rq.data, sizeof(rq.data));
-			break;
+	case INIT_CMD_QUERY_INETD:
+		_d("query inetd");
+		strterm(data, len);
+		result = do_query_inetd(data, len);
+		break;
 #endif
 
-		case INIT_CMD_GET_RUNLEVEL:
-			_d("get runlevel");
-			rq.runlevel  = runlevel;
-			rq.sleeptime = prevlevel;
+	case INIT_CMD_EMIT:
+		strterm(data, len);
+		_d("emit %s", data);
+		result = do_emit(data, len);
+		break;
+
+	case INIT_CMD_GET_RUNLEVEL:
+		_d("get runlevel");
+		rq->runlevel  = runlevel;
+		rq->sleeptime = prevlevel;
+		break;
+
+	case INIT_CMD_POOL_STATS:
+		_d("pool stats");
+		result = do_pool_stats(data, len);
+		break;
+
+	case INIT_CMD_LOOP_STATS:
+		_d("loop stats");
+		result = heartbeat_stats(data, len);
+		break;
+
+	case INIT_CMD_MEM_STATS:
+		_d("mem stats");
+		result = mem_stats(data, len);
+		break;
+
+	case INIT_CMD_ACK:
+		_d("Client failed reading ACK");
+		c->after = API_CLOSE;
+		return;
+
+	case INIT_CMD_WDOG_HELLO:
+		_d("wdog hello");
+		if (rq->runlevel <= 0) {
+			result = 1;
 			break;
+		}
 
-		case INIT_CMD_ACK:
-			_d("Client failed reading ACK");
-			goto leave;
+		_e("Request to hand-over wdog ... to PID %d", rq->runlevel);
+		if (!svc_find_by_pid(rq->runlevel)) {
+			logit(LOG_ERR, "Cannot find PID %d, not registered.", rq->runlevel);
+			break;
+		}
 
-		case INIT_CMD_WDOG_HELLO:
-			_d("wdog hello");
-			if (rq.runlevel <= 0) {
-				result = 1;
-				break;
+		/* Disable and allow Finit to collect bundled watchdog */
+		if (wdog) {
+			logit(LOG_NOTICE, "Stopping and removing %s (PID:%d)", wdog->cmd, wdog->pid);
+			stop(wdog);
+			if (wdog->protect) {
+				wdog->protect = 0;
+				wdog->runlevels = 0;
 			}
+		}
+		break;
+
+	case INIT_CMD_SVC_ITER:
+		_d("svc iter, first: %d", rq->runlevel);
+		c->after = API_CLOSE;
+		if ((sd = client_spool(c)) < 0)
+			return;
+		/*
+		 * XXX: This severly limits the number of
+		 * simultaneous client connections, but will
+		 * have to do for now.
+		 */
+		svc = svc_iterator(&iter, rq->runlevel);
+		send_svc(sd, svc);
+		return;
+
+	case INIT_CMD_SVC_QUERY:
+		strterm(data, len);
+		_d("svc query: %s", data);
+		result = do_query(data, len);
+		break;
+
+	case INIT_CMD_SVC_FIND:
+		strterm(data, len);
+		_d("svc find: %s", data);
+		c->after = API_CLOSE;
+		if ((sd = client_spool(c)) < 0)
+			return;
+		send_svc(sd, do_find(data, len));
+		return;
+
+	case INIT_CMD_SVC_LIST:
+		_d("svc list, mask 0x%x", rq->runlevel);
+		c->after = API_CLOSE;
+		if ((sd = client_spool(c)) < 0)
+			return;
+		send_svc_list(sd, rq->runlevel);
+		return;
+
+	case INIT_CMD_SVC_LOG:
+		strterm(data, len);
+		_d("svc log: %s", data);
+		strlcpy(c->job, data, sizeof(c->job));
+		svc = do_find(data, len);
+		if (!svc || !(ring = logmux_ring(svc))) {
+			result = 1;
+			break;
+		}
 
-			_e("Request to hand-over wdog ... to PID %d", rq.runlevel);
-			if (!svc_find_by_pid(rq.runlevel)) {
-				logit(LOG_ERR, "Cannot find PID %d, not registered.", rq.runlevel);
-				break;
-			}
+		c->after = rq->runlevel ? API_FOLLOW : API_CLOSE;
+		if (client_reply(c, 0) || (sd = client_spool(c)) < 0 ||
+		    logmux_tail(ring, sd, rq->sleeptime)) {
+			_d("Failed sending log to client");
+			c->after = API_CLOSE;
+		}
+		return;
+
+	case INIT_CMD_BOOT_TRACE:
+		_d("boot trace");
+		c->after = API_CLOSE;
+		if ((sd = client_spool(c)) < 0 || boot_trace(sd))
+			_d("Failed sending boot trace to client");
+		return;
+
+	case INIT_CMD_METRICS:
+		_d("metrics");
+		c->after = API_CLOSE;
+		if ((sd = client_spool(c)) < 0 || metric_dump(sd) || heartbeat_dump(sd))
+			_d("Failed sending metrics to client");
+		return;
+
+	case INIT_CMD_SVC_PRIO:
+		strterm(data, len);
+		_d("svc prio: %s", data);
+		result = do_prio(data, len);
+		break;
+
+	case INIT_CMD_KEXEC:
+		_d("kexec reboot");
+		result = kexec_check(data, len);
+		if (!result) {
+			halt = SHUT_KEXEC;
+			service_runlevel(6);
+		}
+		break;
+
+	case INIT_CMD_REEXEC:
+		_d("reexec");
+		result = reexec_check(data, len);
+		if (!result)
+			c->after = API_REEXEC;
+		break;
+
+	case INIT_CMD_SUBSCRIBE:
+		_d("subscribe, mask 0x%x", rq->runlevel);
+		c->mask  = rq->runlevel;
+		c->after = API_SUBSCRIBE;
+		break;
+
+	default:
+		_d("Unsupported cmd: %d", rq->cmd);
+		break;
+	}
 
-			/* Disable and allow Finit to collect bundled watchdog */
-			if (wdog) {
-				logit(LOG_NOTICE, "Stopping and removing %s (PID:%d)", wdog->cmd, wdog->pid);
-				stop(wdog);
-				if (wdog->protect) {
-					wdog->protect = 0;
-					wdog->runlevels = 0;
-				}
+	if (client_reply(c, result)) {
+		_d("Failed sending ACK/NACK back to client");
+		c->after = API_CLOSE;
+	}
+}
+
+/* Reply sent in full, close, hand over, or wait for the next request */
+static void client_done(struct api_client *c)
+{
+	struct logring *ring = NULL;
+	svc_t *svc;
+
+	switch (c->after) {
+	case API_CLOSE:
+		client_close(c);
+		return;
+
+	case API_FOLLOW:
+		/* Stop our watcher before the fd gets a new one */
+		uev_io_stop(&c->io);
+
+		/* The service may have been removed while we sent the tail */
+		svc = do_find(c->job, sizeof(c->job));
+		if (svc)
+			ring = logmux_ring(svc);
+		if (!ring || logmux_follow(ring, c->io.fd)) {
+			client_close(c);
+			return;
+		}
+		client_release(c);
+		return;
+
+	case API_SUBSCRIBE:
+		uev_io_stop(&c->io);
+		if (subscribe(c->io.fd, c->mask)) {
+			_d("Failed subscribing client");
+			client_close(c);
+			return;
+		}
+		client_release(c);
+		return;
+
+	case API_REEXEC:
+		uev_io_stop(&c->io);
+		reexec(c->io.fd);
+		client_release(c);
+		return;
+	}
+
+	client_reset(c);
+	if (uev_io_set(&c->io, c->io.fd, UEV_READ))
+		client_close(c);
+}
+
+/*
+ * Send as much as the client accepts of the reply, first the queued
+ * buffer, then the spool file.  Returns 1 when done, 0 if the socket
+ * is full, and -1 on error.
+ */
+static int client_send(struct api_client *c)
+{
+	char buf[BUFSIZ];
+	ssize_t num;
+
+	while (1) {
+		if (c->wpos == c->wlen && c->spool) {
+			num = read(fileno(c->spool), buf, sizeof(buf));
+			if (num < 0)
+				return -1;
+			if (num == 0) {
+				fclose(c->spool);
+				c->spool = NULL;
+				continue;
 			}
-			break;
 
-		case INIT_CMD_SVC_ITER:
-			_d("svc iter, first: %d", rq.runlevel);
-			/*
-			 * XXX: This severly limits the number of
-			 * simultaneous client connections, but will
-			 * have to do for now.
-			 */
-			svc = svc_iterator(&iter, rq.runlevel);
-			send_svc(sd, svc);
-			goto leave;
-
-		case INIT_CMD_SVC_QUERY:
-			_d("svc query: %s", rq.data);
-			strterm(rq.data, sizeof(rq.data));
-			result = do_query(rq.data, sizeof(rq.data));
-			break;
+			c->wpos = c->wlen = 0;
+			if (client_queue(c, buf, num))
+				return -1;
+		}
 
-		case INIT_CMD_SVC_FIND:
-			_d("svc find: %s", rq.data);
-			strterm(rq.data, sizeof(rq.data));
-			send_svc(sd, do_find(rq.data, sizeof(rq.data)));
-			goto leave;
+		if (c->wpos == c->wlen)
+			return 1;
 
-		default:
-			_d("Unsupported cmd: %d", rq.cmd);
+		num = write(c->io.fd, &c->wbuf[c->wpos], c->wlen - c->wpos);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			return -1;
+		}
+		c->wpos += num;
+	}
+}
+
+static void client_flush(struct api_client *c)
+{
+	switch (client_send(c)) {
+	case 1:
+		client_done(c);
+		break;
+
+	case 0:
+		if (uev_io_set(&c->io, c->io.fd, UEV_WRITE))
+			client_close(c);
+		break;
+
+	default:
+		_d("Failed sending reply to client");
+		client_close(c);
+		break;
+	}
+}
+
+static void client_cb(uev_t *w, void *arg, int events)
+{
+	struct api_client *c = (struct api_client *)arg;
+	uint64_t start = metric_start();
+
+	if (UEV_ERROR == events) {
+		client_close(c);
+		goto done;
+	}
+
+	uev_timer_set(&c->timer, API_TIMEOUT, 0);
+	if (events & UEV_WRITE) {
+		client_flush(c);
+		goto done;
+	}
+
+	switch (client_recv(c)) {
+	case 1:
+		client_request(c);
+		if (c->spool && lseek(fileno(c->spool), 0, SEEK_SET) == -1) {
+			client_close(c);
 			break;
 		}
+		client_flush(c);
+		break;
 
-		if (result)
-			rq.cmd = INIT_CMD_NACK;
-		else
-			rq.cmd = INIT_CMD_ACK;
-		len = write(sd, &rq, sizeof(rq));
-		if (len != sizeof(rq))
-			_d("Failed sending ACK/NACK back to client");
+	case 0:
+		break;
+
+	default:
+		client_close(c);
+		break;
 	}
+done:
+	metric_stop("api", start);
+}
+
+static void client_timeout(uev_t *w, void *arg, int events)
+{
+	_d("Dropping idle API client");
+	client_close((struct api_client *)arg);
+}
+
+static void api_serve(uev_t *w, void *arg, int events)
+{
+	struct api_client *c;
+	int sd;
 
-leave:
-	close(sd);
 	if (UEV_ERROR == events)
 		goto error;
-	return;
+
+	while ((sd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (num_clients >= API_MAX_CLIENTS) {
+			_w("Too many API clients, dropping new connection");
+			close(sd);
+			continue;
+		}
+
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(sd);
+			continue;
+		}
+
+		if (uev_io_init(w->ctx, &c->io, client_cb, c, sd, UEV_READ) ||
+		    uev_timer_init(w->ctx, &c->timer, client_timeout, c, API_TIMEOUT, 0)) {
+			uev_io_stop(&c->io);
+			close(sd);
+			free(c);
+			continue;
+		}
+
+		TAILQ_INSERT_TAIL(&clients, c, link);
+		num_clients++;
+	}
+
+	if (errno == EAGAIN || errno == EINTR)
+		return;
+
+	_pe("Failed serving API request");
 error:
 	api_exit();
 	if (api_init(w->ctx))
 		_e("Unrecoverable error on API socket");
 }
 
+/* Time spent serving initctl, shown by initctl metrics */
+static void api_cb(uev_t *w, void *arg, int events)
+{
+	uint64_t start = metric_start();
+
+	api_serve(w, arg, events);
+	metric_stop("api", start);
+}
+
 int api_init(uev_ctx_t *ctx)
 {
 	int sd;
@@ -391,7 +1210,7 @@ int api_init(uev_ctx_t *ctx)
 	};
 
 	_d("Setting up external API socket ...");
-	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (-1 == sd) {
 		_pe("Failed starting external API socket");
 		return 1;
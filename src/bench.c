@@ -0,0 +1,482 @@
+/* Synthetic load harness for the core of finit, run outside of PID 1
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Links the same objects as PID 1, except finit.c, and drives them with
+ * N synthetic services, each depending on M conditions.  Runs in its own
+ * user, mount, net and UTS namespace with tmpfs over /run and /etc, so
+ * it neither needs root nor disturbs the init of the host.  The output
+ * is one line per benchmark, in the same format across versions:
+ *
+ *     name  ops  ns/op  ops/s
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <lite/lite.h>
+#include <uev/uev.h>
+
+#include "finit.h"
+#include "cond.h"
+#include "conf.h"
+#include "helpers.h"
+#include "metrics.h"
+#include "plugin.h"
+#include "private.h"
+#include "service.h"
+#include "util.h"
+
+#define BENCH_PID   (1 << 23)	/* Above PID_MAX_LIMIT, never a real PID */
+#define BENCH_PORT  37		/* Built-in time service, RFC 868 */
+
+/* Globals otherwise defined in finit.c */
+int   runlevel  = 1;		/* Not bootstrap, all services in [1] */
+int   cfglevel  = RUNLEVEL;
+int   prevlevel = -1;
+int   rescue    = 0;
+int   single    = 0;
+int   splash    = 0;
+char *sdown     = NULL;
+char *kexec     = NULL;
+char *sysroot   = NULL;
+char *network   = NULL;
+char *hostname  = NULL;
+char *rcsd      = FINIT_RCSD;
+char *runparts  = NULL;
+int   runparts_jobs = 0;
+
+uev_ctx_t *ctx  = NULL;
+svc_t *wdog     = NULL;
+
+static int num  = 1000;		/* Services */
+static int deps = 8;		/* Conditions per service */
+static int iter = 10000;	/* Iterations of each benchmark */
+
+static svc_t **bench;
+
+static void report(const char *name, long ops, uint64_t start)
+{
+	uint64_t ns = metric_start() - start;
+	double per = ops ? (double)ns / ops : 0;
+
+	printf("%-14s %10ld %12.1f ns/op %12.0f ops/s\n", name, ops, per,
+	       per > 0 ? 1000000000.0 / per : 0);
+	fflush(stdout);
+}
+
+static void skip(const char *name, const char *why)
+{
+	printf("%-14s %10s  (%s)\n", name, "-", why);
+	fflush(stdout);
+}
+
+static void loopback(void)
+{
+	struct ifreq ifr = { .ifr_name = "lo" };
+	int sd;
+
+	sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		return;
+
+	if (!ioctl(sd, SIOCGIFFLAGS, &ifr)) {
+		ifr.ifr_flags |= IFF_UP;
+		if (ioctl(sd, SIOCSIFFLAGS, &ifr))
+			warn("Failed bringing up loopback");
+	}
+	close(sd);
+}
+
+/*
+ * Private namespaces, so the fixed paths of PID 1, e.g. the API socket
+ * and /etc/finit.d, can be used without touching the real ones.  As a
+ * regular user we map ourselves to root in a new user namespace.
+ */
+static int sandbox(void)
+{
+	const char *dirs[] = { "/run", _PATH_VARRUN };
+	char conf[] = FINIT_CONF;
+	int flags = CLONE_NEWNS | CLONE_NEWNET | CLONE_NEWUTS;
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+	size_t i;
+
+	if (uid)
+		flags |= CLONE_NEWUSER;
+	if (unshare(flags))
+		return -1;
+
+	if (uid) {
+		if (echo("/proc/self/setgroups", 0, "deny") ||
+		    echo("/proc/self/uid_map", 0, "0 %u 1", uid) ||
+		    echo("/proc/self/gid_map", 0, "0 %u 1", gid))
+			return -1;
+	}
+
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL))
+		return -1;
+
+	for (i = 0; i < NELEMS(dirs); i++) {
+		if (mount("tmpfs", dirs[i], "tmpfs", 0, "mode=0755"))
+			return -1;
+	}
+
+	/* Empty /etc/finit.conf and /etc/finit.d/, filled in by us */
+	if (mount("tmpfs", dirname(conf), "tmpfs", 0, "mode=0755"))
+		return -1;
+	if (makepath(FINIT_RCSD) && errno != EEXIST)
+		return -1;
+
+	loopback();
+
+	return 0;
+}
+
+/*
+ * Drive the event loop until @sd has a reply for us, the other end
+ * of @sd being served by one of the callbacks of PID 1.
+ */
+static ssize_t await(int sd, void *buf, size_t len)
+{
+	ssize_t rc;
+
+	while ((rc = read(sd, buf, len)) < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			break;
+		uev_run(ctx, UEV_ONCE);
+	}
+
+	return rc;
+}
+
+static void bench_reload(void)
+{
+	char file[80];
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		snprintf(file, sizeof(file), FINIT_RCSD "/bench-%d.conf", i);
+		if (echo(file, 0, "service [2345] name:reload%d <bench/never> /bin/true -- Reload %d", i, i)) {
+			skip("reload", "cannot write " FINIT_RCSD);
+			return;
+		}
+	}
+
+	/* First one registers, the rest only match existing services */
+	conf_reload();
+
+	start = metric_start();
+	for (i = 0; i < iter / 100 + 1; i++)
+		conf_reload();
+	report("reload", i, start);
+}
+
+static int bench_register(void)
+{
+	char line[MAX_ARG_LEN], name[32];
+	uint64_t start;
+	int i, j, len;
+
+	bench = calloc(num, sizeof(svc_t *));
+	if (!bench)
+		return -1;
+
+	/* Service i depends on conditions i..i+M, and one never set */
+	start = metric_start();
+	for (i = 0; i < num; i++) {
+		len = snprintf(line, sizeof(line), "[1] name:bench%d <", i);
+		for (j = 0; j < deps; j++)
+			len += snprintf(&line[len], sizeof(line) - len, "bench/c%d,", (i + j) % num);
+		snprintf(&line[len], sizeof(line) - len, "bench/never> /bin/true -- Bench %d", i);
+
+		if (service_register(SVC_TYPE_SERVICE, line, global_rlimit, NULL))
+			return -1;
+
+		snprintf(name, sizeof(name), "bench%d", i);
+		bench[i] = svc_find_by_nameid(name, NULL);
+		if (!bench[i])
+			return -1;
+	}
+	report("register", num, start);
+
+	/* Halted -> waiting, nothing can start without bench/never */
+	start = metric_start();
+	service_step_all(SVC_TYPE_SERVICE);
+	report("step-all", num, start);
+
+	return 0;
+}
+
+static void bench_cond(void)
+{
+	char name[32];
+	uint64_t start;
+	int i;
+
+	start = metric_start();
+	for (i = 0; i < iter; i++) {
+		snprintf(name, sizeof(name), "bench/c%d", i % num);
+		cond_set(name);
+		cond_clear(name);
+	}
+	report("cond-storm", 2 * i, start);
+
+	start = metric_start();
+	for (i = 0; i < iter / num + 1; i++) {
+		int j;
+
+		cond_batch_begin();
+		for (j = 0; j < num; j++) {
+			snprintf(name, sizeof(name), "bench/c%d", j);
+			cond_set(name);
+		}
+		cond_batch_commit();
+
+		cond_batch_begin();
+		for (j = 0; j < num; j++) {
+			snprintf(name, sizeof(name), "bench/c%d", j);
+			cond_clear(name);
+		}
+		cond_batch_commit();
+	}
+	report("cond-batch", 2 * i * num, start);
+}
+
+static void bench_lookup(void)
+{
+	char name[32];
+	uint64_t start;
+	unsigned int seed = 1;
+	long found = 0;
+	int i;
+
+	for (i = 0; i < num; i++)
+		svc_set_pid(bench[i], BENCH_PID + i);
+
+	start = metric_start();
+	for (i = 0; i < iter; i++)
+		found += !!svc_find_by_pid(BENCH_PID + rand_r(&seed) % num);
+	report("pid-lookup", i, start);
+
+	start = metric_start();
+	for (i = 0; i < iter; i++)
+		found += !!svc_find_by_pid(BENCH_PID + num + i);
+	report("pid-miss", i, start);
+
+	start = metric_start();
+	for (i = 0; i < iter; i++) {
+		snprintf(name, sizeof(name), "bench%d", rand_r(&seed) % num);
+		found += !!svc_find_by_nameid(name, NULL);
+	}
+	report("name-lookup", i, start);
+
+	for (i = 0; i < num; i++)
+		svc_set_pid(bench[i], 0);
+
+	if (found != 2 * iter)
+		warnx("Lookups found %ld of %d services", found, 2 * iter);
+}
+
+static void bench_api(void)
+{
+	struct sockaddr_un sun = {
+		.sun_family = AF_UNIX,
+		.sun_path   = INIT_SOCKET,
+	};
+	uint64_t start;
+	int i;
+
+	if (api_init(ctx)) {
+		skip("api", "cannot create " INIT_SOCKET);
+		return;
+	}
+
+	start = metric_start();
+	for (i = 0; i < iter; i++) {
+		struct init_request rq = {
+			.magic = INIT_MAGIC,
+			.cmd   = INIT_CMD_GET_RUNLEVEL,
+		};
+		int sd;
+
+		sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (sd < 0)
+			break;
+
+		if (connect(sd, (struct sockaddr *)&sun, sizeof(sun)) ||
+		    write(sd, &rq, sizeof(rq)) != sizeof(rq)) {
+			close(sd);
+			break;
+		}
+
+		/* Server reads until EOF, then closes */
+		shutdown(sd, SHUT_WR);
+		fcntl(sd, F_SETFL, O_NONBLOCK);
+		if (await(sd, &rq, sizeof(rq)) != sizeof(rq) || rq.cmd != INIT_CMD_ACK) {
+			close(sd);
+			break;
+		}
+		close(sd);
+	}
+	report("api", i, start);
+
+	api_exit();
+}
+
+static void bench_inetd(void)
+{
+#ifdef INETD_ENABLED
+	struct sockaddr_in sin = {
+		.sin_family      = AF_INET,
+		.sin_port        = htons(BENCH_PORT),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	char line[80];
+	uint64_t start;
+	int i;
+
+	plugin_init(ctx);
+	snprintf(line, sizeof(line), "%d/tcp nowait [1] internal.time -- Bench time", BENCH_PORT);
+	if (service_register(SVC_TYPE_INETD, line, global_rlimit, NULL)) {
+		skip("inetd", "no time plugin");
+		return;
+	}
+	service_step_all(SVC_TYPE_INETD);
+
+	start = metric_start();
+	for (i = 0; i < iter; i++) {
+		uint32_t now;
+		int sd;
+
+		sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sd < 0)
+			break;
+
+		if (connect(sd, (struct sockaddr *)&sin, sizeof(sin)) && errno != EINPROGRESS) {
+			close(sd);
+			break;
+		}
+
+		if (await(sd, &now, sizeof(now)) != sizeof(now)) {
+			close(sd);
+			break;
+		}
+		close(sd);
+	}
+	report("inetd", i, start);
+#else
+	skip("inetd", "disabled in configure");
+#endif
+}
+
+static int usage(int rc)
+{
+	fprintf(stderr,
+		"Usage: finit-bench [-h] [-n NUM] [-m NUM] [-i NUM]\n"
+		"\n"
+		"  -h      This help text\n"
+		"  -n NUM  Number of synthetic services, default: 1000\n"
+		"  -m NUM  Conditions per service, default: 8\n"
+		"  -i NUM  Iterations of each benchmark, default: 10000\n");
+
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	uev_ctx_t loop;
+	int c;
+
+	while ((c = getopt(argc, argv, "hi:m:n:")) != EOF) {
+		switch (c) {
+		case 'h':
+			return usage(0);
+
+		case 'i':
+			iter = atoi(optarg);
+			break;
+
+		case 'm':
+			deps = atoi(optarg);
+			break;
+
+		case 'n':
+			num = atoi(optarg);
+			break;
+
+		default:
+			return usage(1);
+		}
+	}
+
+	if (num < 1 || deps < 0 || iter < 1)
+		return usage(1);
+
+	if (sandbox())
+		err(1, "Failed setting up private namespaces");
+
+	signal(SIGPIPE, SIG_IGN);
+	log_init(0);
+	uev_init1(&loop, 1);
+	ctx = &loop;
+
+	cond_init();
+	conf_init();
+
+	printf("finit-bench v%s: %d services, %d conditions each, %d iterations\n",
+	       PACKAGE_VERSION, num, deps, iter);
+
+	bench_reload();
+	if (bench_register())
+		errx(1, "Failed registering synthetic services");
+	bench_cond();
+	bench_lookup();
+	bench_api();
+	bench_inetd();
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,588 @@
+/* Bootstrap scheduling and critical path
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <lite/queue.h>
+
+#include "finit.h"
+#include "boot.h"
+#include "cond.h"
+#include "helpers.h"
+#include "log.h"
+
+#define BOOT_MAX_JOBS 512	/* Max recorded jobs, after that we stop */
+
+/*
+ * Everything started while bootstrapping is recorded here, along with
+ * the job it was waiting for.  That is either the job that asserted the
+ * last of its conditions, or the run job it was serialized after.  This
+ * is the dependency graph of the boot, as it actually played out.
+ *
+ * Hook points, plugin callbacks and the steps of main() are recorded
+ * as well, for the boot trace.  They all run in PID 1, in sequence.
+ */
+struct boot_job {
+	char      name[MAX_ARG_LEN];
+	const char *cat;		/* Trace category: service, hook, ... */
+	pid_t     pid;			/* PID of job, 1 for things in finit */
+	unsigned int seq;		/* svc->seq, for run ordering */
+	long long start;		/* usec, CLOCK_MONOTONIC */
+	long long done;			/* Collected, or ready (services) */
+	int       dep;			/* Waited for, id of other job, or 0 */
+};
+
+int boot_jobs   = 0;
+int boot_active = 0;
+
+static struct boot_job jobs[BOOT_MAX_JOBS + 1]; /* id 0 is unused */
+static int num_jobs;
+static int last_run;		/* Last completed run job */
+static int last_hook;
+static int reported;
+
+/* Monotonic usec, used for all boot timestamps, 0 is kernel start */
+long long boot_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int job_new(const char *cat, const char *name, long long start)
+{
+	struct boot_job *job;
+
+	if (reported || num_jobs >= BOOT_MAX_JOBS)
+		return 0;
+
+	job = &jobs[++num_jobs];
+	strlcpy(job->name, name, sizeof(job->name));
+	job->cat   = cat;
+	job->pid   = 1;
+	job->seq   = 0;
+	job->start = start;
+	job->done  = 0;
+	job->dep   = 0;
+
+	return num_jobs;
+}
+
+/* The candidate dependency that completed last is the one we waited for */
+static void job_dep(int id, int dep)
+{
+	struct boot_job *job = &jobs[id];
+
+	if (dep <= 0 || dep == id)
+		return;
+
+	if (!job->dep || jobs[dep].done > jobs[job->dep].done)
+		job->dep = dep;
+}
+
+static const char *job_cat(svc_t *svc)
+{
+	switch (svc->type) {
+	case SVC_TYPE_RUN:
+		return "run";
+
+	case SVC_TYPE_TASK:
+		return "task";
+
+	case SVC_TYPE_SYSV:
+		return "sysv";
+
+	case SVC_TYPE_INETD:
+	case SVC_TYPE_INETD_CONN:
+		return "inetd";
+
+	default:
+		break;
+	}
+
+	return "service";
+}
+
+/**
+ * boot_begin - Record start of something done in finit
+ * @cat:  Trace category, e.g., "plugin", must be a string constant
+ * @name: Name of plugin, or step, e.g., "fsck"
+ *
+ * Returns:
+ * Id to call boot_end() with, 0 if not recorded.
+ */
+int boot_begin(const char *cat, const char *name)
+{
+	return job_new(cat, name, boot_usec());
+}
+
+/**
+ * boot_end - Record end of something done in finit
+ * @id: Id from boot_begin()
+ */
+void boot_end(int id)
+{
+	if (id <= 0 || id > num_jobs)
+		return;
+
+	jobs[id].done = boot_usec();
+}
+
+/**
+ * boot_job_start - Record start of a run/task/service
+ * @svc: Pointer to &svc_t object being started
+ *
+ * Finds what @svc was waiting for, from the conditions it depends on
+ * and any run job it was serialized after.
+ *
+ * Returns:
+ * Job id, also saved in @svc, or 0 if not recorded.
+ */
+int boot_job_start(svc_t *svc)
+{
+	int i, id;
+
+	id = job_new(job_cat(svc), svc->name, boot_usec());
+	svc->boot_id = id;
+	if (!id)
+		return 0;
+
+	jobs[id].pid = svc->pid;
+	jobs[id].seq = svc->seq;
+	for (i = 0; i < svc->num_conds; i++)
+		job_dep(id, svc->conds[i].cond->boot_id);
+
+	/* Registered after a run job, then we had to wait for it */
+	if (last_run && svc->seq > jobs[last_run].seq)
+		job_dep(id, last_run);
+
+	return id;
+}
+
+/**
+ * boot_job_ready - Service is ready, its condition is asserted
+ * @svc: Pointer to &svc_t object
+ *
+ * Services run forever, so here done means ready.  The condition of
+ * @svc is tagged with its job id for boot_job_start() of dependents.
+ */
+void boot_job_ready(svc_t *svc)
+{
+	char name[MAX_COND_LEN];
+	struct cond *c;
+	int id = svc->boot_id;
+
+	if (id <= 0 || jobs[id].done)
+		return;
+
+	jobs[id].done = boot_usec();
+
+	c = cond_find(mkcond(svc, name, sizeof(name)));
+	if (c)
+		c->boot_id = id;
+}
+
+/**
+ * boot_job_done - Run/task has been collected
+ * @svc: Pointer to &svc_t object
+ */
+void boot_job_done(svc_t *svc)
+{
+	int id = svc->boot_id;
+
+	if (id <= 0 || jobs[id].done)
+		return;
+
+	jobs[id].done = boot_usec();
+	if (svc->type == SVC_TYPE_RUN)
+		last_run = id;
+}
+
+/**
+ * boot_hook - Record a completed hook point
+ * @name:  Name of hook condition, e.g., hook/sys/up
+ * @start: Time when hook was called, from boot_usec()
+ *
+ * Returns:
+ * Job id of hook, or 0 if not recorded.
+ */
+int boot_hook(const char *name, long long start)
+{
+	struct cond *c;
+	int id;
+
+	id = job_new("hook", name, start);
+	if (!id)
+		return 0;
+
+	jobs[id].done = boot_usec();
+
+	/* Hooks run in sequence, each one is after the previous */
+	job_dep(id, last_hook);
+	last_hook = id;
+
+	c = cond_find(name);
+	if (c)
+		c->boot_id = id;
+
+	return id;
+}
+
+/*
+ * Learned start times, from the previous boot.  The weight of a job is
+ * its start to ready time, plus the longest chain of jobs that waited
+ * for it, i.e., how much of the boot hangs on it.  When several jobs
+ * can start, those with the highest weight go first.
+ */
+struct learned {
+	LIST_ENTRY(learned) link;
+	long long weight;		/* usec */
+	char      name[];
+};
+
+#define LEARNED_HASH 64
+static LIST_HEAD(, learned) learned[LEARNED_HASH];
+static int learned_num;
+
+static unsigned int learned_key(const char *name)
+{
+	unsigned int h = 5381;
+
+	while (*name)
+		h = h * 33 + (unsigned char)*name++;
+
+	return h % LEARNED_HASH;
+}
+
+static struct learned *learned_find(const char *name)
+{
+	struct learned *l;
+
+	LIST_FOREACH(l, &learned[learned_key(name)], link) {
+		if (!strcmp(l->name, name))
+			return l;
+	}
+
+	return NULL;
+}
+
+static void learned_set(const char *name, long long weight)
+{
+	struct learned *l;
+
+	l = learned_find(name);
+	if (l) {
+		l->weight = weight;
+		return;
+	}
+
+	l = malloc(sizeof(*l) + strlen(name) + 1);
+	if (!l)
+		return;
+
+	strcpy(l->name, name);
+	l->weight = weight;
+	LIST_INSERT_HEAD(&learned[learned_key(name)], l, link);
+	learned_num++;
+}
+
+/**
+ * boot_learn - Load start times learned at the previous boot
+ *
+ * Called when the file systems are mounted, before any run/task or
+ * service in runlevel S is started.  Safe to call again, e.g., after a
+ * switch_root, it is only loaded once.
+ */
+void boot_learn(void)
+{
+	char line[MAX_ARG_LEN + 32], name[MAX_ARG_LEN];
+	long long weight;
+	FILE *fp;
+
+	if (learned_num)
+		return;
+
+	fp = fopen(BOOT_LEARNED, "r");
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%63s %lld", name, &weight) == 2 && weight > 0)
+			learned_set(name, weight);
+	}
+	fclose(fp);
+
+	_d("Loaded %d learned start times from %s", learned_num, BOOT_LEARNED);
+}
+
+/**
+ * boot_learned - Learned weight of a run/task/service
+ * @svc: Pointer to &svc_t object
+ *
+ * Returns:
+ * Start to ready time of @svc, plus the jobs that waited for it, at the
+ * previous boot, in usec.  Zero if unknown, or when bootstrap is done.
+ */
+long long boot_learned(svc_t *svc)
+{
+	struct learned *l;
+
+	if (!learned_num || reported)
+		return 0;
+
+	l = learned_find(svc->name);
+
+	return l ? l->weight : 0;
+}
+
+/* Restarted at bootstrap, only the first start counts */
+static int seen(int id)
+{
+	for (int i = 1; i < id; i++) {
+		if (jobs[i].seq && !strcmp(jobs[i].name, jobs[id].name))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Returns 1 if @buf is already what is in BOOT_LEARNED */
+static int learn_unchanged(const char *buf, size_t len)
+{
+	struct stat st;
+	int same = 0;
+	char *old;
+	FILE *fp;
+
+	if (stat(BOOT_LEARNED, &st) || (size_t)st.st_size != len)
+		return 0;
+
+	fp = fopen(BOOT_LEARNED, "r");
+	if (!fp)
+		return 0;
+
+	old = malloc(len + 1);
+	if (old) {
+		same = fread(old, 1, len, fp) == len && !memcmp(old, buf, len);
+		free(old);
+	}
+	fclose(fp);
+
+	return same;
+}
+
+/*
+ * Called from boot_report().  Jobs only depend on jobs started before
+ * them, so walking backwards each job is done before what it waited
+ * for.  Weights are averaged with the previous boot to even out noise,
+ * jobs not seen this boot are dropped.  The file is only written when
+ * it changes, saves a flash write on each boot of a stable system.
+ */
+static void learn_save(void)
+{
+	char tmp[sizeof(BOOT_LEARNED) + 4], *buf = NULL;
+	long long *tail;
+	size_t len = 0;
+	int i, short_write;
+	FILE *fp;
+
+	tail = calloc(num_jobs + 1, sizeof(long long));
+	if (!tail)
+		return;
+
+	for (i = num_jobs; i > 0; i--) {
+		struct boot_job *job = &jobs[i];
+
+		if (job->done)
+			tail[i] += job->done - job->start;
+		if (job->dep && tail[job->dep] < tail[i])
+			tail[job->dep] = tail[i];
+	}
+
+	fp = open_memstream(&buf, &len);
+	if (!fp)
+		goto done;
+
+	for (i = 1; i <= num_jobs; i++) {
+		struct learned *l;
+		long long weight;
+
+		/* Only run/task/service, not hooks or steps of main() */
+		if (!jobs[i].seq || !tail[i] || seen(i))
+			continue;
+
+		weight = tail[i];
+		l = learned_find(jobs[i].name);
+		if (l)
+			weight = (weight + l->weight) / 2;
+		fprintf(fp, "%s %lld\n", jobs[i].name, weight);
+	}
+	fclose(fp);
+
+	if (!buf || learn_unchanged(buf, len))
+		goto done;
+
+	if (makepath(dirname(strcpy(tmp, BOOT_LEARNED))) && errno != EEXIST)
+		goto done;
+
+	snprintf(tmp, sizeof(tmp), "%s+", BOOT_LEARNED);
+	fp = fopen(tmp, "w");
+	if (!fp)
+		goto done;
+
+	short_write = fwrite(buf, 1, len, fp) != len;
+	if (fclose(fp) || short_write || rename(tmp, BOOT_LEARNED)) {
+		_pe("Failed saving %s", BOOT_LEARNED);
+		remove(tmp);
+	}
+done:
+	free(buf);
+	free(tail);
+}
+
+/**
+ * boot_report - Log critical path of bootstrap
+ *
+ * Called when bootstrap has completed.  Starting from the job that
+ * completed last, the chain of jobs it waited for is logged.  After
+ * this nothing more is recorded, and the learned start times are saved
+ * for the next boot.
+ */
+void boot_report(void)
+{
+	long long t0;
+	int i, id = 0;
+
+	if (reported)
+		return;
+	reported = 1;
+
+	for (i = 1; i <= num_jobs; i++) {
+		if (!jobs[i].done)
+			continue;
+		if (!id || jobs[i].done > jobs[id].done)
+			id = i;
+	}
+	if (!id)
+		return;
+
+	t0 = jobs[1].start;
+	logit(LOG_NOTICE, "Bootstrap critical path, %lld msec, %d jobs:",
+	      (jobs[id].done - t0) / 1000, num_jobs);
+	for (; id; id = jobs[id].dep) {
+		logit(LOG_NOTICE, "  %8lld %6lld msec  %s", (jobs[id].start - t0) / 1000,
+		      (jobs[id].done - jobs[id].start) / 1000, jobs[id].name);
+	}
+
+	if (!rescue)
+		learn_save();
+}
+
+/* Names are from .conf files, escaped to keep them from breaking the JSON */
+static const char *json_str(const char *str, char *buf, size_t len)
+{
+	size_t i = 0;
+
+	for (; *str; str++) {
+		unsigned char c = *str;
+		char esc[8];
+		size_t n;
+
+		if (c == '"' || c == '\\')
+			n = snprintf(esc, sizeof(esc), "\\%c", c);
+		else if (c < 0x20)
+			n = snprintf(esc, sizeof(esc), "\\u%04x", c);
+		else
+			n = snprintf(esc, sizeof(esc), "%c", c);
+
+		/* Never split an escape sequence */
+		if (i + n >= len)
+			break;
+		memcpy(&buf[i], esc, n);
+		i += n;
+	}
+	buf[i] = 0;
+
+	return buf;
+}
+
+/**
+ * boot_trace - Dump boot trace as Chrome trace event JSON
+ * @sd: Socket, or other descriptor, to write to
+ *
+ * One complete event (ph:X) per job, the thread id is the PID of the
+ * job, so parallel jobs are shown on separate lines.  Services that
+ * never signaled ready, e.g. no PID file, are sent as begin events.
+ *
+ * Returns:
+ * POSIX OK(0) or non-zero on error writing to @sd.
+ */
+int boot_trace(int sd)
+{
+	char name[MAX_ARG_LEN * 6], dep[MAX_ARG_LEN * 6]; /* Room for \u00XX */
+	int i;
+
+	if (dprintf(sd, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[") < 0)
+		return 1;
+
+	for (i = 1; i <= num_jobs; i++) {
+		struct boot_job *job = &jobs[i];
+
+		json_str(job->name, name, sizeof(name));
+		if (job->dep)
+			json_str(jobs[job->dep].name, dep, sizeof(dep));
+		else
+			dep[0] = 0;
+
+		if (dprintf(sd, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\","
+			    "\"ts\":%lld,\"pid\":1,\"tid\":%d", i > 1 ? "," : "",
+			    name, job->cat, job->done ? "X" : "B", job->start,
+			    job->pid) < 0)
+			return 1;
+		if (job->done)
+			dprintf(sd, ",\"dur\":%lld", job->done - job->start);
+		if (dep[0])
+			dprintf(sd, ",\"args\":{\"after\":\"%s\"}", dep);
+		dprintf(sd, "}");
+	}
+
+	if (dprintf(sd, "\n]}\n") < 0)
+		return 1;
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,57 @@
+/* Bootstrap scheduling and critical path
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_BOOT_H_
+#define FINIT_BOOT_H_
+
+#include "svc.h"
+
+#define BOOT_LEARNED  "/var/lib/finit/boot-times"
+
+extern int boot_jobs;		/* bootstrap-jobs N, 0: unlimited */
+extern int boot_active;		/* Number of run/task running in [S] */
+
+long long boot_usec      (void);
+
+int       boot_begin     (const char *cat, const char *name);
+void      boot_end       (int id);
+
+int       boot_job_start (svc_t *svc);
+void      boot_job_ready (svc_t *svc);
+void      boot_job_done  (svc_t *svc);
+int       boot_hook      (const char *name, long long start);
+void      boot_report    (void);
+int       boot_trace     (int sd);
+
+void      boot_learn     (void);
+long long boot_learned   (svc_t *svc);
+
+#endif /* FINIT_BOOT_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -22,25 +22,245 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <lite/lite.h>
+#include <lite/queue.h>		/* BSD sys/queue.h API */
+#include <sys/inotify.h>
 #include <sys/mount.h>
 
+#include "cgroup.h"
 #include "log.h"
+#include "metrics.h"
 #include "util.h"
 
+/*
+ * A group that still had processes when its service was removed, e.g.,
+ * forked off and escaped.  Removed when cgroup.events says it is empty.
+ */
+struct cg_stale {
+	LIST_ENTRY(cg_stale) link;
+	int  wd;
+	char path[256];
+};
+
 static int cg_init = 0;
+static int cg_v2   = 0;		/* Unified hierarchy, cgroup v2 */
+
+static uev_t cg_watcher;	/* inotify, for cgroup.events */
+static LIST_HEAD(, cg_stale) cg_stale_list = LIST_HEAD_INITIALIZER(cg_stale_list);
+
+/* Settings allowed in the cgroup: option, a subset of the v2 interface */
+static const char *cg_settings[] = {
+	"cpu.weight", "io.weight", "memory.high", "memory.max",
+	"pids.max", NULL
+};
+
+static int cg_write(int dirfd, const char *file, const char *val)
+{
+	size_t len = strlen(val);
+	int fd, rc;
+
+	fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 1;
+
+	rc = write(fd, val, len) != (ssize_t)len;
+	close(fd);
+
+	return rc;
+}
+
+/* Read populated field of cgroup.events, returns 1 if still populated */
+static int cg_populated(const char *path)
+{
+	char file[300], buf[64];
+	int populated = 0;
+	FILE *fp;
+
+	snprintf(file, sizeof(file), "%s/cgroup.events", path);
+	fp = fopen(file, "r");
+	if (!fp)
+		return 0;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (!strncmp(buf, "populated ", 10)) {
+			populated = atoi(&buf[10]);
+			break;
+		}
+	}
+	fclose(fp);
+
+	return populated;
+}
+
+static void cg_stale_del(struct cg_stale *cg)
+{
+	_d("Removing %s, now empty", cg->path);
+	inotify_rm_watch(cg_watcher.fd, cg->wd);
+	if (rmdir(cg->path) && errno != ENOENT)
+		_d("Failed removing %s: %s", cg->path, strerror(errno));
+
+	LIST_REMOVE(cg, link);
+	free(cg);
+}
+
+/* Watch group for when it becomes empty, then remove it */
+static void cg_stale_add(const char *path)
+{
+	struct cg_stale *cg;
+	char file[300];
+
+	if (cg_watcher.fd < 0)
+		return;
+
+	cg = calloc(1, sizeof(*cg));
+	if (!cg)
+		return;
+
+	strlcpy(cg->path, path, sizeof(cg->path));
+	snprintf(file, sizeof(file), "%s/cgroup.events", path);
+	cg->wd = inotify_add_watch(cg_watcher.fd, file, IN_MODIFY);
+	if (cg->wd < 0) {
+		free(cg);
+		return;
+	}
+	LIST_INSERT_HEAD(&cg_stale_list, cg, link);
+
+	/* In case it was emptied before the watch was added */
+	if (!cg_populated(path))
+		cg_stale_del(cg);
+}
+
+#ifdef CGROUP2_ENABLED
+/* Controllers made available to services, for the cgroup: option */
+static const char *cg_controllers[] = { "cpu", "io", "memory", "pids", NULL };
+
+/* Replaces the cgreaper.sh release_agent of cgroup v1 */
+static void cg_events_cb(uev_t *w, void *arg, int events)
+{
+	char buf[sizeof(struct inotify_event) * 8 + NAME_MAX + 1];
+	ssize_t len, pos;
+
+	len = read(w->fd, buf, sizeof(buf));
+	if (len <= 0)
+		return;
+
+	for (pos = 0; pos < len;) {
+		struct inotify_event *ev = (struct inotify_event *)&buf[pos];
+		struct cg_stale *cg, *tmp;
+
+		LIST_FOREACH_SAFE(cg, &cg_stale_list, link, tmp) {
+			if (cg->wd == ev->wd && !cg_populated(cg->path))
+				cg_stale_del(cg);
+		}
+
+		pos += sizeof(*ev) + ev->len;
+	}
+}
+
+static int cgroup2_supported(void)
+{
+	char buf[80];
+	FILE *fp;
+	int rc = 0;
+
+	fp = fopen("/proc/filesystems", "r");
+	if (!fp)
+		return 0;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (strstr(buf, "\tcgroup2\n")) {
+			rc = 1;
+			break;
+		}
+	}
+	fclose(fp);
+
+	return rc;
+}
+
+/* Enable available controllers in @path, for use by its children */
+static void cgroup2_delegate(const char *path)
+{
+	char file[128], ctrl[16];
+	int i;
+
+	snprintf(file, sizeof(file), "%s/cgroup.subtree_control", path);
+	for (i = 0; cg_controllers[i]; i++) {
+		snprintf(ctrl, sizeof(ctrl), "+%s", cg_controllers[i]);
+		if (cg_write(AT_FDCWD, file, ctrl))
+			_d("Cannot enable %s controller in %s", cg_controllers[i], path);
+	}
+}
 
 /*
- * Called by Finit at early boot to mount initial cgroups
+ * Same layout as with v1: /sys/fs/cgroup/finit/{init,system,user}, but
+ * with the unified hierarchy mounted on /sys/fs/cgroup
  */
-void cgroup_init(void)
+static int cgroup2_init(uev_ctx_t *ctx, int opts)
+{
+	int fd;
+
+	if (mount("none", "/sys/fs/cgroup", "cgroup2", opts, NULL)) {
+		_d("Failed mounting cgroup v2");
+		return 1;
+	}
+
+	if (mkdir("/sys/fs/cgroup/finit", 0755) && EEXIST != errno)
+		return 1;
+	if (mkdir("/sys/fs/cgroup/finit/init", 0755) && EEXIST != errno)
+		return 1;
+	if (mkdir("/sys/fs/cgroup/finit/system", 0755) && EEXIST != errno)
+		return 1;
+	if (mkdir("/sys/fs/cgroup/finit/user", 0755) && EEXIST != errno)
+		return 1;
+
+	/* Move ourselves to init */
+	echo("/sys/fs/cgroup/finit/init/cgroup.procs", 0, "1");
+
+	/* Only leaf nodes have processes, so we can enable controllers */
+	cgroup2_delegate("/sys/fs/cgroup");
+	cgroup2_delegate("/sys/fs/cgroup/finit");
+	cgroup2_delegate("/sys/fs/cgroup/finit/system");
+
+	cg_watcher.fd = -1;
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0 || uev_io_init(ctx, &cg_watcher, cg_events_cb, NULL, fd, UEV_READ)) {
+		_pe("Failed setting up cgroup.events watcher");
+		if (fd >= 0)
+			close(fd);
+		cg_watcher.fd = -1;
+	}
+
+	cg_v2 = 1;
+	cg_init = 1;
+
+	return 0;
+}
+#endif /* CGROUP2_ENABLED */
+
+/*
+ * Called by Finit at early boot to mount initial cgroups.  Built with
+ * --enable-cgroup2 the unified hierarchy, cgroup v2, is preferred if
+ * supported by the kernel, otherwise the v1 layout with cgreaper.sh is
+ * used, same as before.
+ */
+void cgroup_init(uev_ctx_t *ctx)
 {
 	FILE *fp;
 	char buf[80];
 	int opts = MS_NODEV | MS_NOEXEC | MS_NOSUID;
 
+#ifdef CGROUP2_ENABLED
+	if (cgroup2_supported() && !cgroup2_init(ctx, opts))
+		return;
+#endif
+
 	fp = fopen("/proc/cgroups", "r");
 	if (!fp) {
 		_d("No cgroup support");
@@ -132,6 +352,189 @@ int cgroup_service(char *nm, char *id, int pid)
 	return move_pid("finit/system", nm, id, pid);
 }
 
+/**
+ * cgroup_service_open - Create cgroup for a service and open it
+ * @nm: Name of service
+ * @id: Instance id of service
+ *
+ * With cgroup v2 services are started directly in their group, using
+ * this descriptor, see cgroup_fork().  Keep it open for the lifetime
+ * of the service and close with cgroup_service_close().
+ *
+ * Returns:
+ * Directory descriptor, or -1 on error and with cgroup v1.
+ */
+int cgroup_service_open(char *nm, char *id)
+{
+	char path[256];
+
+	if (!cg_v2)
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/fs/cgroup/finit/system/%s:%s", nm, id);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -1;
+
+	return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * cgroup_service_close - Close and remove cgroup of a service
+ * @fd: Descriptor from cgroup_service_open(), or -1
+ * @nm: Name of service
+ * @id: Instance id of service
+ *
+ * The group is only removed if empty, i.e., all processes of the
+ * service have been collected.
+ */
+void cgroup_service_close(int fd, char *nm, char *id)
+{
+	char path[256];
+
+	if (fd < 0)
+		return;
+	close(fd);
+
+	snprintf(path, sizeof(path), "/sys/fs/cgroup/finit/system/%s:%s", nm, id);
+	if (!rmdir(path) || errno == ENOENT)
+		return;
+
+	if (errno == EBUSY)
+		cg_stale_add(path);
+	else
+		_d("Failed removing %s: %s", path, strerror(errno));
+}
+
+/**
+ * cgroup_service_config - Apply resource settings to service cgroup
+ * @fd:  Descriptor from cgroup_service_open()
+ * @cfg: Comma separated list of setting:value, from cgroup: option
+ *
+ * Example: "cpu.weight:50,memory.max:64M,pids.max:32".  Settings not in
+ * cg_settings[] are skipped, as are settings the kernel rejects, e.g.,
+ * if the controller is not available.  Settings removed from @cfg are
+ * not reset, that takes a restart of finit.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if any setting failed.
+ */
+int cgroup_service_config(int fd, const char *cfg)
+{
+	char buf[256], *ptr, *tok;
+	int rc = 0;
+
+	if (fd < 0 || !cfg || !cfg[0])
+		return 0;
+
+	strlcpy(buf, cfg, sizeof(buf));
+	for (tok = strtok_r(buf, ",", &ptr); tok; tok = strtok_r(NULL, ",", &ptr)) {
+		char *val;
+		int i;
+
+		val = strchr(tok, ':');
+		if (!val) {
+			_e("Invalid cgroup setting '%s', missing value", tok);
+			rc = 1;
+			continue;
+		}
+		*val++ = 0;
+
+		for (i = 0; cg_settings[i]; i++) {
+			if (!strcmp(cg_settings[i], tok))
+				break;
+		}
+		if (!cg_settings[i]) {
+			_e("Unsupported cgroup setting '%s'", tok);
+			rc = 1;
+			continue;
+		}
+
+		if (cg_write(fd, tok, val)) {
+			_e("Failed setting %s to %s: %s", tok, val, strerror(errno));
+			rc = 1;
+		}
+	}
+
+	return rc;
+}
+
+/**
+ * cgroup_join - Move calling process to cgroup
+ * @fd: Descriptor from cgroup_service_open()
+ *
+ * Only makes system calls, so safe to use after vfork().
+ *
+ * Returns:
+ * POSIX OK(0) or non-zero on error.
+ */
+int cgroup_join(int fd)
+{
+	/* v2 shorthand, 0 is the writing process */
+	return cg_write(fd, "cgroup.procs", "0");
+}
+
+/**
+ * cgroup_kill - SIGKILL all processes in a service cgroup
+ * @fd: Descriptor from cgroup_service_open(), or -1
+ *
+ * Also kills any processes that have left the process group of the
+ * service.  Requires Linux v5.14, or later.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if not supported, kill() the PGID instead.
+ */
+int cgroup_kill(int fd)
+{
+	if (fd < 0)
+		return 1;
+
+	return cg_write(fd, "cgroup.kill", "1");
+}
+
+/**
+ * cgroup_freeze - Freeze, or thaw, all processes in a service cgroup
+ * @fd:     Descriptor from cgroup_service_open(), or -1
+ * @freeze: Non-zero to freeze, zero to thaw
+ *
+ * Frozen processes are not stopped, they do not see SIGSTOP, but they
+ * do not run either until thawed.  Requires Linux v5.2, or later.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if not supported, use SIGSTOP instead.
+ */
+int cgroup_freeze(int fd, int freeze)
+{
+	if (fd < 0)
+		return 1;
+
+	return cg_write(fd, "cgroup.freeze", freeze ? "1" : "0");
+}
+
+/**
+ * cgroup_fork - Like fork(), but child is moved to cgroup @fd
+ * @fd: Descriptor from cgroup_service_open(), or -1 for plain fork()
+ *
+ * The child joins the group itself before returning, so it never runs
+ * any code of the service outside its group.  A raw clone3() with
+ * CLONE_INTO_CGROUP is not used here, it bypasses the fork handling of
+ * the C library, and the child of this path still calls getpwnam(),
+ * setenv(), and logit() before exec.
+ *
+ * Returns:
+ * Same as fork().
+ */
+pid_t cgroup_fork(int fd)
+{
+	pid_t pid;
+
+	metric_inc(METRIC_FORK);
+	pid = fork();
+	if (pid == 0 && fd >= 0)
+		cgroup_join(fd);
+
+	return pid;
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
@@ -24,9 +24,21 @@
 #ifndef FINIT_CGROUP_H_
 #define FINIT_CGROUP_H_
 
-void cgroup_init   (void);
+#include <sys/types.h>
+#include <uev/uev.h>
+
+void cgroup_init   (uev_ctx_t *ctx);
 
 int cgroup_user    (char *name);
 int cgroup_service (char *cmd, char *id, int pid);
 
+int   cgroup_service_open  (char *nm, char *id);
+void  cgroup_service_close (int fd, char *nm, char *id);
+int   cgroup_service_config(int fd, const char *cfg);
+
+int   cgroup_join          (int fd);
+pid_t cgroup_fork          (int fd);
+int   cgroup_kill          (int fd);
+int   cgroup_freeze        (int fd, int freeze);
+
 #endif /* FINIT_CGROUP_H_ */
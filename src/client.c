@@ -22,35 +22,47 @@
  */
 
 #include <errno.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
 #include "client.h"
 
 static int sd = -1;
+static int list_sd = -1;	/* Kept open by client_svc_list() */
+static char args[CMD_SIZE];
+static char prio[CMD_SIZE];
+static char notify[MAX_STR_LEN];
 
-int client_connect(void)
+static int sock_connect(void)
 {
 	struct sockaddr_un sun = {
 		.sun_family = AF_UNIX,
 		.sun_path   = INIT_SOCKET,
 	};
+	int fd;
 
-	sd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (-1 == sd)
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (-1 == fd)
 		goto error;
 
-	if (connect(sd, (struct sockaddr*)&sun, sizeof(sun)) == -1) {
-		close(sd);
+	if (connect(fd, (struct sockaddr*)&sun, sizeof(sun)) == -1) {
+		close(fd);
 		goto error;
 	}
 
-	return sd;
+	return fd;
 error:
 	perror("Failed connecting to finit");
 	return -1;
 }
 
+int client_connect(void)
+{
+	sd = sock_connect();
+	return sd;
+}
+
 int client_disconnect(void)
 {
 	int rc;
@@ -89,74 +101,422 @@ exit:
 	return result;
 }
 
-svc_t *client_svc_iterator(int first)
+/*
+ * Send @rq and return the socket for reading the reply, which is
+ * streamed until finit closes the connection.  Close when done.
+ */
+int client_stream(struct init_request *rq)
 {
-	int sd = -1;
-	struct init_request rq = {
-		.magic = INIT_MAGIC,
-		.cmd   = INIT_CMD_SVC_ITER,
+	int fd;
+
+	fd = sock_connect();
+	if (-1 == fd)
+		return -1;
+
+	if (write(fd, rq, sizeof(*rq)) != sizeof(*rq)) {
+		perror("Failed communicating with finit");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int readall(int fd, void *buf, size_t len)
+{
+	char *ptr = buf;
+
+	while (len > 0) {
+		ssize_t num;
+
+		num = read(fd, ptr, len);
+		if (num <= 0) {
+			if (num == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		ptr += num;
+		len -= num;
+	}
+
+	return 0;
+}
+
+static int writeall(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+
+	while (len > 0) {
+		ssize_t num;
+
+		num = write(fd, ptr, len);
+		if (num <= 0) {
+			if (num == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		ptr += num;
+		len -= num;
+	}
+
+	return 0;
+}
+
+/*
+ * Send @cmd with @data of any length, up to INIT_FRAME_MAX, using the
+ * framed request format.  The text reply, if any, is copied to @buf.
+ * Returns 0 on ACK, 1 on NACK, and -1 on error.
+ */
+int client_request(int cmd, const char *data, char *buf, size_t len)
+{
+	struct init_frame hdr = {
+		.magic = INIT_MAGIC_FRAME,
+		.cmd   = cmd,
+		.len   = strlen(data),
 	};
-	static svc_t svc;
+	int fd, result = -1;
 
-	sd = client_connect();
-	if (sd == -1)
-		return NULL;
+	if (buf && len)
+		buf[0] = 0;
 
-	if (first)
-		rq.runlevel = 1;
-	else
-		rq.runlevel = 0;
+	fd = sock_connect();
+	if (-1 == fd)
+		return -1;
 
-	if (write(sd, &rq, sizeof(rq)) != sizeof(rq))
+	if (writeall(fd, &hdr, sizeof(hdr)) || writeall(fd, data, hdr.len) ||
+	    readall(fd, &hdr, sizeof(hdr)) || hdr.magic != INIT_MAGIC_FRAME)
 		goto error;
-	if (read(sd, &svc, sizeof(svc)) != sizeof(svc))
+
+	while (hdr.len > 0) {
+		char tmp[128], *ptr = tmp;
+		size_t num = sizeof(tmp);
+
+		if (buf && len > 1) {
+			ptr = buf;
+			num = len - 1;
+		}
+		if (num > hdr.len)
+			num = hdr.len;
+
+		if (readall(fd, ptr, num))
+			goto error;
+		hdr.len -= num;
+
+		if (ptr == buf) {
+			buf[num] = 0;
+			buf += num;
+			len -= num;
+		}
+	}
+
+	result = hdr.cmd == INIT_CMD_ACK ? 0 : 1;
+	goto exit;
+error:
+	perror("Failed communicating with finit");
+exit:
+	close(fd);
+	return result;
+}
+
+static void rec_str(char *dst, size_t sz, const char *data, size_t len)
+{
+	if (len >= sz)
+		len = sz - 1;
+	memcpy(dst, data, len);
+	dst[len] = 0;
+}
+
+static int32_t rec_int(const char *data, size_t len)
+{
+	int32_t val = 0;
+
+	if (len == sizeof(val))
+		memcpy(&val, data, len);
+
+	return val;
+}
+
+/* Unpack the known fields of a struct svc_rec into @svc, keeps its @config and @stats */
+static void rec_unpack(svc_t *svc, const char *buf, size_t len)
+{
+	struct svc_config *config = svc->config;
+	struct svc_stats *stats = svc->stats;
+	size_t pos = 0, num;
+
+	memset(svc, 0, sizeof(*svc));
+	memset(config, 0, sizeof(*config));
+	memset(stats, 0, sizeof(*stats));
+	svc->config = config;
+	svc->stats  = stats;
+	svc->notify_msg = notify;
+	args[0]   = 0;
+	prio[0]   = 0;
+	notify[0] = 0;
+
+	while (pos + sizeof(struct svc_tlv) <= len) {
+		struct svc_tlv tlv;
+		const char *data;
+
+		memcpy(&tlv, &buf[pos], sizeof(tlv));
+		pos += sizeof(tlv);
+		if (pos + tlv.len > len)
+			break;
+		data = &buf[pos];
+		pos += tlv.len;
+
+		switch (tlv.type) {
+		case SVC_FIELD_JOB:
+			svc->job = rec_int(data, tlv.len);
+			break;
+
+		case SVC_FIELD_ID:
+			rec_str(svc->id, sizeof(svc->id), data, tlv.len);
+			break;
+
+		case SVC_FIELD_PID:
+			svc->pid = rec_int(data, tlv.len);
+			break;
+
+		case SVC_FIELD_STATE:
+			svc->state = rec_int(data, tlv.len);
+			break;
+
+		case SVC_FIELD_BLOCK:
+			svc->block = rec_int(data, tlv.len);
+			break;
+
+		case SVC_FIELD_TYPE:
+			svc->type = rec_int(data, tlv.len);
+			break;
+
+		case SVC_FIELD_RUNLEVELS:
+			svc->runlevels = rec_int(data, tlv.len);
+			break;
+
+		case SVC_FIELD_START_TIME:
+			if (tlv.len == sizeof(int64_t)) {
+				int64_t val;
+
+				memcpy(&val, data, sizeof(val));
+				svc->start_time = val;
+			}
+			break;
+
+		case SVC_FIELD_RESTART_CNT:
+			svc->restart_cnt = rec_int(data, tlv.len);
+			break;
+
+		case SVC_FIELD_NAME:
+			rec_str(svc->name, sizeof(svc->name), data, tlv.len);
+			break;
+
+		case SVC_FIELD_CMD:
+			rec_str(svc->cmd, sizeof(svc->cmd), data, tlv.len);
+			break;
+
+		case SVC_FIELD_ARGS:
+			rec_str(args, sizeof(args), data, tlv.len);
+			break;
+
+		case SVC_FIELD_DESC:
+			rec_str(config->desc, sizeof(config->desc), data, tlv.len);
+			break;
+
+		case SVC_FIELD_COND:
+			rec_str(config->cond, sizeof(config->cond), data, tlv.len);
+			break;
+
+		case SVC_FIELD_NOTIFY_MSG:
+			rec_str(notify, sizeof(notify), data, tlv.len);
+			break;
+
+		case SVC_FIELD_PRIO:
+			rec_str(prio, sizeof(prio), data, tlv.len);
+			break;
+
+		case SVC_FIELD_ADMIT:
+			svc->admit_wait = rec_int(data, tlv.len);
+			break;
+
+		case SVC_FIELD_STAMPS:
+			if (tlv.len <= sizeof(stats->stamp))
+				memcpy(stats->stamp, data, tlv.len);
+			break;
+
+		case SVC_FIELD_HISTORY:
+			num = tlv.len / sizeof(struct svc_hist);
+			if (num > SVC_HIST_MAX)
+				num = SVC_HIST_MAX;
+
+			/* Oldest first, as read back by svc_history_get() */
+			memcpy(stats->hist, data, num * sizeof(struct svc_hist));
+			stats->pos = num % SVC_HIST_MAX;
+			break;
+
+		default:		/* From a newer Finit, skip */
+			break;
+		}
+	}
+}
+
+/*
+ * Read one struct svc_rec from @fd into @svc.  Returns 1 if a service
+ * was read, 0 at the end of list marker, and -1 on error.
+ */
+static int rec_recv(int fd, svc_t *svc)
+{
+	static char buf[SVC_REC_MAX];
+	struct svc_rec rec;
+
+	if (readall(fd, &rec, sizeof(rec)))
+		return -1;
+	if (rec.len > sizeof(buf) || readall(fd, buf, rec.len))
+		return -1;
+
+	if (rec.version != SVC_REC_VERSION) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (!rec.len)
+		return 0;
+
+	rec_unpack(svc, buf, rec.len);
+
+	return 1;
+}
+
+/* Send @rq and read back a single svc record, with all fields */
+static svc_t *svc_request(struct init_request *rq)
+{
+	static struct svc_config config;
+	static struct svc_stats stats;
+	static svc_t svc = { .config = &config, .stats = &stats };
+	int rc;
+
+	if (client_connect() == -1)
+		return NULL;
+
+	if (write(sd, rq, sizeof(*rq)) != sizeof(*rq))
+		goto error;
+
+	rc = rec_recv(sd, &svc);
+	if (rc < 0)
 		goto error;
 
 	client_disconnect();
-	if (svc.pid < 0)
-		return NULL;
 
-	return &svc;
+	return rc ? &svc : NULL;
 error:
 	perror("Failed communicating with finit");
 	client_disconnect();
-	sd = -1;
 
 	return NULL;
 }
 
+svc_t *client_svc_iterator(int first)
+{
+	struct init_request rq = {
+		.magic    = INIT_MAGIC,
+		.cmd      = INIT_CMD_SVC_ITER,
+		.runlevel = first ? 1 : 0,
+	};
+
+	return svc_request(&rq);
+}
+
 svc_t *client_svc_find(const char *arg)
 {
-	int sd = -1;
 	struct init_request rq = {
 		.magic = INIT_MAGIC,
 		.cmd   = INIT_CMD_SVC_FIND,
 	};
-	static svc_t svc;
 
-	sd = client_connect();
-	if (sd == -1)
+	strlcpy(rq.data, arg, sizeof(rq.data));
+
+	return svc_request(&rq);
+}
+
+/**
+ * client_svc_list - Iterate over all services in one connection
+ * @first: Set to send the request, and return the first service
+ * @mask:  Fields to request, SVC_FIELD() bits, or zero for all
+ *
+ * Unlike client_svc_iterator(), Finit streams all services in reply
+ * to a single request.  Fields not in @mask are zero in the returned
+ * svc_t.  The connection is separate from client_connect(), so other
+ * requests can be made while iterating.  It is closed when the end of
+ * the list is reached, so always iterate until %NULL is returned.
+ *
+ * Returns:
+ * Pointer to a static svc_t, or %NULL when done or on error.
+ */
+svc_t *client_svc_list(int first, uint32_t mask)
+{
+	static struct svc_config config;
+	static struct svc_stats stats;
+	static svc_t svc = { .config = &config, .stats = &stats };
+	int rc;
+
+	if (first) {
+		struct init_request rq = {
+			.magic    = INIT_MAGIC,
+			.cmd      = INIT_CMD_SVC_LIST,
+			.runlevel = mask,
+		};
+
+		if (list_sd != -1)
+			close(list_sd);
+		list_sd = sock_connect();
+		if (list_sd == -1)
+			return NULL;
+
+		if (write(list_sd, &rq, sizeof(rq)) != sizeof(rq))
+			goto error;
+	}
+
+	if (list_sd == -1)
 		return NULL;
 
-	strlcpy(rq.data, arg, sizeof(rq.data));
-	if (write(sd, &rq, sizeof(rq)) != sizeof(rq))
-		goto error;
-	if (read(sd, &svc, sizeof(svc)) != sizeof(svc))
+	rc = rec_recv(list_sd, &svc);
+	if (rc < 0)
 		goto error;
 
-	client_disconnect();
-	if (svc.pid < 0)
+	if (!rc) {
+		close(list_sd);
+		list_sd = -1;
 		return NULL;
+	}
 
 	return &svc;
 error:
-	client_disconnect();
 	perror("Failed communicating with finit");
-	sd = -1;
+	close(list_sd);
+	list_sd = -1;
 
 	return NULL;
 }
 
+/*
+ * Arguments of the svc_t last returned by client_svc_iterator() or
+ * client_svc_find(), excluding the command.
+ */
+const char *client_svc_args(void)
+{
+	return args;
+}
+
+/*
+ * CPU and I/O scheduling of the same svc_t, as stanza options, or an
+ * empty string if none are set.
+ */
+const char *client_svc_prio(void)
+{
+	return prio;
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
@@ -31,7 +31,12 @@ int    client_connect      (void);
 int    client_disconnect   (void);
 
 int    client_send         (struct init_request *rq, ssize_t len);
+int    client_stream       (struct init_request *rq);
+int    client_request      (int cmd, const char *data, char *buf, size_t len);
 svc_t *client_svc_iterator (int first);
 svc_t *client_svc_find     (const char *arg);
+svc_t *client_svc_list     (int first, uint32_t mask);
+const char *client_svc_args(void);
+const char *client_svc_prio(void);
 
 #endif /* FINIT_CLIENT_H_ */
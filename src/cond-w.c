@@ -21,15 +21,19 @@
  * THE SOFTWARE.
  */
 
-#include <ftw.h>
+#include <fnmatch.h>
 #include <libgen.h>
 #include <lite/lite.h>
 #include <stdio.h>
 
 #include "finit.h"
 #include "cond.h"
+#include "metrics.h"
 #include "pid.h"
+#include "private.h"
+#include "schedule.h"
 #include "service.h"
+#include "shm.h"
 
 /*
  * The service condition name is constructed from the 'svc/' prefix, the
@@ -130,20 +134,6 @@ static int cond_set_gen(const char *file, unsigned int gen)
 	return (ret > 0) ? 0 : ret;
 }
 
-static void cond_bump_reconf(void)
-{
-	unsigned int rgen;
-
-	/*
-	 * If %COND_RECONF does not exist, cond_get_gen() returns 0
-	 * meaning that rgen++ is always what we want.
-	 */
-	rgen = cond_get_gen(COND_RECONF);
-	rgen++;
-
-	cond_set_gen(COND_RECONF, rgen);
-}
-
 static int cond_checkpath(const char *path)
 {
 	char buf[MAX_ARG_LEN], *dir;
@@ -163,31 +153,111 @@ static int cond_checkpath(const char *path)
 	return 0;
 }
 
-int cond_set_path(const char *path, enum cond_state new)
+/*
+ * Write-behind of the in-memory store to COND_PATH, for initctl and
+ * other tools.  Called from the event loop after a burst of changes.
+ */
+static LIST_HEAD(, cond) cond_dirty = LIST_HEAD_INITIALIZER(cond_dirty);
+static void cond_flush(void *arg);
+static void cond_gc(struct cond *c);
+static struct wq flush_work = {
+	.cb    = cond_flush,
+	.delay = 0,
+	.name  = "cond_flush"
+};
+
+static void cond_flush(void *arg)
+{
+	struct cond *c, *next;
+
+	cond_set_gen(COND_RECONF, cond_rgen);
+
+	LIST_FOREACH_SAFE(c, &cond_dirty, dlink, next) {
+		const char *path = cond_path(c->name);
+
+		LIST_REMOVE(c, dlink);
+		c->dirty = 0;
+
+		/* May be a oneshot symlink to reconf, never write through it */
+		if (unlink(path) && errno != ENOENT)
+			_pe("Failed removing condition '%s'", path);
+
+		if (c->oneshot) {
+			if (!cond_checkpath(path))
+				symlink(COND_RECONF, path);
+			continue;
+		}
+
+		if (c->gen) {
+			if (!cond_checkpath(path))
+				cond_set_gen(path, c->gen);
+			continue;
+		}
+
+		/* Off and mirrored, nothing more to remember */
+		cond_gc(c);
+	}
+}
+
+static void cond_mirror(struct cond *c)
+{
+	shm_cond(c);
+	if (!c->dirty) {
+		c->dirty = 1;
+		LIST_INSERT_HEAD(&cond_dirty, c, dlink);
+	}
+
+	schedule_work(&flush_work);
+}
+
+static void cond_bump_reconf(void)
+{
+	cond_rgen++;
+	shm_rgen(cond_rgen);
+	schedule_work(&flush_work);
+}
+
+/* Update in-memory state of condition, returns 1 if state changed */
+static int cond_set_state(const char *name, enum cond_state new)
 {
 	enum cond_state old;
-	unsigned int rgen;
+	struct cond *c;
 
-	_d("%s", path);
+	_d("%s", name);
 
-	rgen = cond_get_gen(COND_RECONF);
-	if (!rgen) {
-		_e("Unable to read configuration generation (%s)", path);
+	if (!cond_rgen) {
+		_e("Unable to read configuration generation (%s)", name);
 		return -1;
 	}
 
-	old = cond_get_path(path);
+	if (cond_is_wild(name)) {
+		_e("Cannot set or clear wildcard condition %s", name);
+		return 0;
+	}
+
+	old = cond_get(name);
 
 	switch (new) {
 	case COND_ON:
-		if (cond_checkpath(path))
-		    return 0;
-		cond_set_gen(path, rgen);
+		c = cond_add(name);
+		if (!c)
+			return 0;
+		if (c->gen == cond_rgen && !c->oneshot)
+			break;
+
+		c->oneshot = 0;
+		c->gen = cond_rgen;
+		cond_mirror(c);
 		break;
 
 	case COND_OFF:
-		if (unlink(path) && errno != ENOENT)
-			_pe("Failed removing condition '%s'", path);
+		c = cond_find(name);
+		if (!c || (!c->gen && !c->oneshot))
+			break;
+
+		c->oneshot = 0;
+		c->gen = 0;
+		cond_mirror(c);
 		break;
 
 	default:
@@ -195,13 +265,40 @@ int cond_set_path(const char *path, enum cond_state new)
 		return 0;
 	}
 
+	if (new != old) {
+		metric_inc(new == COND_ON ? METRIC_COND_SET : METRIC_COND_CLEAR);
+		api_event(INIT_EV_COND, "cond %s %s", name, condstr(new));
+	}
+
 	return new != old;
 }
 
+/*
+ * Kept for compatibility with external plugins, the path is mapped to
+ * a condition name in the in-memory store.
+ */
+int cond_set_path(const char *path, enum cond_state new)
+{
+	char buf[256];
+	const char *base;
+	size_t len;
+
+	/* @path is likely the static buffer returned by cond_path() */
+	strlcpy(buf, path, sizeof(buf));
+	base = cond_path("");
+	len  = strlen(base);
+	if (strncmp(buf, base, len)) {
+		_e("Invalid condition path %s", buf);
+		return 0;
+	}
+
+	return cond_set_state(&buf[len], new);
+}
+
 /* Has condition in configuration and cond is allowed? */
 static int svc_has_cond(svc_t *svc)
 {
-	if (!svc->cond[0])
+	if (!svc->config->cond[0])
 		return 0;
 
 	switch (svc->type) {
@@ -218,18 +315,278 @@ static int svc_has_cond(svc_t *svc)
 	return 0;
 }
 
-static void cond_update(const char *name)
+/*
+ * Assert condition without stepping any services directly, used when
+ * reasserting conditions after reconf, or from service_step().  The
+ * services depending on the condition are instead queued for the
+ * service_worker().
+ */
+static void cond_schedule(struct cond *c)
 {
-	svc_t *svc, *iter = NULL;
+	struct cond_dep *dep;
 
-	_d("%s", name);
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
-		if (!svc_has_cond(svc) || !cond_affects(name, svc->cond))
+	LIST_FOREACH(dep, &c->deps, link) {
+		if (svc_has_cond(dep->svc))
+			service_schedule(dep->svc);
+	}
+}
+
+int cond_set_noupdate(const char *name)
+{
+	struct cond *c;
+	int rc;
+
+	if (string_compare(name, "nop"))
+		return 0;
+
+	rc = cond_set_state(name, COND_ON);
+	if (rc <= 0)
+		return rc;
+
+	c = cond_find(name);
+	if (c)
+		cond_schedule(c);
+
+	LIST_FOREACH(c, &cond_wild, wlink) {
+		if (!fnmatch(c->name, name, FNM_PATHNAME))
+			cond_schedule(c);
+	}
+
+	return rc;
+}
+
+/**
+ * cond_svc_attach - Resolve conditions of a service
+ * @svc: Pointer to &svc_t object
+ *
+ * Parses the comma separated conditions of @svc, set by conf_parse_cond(), into
+ * references to the in-memory store.  Any previous references are
+ * dropped first.  This is what allows cond_update() to only step the
+ * services affected by a condition change.
+ */
+void cond_svc_attach(svc_t *svc)
+{
+	char conds[MAX_COND_LEN], *cond;
+	size_t i, num = 0;
+
+	cond_svc_detach(svc);
+	if (!svc->config->cond[0])
+		return;
+
+	strlcpy(conds, svc->config->cond, sizeof(conds));
+	for (i = 0; conds[i]; i++) {
+		if (conds[i] == ',')
+			num++;
+	}
+	num++;
+
+	svc->conds = calloc(num, sizeof(struct cond_dep));
+	if (!svc->conds) {
+		_pe("Failed allocating conditions for %s", svc->cmd);
+		return;
+	}
+
+	for (cond = strtok(conds, ","); cond; cond = strtok(NULL, ",")) {
+		struct cond_dep *dep = &svc->conds[svc->num_conds];
+
+		dep->cond = cond_add(cond);
+		if (!dep->cond)
+			continue;
+
+		dep->svc = svc;
+		LIST_INSERT_HEAD(&dep->cond->deps, dep, link);
+		svc->num_conds++;
+	}
+}
+
+/**
+ * cond_svc_detach - Drop condition references of a service
+ * @svc: Pointer to &svc_t object
+ *
+ * Called when a service is deleted, or its conditions are changed.
+ */
+void cond_svc_detach(svc_t *svc)
+{
+	int i;
+
+	for (i = 0; i < svc->num_conds; i++) {
+		struct cond *c = svc->conds[i].cond;
+
+		LIST_REMOVE(&svc->conds[i], link);
+		cond_gc(c);
+	}
+
+	free(svc->conds);
+	svc->conds = NULL;
+	svc->num_conds = 0;
+}
+
+/**
+ * cond_svc_get - Aggregate condition state of a service
+ * @svc: Pointer to &svc_t object
+ *
+ * Pre-resolved version of cond_get_agg(), only available in PID 1.
+ *
+ * Returns:
+ * %COND_ON if all conditions are on, or the service has none,
+ * otherwise %COND_FLUX or %COND_OFF.
+ */
+enum cond_state cond_svc_get(svc_t *svc)
+{
+	enum cond_state s = COND_ON;
+	int i;
+
+	for (i = 0; s && i < svc->num_conds; i++)
+		s = min(s, cond_get_state(svc->conds[i].cond));
+
+	return s;
+}
+
+/*
+ * Batched updates, see cond_batch_begin().  Conditions changed while a
+ * batch is open are queued here, their services are stepped on commit.
+ */
+static LIST_HEAD(, cond) cond_pending = LIST_HEAD_INITIALIZER(cond_pending);
+static int               cond_batch_level;
+static unsigned int      cond_batch_seq;
+
+/* Free condition if it is off, mirrored, and no longer referenced */
+static void cond_gc(struct cond *c)
+{
+	if (!LIST_EMPTY(&c->deps) || c->gen || c->oneshot)
+		return;
+	if (c->dirty || c->pending)
+		return;
+
+	shm_cond_del(c);
+	cond_del(c);
+}
+
+static size_t cond_num_deps(struct cond *c)
+{
+	struct cond_dep *dep;
+	size_t num = 0;
+
+	LIST_FOREACH(dep, &c->deps, link)
+		num++;
+
+	return num;
+}
+
+/*
+ * Stepping a service may modify @c->deps, e.g. when an inetd connection
+ * is collected, so we step from a snapshot.  Services already in the
+ * snapshot, stamped with the current @cond_batch_seq, are skipped.
+ */
+static size_t cond_collect(struct cond *c, svc_t **list, size_t i, size_t max)
+{
+	struct cond_dep *dep;
+
+	LIST_FOREACH(dep, &c->deps, link) {
+		svc_t *svc = dep->svc;
+
+		if (i >= max)
+			break;
+		if (svc->cond_seq == cond_batch_seq || !svc_has_cond(svc))
 			continue;
 
-		_d("%s: match <%s> %s(%s)", name ?: "nil", svc->cond, svc->desc, svc->cmd);
-		service_step(svc);
+		_d("%s: match <%s> %s(%s)", c->name, svc->config->cond, svc->config->desc, svc->cmd);
+		svc->cond_seq = cond_batch_seq;
+		list[i++] = svc;
 	}
+
+	return i;
+}
+
+static void cond_step(svc_t **list, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		service_step(list[i]);
+}
+
+static void cond_pend(struct cond *c)
+{
+	if (c->pending)
+		return;
+
+	c->pending = 1;
+	LIST_INSERT_HEAD(&cond_pending, c, plink);
+}
+
+/*
+ * Step all services that depend on condition @name, or on a wildcard
+ * matching it, as a batch of one unless a batch is already open.
+ */
+static void cond_update(const char *name)
+{
+	struct cond *c;
+
+	_d("%s", name ?: "nil");
+	if (!name)
+		return;
+
+	cond_batch_begin();
+	c = cond_find(name);
+	if (c)
+		cond_pend(c);
+
+	LIST_FOREACH(c, &cond_wild, wlink) {
+		if (!fnmatch(c->name, name, FNM_PATHNAME))
+			cond_pend(c);
+	}
+	cond_batch_commit();
+}
+
+/**
+ * cond_batch_begin - Start a batch of condition changes
+ *
+ * Until the matching cond_batch_commit(), cond_set(), cond_clear() and
+ * cond_set_oneshot() only update the in-memory state.  Use this around
+ * a burst of changes, e.g. all messages from one netlink recv(), to step
+ * each affected service once instead of once per change.  Batches nest,
+ * only the outermost commit steps services.
+ */
+void cond_batch_begin(void)
+{
+	cond_batch_level++;
+}
+
+/**
+ * cond_batch_commit - End a batch of condition changes
+ *
+ * Steps every service depending on any of the conditions changed since
+ * cond_batch_begin(), each service only once.
+ */
+void cond_batch_commit(void)
+{
+	struct cond *c, *next;
+	size_t i = 0, num = 0;
+
+	if (!cond_batch_level) {
+		_e("Unbalanced condition batch commit");
+		return;
+	}
+
+	if (--cond_batch_level)
+		return;
+
+	LIST_FOREACH(c, &cond_pending, plink)
+		num += cond_num_deps(c);
+
+	svc_t *list[num + 1];
+
+	cond_batch_seq++;
+	LIST_FOREACH_SAFE(c, &cond_pending, plink, next) {
+		LIST_REMOVE(c, plink);
+		c->pending = 0;
+		i = cond_collect(c, list, i, num);
+		cond_gc(c);
+	}
+
+	_d("Stepping %zu services", i);
+	cond_step(list, i);
 }
 
 void cond_set(const char *name)
@@ -238,7 +595,7 @@ void cond_set(const char *name)
 	if (string_compare(name, "nop"))
 		return;
 
-	if (!cond_set_path(cond_path(name), COND_ON))
+	if (!cond_set_state(name, COND_ON))
 		return;
 
 	cond_update(name);
@@ -246,18 +603,26 @@ void cond_set(const char *name)
 
 void cond_set_oneshot(const char *name)
 {
-	const char *path;
+	struct cond *c;
 
 	if (string_compare(name, "nop"))
 		return;
 
-	path = cond_path(name);
-	_d("%s => %s", name, path);
+	_d("%s", name);
+	if (cond_is_wild(name)) {
+		_e("Cannot set wildcard condition %s", name);
+		return;
+	}
 
-	if (cond_checkpath(path))
+	c = cond_add(name);
+	if (!c)
 		return;
 
-	symlink(COND_RECONF, path);
+	if (!c->oneshot) {
+		c->oneshot = 1;
+		cond_mirror(c);
+		metric_inc(METRIC_COND_SET);
+	}
 	cond_update(name);
 }
 
@@ -267,7 +632,7 @@ void cond_clear(const char *name)
 	if (string_compare(name, "nop"))
 		return;
 
-	if (!cond_set_path(cond_path(name), COND_OFF))
+	if (!cond_set_state(name, COND_OFF))
 		return;
 
 	cond_update(name);
@@ -281,49 +646,39 @@ void cond_reload(void)
 	cond_update(NULL);
 }
 
-static int reassert(const char *fpath, const struct stat *sb, int tflg, struct FTW *ftw)
+static int reassert_cb(struct cond *c, void *arg)
 {
-	char *nm;
-
-	if (ftw->level == 0)
-		return 1;
-
-	if (tflg != FTW_F)
+	if (c->oneshot || !c->gen)
 		return 0;
 
-	nm = strstr((char *)fpath, COND_DIR);
-	if (!nm) {
-		_e("Incorrect condtion path %s, cannot reassert", fpath);
-		return 1;
-	}
-
-	nm += sizeof(COND_DIR);
-	_d("Reasserting %s => %s", fpath, nm);
-	cond_set(nm);
+	_d("Reasserting %s", c->name);
+	cond_set(c->name);
 
 	return 0;
 }
 
 /*
  * Used only by netlink plugin atm.
- * type: is a one of svc/, net/, etc.
+ * pat: is a subtree, e.g. svc/, net/, see cond_walk()
  */
-void cond_reassert(const char *type)
+void cond_reassert(const char *pat)
 {
-	_d("%s", type);
-	nftw(cond_path(type), reassert, 20, FTW_DEPTH);
+	_d("%s", pat);
+	cond_batch_begin();
+	cond_walk(pat, reassert_cb, NULL);
+	cond_batch_commit();
 }
 
 void cond_init(void)
 {
 	char path[MAX_ARG_LEN];
 
-	if (makepath(pid_runpath(COND_PATH, path, sizeof(path))) && errno != EEXIST) {
-		_pe("Failed creating condition base directory '%s'", COND_PATH);
-		return;
-	}
-
+	/* The in-memory store works regardless of the mirror */
+	cond_store = 1;
 	cond_bump_reconf();
+
+	if (makepath(pid_runpath(COND_PATH, path, sizeof(path))) && errno != EEXIST)
+		_pe("Failed creating condition base directory '%s'", COND_PATH);
 }
 
 /**
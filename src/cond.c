@@ -21,6 +21,8 @@
  * THE SOFTWARE.
  */
 
+#include <fnmatch.h>
+#include <glob.h>
 #include <lite/lite.h>
 #include <stdio.h>
 
@@ -29,6 +31,271 @@
 #include "pid.h"
 #include "service.h"
 
+#define COND_HASH_SIZE  256
+
+int          cond_store = 0;
+unsigned int cond_rgen  = 0;
+
+struct cond_wild cond_wild = LIST_HEAD_INITIALIZER(cond_wild);
+
+static LIST_HEAD(, cond) cond_hash[COND_HASH_SIZE];
+static struct cond_node  cond_root;
+
+static unsigned int cond_hash_key(const char *name)
+{
+	unsigned int hash = 5381;
+
+	while (*name)
+		hash = ((hash << 5) + hash) + (unsigned char)*name++;
+
+	return hash & (COND_HASH_SIZE - 1);
+}
+
+/* Find, or create, child of @node for component @seg, of @len bytes */
+static struct cond_node *node_add(struct cond_node *node, const char *seg, size_t len)
+{
+	struct cond_node *kid, *prev = NULL;
+	int rc;
+
+	LIST_FOREACH(kid, &node->kids, link) {
+		rc = strncmp(kid->seg, seg, len);
+		if (!rc && !kid->seg[len])
+			return kid;
+		if (rc > 0)
+			break;
+		prev = kid;
+	}
+
+	kid = calloc(1, sizeof(*kid) + len + 1);
+	if (!kid)
+		return NULL;
+
+	memcpy(kid->seg, seg, len);
+	kid->parent = node;
+	if (prev)
+		LIST_INSERT_AFTER(prev, kid, link);
+	else
+		LIST_INSERT_HEAD(&node->kids, kid, link);
+
+	return kid;
+}
+
+/* Drop @node, and any parents, no longer leading to a condition */
+static void node_del(struct cond_node *node)
+{
+	while (node != &cond_root && !node->cond && LIST_EMPTY(&node->kids)) {
+		struct cond_node *parent = node->parent;
+
+		LIST_REMOVE(node, link);
+		free(node);
+		node = parent;
+	}
+}
+
+static int trie_add(struct cond *c)
+{
+	struct cond_node *node = &cond_root;
+	const char *seg = c->name;
+
+	while (node) {
+		size_t len = strcspn(seg, "/");
+
+		node = node_add(node, seg, len);
+		if (!seg[len])
+			break;
+		seg += len + 1;
+	}
+
+	if (!node) {
+		_pe("Failed allocating condition %s", c->name);
+		return -1;
+	}
+
+	node->cond = c;
+	c->node = node;
+
+	return 0;
+}
+
+/**
+ * cond_find - Find condition in in-memory store
+ * @name: Condition name, e.g. net/eth0/up
+ *
+ * Returns:
+ * A pointer to the &struct cond, or %NULL if not found.
+ */
+struct cond *cond_find(const char *name)
+{
+	struct cond *c;
+
+	LIST_FOREACH(c, &cond_hash[cond_hash_key(name)], link) {
+		if (!strcmp(c->name, name))
+			return c;
+	}
+
+	return NULL;
+}
+
+/**
+ * cond_add - Find, or create, condition in in-memory store
+ * @name: Condition name, e.g. net/eth0/up
+ *
+ * New conditions start out in the off state.
+ *
+ * Returns:
+ * A pointer to the &struct cond, or %NULL if out of memory.
+ */
+struct cond *cond_add(const char *name)
+{
+	struct cond *c;
+	size_t len;
+
+	c = cond_find(name);
+	if (c)
+		return c;
+
+	len = strlen(name) + 1;
+	c = calloc(1, sizeof(*c) + len);
+	if (!c) {
+		_pe("Failed allocating condition %s", name);
+		return NULL;
+	}
+
+	memcpy(c->name, name, len);
+	if (cond_is_wild(name)) {
+		c->wild = 1;
+		LIST_INSERT_HEAD(&cond_wild, c, wlink);
+	} else if (trie_add(c)) {
+		free(c);
+		return NULL;
+	}
+	LIST_INSERT_HEAD(&cond_hash[cond_hash_key(name)], c, link);
+
+	return c;
+}
+
+/**
+ * cond_del - Remove condition from in-memory store
+ * @c: Pointer to a &struct cond, must not be on the dirty list, or
+ *     have any services depending on it
+ */
+void cond_del(struct cond *c)
+{
+	if (c->wild)
+		LIST_REMOVE(c, wlink);
+	if (c->node) {
+		c->node->cond = NULL;
+		node_del(c->node);
+	}
+	LIST_REMOVE(c, link);
+	free(c);
+}
+
+/**
+ * cond_iterator - Iterate over all conditions in in-memory store
+ * @first: If set, get first condition, otherwise get next
+ *
+ * The iterator is safe against cond_del() of the current condition.
+ * Wildcard patterns of services are skipped.
+ *
+ * Returns:
+ * A pointer to a &struct cond, or %NULL when no more entries exist.
+ */
+struct cond *cond_iterator(int first)
+{
+	static struct cond *next;
+	static int bucket;
+	struct cond *c;
+
+	if (first) {
+		bucket = 0;
+		next = LIST_FIRST(&cond_hash[0]);
+	}
+
+	do {
+		while (!next && ++bucket < COND_HASH_SIZE)
+			next = LIST_FIRST(&cond_hash[bucket]);
+
+		c = next;
+		if (c)
+			next = LIST_NEXT(c, link);
+	} while (c && c->wild);
+
+	return c;
+}
+
+/* All conditions in, and below, @node */
+static int walk_all(struct cond_node *node, int (*cb)(struct cond *, void *), void *arg)
+{
+	struct cond_node *kid;
+
+	if (node->cond && cb(node->cond, arg))
+		return 1;
+
+	LIST_FOREACH(kid, &node->kids, link) {
+		if (walk_all(kid, cb, arg))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int walk(struct cond_node *node, const char *pat, int (*cb)(struct cond *, void *), void *arg)
+{
+	char seg[MAX_COND_LEN];
+	struct cond_node *kid;
+	const char *next;
+	size_t len;
+	int exact;
+
+	if (!*pat)
+		return walk_all(node, cb, arg);
+
+	len = strcspn(pat, "/");
+	if (len >= sizeof(seg))
+		return 0;
+	memcpy(seg, pat, len);
+	seg[len] = 0;
+
+	exact = !cond_is_wild(seg);
+	next  = pat[len] ? &pat[len + 1] : NULL;
+
+	LIST_FOREACH(kid, &node->kids, link) {
+		if (exact ? strcmp(kid->seg, seg) : fnmatch(seg, kid->seg, 0))
+			continue;
+
+		if (next) {
+			if (walk(kid, next, cb, arg))
+				return 1;
+		} else if (kid->cond && cb(kid->cond, arg))
+			return 1;
+
+		if (exact)
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * cond_walk - Call a function for each condition matching a pattern
+ * @pat: Pattern, e.g. net/eth0/up, net/eth?/up, or net/ for all
+ * @cb:  Callback, return non-zero to stop, must not remove conditions
+ * @arg: Argument to @cb
+ *
+ * Each path component of @pat is matched, with fnmatch(3), against the
+ * components in the trie, so only the relevant nodes are visited.  With
+ * a trailing '/', or an empty @pat, all conditions below are included.
+ * Conditions are visited in alphabetic order of their components.
+ *
+ * Returns:
+ * Non-zero if @cb stopped the walk.
+ */
+int cond_walk(const char *pat, int (*cb)(struct cond *, void *), void *arg)
+{
+	return walk(&cond_root, pat, cb, arg);
+}
+
 const char *condstr(enum cond_state s)
 {
 	static const char *strs[] = {
@@ -85,9 +352,72 @@ enum cond_state cond_get_path(const char *path)
 	return (cgen == rgen) ? COND_ON : COND_FLUX;
 }
 
+/* State of a wildcard is that of its best match, from the mirror */
+static enum cond_state cond_get_glob(const char *name)
+{
+	enum cond_state s = COND_OFF;
+	glob_t gl;
+
+	if (glob(cond_path(name), 0, NULL, &gl))
+		return COND_OFF;
+
+	for (size_t i = 0; s != COND_ON && i < gl.gl_pathc; i++)
+		s = max(s, cond_get_path(gl.gl_pathv[i]));
+	globfree(&gl);
+
+	return s;
+}
+
+static int wild_cb(struct cond *c, void *arg)
+{
+	enum cond_state *s = arg;
+
+	*s = max(*s, cond_get_state(c));
+
+	return *s == COND_ON;
+}
+
+/* ... and from the in-memory store */
+static enum cond_state cond_get_wild(const char *name)
+{
+	enum cond_state s = COND_OFF;
+
+	cond_walk(name, wild_cb, &s);
+
+	return s;
+}
+
+/* State of a condition in the in-memory store, PID 1 only */
+enum cond_state cond_get_state(struct cond *c)
+{
+	if (!c || !cond_rgen)
+		return COND_OFF;
+
+	if (c->wild)
+		return cond_get_wild(c->name);
+
+	if (c->oneshot)
+		return COND_ON;
+
+	if (!c->gen)
+		return COND_OFF;
+
+	return (c->gen == cond_rgen) ? COND_ON : COND_FLUX;
+}
+
 enum cond_state cond_get(const char *name)
 {
-	return cond_get_path(cond_path(name));
+	/* Not PID 1, e.g. initctl, read the mirror */
+	if (!cond_store) {
+		if (cond_is_wild(name))
+			return cond_get_glob(name);
+		return cond_get_path(cond_path(name));
+	}
+
+	if (cond_is_wild(name) && cond_rgen)
+		return cond_get_wild(name);
+
+	return cond_get_state(cond_find(name));
 }
 
 enum cond_state cond_get_agg(const char *names)
@@ -2,6 +2,7 @@
 #define FINIT_COND_H_
 
 #include <paths.h>
+#include <string.h>
 #include <svc.h>
 
 #define COND_DIR      "finit/cond"
@@ -14,6 +15,70 @@ typedef enum cond_state {
 	COND_ON
 } cond_state_t;
 
+/*
+ * In PID 1 the condition state is kept in memory, this is what
+ * cond_get() et al. use.  The files in COND_PATH are a write-behind
+ * mirror for initctl and other external tools.
+ *
+ * A condition is also a leaf in a trie of its path components, for
+ * cond_walk().  A wildcard from a service, e.g. <net/eth?/up>, is not a
+ * condition of its own, but a pattern on the cond_wild list.
+ */
+struct cond {
+	LIST_ENTRY(cond) link;		/* Lookup hash */
+	LIST_ENTRY(cond) wlink;		/* On cond_wild, if wildcard */
+	struct cond_node *node;		/* In trie, unless wildcard */
+	LIST_ENTRY(cond) dlink;		/* Pending write to COND_PATH */
+	LIST_ENTRY(cond) plink;		/* Changed in open batch */
+	LIST_HEAD(, cond_dep) deps;	/* Services depending on this */
+
+	unsigned int     gen;		/* Generation when set, 0: off */
+	int              oneshot;	/* Follows reconf gen., always on */
+	int              dirty;		/* Set while on dirty list */
+	int              pending;	/* Set while on batch list */
+	int              boot_id;	/* Job that asserted it at boot */
+	int              wild;		/* Pattern, state of its matches */
+	int              shm;		/* Status page slot + 1, see shm.c */
+
+	char             name[];
+};
+
+/* Path component of a condition name, e.g. eth0 in net/eth0/up */
+struct cond_node {
+	LIST_ENTRY(cond_node) link;	/* On parent->kids, sorted */
+	LIST_HEAD(, cond_node) kids;
+	struct cond_node *parent;
+	struct cond      *cond;		/* Condition ending here, if any */
+
+	char              seg[];
+};
+
+/*
+ * A service's <cond> is parsed once into an array of these, linking
+ * the service to each condition it depends on, and back.
+ */
+struct cond_dep {
+	LIST_ENTRY(cond_dep) link;	/* On cond->deps */
+	struct cond     *cond;
+	svc_t           *svc;
+};
+
+extern int          cond_store;	/* Set by cond_init() in PID 1 */
+extern unsigned int cond_rgen;	/* Current reconf generation */
+extern LIST_HEAD(cond_wild, cond) cond_wild;
+
+static inline int cond_is_wild(const char *name)
+{
+	return strpbrk(name, "*?[") != NULL;
+}
+
+struct cond    *cond_find    (const char *name);
+struct cond    *cond_add     (const char *name);
+void            cond_del     (struct cond *c);
+struct cond    *cond_iterator(int first);
+int             cond_walk    (const char *pat, int (*cb)(struct cond *, void *), void *arg);
+enum cond_state cond_get_state(struct cond *c);
+
 char           *mkcond       (svc_t *svc, char *buf, size_t len);
 const char     *condstr      (enum cond_state s);
 const char     *cond_path    (const char *name);
@@ -23,11 +88,18 @@ enum cond_state cond_get     (const char *name);
 enum cond_state cond_get_agg (const char *names);
 int             cond_affects (const char *name, const char *names);
 
+void            cond_svc_attach(svc_t *svc);
+void            cond_svc_detach(svc_t *svc);
+enum cond_state cond_svc_get   (svc_t *svc);
+
 int  cond_set_path    (const char *path, enum cond_state new);
+int  cond_set_noupdate(const char *name);
 void cond_set         (const char *name);
 void cond_set_oneshot (const char *name);
 void cond_clear       (const char *name);
 void cond_reload      (void);
+void cond_batch_begin (void);
+void cond_batch_commit(void);
 void cond_reassert    (const char *pat);
 void cond_init        (void);
 
@@ -33,7 +33,13 @@
 #include <glob.h>
 
 #include "finit.h"
+#include "admit.h"
+#include "boot.h"
 #include "cond.h"
+#include "conf.h"
+#include "confcache.h"
+#include "metrics.h"
+#include "pressure.h"
 #include "service.h"
 #include "tty.h"
 #include "helpers.h"
@@ -54,6 +60,7 @@ struct conf_change {
 };
 
 static uev_t w1, w2, w3, w4;
+static int full_reload = 1;	/* Until watchers are set up, see conf_incremental() */
 static TAILQ_HEAD(head, conf_change) conf_change_list = TAILQ_HEAD_INITIALIZER(conf_change_list);
 
 static int parse_conf(char *file);
@@ -206,12 +213,14 @@ void conf_parse_cond(svc_t *svc, char *cond)
 		i++;
 	ptr[i] = 0;
 
-	if (i >= sizeof(svc->cond)) {
+	if (i >= MAX_COND_LEN) {
 		logit(LOG_WARNING, "Too long event list in declaration of %s: %s", svc->cmd, ptr);
 		return;
 	}
 
-	strlcpy(svc->cond, ptr, sizeof(svc->cond));
+	if (svc_set_cond(svc, ptr))
+		return;
+	cond_svc_attach(svc);
 }
 
 struct rlimit_name {
@@ -290,19 +299,19 @@ char *lim2str(struct rlimit *rlim)
 /* First form: `rlimit <hard|soft> RESOURCE LIMIT` */
 void conf_parse_rlimit(char *line, struct rlimit arr[])
 {
-	char *level, *limit, *val;
+	char *level, *limit, *val, *ptr;
 	int resource = -1;
 	rlim_t cfg;
 
-	level = strtok(line, " \t");
+	level = strtok_r(line, " \t", &ptr);
 	if (!level)
 		goto error;
 
-	limit = strtok(NULL, " \t");
+	limit = strtok_r(NULL, " \t", &ptr);
 	if (!limit)
 		goto error;
 
-	val = strtok(NULL, " \t");
+	val = strtok_r(NULL, " \t", &ptr);
 	if (!val) {
 		/* Second form: `rlimit RESOURCE LIMIT` */
 		val   = limit;
@@ -369,6 +378,62 @@ static void parse_static(char *line)
 		return;
 	}
 
+	/* Max number of run/task started in parallel at bootstrap */
+	if (BOOTSTRAP && MATCH_CMD(line, "bootstrap-jobs ", x)) {
+		const char *err = NULL;
+		int num;
+
+		num = strtonum(strip_line(x), 0, 1024, &err);
+		if (err)
+			_e("Invalid bootstrap-jobs %s: %s", x, err);
+		else
+			boot_jobs = num;
+		return;
+	}
+
+	/* Max number of starts in flight, not yet ready, in any runlevel */
+	if (MATCH_CMD(line, "start-jobs ", x)) {
+		const char *err = NULL;
+		int num;
+
+		num = strtonum(strip_line(x), 0, 1024, &err);
+		if (err)
+			_e("Invalid start-jobs %s: %s", x, err);
+		else
+			admit_max = num;
+		return;
+	}
+
+	if (MATCH_CMD(line, "start-delay ", x)) {
+		const char *err = NULL;
+		int msec;
+
+		msec = strtonum(strip_line(x), 0, 60000, &err);
+		if (err)
+			_e("Invalid start-delay %s: %s", x, err);
+		else
+			admit_delay = msec;
+		return;
+	}
+
+	/* Trigger for sys/pressure/RES, and shed:RES services */
+	if (MATCH_CMD(line, "pressure ", x)) {
+		pressure_conf(strip_line(x));
+		return;
+	}
+
+	if (BOOTSTRAP && MATCH_CMD(line, "runparts-jobs ", x)) {
+		const char *err = NULL;
+		int num;
+
+		num = strtonum(strip_line(x), 0, 1024, &err);
+		if (err)
+			_e("Invalid runparts-jobs %s: %s", x, err);
+		else
+			runparts_jobs = num;
+		return;
+	}
+
 	if (BOOTSTRAP && MATCH_CMD(line, "runparts ", x)) {
 		if (runparts) free(runparts);
 		runparts = strdup(strip_line(x));
@@ -389,17 +454,17 @@ static void parse_static(char *line)
 	}
 
 	if (MATCH_CMD(line, "log ", x)) {
-		char *tok;
+		char *tok, *ptr;
 		static int size = 200000, count = 5;
 
-		tok = strtok(x, ":= ");
+		tok = strtok_r(x, ":= ", &ptr);
 		while (tok) {
 			if (!strncmp(tok, "size", 4))
-				size = strtobytes(strtok(NULL, ":= "));
+				size = strtobytes(strtok_r(NULL, ":= ", &ptr));
 			else if (!strncmp(tok, "count", 5))
-				count = strtobytes(strtok(NULL, ":= "));
+				count = strtobytes(strtok_r(NULL, ":= ", &ptr));
 
-			tok = strtok(NULL, ":= ");
+			tok = strtok_r(NULL, ":= ", &ptr);
 		}
 
 		if (size >= 0)
@@ -414,6 +479,19 @@ static void parse_static(char *line)
 		return;
 	}
 
+	/* Real root, mounted by the initramfs, see switchroot.c */
+	if (BOOTSTRAP && MATCH_CMD(line, "switch-root ", x)) {
+		if (sysroot) free(sysroot);
+		sysroot = strdup(strip_line(x));
+		return;
+	}
+
+	if (MATCH_CMD(line, "kexec ", x)) {
+		if (kexec) free(kexec);
+		kexec = strdup(strip_line(x));
+		return;
+	}
+
 	/*
 	 * The desired runlevel to start when leaving bootstrap (S).
 	 * Finit supports 1-9, but most systems only use 1-6, where
@@ -579,6 +657,163 @@ static int parse_conf(char *file)
 	return 0;
 }
 
+/*
+ * Replay the lines of finit.conf and *.conf from the cache built by
+ * `initctl cache build`, in the same order as parse_conf() and
+ * parse_conf_dynamic() would read them.  Saves opening and scanning
+ * every file at boot.  A missing or stale cache returns non-zero and
+ * the caller falls back to parsing the .conf files.
+ */
+static int parse_cache(void)
+{
+	struct confcache cc;
+	char *file;
+	int rc;
+
+	rc = confcache_open(FINIT_CACHE, &cc);
+	if (rc) {
+		if (rc != ENOENT)
+			_d("Skipping %s: %s", FINIT_CACHE, strerror(rc));
+		return 1;
+	}
+
+	_d("Loading %s", FINIT_CACHE);
+	for (int i = 0; i < RLIMIT_NLIMITS; i++)
+		getrlimit(i, &global_rlimit[i]);
+
+	while ((file = confcache_file(&cc))) {
+		struct rlimit rlimit[RLIMIT_NLIMITS];
+		int is_main = !strcmp(file, FINIT_CONF);
+		char *ptr;
+
+		memcpy(rlimit, global_rlimit, sizeof(rlimit));
+		while ((ptr = confcache_line(&cc))) {
+			char line[LINE_SIZE];
+
+			strlcpy(line, ptr, sizeof(line));
+			tabstospaces(line);
+
+			if (is_main) {
+				parse_static(line);
+				parse_dynamic(line, global_rlimit, NULL);
+			} else
+				parse_dynamic(line, rlimit, file);
+		}
+
+		if (!is_main)
+			continue;
+
+		for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+			if (setrlimit(i, &global_rlimit[i]) == -1)
+				logit(LOG_WARNING, "rlimit: Failed setting %s: %s",
+				      rlim2str(i), lim2str(&global_rlimit[i]));
+		}
+	}
+	confcache_close(&cc);
+
+	return 0;
+}
+
+/* Check that it's an actual file, beyond any symlinks, ending with .conf */
+static int conf_valid(char *path)
+{
+	struct stat st;
+	size_t len;
+
+	if (lstat(path, &st)) {
+		_d("Skipping %s, cannot access: %s", path, strerror(errno));
+		return 0;
+	}
+
+	/* Skip directories */
+	if (S_ISDIR(st.st_mode)) {
+		_d("Skipping directory %s", path);
+		return 0;
+	}
+
+	/* Check for dangling symlinks */
+	if (S_ISLNK(st.st_mode)) {
+		char *rp;
+
+		rp = realpath(path, NULL);
+		if (!rp) {
+			logit(LOG_WARNING, "Skipping %s, dangling symlink: %s", path, strerror(errno));
+			return 0;
+		}
+
+		free(rp);
+	}
+
+	/* Check that file ends with '.conf' */
+	len = strlen(path);
+	if (len < 6 || strcmp(&path[len - 5], ".conf")) {
+		_d("Skipping %s, not a valid .conf ... ", path);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * An incremental reload is possible if all changes are to *.conf in
+ * /etc/finit.d/, and we know we have seen all changes.  Changes to
+ * finit.conf, global rlimits, or the directories themselves, require
+ * a full reload.
+ */
+static int conf_incremental(void)
+{
+	struct conf_change *node;
+
+	if (full_reload)
+		return 0;
+
+	if (w1.fd < 0 || (w3.fd < 0 && fisdir(FINIT_RCSD "/enabled")) ||
+	    (w2.fd < 0 && fisdir(FINIT_RCSD "/available")))
+		return 0;
+
+	TAILQ_FOREACH(node, &conf_change_list, link) {
+		size_t len = strlen(node->name);
+
+		if (len < 6 || strcmp(&node->name[len - 5], ".conf"))
+			return 0;
+		if (!strcmp(node->name, "finit.conf"))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Re-read only the *.conf in /etc/finit.d/ and /etc/finit.d/enabled/
+ * inotify has told us about.  Services and TTYs from other .conf files
+ * are left untouched, and services re-registered with the same
+ * definition are not marked dirty by service_register().
+ */
+static void conf_reload_changed(void)
+{
+	static const char *dirs[] = {
+		FINIT_RCSD "/",
+		FINIT_RCSD "/enabled/",
+	};
+	struct conf_change *node;
+
+	svc_mark_dynamic(conf_changed);
+	tty_mark(conf_changed);
+
+	TAILQ_FOREACH(node, &conf_change_list, link) {
+		for (size_t i = 0; i < NELEMS(dirs); i++) {
+			char path[PATH_MAX];
+
+			snprintf(path, sizeof(path), "%s%s", dirs[i], node->name);
+			if (!fexist(path))
+				continue;
+
+			if (conf_valid(path))
+				parse_conf_dynamic(path);
+		}
+	}
+}
+
 /*
  * Reload /etc/finit.conf and all *.conf in /etc/finit.d/
  */
@@ -587,9 +822,16 @@ int conf_reload(void)
 	size_t i;
 	glob_t gl;
 
+	if (!rescue && conf_incremental()) {
+		_d("Incremental reload of changed .conf files only");
+		conf_reload_changed();
+		goto done;
+	}
+
 	/* Mark and sweep */
-	svc_mark_dynamic();
-	tty_mark();
+	svc_mark_dynamic(NULL);
+	tty_mark(NULL);
+	full_reload = 0;
 
 	if (rescue) {
 		int rc;
@@ -604,51 +846,22 @@ int conf_reload(void)
 		goto done;
 	}
 
+	/* Use precompiled cache, if up to date */
+	if (!parse_cache())
+		goto done;
+
 	/* First, read /etc/finit.conf */
 	parse_conf(FINIT_CONF);
 
 	/* Next, read all *.conf in /etc/finit.d/ */
-	glob("/etc/finit.d/*.conf", 0, NULL, &gl);
-	glob("/etc/finit.d/enabled/*.conf", GLOB_APPEND, NULL, &gl);
+	glob(FINIT_RCSD "/*.conf", 0, NULL, &gl);
+	glob(FINIT_RCSD "/enabled/*.conf", GLOB_APPEND, NULL, &gl);
 
 	for (i = 0; i < gl.gl_pathc; i++) {
 		char *path = gl.gl_pathv[i];
-		size_t len;
-		struct stat st;
-
-		/* Check that it's an actual file ... beyond any symlinks */
-		if (lstat(path, &st)) {
-			_d("Skipping %s, cannot access: %s", path, strerror(errno));
-			continue;
-		}
-
-		/* Skip directories */
-		if (S_ISDIR(st.st_mode)) {
-			_d("Skipping directory %s", path);
-			continue;
-		}
-
-		/* Check for dangling symlinks */
-		if (S_ISLNK(st.st_mode)) {
-			char *rp;
-
-			rp = realpath(path, NULL);
-			if (!rp) {
-				logit(LOG_WARNING, "Skipping %s, dangling symlink: %s", path, strerror(errno));
-				continue;
-			}
 
-			free(rp);
-		}
-
-		/* Check that file ends with '.conf' */
-		len = strlen(path);
-		if (len < 6 || strcmp(&path[len - 5], ".conf")) {
-			_d("Skipping %s, not a valid .conf ... ", path);
-			continue;
-		}
-
-		parse_conf_dynamic(path);
+		if (conf_valid(path))
+			parse_conf_dynamic(path);
 	}
 
 	globfree(&gl);
@@ -707,12 +920,8 @@ static int do_change(char *name, uint32_t mask)
 
 	_d("Change detected for %s, mask 0x%08x", name, mask);
 
+	/* Removed .conf files are also recorded, for conf_reload_changed() */
 	node = conf_find(name);
-	if (mask & (IN_DELETE | IN_MOVED_FROM)) {
-		drop_change(node);
-		return 0;
-	}
-
 	if (node) {
 		_d("Event already registered for %s ...", name);
 		return 0;
@@ -758,7 +967,7 @@ int conf_changed(char *file)
 	return 0;
 }
 
-static void conf_cb(uev_t *w, void *arg, int events)
+static void conf_event(uev_t *w, void *arg, int events)
 {
 	static char ev_buf[8 *(sizeof(struct inotify_event) + NAME_MAX + 1) + 1];
 	struct inotify_event *ev;
@@ -791,6 +1000,15 @@ static void conf_cb(uev_t *w, void *arg, int events)
 #endif
 }
 
+/* How long reloading takes is accounted as "conf" in initctl metrics */
+static void conf_cb(uev_t *w, void *arg, int events)
+{
+	uint64_t start = metric_start();
+
+	conf_event(w, arg, events);
+	metric_stop("conf", start);
+}
+
 static int add_watcher(uev_ctx_t *ctx, uev_t *w, char *path, uint32_t opt)
 {
 	struct stat st;
@@ -814,8 +1032,11 @@ static int add_watcher(uev_ctx_t *ctx, uev_t *w, char *path, uint32_t opt)
 			arg++;
 	}
 
-	if (w->fd >= 0)
+	/* Called again after switch-root, for the new /etc */
+	if (w->fd >= 0) {
+		uev_io_stop(w);
 		close(w->fd);
+	}
 
 	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 	if (fd < 0) {
@@ -868,6 +1089,9 @@ int conf_monitor(uev_ctx_t *ctx)
 	rc += add_watcher(ctx, &w3, FINIT_RCSD "/enabled/", 0);
 	rc += add_watcher(ctx, &w4, FINIT_CONF, 0);
 
+	/* Changes before this point are unknown, force a full reload */
+	full_reload = 1;
+
 	return rc + conf_reload();
 }
 
@@ -0,0 +1,427 @@
+/* Precompiled configuration cache, see conf_reload()
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "confcache.h"
+
+#define CONFCACHE_MAX   (16 * 1024 * 1024)
+#define ALIGN8(x)       (((x) + 7) & ~(size_t)7)
+
+/* Directories checked for added or removed .conf files */
+static const char *dirs[] = {
+	FINIT_RCSD,
+	FINIT_RCSD "/available",
+	FINIT_RCSD "/enabled",
+};
+
+struct buf {
+	char   *data;
+	size_t  len;
+	size_t  size;
+};
+
+static uint32_t fnv1a(const char *ptr, size_t len)
+{
+	uint32_t hash = 0x811c9dc5;
+
+	while (len--)
+		hash = (hash ^ (unsigned char)*ptr++) * 0x01000193;
+
+	return hash;
+}
+
+/* Append @len bytes of @data, or zeroes, padded to 8 bytes.  Returns offset */
+static ssize_t put(struct buf *b, const void *data, size_t len)
+{
+	size_t need = ALIGN8(b->len + len);
+	size_t off = b->len;
+
+	if (need > CONFCACHE_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (need > b->size) {
+		size_t size = b->size ? b->size : 4096;
+		char *tmp;
+
+		while (size < need)
+			size *= 2;
+		tmp = realloc(b->data, size);
+		if (!tmp)
+			return -1;
+		b->data = tmp;
+		b->size = size;
+	}
+
+	memset(&b->data[off], 0, need - off);
+	if (data)
+		memcpy(&b->data[off], data, len);
+	b->len = need;
+
+	return off;
+}
+
+/* Append lines of @path, the same lines parse_conf() acts on */
+static int put_lines(struct buf *b, const char *path, uint32_t *lines)
+{
+	char line[LINE_SIZE];
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		chomp(line);
+		if (!line[0] || line[0] == '#')
+			continue;
+
+		if (put(b, line, strlen(line) + 1) < 0) {
+			fclose(fp);
+			return 1;
+		}
+		(*lines)++;
+	}
+
+	return fclose(fp);
+}
+
+static int put_src(struct buf *b, const char *path, int dir)
+{
+	struct confcache_src src = { 0 };
+	struct confcache_src *ptr;
+	size_t len = strlen(path) + 1;
+	struct stat st;
+	uint32_t lines = 0;
+	ssize_t off;
+
+	if (len > UINT16_MAX)
+		return errno = ENAMETOOLONG;
+
+	if (!stat(path, &st)) {
+		src.ino        = st.st_ino;
+		src.mtime_sec  = st.st_mtim.tv_sec;
+		src.mtime_nsec = st.st_mtim.tv_nsec;
+		src.size       = st.st_size;
+	}
+	src.len = len;
+	src.dir = dir;
+
+	off = put(b, NULL, sizeof(src) + len);
+	if (off < 0)
+		return errno;
+
+	if (src.ino && !dir && put_lines(b, path, &lines))
+		return errno;
+
+	/* Write record last, b->data may have been moved by realloc() */
+	src.lines = lines;
+	ptr = (struct confcache_src *)&b->data[off];
+	memcpy(ptr, &src, sizeof(src));
+	memcpy(ptr->path, path, len);
+
+	return 0;
+}
+
+/* Same checks as conf_reload(), regular file, beyond symlinks, ending in .conf */
+static int is_conf(const char *path)
+{
+	struct stat st;
+	size_t len;
+
+	if (stat(path, &st) || !S_ISREG(st.st_mode))
+		return 0;
+
+	len = strlen(path);
+	if (len < 6 || strcmp(&path[len - 5], ".conf"))
+		return 0;
+
+	return 1;
+}
+
+/**
+ * confcache_build - Build configuration cache
+ * @file: Cache file to create, usually %FINIT_CACHE
+ *
+ * Reads finit.conf and all enabled *.conf in finit.d/, in the same order
+ * as conf_reload(), and saves all non-empty lines, except comments, in
+ * one file.  Along with the inode, size, and mtime of each file, and of
+ * the directories, so a stale cache can be detected by confcache_open().
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, with @errno set.
+ */
+int confcache_build(const char *file)
+{
+	struct confcache_hdr hdr = {
+		.magic     = CONFCACHE_MAGIC,
+		.version   = CONFCACHE_VERSION,
+		.line_size = LINE_SIZE,
+	};
+	struct buf b = { 0 };
+	char tmp[strlen(file) + 5];
+	size_t i;
+	glob_t gl;
+	int fd, rc = 0;
+
+	if (put(&b, NULL, sizeof(hdr)) < 0)
+		return errno;
+
+	for (i = 0; i < NELEMS(dirs); i++) {
+		if (put_src(&b, dirs[i], 1))
+			goto error;
+		hdr.nsrc++;
+	}
+
+	if (put_src(&b, FINIT_CONF, 0))
+		goto error;
+	hdr.nsrc++;
+
+	glob(FINIT_RCSD "/*.conf", 0, NULL, &gl);
+	glob(FINIT_RCSD "/enabled/*.conf", GLOB_APPEND, NULL, &gl);
+	for (i = 0; i < gl.gl_pathc; i++) {
+		if (!is_conf(gl.gl_pathv[i]))
+			continue;
+
+		if (put_src(&b, gl.gl_pathv[i], 0)) {
+			globfree(&gl);
+			goto error;
+		}
+		hdr.nsrc++;
+	}
+	globfree(&gl);
+
+	hdr.size = b.len;
+	hdr.csum = fnv1a(&b.data[sizeof(hdr)], b.len - sizeof(hdr));
+	memcpy(b.data, &hdr, sizeof(hdr));
+
+	/* Replace atomically, PID 1 may be reading the old one */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto error;
+
+	if (write(fd, b.data, b.len) != (ssize_t)b.len || fsync(fd)) {
+		close(fd);
+		goto fail;
+	}
+	if (close(fd) || rename(tmp, file))
+		goto fail;
+
+	free(b.data);
+	return 0;
+fail:
+	rc = errno;
+	unlink(tmp);
+	errno = rc;
+error:
+	rc = errno ?: EIO;
+	free(b.data);
+
+	return errno = rc;
+}
+
+/* Walk all records, bounds checking and comparing with the file system */
+static int validate(struct confcache *cc)
+{
+	char *pos = cc->pos;
+	uint32_t i, j;
+
+	for (i = 0; i < cc->nsrc; i++) {
+		struct confcache_src *src = (struct confcache_src *)pos;
+		struct stat st;
+
+		if (pos + sizeof(*src) > cc->end || !src->len ||
+		    pos + sizeof(*src) + src->len > cc->end ||
+		    src->path[src->len - 1])
+			return EINVAL;
+		pos += ALIGN8(sizeof(*src) + src->len);
+
+		if (stat(src->path, &st)) {
+			if (src->ino)
+				return ESTALE;
+		} else {
+			if (src->ino        != (uint64_t)st.st_ino          ||
+			    src->mtime_sec  != (int64_t)st.st_mtim.tv_sec   ||
+			    src->mtime_nsec != (int64_t)st.st_mtim.tv_nsec  ||
+			    src->size       != (int64_t)st.st_size          ||
+			    !src->dir       != !S_ISDIR(st.st_mode))
+				return ESTALE;
+		}
+
+		for (j = 0; j < src->lines; j++) {
+			size_t len = strnlen(pos, cc->end - pos);
+
+			if (pos + len >= cc->end)
+				return EINVAL;
+			pos += ALIGN8(len + 1);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * confcache_open - Open and validate configuration cache
+ * @file: Cache file, usually %FINIT_CACHE
+ * @cc:   Pointer to &struct confcache to initialize
+ *
+ * The cache is only used if it is owned by root, not writable by others,
+ * intact, and none of its source files or directories have changed since
+ * it was built.  Use confcache_file() and confcache_line() to read it.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, %ESTALE if the cache is out of date.
+ */
+int confcache_open(const char *file, struct confcache *cc)
+{
+	struct confcache_hdr *hdr;
+	struct stat st;
+	int fd, rc;
+
+	memset(cc, 0, sizeof(*cc));
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno;
+
+	if (fstat(fd, &st)) {
+		rc = errno;
+		goto done;
+	}
+
+	rc = EPERM;
+	if (!S_ISREG(st.st_mode) || st.st_uid != 0 || (st.st_mode & 022))
+		goto done;
+
+	rc = EINVAL;
+	if (st.st_size < (off_t)sizeof(*hdr) || st.st_size > CONFCACHE_MAX)
+		goto done;
+
+	cc->len = st.st_size;
+	cc->map = mmap(NULL, cc->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (cc->map == MAP_FAILED) {
+		rc = errno;
+		cc->map = NULL;
+		goto done;
+	}
+
+	hdr = (struct confcache_hdr *)cc->map;
+	if (hdr->magic != CONFCACHE_MAGIC || hdr->version != CONFCACHE_VERSION ||
+	    hdr->size != cc->len || hdr->line_size != LINE_SIZE ||
+	    hdr->csum != fnv1a(&cc->map[sizeof(*hdr)], cc->len - sizeof(*hdr)))
+		goto done;
+
+	cc->pos  = &cc->map[sizeof(*hdr)];
+	cc->end  = &cc->map[cc->len];
+	cc->nsrc = hdr->nsrc;
+	rc = validate(cc);
+done:
+	close(fd);
+	if (rc) {
+		confcache_close(cc);
+		return errno = rc;
+	}
+
+	return 0;
+}
+
+/**
+ * confcache_file - Next source file in cache
+ * @cc: Pointer to &struct confcache from confcache_open()
+ *
+ * Skips any directories, missing files, and unread lines of the current
+ * file.  The returned path is valid until confcache_close().
+ *
+ * Returns:
+ * Path to next .conf file, or %NULL when done.
+ */
+char *confcache_file(struct confcache *cc)
+{
+	while (confcache_line(cc))
+		;
+
+	while (cc->nsrc > 0) {
+		struct confcache_src *src = (struct confcache_src *)cc->pos;
+
+		cc->nsrc--;
+		cc->pos += ALIGN8(sizeof(*src) + src->len);
+		cc->lines = src->lines;
+		if (src->dir || !src->ino)
+			continue;
+
+		return src->path;
+	}
+
+	return NULL;
+}
+
+/**
+ * confcache_line - Next line of current source file
+ * @cc: Pointer to &struct confcache from confcache_open()
+ *
+ * Returns:
+ * Read-only line, copy before tokenizing, or %NULL at end of file.
+ */
+char *confcache_line(struct confcache *cc)
+{
+	char *line;
+
+	if (!cc->lines)
+		return NULL;
+
+	line = cc->pos;
+	cc->pos += ALIGN8(strlen(line) + 1);
+	cc->lines--;
+
+	return line;
+}
+
+void confcache_close(struct confcache *cc)
+{
+	if (cc->map)
+		munmap(cc->map, cc->len);
+	memset(cc, 0, sizeof(*cc));
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,85 @@
+/* Precompiled configuration cache, see conf_reload()
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_CONFCACHE_H_
+#define FINIT_CONFCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FINIT_CACHE
+#define FINIT_CACHE      "/etc/finit.cache"
+#endif
+
+#define CONFCACHE_MAGIC   0x46434331	/* "FCC1" */
+#define CONFCACHE_VERSION 1
+
+/*
+ * On-disk format, everything in host byte order.  The header is
+ * followed by nsrc source records, each followed by its lines as
+ * NUL terminated strings.  Records are padded to 8 byte alignment.
+ */
+struct confcache_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;			/* Total size of file */
+	uint32_t csum;			/* FNV-1a of everything after header */
+	uint32_t nsrc;
+	uint32_t line_size;		/* LINE_SIZE of builder */
+};
+
+struct confcache_src {
+	uint64_t ino;			/* 0 if missing when built */
+	int64_t  mtime_sec;
+	int64_t  mtime_nsec;
+	int64_t  size;
+	uint32_t lines;			/* Number of lines following */
+	uint16_t len;			/* Length of path, including NUL */
+	uint16_t dir;			/* Directory, only checked for changes */
+	char     path[];
+};
+
+struct confcache {
+	char    *map;
+	size_t   len;
+	char    *pos;
+	char    *end;
+	uint32_t nsrc;			/* Sources left */
+	uint32_t lines;			/* Lines left in current source */
+};
+
+int   confcache_build (const char *file);
+int   confcache_open  (const char *file, struct confcache *cc);
+char *confcache_file  (struct confcache *cc);
+char *confcache_line  (struct confcache *cc);
+void  confcache_close (struct confcache *cc);
+
+#endif /* FINIT_CONFCACHE_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
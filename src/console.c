@@ -0,0 +1,291 @@
+/* Buffered, non-blocking progress output to the console
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <lite/lite.h>
+
+#include "console.h"
+#include "log.h"
+
+/*
+ * Progress is queued here and written out when the console can take
+ * it.  At 9600 baud the ring holds roughly eight seconds of output.
+ */
+#define CONSOLE_RING    8192
+#define CONSOLE_SYNC    3000		/* msec, max time to drain ring */
+
+static char   ring[CONSOLE_RING];
+static size_t head;			/* Next byte to write out */
+static size_t used;			/* Bytes queued */
+static char   last = '\n';		/* Last byte queued */
+
+static int    dropping;			/* Dropping rest of current line */
+static int    dropped;			/* Lines dropped, not yet reported */
+
+static int    fd = -1;			/* Non-blocking console, or -1 */
+static uev_t  watcher;
+
+static void push(const char *buf, size_t len)
+{
+	while (len) {
+		size_t pos = (head + used) % CONSOLE_RING;
+		size_t num = MIN(len, CONSOLE_RING - pos);
+
+		memcpy(&ring[pos], buf, num);
+		used += num;
+		buf  += num;
+		len  -= num;
+	}
+}
+
+/* Write as much as the console takes right now, without blocking */
+static void flush(void)
+{
+	while (used) {
+		size_t len = MIN(used, CONSOLE_RING - head);
+		ssize_t num;
+
+		num = write(fd, &ring[head], len);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				used = 0; /* Console gone, e.g. hangup */
+			break;
+		}
+
+		head  = (head + num) % CONSOLE_RING;
+		used -= num;
+	}
+
+	if (!used) {
+		head = 0;
+		uev_io_stop(&watcher);
+	} else
+		uev_io_start(&watcher);
+}
+
+static void cb(uev_t *w, void *arg, int events)
+{
+	flush();
+}
+
+/*
+ * Queue one line, or the start or end of one.  We never queue part of
+ * a line, so when the ring is full the rest of the line the console
+ * could not take is dropped, and the count is reported once there is
+ * room again.
+ */
+static void queue(const char *buf, size_t len, int eol)
+{
+	if (dropping) {
+		if (eol) {
+			dropping = 0;
+			dropped++;
+		}
+		return;
+	}
+
+	if (dropped) {
+		char msg[64];
+		size_t num;
+
+		num = snprintf(msg, sizeof(msg), "%s[ %d line%s dropped, console too slow ]\n",
+			       last == '\n' ? "" : "\n", dropped, dropped > 1 ? "s" : "");
+		if (num + len > CONSOLE_RING - used)
+			goto drop;
+
+		push(msg, num);
+		last = '\n';
+		dropped = 0;
+	}
+
+	if (len > CONSOLE_RING - used)
+		goto drop;
+
+	push(buf, len);
+	last = buf[len - 1];
+	return;
+drop:
+	dropping = 1;
+	queue(buf, len, eol);
+}
+
+/**
+ * console_write - Write progress to the console
+ * @buf: Text to write
+ * @len: Length of @buf
+ *
+ * Before console_init(), or if the console cannot be written to
+ * without blocking, this is a regular blocking write to stderr.
+ * Otherwise @buf is queued and flushed from the event loop.
+ */
+void console_write(const char *buf, size_t len)
+{
+	if (fd == -1) {
+		while (len) {
+			ssize_t num;
+
+			num = write(STDERR_FILENO, buf, len);
+			if (num < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			buf += num;
+			len -= num;
+		}
+		return;
+	}
+
+	/* Make room, unless the console is busy */
+	if (used)
+		flush();
+
+	while (len) {
+		char *nl = memchr(buf, '\n', len);
+		size_t num = nl ? (size_t)(nl - buf) + 1 : len;
+
+		queue(buf, num, nl != NULL);
+		buf += num;
+		len -= num;
+	}
+
+	flush();
+}
+
+void console_vprintf(const char *fmt, va_list ap)
+{
+	char buf[1024];
+	int len;
+
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	if (len <= 0)
+		return;
+	if ((size_t)len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+
+	console_write(buf, len);
+}
+
+void console_printf(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	console_vprintf(fmt, ap);
+	va_end(ap);
+}
+
+static long now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * console_sync - Drain queued progress, blocking
+ *
+ * For when the event loop is not running, e.g., at shutdown.  Gives
+ * up after CONSOLE_SYNC msec if the console does not drain.
+ */
+void console_sync(void)
+{
+	long end = now() + CONSOLE_SYNC;
+
+	if (fd == -1)
+		return;
+
+	while (used) {
+		struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+		long left = end - now();
+
+		if (left <= 0 || poll(&pfd, 1, left) <= 0)
+			break;
+
+		flush();
+	}
+}
+
+/**
+ * console_init - Start writing progress asynchronously
+ * @ctx: Event loop context
+ *
+ * Opens the console once more, from /proc, to get our own open file
+ * description that can be set non-blocking without affecting services
+ * that inherit stderr.  Requires /proc.  In debug mode, or if stderr
+ * is not a terminal, all output stays blocking to keep it in order
+ * with other writes to the console.
+ */
+void console_init(uev_ctx_t *ctx)
+{
+	if (fd != -1 || log_is_debug() || !isatty(STDERR_FILENO))
+		return;
+
+	fd = open("/proc/self/fd/2", O_WRONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		_pe("Failed opening console for non-blocking writes");
+		return;
+	}
+
+	if (uev_io_init(ctx, &watcher, cb, NULL, fd, UEV_WRITE)) {
+		_pe("Failed setting up console watcher");
+		close(fd);
+		fd = -1;
+		return;
+	}
+	uev_io_stop(&watcher);
+}
+
+/**
+ * console_exit - Drain and go back to blocking writes
+ *
+ * Called before the event loop stops, at shutdown and re-exec.
+ */
+void console_exit(void)
+{
+	if (fd == -1)
+		return;
+
+	console_sync();
+	uev_io_stop(&watcher);
+	close(fd);
+	fd = -1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -26,6 +26,9 @@
 
 #include <ctype.h>		/* isdigit() */
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
@@ -35,8 +38,12 @@
 #include <lite/lite.h>
 
 #include "finit.h"
+#include "boot.h"
 #include "conf.h"
+#include "console.h"
 #include "helpers.h"
+#include "metrics.h"
+#include "pid.h"
 #include "sig.h"
 #include "utmp-api.h"
 
@@ -100,6 +107,7 @@ int run(char *cmd)
 		return 1;
 	}
 
+	metric_inc(METRIC_FORK);
 	pid = fork();
 	if (0 == pid) {
 		FILE *fp;
@@ -199,13 +207,11 @@ int run_interactive(char *cmd, char *fmt, ...)
 
 	/* Dump any results of cmd on stderr after we've printed [ OK ] or [FAIL]  */
 	if (fp && !log_is_debug()) {
-		size_t len, written;
+		size_t len;
 
 		rewind(fp);
-		do {
-			len     = fread(line, 1, sizeof(line), fp);
-			written = fwrite(line, len, sizeof(char), stderr);
-		} while (len > 0 && written == len);
+		while ((len = fread(line, 1, sizeof(line), fp)) > 0)
+			console_write(line, len);
 	}
 
 	if (fp)
@@ -214,10 +220,24 @@ int run_interactive(char *cmd, char *fmt, ...)
 	return status;
 }
 
-int exec_runtask(char *cmd, char *args[])
+/* Command line for the shell to run a run/task, from @cmd and @args */
+char *runtask_cmdline(char *cmd, char *args[], char *buf, size_t len)
 {
 	size_t i;
-	char buf[1024] = "";
+
+	buf[0] = 0;
+	strlcat(buf, cmd, len);
+	for (i = 1; args[i]; i++) {
+		strlcat(buf, " ", len);
+		strlcat(buf, args[i], len);
+	}
+
+	return buf;
+}
+
+int exec_runtask(char *cmd, char *args[])
+{
+	char buf[1024];
 	char *argv[4] = {
 		"sh",
 		"-c",
@@ -225,11 +245,7 @@ int exec_runtask(char *cmd, char *args[])
 		NULL
 	};
 
-	strlcat(buf, cmd, sizeof(buf));
-	for (i = 1; args[i]; i++) {
-		strlcat(buf, " ", sizeof(buf));
-		strlcat(buf, args[i], sizeof(buf));
-	}
+	runtask_cmdline(cmd, args, buf, sizeof(buf));
 	logit(LOG_DEBUG, "Calling %s %s", _PATH_BSHELL, buf);
 	_d("Calling %s %s", _PATH_BSHELL, buf);
 
@@ -382,6 +398,7 @@ pid_t run_getty(char *tty, char *baud, char *term, int noclear, int nowait, stru
 {
 	pid_t pid;
 
+	metric_inc(METRIC_FORK);
 	pid = fork();
 	if (!pid) {
 		speed_t speed;
@@ -400,6 +417,7 @@ pid_t run_getty2(char *tty, char *cmd, char *args[], int noclear, int nowait, st
 {
 	pid_t pid;
 
+	metric_inc(METRIC_FORK);
 	pid = fork();
 	if (!pid) {
 		/* Dunno speed, tell stty() to not mess with it */
@@ -419,6 +437,7 @@ pid_t run_sh(char *tty, int noclear, int nowait, struct rlimit rlimit[])
 {
 	pid_t pid;
 
+	metric_inc(METRIC_FORK);
 	pid = fork();
 	if (!pid) {
 		prepare_tty(tty, B0, "finit-sh", rlimit);
@@ -429,10 +448,208 @@ pid_t run_sh(char *tty, int noclear, int nowait, struct rlimit rlimit[])
 	return pid;
 }
 
-int run_parts(char *dir, char *cmd)
+/*
+ * A script in run_parts(), scripts with the same numeric prefix, e.g.
+ * S10foo and S10bar, or 10-foo and 10-bar, are in the same group.
+ */
+struct part {
+	char      *name;
+	int        group;	/* Numeric prefix, or -1 for none */
+	char       cmd[512];	/* For sh -c, with start/stop or @cmd */
+
+	pid_t      pid;
+	int        pidfd;
+	FILE      *fp;		/* Captured output, parallel mode */
+	int        id;		/* In boot trace */
+	long long  start;
+};
+
+static int part_group(const char *name)
+{
+	if ((name[0] == 'S' || name[0] == 'K') && isdigit(name[1]))
+		name++;
+	if (!isdigit(name[0]))
+		return -1;
+
+	return atoi(name);
+}
+
+/*
+ * PID 1 can be quite big, so use posix_spawn(), i.e., vfork(), rather
+ * than copying its page tables for each script.  Same signal setup in
+ * the child as sig_unblock().  Output to @fp, if set.
+ */
+static pid_t part_spawn(struct part *p)
+{
+	char *argv[] = { "sh", "-c", p->cmd, NULL };
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	pid_t pid;
+	int rc;
+
+	posix_spawnattr_init(&attr);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigfillset(&mask);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	posix_spawn_file_actions_init(&fa);
+	if (p->fp) {
+		posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+		posix_spawn_file_actions_adddup2(&fa, fileno(p->fp), STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&fa, fileno(p->fp), STDERR_FILENO);
+	}
+
+	metric_inc(METRIC_FORK);
+	rc = posix_spawn(&pid, _PATH_BSHELL, &fa, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+	if (rc) {
+		errno = rc;
+		_pe("Failed starting %s", p->name);
+		return -1;
+	}
+
+	return pid;
+}
+
+static int part_start(struct part *p, int capture)
+{
+	if (capture) {
+		p->fp = tempfile();
+		if (!p->fp)
+			_pe("Failed capturing output of %s", p->name);
+	}
+
+	p->id    = boot_begin("runparts", p->name);
+	p->start = boot_usec();
+	p->pid   = part_spawn(p);
+	if (p->pid <= 0) {
+		boot_end(p->id);
+		if (p->fp)
+			fclose(p->fp);
+		p->fp = NULL;
+		return -1;
+	}
+	if (capture)
+		p->pidfd = pid_open(p->pid);
+
+	return 0;
+}
+
+/* Log captured output, line by line, and the duration of the script */
+static void part_done(struct part *p, int status)
+{
+	long long msec = (boot_usec() - p->start) / 1000;
+
+	boot_end(p->id);
+	if (p->pidfd >= 0)
+		close(p->pidfd);
+	p->pidfd = -1;
+	p->pid = 0;
+
+	if (p->fp) {
+		char line[LINE_SIZE];
+
+		rewind(p->fp);
+		while (fgets(line, sizeof(line), p->fp))
+			logit(LOG_NOTICE, "%s: %s", p->name, chomp(line));
+		fclose(p->fp);
+		p->fp = NULL;
+	}
+
+	if (WIFEXITED(status) && !WEXITSTATUS(status))
+		logit(LOG_INFO, "%s done after %lld.%03lld sec", p->name, msec / 1000, msec % 1000);
+	else
+		logit(LOG_WARNING, "%s failed, status %d, after %lld.%03lld sec", p->name,
+		      WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status),
+		      msec / 1000, msec % 1000);
+}
+
+/*
+ * Wait for any one of the running scripts to complete.  We cannot use
+ * waitpid(-1), that would reap services, so poll the pidfds, or on old
+ * kernels without pidfd, check each script at a short interval.
+ */
+static int part_wait(struct part *parts[], int num)
+{
+	struct pollfd pfd[num];
+	int i, n = 0, timeout = -1;
+
+	while (1) {
+		for (i = 0; i < num; i++) {
+			int status = 0;
+			pid_t pid;
+
+			pid = waitpid(parts[i]->pid, &status, WNOHANG);
+			if (pid == parts[i]->pid || (pid == -1 && errno == ECHILD)) {
+				part_done(parts[i], status);
+				return i;
+			}
+		}
+
+		for (i = 0, n = 0; i < num; i++) {
+			if (parts[i]->pidfd < 0) {
+				timeout = 20;
+				continue;
+			}
+			pfd[n].fd = parts[i]->pidfd;
+			pfd[n].events = POLLIN;
+			n++;
+		}
+
+		if (poll(pfd, n, timeout) < 0 && errno != EINTR) {
+			_pe("Failed waiting for runparts scripts");
+			return -1;
+		}
+	}
+}
+
+/* Run a group of scripts, at most @jobs at a time */
+static void part_group_run(struct part *group, int num, int jobs)
+{
+	struct part *running[jobs];
+	int i, n = 0, done;
+
+	for (i = 0; i < num || n > 0; ) {
+		if (i < num && n < jobs) {
+			if (!part_start(&group[i], 1))
+				running[n++] = &group[i];
+			i++;
+			continue;
+		}
+
+		done = part_wait(running, n);
+		if (done < 0)
+			break;
+		running[done] = running[--n];
+	}
+}
+
+/**
+ * run_parts_jobs - Call all executable files in a directory
+ * @dir:  Directory with scripts, e.g. /etc/start.d
+ * @cmd:  Argument to all scripts, or %NULL for start/stop of SysV style
+ *        S<NUM>name and K<NUM>name scripts
+ * @jobs: Max number of scripts to run in parallel, 0 or 1 for serial
+ *
+ * Scripts are called in alphabetic order.  In parallel mode scripts with
+ * the same numeric prefix are run concurrently, and one group must have
+ * completed before the next is started.  Scripts without a prefix are
+ * run on their own.  The output of each script is then captured and
+ * logged when it completes, to not interleave on the console.
+ *
+ * Returns:
+ * POSIX OK(0), or -1 if @dir cannot be read.
+ */
+int run_parts_jobs(char *dir, char *cmd, int jobs)
 {
 	struct dirent **e;
-	int i, num;
+	struct part *parts;
+	long long start;
+	int i, j, n = 0, num;
 
 	num = scandir(dir, &e, NULL, alphasort);
 	if (num < 0) {
@@ -440,26 +657,29 @@ int run_parts(char *dir, char *cmd)
 		return -1;
 	}
 
+	parts = calloc(num ? num : 1, sizeof(struct part));
+	if (!parts) {
+		_pe("Failed allocating memory for %s", dir);
+		jobs = 0;
+	}
+
+	start = boot_usec();
 	for (i = 0; i < num; i++) {
+		struct part one, *p = parts ? &parts[n] : &one;
 		struct stat st;
-		char path[512];
-		char *argv[4] = {
-			"sh",
-			"-c",
-			path,
-			NULL
-		};
 		char *name = e[i]->d_name;
-		pid_t pid = 0;
+		int status;
 
-		snprintf(path, sizeof(path), "%s/%s", dir, name);
-		if (stat(path, &st)) {
-			_d("Failed stat(%s): %s", path, strerror(errno));
+		memset(p, 0, sizeof(*p));
+		p->pidfd = -1;
+		snprintf(p->cmd, sizeof(p->cmd), "%s/%s", dir, name);
+		if (stat(p->cmd, &st)) {
+			_d("Failed stat(%s): %s", p->cmd, strerror(errno));
 			continue;
 		}
 
 		if (!S_ISEXEC(st.st_mode) || S_ISDIR(st.st_mode)) {
-			_d("Skipping %s ...", path);
+			_d("Skipping %s ...", p->cmd);
 			continue;
 		}
 
@@ -468,22 +688,39 @@ int run_parts(char *dir, char *cmd)
 			/* Check if S<NUM>service or K<NUM>service notation is used */
 			_d("Checking if %s is a sysvinit startstop script ...", name);
 			if (name[0] == 'S' && isdigit(name[1]))
-				strlcat(path, " start", sizeof(path));
+				strlcat(p->cmd, " start", sizeof(p->cmd));
 			else if (name[0] == 'K' && isdigit(name[1]))
-				strlcat(path, " stop", sizeof(path));
+				strlcat(p->cmd, " stop", sizeof(p->cmd));
 		} else {
-			strlcat(path, cmd, sizeof(path));
+			strlcat(p->cmd, " ", sizeof(p->cmd));
+			strlcat(p->cmd, cmd, sizeof(p->cmd));
 		}
 
-		pid = fork();
-		if (!pid) {
-			sig_unblock();
-			return execvp(_PATH_BSHELL, argv);
+		p->name  = name;
+		p->group = part_group(name);
+		if (jobs > 1) {
+			n++;
+			continue;
 		}
 
-                complete(path, pid);
+		/* Serial, output to console as before */
+		if (part_start(p, 0))
+			continue;
+		status = complete(p->cmd, p->pid);
+		part_done(p, status == -1 ? W_EXITCODE(1, 0) : status);
 	}
 
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n; j++) {
+			if (parts[i].group == -1 || parts[j].group != parts[i].group)
+				break;
+		}
+		part_group_run(&parts[i], j - i, jobs);
+	}
+
+	logit(LOG_NOTICE, "Called scripts in %s in %lld msec", dir, (boot_usec() - start) / 1000);
+
+	free(parts);
 	while (num--)
 		free(e[num]);
 	free(e);
@@ -491,6 +728,11 @@ int run_parts(char *dir, char *cmd)
 	return 0;
 }
 
+int run_parts(char *dir, char *cmd)
+{
+	return run_parts_jobs(dir, cmd, 0);
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
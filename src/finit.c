@@ -37,15 +37,23 @@
 #include <lite/lite.h>
 
 #include "finit.h"
+#include "boot.h"
 #include "cgroup.h"
 #include "cond.h"
 #include "conf.h"
+#include "console.h"
 #include "helpers.h"
+#include "mount.h"
+#include "mtab.h"
 #include "private.h"
 #include "plugin.h"
+#include "pressure.h"
+#include "reexec.h"
 #include "service.h"
+#include "shm.h"
 #include "sig.h"
 #include "sm.h"
+#include "switchroot.h"
 #include "tty.h"
 #include "util.h"
 #include "utmp-api.h"
@@ -58,10 +66,13 @@ int   rescue    = 0;		/* rescue mode from kernel cmdline */
 int   single    = 0;		/* single user mode from kernel cmdline */
 int   splash    = 0;		/* splash + progress enabled on kernel cmdline */
 char *sdown     = NULL;
+char *kexec     = NULL;		/* kexec kernel for reboot, see kexec.c */
+char *sysroot   = NULL;		/* switch-root DIR, see switchroot.c */
 char *network   = NULL;
 char *hostname  = NULL;
 char *rcsd      = FINIT_RCSD;
 char *runparts  = NULL;
+int   runparts_jobs = 0;	/* Serial by default */
 
 uev_ctx_t *ctx  = NULL;		/* Main loop context */
 svc_t *wdog     = NULL;		/* No watchdog by default */
@@ -85,54 +96,6 @@ static void banner(void)
 	print_banner(INIT_HEADING);
 }
 
-/*
- * Check all filesystems in /etc/fstab with a fs_passno > 0
- */
-static int fsck(int pass)
-{
-	struct fstab *fs;
-//	int save;
-	int rc = 0;
-
-	if (!setfsent()) {
-		_pe("Failed opening fstab");
-		return 1;
-	}
-
-//	if ((save = log_is_debug()))
-//		log_debug();
-
-	while ((fs = getfsent())) {
-		char cmd[80];
-		struct stat st;
-
-		if (fs->fs_passno != pass)
-			continue;
-
-		errno = 0;
-		if (stat(fs->fs_spec, &st) || !S_ISBLK(st.st_mode)) {
-			if (!string_match(fs->fs_spec, "UUID=") && !string_match(fs->fs_spec, "LABEL=")) {
-				_d("Cannot fsck %s, not a block device: %s", fs->fs_spec, strerror(errno));
-				continue;
-			}
-		}
-
-		if (ismnt("/proc/mounts", fs->fs_file, "rw")) {
-			_d("Skipping fsck of %s, already mounted rw on %s.", fs->fs_spec, fs->fs_file);
-			continue;
-		}
-
-		snprintf(cmd, sizeof(cmd), "fsck -a %s", fs->fs_spec);
-		rc += run_interactive(cmd, "Checking filesystem %.13s", fs->fs_spec);
-	}
-
-//	if (save)
-//		log_debug();
-	endfsent();
-
-	return rc;
-}
-
 /*
  * If everything goes south we can use this to give the operator an
  * emergency shell to debug the problem -- Finit should not crash!
@@ -176,6 +139,156 @@ static void emergency_shell(void)
 #endif /* EMERGENCY_SHELL */
 }
 
+/*
+ * Check file systems listed with pass > 0 in /etc/fstab, then remount
+ * / read-write if it exists in fstab is not 'ro'.  This is what the
+ * Debian sysv initscripts does.
+ */
+static int fs_root(void)
+{
+	int rc, id;
+
+	id = boot_begin("init", "fsck");
+	rc = fs_check();
+	boot_end(id);
+
+	if (setfsent()) {
+		struct fstab *fs;
+
+		while ((fs = getfsent())) {
+			if (strcmp(fs->fs_file, "/"))
+				continue;
+
+			if (strcmp(fs->fs_type, "ro")) {
+				if (rc)
+					print(1, "Cannot remount / as read-write, fsck failed before");
+				else
+					rc = run_interactive("mount -n -o remount,rw /", "Remounting / as read-write");
+			}
+			break;
+		}
+
+		endfsent();
+	}
+
+	return rc;
+}
+
+/*
+ * Mount everything else in /etc/fstab, and enable swap
+ */
+static void fs_setup(void)
+{
+	_d("Root FS up, calling hooks ...");
+	plugin_run_hooks(HOOK_ROOTFS_UP);
+
+	umask(0);
+	if (fs_mount())
+		plugin_run_hooks(HOOK_MOUNT_ERROR);
+
+	_d("Calling extra mount hook, after mounting filesystems ...");
+	plugin_run_hooks(HOOK_MOUNT_POST);
+
+	run("swapon -ea");
+	umask(0022);
+}
+
+/*
+ * Services Finit registers on its own, found in the current root
+ */
+static void builtin_services(int resumed)
+{
+	char cmd[256];
+	char *path;
+
+	/*
+	 * Populate /dev and prepare for runtime events from kernel.
+	 * Prefer udev if mdev is also available on the system.  With
+	 * the uevent plugin loaded, PID 1 is the device manager.
+	 */
+	path = which("udevd");
+	if (!path)
+		path = which("/lib/systemd/systemd-udevd");
+	if (path) {
+		/* Desktop and server distros usually have a variant of udev */
+		udev = 1;
+
+		/* Register udevd as a monitored service */
+		snprintf(cmd, sizeof(cmd), "[S12345789] pid:udevd %s -- Device event managing daemon", path);
+		if (service_register(SVC_TYPE_SERVICE, cmd, global_rlimit, NULL)) {
+			_pe("Failed registering %s", path);
+			udev = 0;
+		} else {
+			snprintf(cmd, sizeof(cmd), ":1 [S] <svc%s> "
+				 "udevadm trigger -c add -t devices "
+				 "-- Requesting device events", path);
+			service_register(SVC_TYPE_RUN, cmd, global_rlimit, NULL);
+
+			snprintf(cmd, sizeof(cmd), ":2 [S] <svc%s> "
+				 "udevadm trigger -c add -t subsystems "
+				 "-- Requesting subsystem events", path);
+			service_register(SVC_TYPE_RUN, cmd, global_rlimit, NULL);
+		}
+		free(path);
+	} else if (!resumed && !plugin_find("uevent")) {
+		path = which("mdev");
+		if (path) {
+			/* Embedded Linux systems usually have BusyBox mdev */
+			if (log_is_debug())
+				touch("/dev/mdev.log");
+
+			snprintf(cmd, sizeof(cmd), "%s -s", path);
+			free(path);
+
+			run_interactive(cmd, "Populating device tree");
+		}
+	}
+
+	/*
+	 * Start bundled watchdogd as soon as possible, if enabled
+	 */
+	if (which(FINIT_LIBPATH_ "/watchdogd")) {
+		service_register(SVC_TYPE_SERVICE, FINIT_LIBPATH_ "/watchdogd -- Finit watchdog daemon", global_rlimit, NULL);
+		wdog = svc_find(FINIT_LIBPATH_ "/watchdogd", NULL);
+	}
+}
+
+/*
+ * Mount /dev, /dev/pts, /dev/shm and /run, unless already mounted
+ */
+static void devfs_setup(void)
+{
+	/*
+	 * Some non-embedded systems without an initramfs may not have /dev mounted yet
+	 * If they do, check if system has udevadm and perform cleanup from initramfs
+	 */
+	if (!fismnt("/dev"))
+		mount("udev", "/dev", "devtmpfs", MS_RELATIME, "size=10%,nr_inodes=61156,mode=755");
+	else if (whichp("udevadm"))
+		run_interactive("udevadm info --cleanup-db", "Cleaning up udev db");
+
+	/* Modern systems use /dev/pts */
+	makedir("/dev/pts", 0755);
+	mount("devpts", "/dev/pts", "devpts", 0, "gid=5,mode=620,ptmxmode=0666");
+
+	/*
+	 * Some systems rely on us to both create /dev/shm and, to mount
+	 * a tmpfs there.  Any system with dbus needs shared memory, so
+	 * mount it, unless its already mounted, but not if listed in
+	 * the /etc/fstab file already.
+	 */
+	makedir("/dev/shm", 0755);
+	if (!fismnt("/dev/shm") && !ismnt("/etc/fstab", "/dev/shm", NULL))
+		mount("shm", "/dev/shm", "tmpfs", 0, "mode=0777");
+
+	/*
+	 * New tmpfs based /run for volatile runtime data
+	 * For details, see http://lwn.net/Articles/436012/
+	 */
+	if (fisdir("/run") && !fismnt("/run"))
+		mount("tmpfs", "/run", "tmpfs", MS_NODEV | MS_NOSUID | MS_NOEXEC, "mode=0755,size=10%");
+}
+
 /*
  * Handle bootstrap transition to configured runlevel, start TTYs
  *
@@ -193,7 +306,7 @@ static void finalize(void)
 	 * Run startup scripts in the runparts directory, if any.
 	 */
 	if (runparts && fisdir(runparts) && !rescue)
-		run_parts(runparts, NULL);
+		run_parts_jobs(runparts, NULL, runparts_jobs);
 
 	/*
 	 * Start all tasks/services in the configured runlevel
@@ -218,6 +331,10 @@ static void finalize(void)
 	_d("Calling all system up hooks ...");
 	plugin_run_hooks(HOOK_SYSTEM_UP);
 	service_step_all(SVC_TYPE_ANY);
+	boot_report();
+
+	/* Unload boot-only plugins, and free what we used for bootstrap */
+	mem_trim();
 
 	/* Enable silent mode before starting TTYs */
 	_d("Going silent ...");
@@ -245,6 +362,27 @@ static void crank_worker(void *unused)
 		run_interactive("/lib/udev/udev-finish", "Finalizing udev");
 }
 
+/*
+ * Continue bootstrap on the real root, as if Finit had been started
+ * there, but with the state from the initramfs.  The configuration is
+ * read from the new root, services the initramfs declared, but not the
+ * new root, are stopped, and all run/task in [S] are run again.
+ */
+static void root_switched(void)
+{
+	fs_root();
+	conf_monitor(ctx);
+	builtin_services(0);
+	fs_setup();
+	boot_learn();
+
+	_d("Base FS up, calling hooks ...");
+	plugin_run_hooks(HOOK_BASEFS_UP);
+
+	svc_clean_dynamic(service_unregister);
+	service_runtask_clean();
+}
+
 /*
  * Wait for system bootstrap to complete, all SVC_TYPE_RUNTASK must be
  * allowed to complete their work in [S], or timeout, before we call
@@ -268,22 +406,30 @@ static void final_worker(void *work)
 	else
 		_d("Timeout, resuming bootstrap.");
 
+	/* Done with the initramfs, bootstrap the real root */
+	if (switchroot_pending() && !switchroot()) {
+		root_switched();
+		cnt = 120;
+		schedule_work(work);
+		return;
+	}
+
 	finalize();
 }
 
 int main(int argc, char *argv[])
 {
 	struct wq crank = {
-		.cb = crank_worker
+		.cb = crank_worker,
+		.name = "crank_worker"
 	};
 	struct wq final = {
 		.cb = final_worker,
-		.delay = 1000
+		.delay = 1000,
+		.name = "final_worker"
 	};
 	uev_ctx_t loop;
-	char cmd[256];
-	char *path;
-	int rc = 0;
+	int rc = 0, id, resumed;
 
 	/*
 	 * finit/init/telinit client tool uses /dev/initctl pipe
@@ -340,6 +486,11 @@ int main(int argc, char *argv[])
 	 */
 	sig_init();
 
+	/*
+	 * Re-exec of a running system, resume instead of bootstrap
+	 */
+	resumed = reexec_load();
+
 	/*
 	 * Mount base file system
 	 */
@@ -348,62 +499,32 @@ int main(int argc, char *argv[])
 	if (fisdir("/proc/bus/usb"))
 		mount("none", "/proc/bus/usb", "usbfs", 0, NULL);
 
+	/* Progress no longer waits for a slow serial console */
+	console_init(&loop);
+
 	/*
 	 * Load plugins early, finit.conf may contain references to
 	 * features implemented by plugins.
 	 */
+	id = boot_begin("init", "plugin_init");
 	plugin_init(&loop);
+	boot_end(id);
 
 	/*
 	 * Hello world.
 	 */
-	banner();
-
-	/*
-	 * Check file systems listed with pass > 0 in /etc/fstab
-	 */
-	rc = 0;
-	for (int pass = 1; pass < 10 && !rescue; pass++) {
-		rc = fsck(pass);
-		if (rc)
-			break;
+	if (!resumed) {
+		id = boot_begin("init", "banner");
+		banner();
+		boot_end(id);
 	}
 
 	/*
-	 * Mount filesystems
+	 * Check and remount root filesystem
 	 */
-	if (!rescue) {
-#ifndef SYSROOT
-		/*
-		 * Remount / read-write if it exists in fstab is not 'ro'.
-		 * This is what the Debian sysv initscripts does.
-		 */
-		if (setfsent()) {
-			struct fstab *fs;
-
-			while ((fs = getfsent())) {
-				if (strcmp(fs->fs_file, "/"))
-					continue;
-
-				if (strcmp(fs->fs_type, "ro")) {
-					if (rc)
-						print(1, "Cannot remount / as read-write, fsck failed before");
-					else
-						rc = run_interactive("mount -n -o remount,rw /", "Remounting / as read-write");
-				}
-				break;
-			}
-
-			endfsent();
-		}
-#else
-		/*
-		 * XXX: Untested, in the initramfs age we should
-		 *      probably use switch_root instead.
-		 */
-		rc = mount(SYSROOT, "/", NULL, MS_MOVE, NULL);
-#endif
-	}
+	rc = 0;
+	if (!rescue && !resumed)
+		rc = fs_root();
 
 	/* Create /sys if missing, some systems don't include it in their rootfs skeleton */
 	if (!rc && !fisdir("/sys"))
@@ -418,117 +539,48 @@ int main(int argc, char *argv[])
 	/*
 	 * Initialize default control groups, if available
 	 */
-	cgroup_init();
+	cgroup_init(&loop);
 
 	/*
 	 * Initialize .conf system and load static /etc/finit.conf
 	 * Also initializes global_rlimit[] for udevd, below.
 	 */
+	id = boot_begin("init", "conf_init");
 	conf_init();
+	boot_end(id);
 
-	/*
-	 * Some non-embedded systems without an initramfs may not have /dev mounted yet
-	 * If they do, check if system has udevadm and perform cleanup from initramfs
-	 */
-	if (!fismnt("/dev"))
-		mount("udev", "/dev", "devtmpfs", MS_RELATIME, "size=10%,nr_inodes=61156,mode=755");
-	else if (whichp("udevadm"))
-		run_interactive("udevadm info --cleanup-db", "Cleaning up udev db");
-
-	/* Modern systems use /dev/pts */
-	makedir("/dev/pts", 0755);
-	mount("devpts", "/dev/pts", "devpts", 0, "gid=5,mode=620,ptmxmode=0666");
-
-	/*
-	 * Some systems rely on us to both create /dev/shm and, to mount
-	 * a tmpfs there.  Any system with dbus needs shared memory, so
-	 * mount it, unless its already mounted, but not if listed in
-	 * the /etc/fstab file already.
-	 */
-	makedir("/dev/shm", 0755);
-	if (!fismnt("/dev/shm") && !ismnt("/etc/fstab", "/dev/shm", NULL))
-		mount("shm", "/dev/shm", "tmpfs", 0, "mode=0777");
-
-	/*
-	 * New tmpfs based /run for volatile runtime data
-	 * For details, see http://lwn.net/Articles/436012/
-	 */
-	if (fisdir("/run") && !fismnt("/run"))
-		mount("tmpfs", "/run", "tmpfs", MS_NODEV | MS_NOSUID | MS_NOEXEC, "mode=0755,size=10%");
+	/* Already set up, and a new devpts would hide the ptys in use */
+	if (!resumed)
+		devfs_setup();
 	umask(022);
 
 	/* Bootstrap conditions, needed for hooks */
+	id = boot_begin("init", "cond_init");
 	cond_init();
+	boot_end(id);
 
-	/*
-	 * Populate /dev and prepare for runtime events from kernel.
-	 * Prefer udev if mdev is also available on the system.
-	 */
-	path = which("udevd");
-	if (!path)
-		path = which("/lib/systemd/systemd-udevd");
-	if (path) {
-		/* Desktop and server distros usually have a variant of udev */
-		udev = 1;
+	/* Status page in /run/finit, for clients that poll service state */
+	shm_init();
 
-		/* Register udevd as a monitored service */
-		snprintf(cmd, sizeof(cmd), "[S12345789] pid:udevd %s -- Device event managing daemon", path);
-		if (service_register(SVC_TYPE_SERVICE, cmd, global_rlimit, NULL)) {
-			_pe("Failed registering %s", path);
-			udev = 0;
-		} else {
-			snprintf(cmd, sizeof(cmd), ":1 [S] <svc%s> "
-				 "udevadm trigger -c add -t devices "
-				 "-- Requesting device events", path);
-			service_register(SVC_TYPE_RUN, cmd, global_rlimit, NULL);
+	/* mount/ conditions, for all mounts from now on */
+	mtab_init(&loop);
 
-			snprintf(cmd, sizeof(cmd), ":2 [S] <svc%s> "
-				 "udevadm trigger -c add -t subsystems "
-				 "-- Requesting subsystem events", path);
-			service_register(SVC_TYPE_RUN, cmd, global_rlimit, NULL);
-		}
-		free(path);
-	} else {
-		path = which("mdev");
-		if (path) {
-			/* Embedded Linux systems usually have BusyBox mdev */
-			if (log_is_debug())
-				touch("/dev/mdev.log");
+	/* sys/pressure/ conditions, and shedding of services */
+	pressure_init(&loop);
 
-			snprintf(cmd, sizeof(cmd), "%s -s", path);
-			free(path);
+	/* udevd, or mdev, and the bundled watchdogd */
+	builtin_services(resumed);
 
-			run_interactive(cmd, "Populating device tree");
-		}
-	}
-
-	/*
-	 * Start bundled watchdogd as soon as possible, if enabled
-	 */
-	if (which(FINIT_LIBPATH_ "/watchdogd")) {
-		service_register(SVC_TYPE_SERVICE, FINIT_LIBPATH_ "/watchdogd -- Finit watchdog daemon", global_rlimit, NULL);
-		wdog = svc_find(FINIT_LIBPATH_ "/watchdogd", NULL);
-	}
-
-	if (!rescue) {
-		_d("Root FS up, calling hooks ...");
-		plugin_run_hooks(HOOK_ROOTFS_UP);
-
-		umask(0);
-		if (run_interactive("mount -na", "Mounting filesystems"))
-			plugin_run_hooks(HOOK_MOUNT_ERROR);
-
-		_d("Calling extra mount hook, after mount -a ...");
-		plugin_run_hooks(HOOK_MOUNT_POST);
-
-		run("swapon -ea");
-		umask(0022);
-	}
+	if (!rescue && !resumed)
+		fs_setup();
 
 	/* Base FS up, enable standard SysV init signals */
 	sig_setup(&loop);
 
-	if (!rescue) {
+	if (!rescue && !resumed) {
+		/* Start times learned at previous boot, for start order */
+		boot_learn();
+
 		_d("Base FS up, calling hooks ...");
 		plugin_run_hooks(HOOK_BASEFS_UP);
 	}
@@ -543,11 +595,22 @@ int main(int argc, char *argv[])
 	api_init(&loop);
 	umask(022);
 
-	_d("Starting the big state machine ...");
-	schedule_work(&crank);
+	_d("Starting readiness notification socket ...");
+	notify_init(&loop);
+
+	_d("Starting event loop heartbeat ...");
+	heartbeat_init(&loop);
 
-	_d("Starting bootstrap finalize timer ...");
-	schedule_work(&final);
+	if (resumed) {
+		_d("Resuming services from before re-exec ...");
+		reexec_restore();
+	} else {
+		_d("Starting the big state machine ...");
+		schedule_work(&crank);
+
+		_d("Starting bootstrap finalize timer ...");
+		schedule_work(&final);
+	}
 
 	/*
 	 * Enter main loop to monitor /dev/initctl and services
@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <paths.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -55,7 +56,9 @@
  * with the old-style /dev/initctl FIFO.
  */
 #define INIT_SOCKET             _PATH_VARRUN "finit.sock"
+#define INIT_NOTIFY             _PATH_VARRUN "finit-notify.sock"
 #define INIT_MAGIC              0x03091969
+#define INIT_MAGIC_FRAME        0x03091970   /* struct init_frame */
 
 #define INIT_CMD_START          0
 #define INIT_CMD_RUNLVL         1
@@ -74,12 +77,23 @@
 #define INIT_CMD_RELOAD_SVC     12   /* SIGHUP service */
 #define INIT_CMD_RESTART_SVC    13   /* STOP + START service */
 #define INIT_CMD_QUERY_INETD    14
-#define INIT_CMD_UNUSED1        15   /* Unused, was INIT_CMD_EMIT */
+#define INIT_CMD_EMIT           15   /* Set/clear conditions, "-name" to clear */
 #define INIT_CMD_GET_RUNLEVEL   16
+#define INIT_CMD_POOL_STATS     17   /* Memory pool statistics, as text */
+#define INIT_CMD_LOOP_STATS     18   /* Event loop latency histogram, as text */
+#define INIT_CMD_MEM_STATS      19   /* Memory usage after bootstrap, as text */
 #define INIT_CMD_WDOG_HELLO     128  /* Watchdog register and hello */
 #define INIT_CMD_SVC_ITER       129
 #define INIT_CMD_SVC_QUERY      130
 #define INIT_CMD_SVC_FIND       131
+#define INIT_CMD_SVC_LIST       132  /* Stream svc_rec for all services */
+#define INIT_CMD_BOOT_TRACE     133  /* Stream boot trace, JSON text */
+#define INIT_CMD_SVC_LOG        134  /* Stream log ring of service, see below */
+#define INIT_CMD_METRICS        135  /* Stream metrics, Prometheus text format */
+#define INIT_CMD_SUBSCRIBE      136  /* Stream events, see below */
+#define INIT_CMD_SVC_PRIO       137  /* Show/change CPU and I/O scheduling, see below */
+#define INIT_CMD_REEXEC         138  /* Re-exec PID 1, see below */
+#define INIT_CMD_KEXEC          139  /* Reboot with kexec, NACK if no kernel */
 #define INIT_CMD_NACK           254
 #define INIT_CMD_ACK            255
 
@@ -92,6 +106,108 @@ struct init_request {
 	char	data[368];
 };
 
+/*
+ * Variable length framing, for requests with more data than fits in
+ * struct init_request, e.g., a long list of services.  The header is
+ * followed by @len bytes of data, at most INIT_FRAME_MAX.  The reply
+ * to a framed request is a struct init_frame with the same layout, the
+ * data, if any, is text.  Streamed replies are the same for both.
+ */
+#define INIT_FRAME_MAX          65536
+
+struct init_frame {
+	int      magic;		/* INIT_MAGIC_FRAME		*/
+	int      cmd;
+	int      runlevel;
+	int      sleeptime;
+	uint32_t len;		/* Length of data after header	*/
+};
+
+/*
+ * INIT_CMD_SVC_LOG replies with an ACK request, followed by the last
+ * output of the service as text until Finit closes the connection.  The
+ * number of lines is sent in the sleeptime member, zero for all, set
+ * runlevel to follow the log, i.e. keep the connection for new lines.
+ * NACK if the service has no log ring, e.g. it does not log to syslog.
+ */
+
+/*
+ * INIT_CMD_SVC_PRIO takes "JOB[:ID] [OPTION ...]" with the same options
+ * as the service stanza, e.g. "sshd nice:-5 cpus:0-1".  The reply data
+ * is the resulting settings, or the reason for a NACK.
+ */
+
+/*
+ * INIT_CMD_REEXEC replies with an ACK request when Finit is about to
+ * re-exec itself, keeping all services running, or a NACK with the
+ * reason in the data.  The connection is kept across the exec() and the
+ * new Finit replies with a second ACK when it has taken over, or the old
+ * one with a NACK if the exec() failed.
+ */
+
+/*
+ * INIT_CMD_SUBSCRIBE replies with an ACK request and then keeps the
+ * connection open, pushing one line of text per event until the client
+ * hangs up.  The events of interest are sent in the runlevel member as
+ * a mask of INIT_EV_*, zero for all.  A client that does not keep up is
+ * disconnected, it is expected to re-read the state and subscribe again.
+ *
+ *     svc <JOB>[:ID] <NAME> <STATUS>   service changed state
+ *     cond <NAME> <on|off|flux>        condition changed
+ *     runlevel <PREV> <NEW>            runlevel changed
+ */
+#define INIT_EV_SVC             0x01
+#define INIT_EV_COND            0x02
+#define INIT_EV_RUNLEVEL        0x04
+
+/*
+ * Wire format of a service, used instead of the in-memory svc_t so that
+ * initctl and Finit may differ in version.  Each service is a struct
+ * svc_rec header followed by its fields, as struct svc_tlv and data.
+ *
+ * INIT_CMD_SVC_ITER and INIT_CMD_SVC_FIND reply with one record, all
+ * fields.  INIT_CMD_SVC_LIST replies with all records on the same
+ * connection, the field mask is sent in the runlevel member of the
+ * request, zero for all fields.
+ * Unknown fields should be skipped by the receiver.  The job is always
+ * sent, the end of the list is marked by a header without any fields.
+ */
+#define SVC_REC_VERSION         1    /* Bumped only if the header changes */
+#define SVC_REC_MAX             1024 /* Max size of a record, incl. header */
+
+enum {
+	SVC_FIELD_JOB = 0,		/* int32_t */
+	SVC_FIELD_ID,			/* string */
+	SVC_FIELD_PID,			/* int32_t */
+	SVC_FIELD_STATE,		/* int32_t */
+	SVC_FIELD_BLOCK,		/* int32_t */
+	SVC_FIELD_TYPE,			/* int32_t */
+	SVC_FIELD_RUNLEVELS,		/* int32_t */
+	SVC_FIELD_START_TIME,		/* int64_t */
+	SVC_FIELD_RESTART_CNT,		/* int32_t */
+	SVC_FIELD_NAME,			/* string */
+	SVC_FIELD_CMD,			/* string */
+	SVC_FIELD_ARGS,			/* string, space separated */
+	SVC_FIELD_DESC,			/* string */
+	SVC_FIELD_COND,			/* string */
+	SVC_FIELD_NOTIFY_MSG,		/* string, STATUS= from sd_notify() */
+	SVC_FIELD_PRIO,			/* string, cpus:, sched:, nice:, ... */
+	SVC_FIELD_ADMIT,		/* int32_t, queued for a start slot */
+	SVC_FIELD_STAMPS,		/* int64_t[SVC_STAMP_MAX], jiffies_ns() */
+	SVC_FIELD_HISTORY,		/* struct svc_hist[], oldest first */
+};
+#define SVC_FIELD(f)            (1 << (f))
+
+struct svc_rec {
+	uint16_t version;
+	uint16_t len;			/* Length of fields after header */
+};
+
+struct svc_tlv {
+	uint16_t type;			/* SVC_FIELD_* */
+	uint16_t len;			/* Length of data after this, no NUL */
+};
+
 extern int    runlevel;
 extern int    cfglevel;
 extern int    prevlevel;
@@ -100,9 +216,12 @@ extern int    single;
 extern int    splash;
 extern char  *rcsd;
 extern char  *sdown;
+extern char  *kexec;
+extern char  *sysroot;
 extern char  *network;
 extern char  *hostname;
 extern char  *runparts;
+extern int    runparts_jobs;
 extern uev_ctx_t *ctx;
 
 #endif /* FINIT_H_ */
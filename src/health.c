@@ -0,0 +1,545 @@
+/* Active health checks of running services
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "cgroup.h"
+#include "cond.h"
+#include "health.h"
+#include "log.h"
+#include "sig.h"
+#include "util.h"
+
+#define HEALTH_INTERVAL 10	/* sec */
+#define HEALTH_TIMEOUT  2	/* sec */
+#define HEALTH_RETRIES  3
+
+static int probes;		/* Exec probes not yet collected */
+
+static void probe_cb(uev_t *w, void *arg, int events);
+
+static char *mkhealth(svc_t *svc, char *buf, size_t len)
+{
+	if (svc->id[0])
+		snprintf(buf, len, "health/%s/%s", svc->name, svc->id);
+	else
+		snprintf(buf, len, "health/%s", svc->name);
+
+	return buf;
+}
+
+static void healthy(svc_t *svc, int set)
+{
+	struct svc_health *h = svc->health;
+	char cond[MAX_COND_LEN];
+
+	if (h->healthy == set)
+		return;
+
+	h->healthy = set;
+	mkhealth(svc, cond, sizeof(cond));
+	if (set)
+		cond_set_oneshot(cond);
+	else
+		cond_clear(cond);
+}
+
+/*
+ * A hung daemon may not act on SIGTERM, so the whole service is killed
+ * and collected by service_monitor() like any other crash.  That way it
+ * is restarted with the same back-off and respawn limits.
+ */
+static void unhealthy(svc_t *svc)
+{
+	struct svc_health *h = svc->health;
+
+	logit(LOG_CONSOLE | LOG_ERR, "Service %s[%d] failed %d health checks in a row, restarting.",
+	      svc->name, svc->pid, h->fails);
+	h->fails = 0;
+	healthy(svc, 0);
+
+	if (svc->pid <= 1)
+		return;
+	if (cgroup_kill(svc->cgroup_fd))
+		kill(-svc->pid, SIGKILL);
+}
+
+static void probe_cancel(svc_t *svc)
+{
+	struct svc_health *h = svc->health;
+
+	uev_timer_stop(&h->expire);
+	if (h->sd >= 0) {
+		uev_io_stop(&h->watcher);
+		close(h->sd);
+		h->sd = -1;
+	}
+	if (h->pid > 0 && !h->killed) {
+		kill(-h->pid, SIGKILL);
+		h->killed = 1;
+	}
+}
+
+static void probe_done(svc_t *svc, int ok)
+{
+	struct svc_health *h = svc->health;
+
+	probe_cancel(svc);
+
+	/* Result of a probe that outlived its service */
+	if (svc->pid <= 0)
+		return;
+
+	if (ok) {
+		if (h->fails)
+			_d("%s: health check ok after %d failures", svc->name, h->fails);
+		h->fails = 0;
+		healthy(svc, 1);
+		return;
+	}
+
+	h->fails++;
+	_d("%s: health check failed, %d/%d", svc->name, h->fails, h->retries);
+	if (h->fails >= h->retries)
+		unhealthy(svc);
+}
+
+static void expire_cb(uev_t *w, void *arg, int events)
+{
+	svc_t *svc = arg;
+
+	_d("%s: health check timed out after %d sec", svc->name, svc->health->timeout);
+	probe_done(svc, 0);
+}
+
+static void conn_cb(uev_t *w, void *arg, int events)
+{
+	svc_t *svc = arg;
+	socklen_t len;
+	int err = 0;
+
+	len = sizeof(err);
+	if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+		err = errno;
+
+	probe_done(svc, !err);
+}
+
+static int probe_connect(svc_t *svc)
+{
+	struct svc_health *h = svc->health;
+	int sd;
+
+	sd = socket(h->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+		return -1;
+
+	if (!connect(sd, (struct sockaddr *)&h->addr, h->addrlen)) {
+		close(sd);
+		return 1;
+	}
+
+	/* A UNIX socket with a full backlog is EAGAIN, also a failure */
+	if (errno != EINPROGRESS) {
+		close(sd);
+		return -1;
+	}
+
+	if (uev_io_init(ctx, &h->watcher, conn_cb, svc, sd, UEV_WRITE)) {
+		close(sd);
+		return -1;
+	}
+	h->sd = sd;
+
+	return 0;
+}
+
+static int probe_exec(svc_t *svc)
+{
+	struct svc_health *h = svc->health;
+	pid_t pid;
+	int fd;
+
+	/* In the cgroup of the service, so it is accounted for */
+	pid = cgroup_fork(svc->cgroup_fd);
+	if (pid < 0)
+		return -1;
+
+	if (pid == 0) {
+		char *home = NULL;
+#ifdef ENABLE_STATIC
+		int uid = 0; /* No getpwnam() in static builds, see service_start() */
+		int gid = 0;
+#else
+		int uid = getuser(svc->username, &home);
+		int gid = getgroup(svc->group);
+#endif
+
+		sig_unblock();
+		setsid();
+
+		fd = open("/dev/null", O_RDWR);
+		if (fd != -1) {
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			if (fd > STDERR_FILENO)
+				close(fd);
+		}
+
+		/* Same user and group as the service, never root by mistake */
+		if (gid >= 0 && setgid(gid))
+			_exit(1);
+		if (uid >= 0) {
+			if (setuid(uid))
+				_exit(1);
+
+			if (uid > 0)
+				setenv("PATH", _PATH_DEFPATH, 1);
+			if (home) {
+				setenv("HOME", home, 1);
+				if (chdir(home))
+					chdir("/");
+			}
+		}
+
+		execl(h->path, h->path, svc->name, NULL);
+		_exit(1);
+	}
+
+	h->pid    = pid;
+	h->killed = 0;
+	probes++;
+
+	return 0;
+}
+
+static void probe_cb(uev_t *w, void *arg, int events)
+{
+	svc_t *svc = arg;
+	struct svc_health *h = svc->health;
+	int rc;
+
+	if (svc->pid <= 0) {
+		health_stop(svc);
+		return;
+	}
+
+	/* Stopped by a condition going flux, or previous probe still busy */
+	if (svc->state != SVC_RUNNING_STATE || h->sd >= 0 || h->pid > 0)
+		return;
+
+	if (h->type == HEALTH_EXEC)
+		rc = probe_exec(svc);
+	else
+		rc = probe_connect(svc);
+
+	if (rc) {
+		probe_done(svc, rc > 0);
+		return;
+	}
+
+	if (uev_timer_init(ctx, &h->expire, expire_cb, svc, h->timeout * 1000, 0))
+		_pe("%s: failed starting health check timeout", svc->name);
+}
+
+/* [ADDR:]PORT[/tcp], ADDR can be [IPV6], default is 127.0.0.1 */
+static int parse_inet(struct svc_health *h, char *arg)
+{
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&h->addr;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&h->addr;
+	char buf[MAX_ARG_LEN], *addr = NULL, *port = buf, *ptr;
+	const char *errstr = NULL;
+	struct servent *sv;
+	int num;
+
+	strlcpy(buf, arg, sizeof(buf));
+	ptr = strchr(buf, '/');
+	if (ptr) {
+		if (strcasecmp(&ptr[1], "tcp"))
+			return -1;
+		*ptr = 0;
+	}
+
+	if (buf[0] == '[') {
+		addr = &buf[1];
+		ptr = strchr(addr, ']');
+		if (!ptr || ptr[1] != ':')
+			return -1;
+		*ptr = 0;
+		port = &ptr[2];
+	} else {
+		ptr = strrchr(buf, ':');
+		if (ptr) {
+			*ptr++ = 0;
+			addr = buf;
+			port = ptr;
+		}
+	}
+
+	sv = getservbyname(port, "tcp");
+	if (sv) {
+		num = ntohs(sv->s_port);
+	} else {
+		num = strtonum(port, 1, 65535, &errstr);
+		if (errstr)
+			return -1;
+	}
+
+	memset(&h->addr, 0, sizeof(h->addr));
+	if (addr && strchr(addr, ':')) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port   = htons(num);
+		if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) != 1)
+			return -1;
+		h->addrlen = sizeof(*sin6);
+	} else {
+		sin->sin_family = AF_INET;
+		sin->sin_port   = htons(num);
+		if (inet_pton(AF_INET, addr ?: "127.0.0.1", &sin->sin_addr) != 1)
+			return -1;
+		h->addrlen = sizeof(*sin);
+	}
+
+	return 0;
+}
+
+static int parse_probe(struct svc_health *h, char *arg)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *)&h->addr;
+
+	if (!strncasecmp(arg, "exec:", 5)) {
+		if (arg[5] != '/')
+			return -1;
+		strlcpy(h->path, &arg[5], sizeof(h->path));
+		h->type = HEALTH_EXEC;
+		return 0;
+	}
+
+	if (arg[0] == '/') {
+		if (strlen(arg) >= sizeof(sun->sun_path))
+			return -1;
+		memset(&h->addr, 0, sizeof(h->addr));
+		sun->sun_family = AF_UNIX;
+		strlcpy(sun->sun_path, arg, sizeof(sun->sun_path));
+		strlcpy(h->path, arg, sizeof(h->path));
+		h->addrlen = sizeof(*sun);
+		h->type = HEALTH_UNIX;
+		return 0;
+	}
+
+	h->type = HEALTH_TCP;
+	return parse_inet(h, arg);
+}
+
+/**
+ * health_parse - Parse health:PROBE option of a service
+ * @svc: Pointer to &svc_t
+ * @arg: Argument to health:, or %NULL to disable health checks
+ *
+ * The argument is a probe, [ADDR:]PORT[/tcp], /path/to/unix.sock, or
+ * exec:/path/to/script, followed by an optional comma separated list
+ * of interval:SEC, timeout:SEC, and retries:NUM.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int health_parse(svc_t *svc, char *arg)
+{
+	char spec[MAX_ARG_LEN], *tok;
+	struct svc_health *h, tmp;
+	const char *errstr = NULL;
+
+	if (!arg) {
+		health_free(svc);
+		return 0;
+	}
+
+	if (svc->health && !strcmp(svc->health->spec, arg))
+		return 0;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.interval = HEALTH_INTERVAL;
+	tmp.timeout  = HEALTH_TIMEOUT;
+	tmp.retries  = HEALTH_RETRIES;
+
+	strlcpy(spec, arg, sizeof(spec));
+	for (tok = strtok(spec, ","); tok && !errstr; tok = strtok(NULL, ",")) {
+		if (!strncasecmp(tok, "interval:", 9))
+			tmp.interval = strtonum(&tok[9], 1, 3600, &errstr);
+		else if (!strncasecmp(tok, "timeout:", 8))
+			tmp.timeout = strtonum(&tok[8], 1, 3600, &errstr);
+		else if (!strncasecmp(tok, "retries:", 8))
+			tmp.retries = strtonum(&tok[8], 1, 100, &errstr);
+		else if (parse_probe(&tmp, tok))
+			errstr = "invalid probe";
+	}
+
+	if (errstr) {
+		logit(LOG_WARNING, "%s: invalid health:%s, %s", svc->cmd, arg, errstr);
+		health_free(svc);
+		return errno = EINVAL;
+	}
+
+	/* Keep state across reloads, only the probe is replaced */
+	h = svc->health;
+	if (!h) {
+		h = calloc(1, sizeof(*h));
+		if (!h) {
+			_pe("%s: failed allocating health check state", svc->cmd);
+			return errno;
+		}
+		h->sd = -1;
+		svc->health = h;
+	} else
+		probe_cancel(svc);
+
+	strlcpy(h->spec, arg, sizeof(h->spec));
+	strlcpy(h->path, tmp.path, sizeof(h->path));
+	h->type     = tmp.type;
+	h->addr     = tmp.addr;
+	h->addrlen  = tmp.addrlen;
+	h->interval = tmp.interval;
+	h->timeout  = tmp.timeout;
+	h->retries  = tmp.retries;
+	h->fails    = 0;
+
+	if (h->active)
+		uev_timer_set(&h->timer, h->interval * 1000, h->interval * 1000);
+
+	return 0;
+}
+
+/**
+ * health_free - Release health check state, if any, of a service
+ * @svc: Pointer to &svc_t
+ */
+void health_free(svc_t *svc)
+{
+	if (!svc->health)
+		return;
+
+	health_stop(svc);
+	if (svc->health->pid > 0)
+		probes--;
+	free(svc->health);
+	svc->health = NULL;
+}
+
+/**
+ * health_start - Start health checks of a service
+ * @svc: Pointer to &svc_t, just started
+ *
+ * The first probe is after one interval, giving the service time to
+ * get up.  Dependents waiting for health/NAME wait until it succeeds.
+ */
+void health_start(svc_t *svc)
+{
+	struct svc_health *h = svc->health;
+	int period;
+
+	if (!h)
+		return;
+
+	h->fails = 0;
+	period = h->interval * 1000;
+	uev_timer_stop(&h->timer);
+	if (uev_timer_init(ctx, &h->timer, probe_cb, svc, period, period)) {
+		_pe("%s: failed starting health checks", svc->name);
+		return;
+	}
+	h->active = 1;
+}
+
+/**
+ * health_stop - Stop health checks of a service
+ * @svc: Pointer to &svc_t, stopped or collected
+ */
+void health_stop(svc_t *svc)
+{
+	struct svc_health *h = svc->health;
+
+	if (!h)
+		return;
+
+	uev_timer_stop(&h->timer);
+	h->active = 0;
+	probe_cancel(svc);
+	healthy(svc, 0);
+}
+
+/**
+ * health_collect - Collect an exec probe
+ * @pid:    Process ID of collected child
+ * @status: Exit status from waitpid()
+ *
+ * Returns:
+ * %TRUE(1) if @pid was a health check probe, otherwise %FALSE(0).
+ */
+int health_collect(pid_t pid, int status)
+{
+	svc_t *svc, *iter = NULL;
+
+	if (!probes)
+		return 0;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		struct svc_health *h = svc->health;
+
+		if (!h || h->pid != pid)
+			continue;
+
+		probes--;
+		h->pid = 0;
+		if (h->killed) {
+			h->killed = 0;
+			return 1;
+		}
+
+		probe_done(svc, WIFEXITED(status) && !WEXITSTATUS(status));
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
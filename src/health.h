@@ -0,0 +1,79 @@
+/* Active health checks of running services
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_HEALTH_H_
+#define FINIT_HEALTH_H_
+
+#include <sys/socket.h>
+#include <uev/uev.h>
+#include "svc.h"
+
+typedef enum {
+	HEALTH_TCP = 0,
+	HEALTH_UNIX,
+	HEALTH_EXEC,
+} health_type_t;
+
+/*
+ * State of a service with health:PROBE, allocated only for those.  At
+ * most one probe is in flight, a connect on @sd or an exec in @pid.
+ */
+struct svc_health {
+	health_type_t type;
+	char     spec[MAX_ARG_LEN];	/* health: argument, for reload */
+	char     path[MAX_ARG_LEN];	/* Probe script, or UNIX socket */
+	struct sockaddr_storage addr;	/* Resolved target to connect to */
+	socklen_t addrlen;
+
+	int      interval;		/* sec, between probes */
+	int      timeout;		/* sec, for each probe */
+	int      retries;		/* Failures in a row, then restart */
+
+	int      fails;			/* Failures since last success */
+	int      healthy;		/* Condition asserted */
+	int      active;		/* Interval timer running */
+	int      killed;		/* Exec probe timed out, await collect */
+	int      sd;
+	pid_t    pid;
+
+	uev_t    timer;			/* Next probe */
+	uev_t    expire;		/* Probe timeout */
+	uev_t    watcher;		/* Probe connect */
+};
+
+int  health_parse  (svc_t *svc, char *arg);
+void health_free   (svc_t *svc);
+
+void health_start  (svc_t *svc);
+void health_stop   (svc_t *svc);
+int  health_collect(pid_t pid, int status);
+
+#endif /* FINIT_HEALTH_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,256 @@
+/* Event loop heartbeat to the bundled watchdogd, and loop latency stats
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <lite/lite.h>
+#include <uev/uev.h>
+
+#include "finit.h"
+#include "helpers.h"
+#include "private.h"
+#include "svc.h"
+#include "util.h"
+#include "watchdog.h"
+
+#define HB_BUCKETS 12		/* <1 ms, <2 ms, <4 ms ... <1024 ms, longer */
+
+static uev_t heartbeat_watcher;
+static int   heartbeat_sd = -1;
+
+static struct timespec armed;	/* When the timer was last set */
+static unsigned long   hist[HB_BUCKETS];
+static long            latency_max;
+static unsigned long   latency_sum;
+static char            sick[MAX_ARG_LEN];
+
+static long msec_since(struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - ts->tv_sec) * 1000 + (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+static void record(long latency)
+{
+	int i = 0;
+
+	if (latency < 0)
+		latency = 0;
+	if (latency > latency_max)
+		latency_max = latency;
+	latency_sum += latency;
+
+	while (i < HB_BUCKETS - 1 && latency >= (1L << i))
+		i++;
+	hist[i]++;
+
+	if (latency >= WDT_HEARTBEAT_MSEC)
+		logit(LOG_WARNING, "Event loop stalled for %ld msec", latency);
+}
+
+/*
+ * Services with watchdog:SEC must send WATCHDOG=1 at least every SEC
+ * seconds while running, starting from when they were started.
+ */
+static svc_t *check(void)
+{
+	svc_t *svc, *iter = NULL;
+	long now = jiffies();
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		long last;
+
+		if (!svc->watchdog || svc->state != SVC_RUNNING_STATE || svc->pid <= 0)
+			continue;
+
+		last = svc->notify_wdog;
+		if (last < svc->start_time)
+			last = svc->start_time;
+
+		if (now - last > svc->watchdog)
+			return svc;
+	}
+
+	return NULL;
+}
+
+/*
+ * Called every WDT_HEARTBEAT_MSEC from the event loop.  How late we are
+ * called is the latency of the loop, i.e., for how long PID 1 has been
+ * busy with something else.
+ */
+static void heartbeat_cb(uev_t *w, void *arg, int events)
+{
+	struct sockaddr_un sun = {
+		.sun_family = AF_UNIX,
+		.sun_path   = WDT_HEARTBEAT,
+	};
+	char msg[MAX_ARG_LEN + 8] = "OK";
+	svc_t *svc;
+
+	record(msec_since(&armed) - WDT_HEARTBEAT_MSEC);
+
+	svc = check();
+	if (svc) {
+		if (strcmp(sick, svc->name))
+			logit(LOG_CRIT, "%s missed its watchdog:%d keepalive, not sending heartbeat",
+			      svc->name, svc->watchdog);
+		strlcpy(sick, svc->name, sizeof(sick));
+		snprintf(msg, sizeof(msg), "SICK %s", svc->name);
+	} else if (sick[0]) {
+		logit(LOG_NOTICE, "%s is alive again, resuming heartbeat", sick);
+		sick[0] = 0;
+	}
+
+	/* Not an error if there is no watchdogd, or it does not listen */
+	if (sendto(heartbeat_sd, msg, strlen(msg), MSG_DONTWAIT,
+		   (struct sockaddr *)&sun, sizeof(sun)) == -1 &&
+	    errno != ENOENT && errno != ECONNREFUSED && errno != EAGAIN)
+		_pe("Failed sending heartbeat");
+
+	clock_gettime(CLOCK_MONOTONIC, &armed);
+	uev_timer_set(w, WDT_HEARTBEAT_MSEC, 0);
+}
+
+/**
+ * heartbeat_init - Start event loop heartbeat
+ * @ctx: Main event loop context
+ *
+ * Sends a heartbeat to the bundled watchdogd every second, which it
+ * uses to decide if the hardware watchdog should be kicked.  The same
+ * timer is used to track the latency of the event loop.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int heartbeat_init(uev_ctx_t *ctx)
+{
+	heartbeat_sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (heartbeat_sd == -1) {
+		_pe("Failed creating heartbeat socket");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &armed);
+	if (uev_timer_init(ctx, &heartbeat_watcher, heartbeat_cb, NULL, WDT_HEARTBEAT_MSEC, 0)) {
+		_pe("Failed starting heartbeat timer");
+		close(heartbeat_sd);
+		heartbeat_sd = -1;
+		return 1;
+	}
+
+	return 0;
+}
+
+int heartbeat_exit(void)
+{
+	uev_timer_stop(&heartbeat_watcher);
+	if (heartbeat_sd == -1)
+		return 0;
+
+	close(heartbeat_sd);
+	heartbeat_sd = -1;
+
+	return 0;
+}
+
+/**
+ * heartbeat_stats - Event loop latency histogram, as text
+ * @buf: Buffer to write to
+ * @len: Size of @buf
+ *
+ * One line per bucket, upper limit in msec and count, the last bucket
+ * has no upper limit and is shown as 0.  Followed by a line with the
+ * worst latency seen.
+ *
+ * Returns:
+ * POSIX OK(0), always.
+ */
+int heartbeat_stats(char *buf, size_t len)
+{
+	size_t pos = 0;
+
+	buf[0] = 0;
+	for (int i = 0; i < HB_BUCKETS; i++) {
+		int n;
+
+		n = snprintf(&buf[pos], len - pos, "%ld %lu\n",
+			     i < HB_BUCKETS - 1 ? 1L << i : 0L, hist[i]);
+		if (n < 0 || (size_t)n >= len - pos)
+			return 0;
+		pos += n;
+	}
+	snprintf(&buf[pos], len - pos, "max %ld\n", latency_max);
+
+	return 0;
+}
+
+/**
+ * heartbeat_dump - Event loop latency histogram, Prometheus text format
+ * @sd: Socket or file descriptor to write to
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error writing to @sd.
+ */
+int heartbeat_dump(int sd)
+{
+	unsigned long count = 0;
+
+	if (dprintf(sd, "# HELP finit_loop_latency_seconds How late the event loop runs a timer\n"
+		    "# TYPE finit_loop_latency_seconds histogram\n") < 0)
+		return 1;
+
+	for (int i = 0; i < HB_BUCKETS; i++) {
+		int rc;
+
+		count += hist[i];
+		if (i < HB_BUCKETS - 1)
+			rc = dprintf(sd, "finit_loop_latency_seconds_bucket{le=\"%.3f\"} %lu\n",
+				     (1L << i) / 1000.0, count);
+		else
+			rc = dprintf(sd, "finit_loop_latency_seconds_bucket{le=\"+Inf\"} %lu\n", count);
+		if (rc < 0)
+			return 1;
+	}
+
+	if (dprintf(sd, "finit_loop_latency_seconds_sum %.3f\n"
+		    "finit_loop_latency_seconds_count %lu\n", latency_sum / 1000.0, count) < 0)
+		return 1;
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
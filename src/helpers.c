@@ -22,11 +22,16 @@
  * THE SOFTWARE.
  */
 
+#include "config.h"		/* Generated by configure script */
+
 #include <ctype.h>		/* isblank() */
 #include <errno.h>
 #include <grp.h>
 #include <pwd.h>
 #include <limits.h>
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>		/* malloc_trim(), mallinfo() */
+#endif
 #include <net/if.h>
 #include <netinet/in.h>
 #include <stdarg.h>
@@ -34,7 +39,9 @@
 #include <lite/lite.h>
 
 #include "finit.h"
+#include "console.h"
 #include "helpers.h"
+#include "mtab.h"
 #include "private.h"
 #include "util.h"
 #include "utmp-api.h"
@@ -153,7 +160,7 @@ void print_banner(const char *heading)
 	}
 	strlcat(buf, "\e[0m\n", sizeof(buf));
 
-	(void)write(STDERR_FILENO, buf, strlen(buf));
+	console_write(buf, strlen(buf));
 }
 
 static size_t print_timestamp(char *buf, size_t len)
@@ -204,16 +211,14 @@ void printv(const char *fmt, va_list ap)
 	if (!fmt || log_is_silent())
 		return;
 
-	delline();
-
 	memset(buf, 0, sizeof(buf));
 	len = print_timestamp(buf, sizeof(buf));
 	vsnprintf(&buf[len], sizeof(buf) - len, fmt, ap);
 
 	if (progress_style == 1)
-		fprintf(stderr, "\r%s ", pad(buf, sizeof(buf), ".", sizeof(buf)));
+		console_printf("\r\e[2K%s ", pad(buf, sizeof(buf), ".", sizeof(buf)));
 	else
-		fprintf(stderr, "\r\e[2K%s%s", status(3), buf);
+		console_printf("\r\e[2K%s%s", status(3), buf);
 }
 
 void print(int rc, const char *fmt, ...)
@@ -233,9 +238,9 @@ void print(int rc, const char *fmt, ...)
 		return;
 
 	if (progress_style == 1)
-		fprintf(stderr, "%s\n", status(rc));
+		console_printf("%s\n", status(rc));
 	else
-		fprintf(stderr, ".\r%s\n", status(rc));
+		console_printf(".\r%s\n", status(rc));
 }
 
 void print_desc(char *action, char *desc)
@@ -429,7 +434,7 @@ void endfsent(void)
 }
 #endif	/* HAVE_GETFSENT */
 
-static int hasopt(char *opts, char *opt)
+int hasopt(char *opts, char *opt)
 {
 	char buf[strlen(opts) + 1];
 	char *ptr;
@@ -446,21 +451,32 @@ static int hasopt(char *opts, char *opt)
 	return 0;
 }
 
+/*
+ * The mount table and /etc/fstab are answered from the cache, other
+ * files in the same format are read on every call.
+ */
 int ismnt(char *file, char *dir, char *mode)
 {
 	struct mntent *mnt;
+	struct mtab_ent *e;
 	int found = 0;
 	FILE *fp;
 
+	if (!strcmp(file, MTAB_MOUNTS) || !strcmp(file, MTAB_FSTAB)) {
+		e = mtab_find(file, dir);
+		if (!e)
+			return 0;
+
+		return !mode || hasopt(e->opts, mode);
+	}
+
 	fp = setmntent(file, "r");
 	if (!fp)
 		return 0;	/* Dunno, maybe not */
 
 	while ((mnt = getmntent(fp))) {
 		if (!strcmp(mnt->mnt_dir, dir)) {
-			if (mode && hasopt(mnt->mnt_opts, mode))
-				found = 1;
-			else
+			if (!mode || hasopt(mnt->mnt_opts, mode))
 				found = 1;
 			break;
 		}
@@ -473,7 +489,87 @@ int ismnt(char *file, char *dir, char *mode)
 /* Requires /proc to be mounted */
 int fismnt(char *dir)
 {
-	return ismnt("/proc/mounts", dir, NULL);
+	return ismnt(MTAB_MOUNTS, dir, NULL);
+}
+
+/* File system type mounted on @dir, or NULL.  Requires /proc */
+char *mnttype(char *dir)
+{
+	struct mtab_ent *e;
+
+	e = mtab_find(MTAB_MOUNTS, dir);
+	if (!e)
+		return NULL;
+
+	return e->type;
+}
+
+static long rss_boot = -1;	/* kB, before mem_trim() */
+static long rss_trim = -1;	/* kB, after mem_trim() */
+static int  unloaded;
+
+/* Value of, e.g., "VmRSS:" in /proc/self/status, in kB */
+static long proc_status(const char *key)
+{
+	size_t len = strlen(key);
+	char line[80];
+	long val = -1;
+	FILE *fp;
+
+	fp = fopen("/proc/self/status", "r");
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, key, len)) {
+			val = strtol(&line[len], NULL, 10);
+			break;
+		}
+	}
+	fclose(fp);
+
+	return val;
+}
+
+/**
+ * mem_trim - Give back memory only used at bootstrap
+ *
+ * Called when bootstrap is done.  Unloads boot-only plugins, and then
+ * returns free heap, e.g. from parsing .conf files, to the kernel.
+ */
+void mem_trim(void)
+{
+	rss_boot = proc_status("VmRSS:");
+	unloaded = plugin_prune_bootstrap();
+#ifdef HAVE_MALLOC_TRIM
+	malloc_trim(0);
+#endif
+	rss_trim = proc_status("VmRSS:");
+
+	_d("Unloaded %d plugins, RSS %ld kB -> %ld kB", unloaded, rss_boot, rss_trim);
+}
+
+/* Memory report for initctl, one "name kB" per line */
+int mem_stats(char *buf, size_t len)
+{
+	long used = -1, avail = -1;
+#if defined(HAVE_MALLINFO2)
+	struct mallinfo2 mi = mallinfo2();
+
+	used  = mi.uordblks / 1024;
+	avail = mi.fordblks / 1024;
+#elif defined(HAVE_MALLINFO)
+	struct mallinfo mi = mallinfo();
+
+	used  = (unsigned int)mi.uordblks / 1024;
+	avail = (unsigned int)mi.fordblks / 1024;
+#endif
+
+	snprintf(buf, len, "rss %ld\npeak %ld\nboot %ld\ntrim %ld\nheap %ld\nfree %ld\nunloaded %d\n",
+		 proc_status("VmRSS:"), proc_status("VmHWM:"), rss_boot, rss_trim,
+		 used, avail, unloaded);
+
+	return 0;
 }
 
 /**
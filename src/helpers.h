@@ -72,11 +72,13 @@ void    networking      (int updown);
 int     complete        (char *cmd, int pid);
 int     run             (char *cmd);
 int     run_interactive (char *cmd, char *fmt, ...);
+char   *runtask_cmdline (char *cmd, char *args[], char *buf, size_t len);
 int     exec_runtask    (char *cmd, char *args[]);
 pid_t   run_getty       (char *tty, char *baud, char *term,  int noclear, int nowait, struct rlimit rlimit[]);
 pid_t   run_getty2      (char *tty, char *cmd, char *args[], int noclear, int nowait, struct rlimit rlimit[]);
 pid_t   run_sh          (char *tty, int noclear, int nowait, struct rlimit rlimit[]);
 int     run_parts       (char *dir, char *cmd);
+int     run_parts_jobs  (char *dir, char *cmd, int jobs);
 
 static inline int create(char *path, mode_t mode, uid_t uid, gid_t gid)
 {
@@ -88,8 +90,10 @@ static inline int create(char *path, mode_t mode, uid_t uid, gid_t gid)
 	return 0;
 }
 
+int	hasopt		(char *opts, char *opt);
 int	ismnt		(char *file, char *dir, char *mode);
 int	fismnt		(char *dir);
+char	*mnttype	(char *dir);
 
 #endif /* FINIT_HELPERS_H_ */
 
@@ -21,18 +21,25 @@
  * THE SOFTWARE.
  */
 
+#include <time.h>
 #include <ifaddrs.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
 #include <uev/uev.h>
 #include <lite/lite.h>
 
 #include "finit.h"
+#include "cond.h"
 #include "inetd.h"
 #include "helpers.h"
+#include "pool.h"
 #include "private.h"
 #include "service.h"
+#include "util.h"
+
+static struct pool filter_pool = POOL_INIT("filter", inetd_filter_t, 32);
 
 #define ENABLE_SOCKOPT(sd, level, opt)						\
 	do {									\
@@ -42,67 +49,90 @@
 			      #opt, inetd->name);				\
 	} while (0);
 
-/* Peek into SOCK_DGRAM socket to figure out where an inbound packet comes from. */
-static int inetd_dgram_peek(int sd, char *ifname, size_t len)
+struct inetd_conn {
+	TAILQ_ENTRY(inetd_conn) link;
+	inetd_t *inetd;
+	uev_t    watcher;
+	uev_t    timer;		/* Idle timeout, reset on any progress */
+	size_t   len, off;	/* Pending output in buf[] */
+	char     buf[BUFSIZ];
+};
+
+/* Ingress ifindex from IP_PKTINFO control message, 0 if unknown */
+static int pktinfo_ifindex(struct msghdr *msgh)
 {
 	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msgh); cmsg; cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+		struct in_pktinfo *ipi = (struct in_pktinfo *)CMSG_DATA(cmsg);
+
+		if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_PKTINFO)
+			continue;
+
+		return ipi->ipi_ifindex;
+	}
+
+	return 0;
+}
+
+/* Peek into SOCK_DGRAM socket to figure out where an inbound packet comes from. */
+static int inetd_dgram_peek(int sd)
+{
 	struct msghdr msgh;
 	char cmbuf[0x100];
 
-	memset(ifname, 0, len);
 	memset(&msgh, 0, sizeof(msgh));
 	msgh.msg_control    = cmbuf;
 	msgh.msg_controllen = sizeof(cmbuf);
 
 	if (recvmsg(sd, &msgh, MSG_PEEK) < 0)
-		return -1;
-
-	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
-		struct in_pktinfo *ipi = (struct in_pktinfo *)CMSG_DATA(cmsg);
-		char tmp[IF_NAMESIZE + 1] = { 0 };
-
-		if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_PKTINFO)
-			continue;
-
-		if_indextoname(ipi->ipi_ifindex, tmp);
-		strlcpy(ifname, tmp, len);
-
 		return 0;
-	}
 
-	return -1;
+	return pktinfo_ifindex(&msgh);
 }
 
-/* Peek into SOCK_DGRAM socket to figure out where an inbound packet comes from. */
-static void inetd_dgram_drop(int sd, const char *ifname)
+/* Drop all queued packets from the same ingress interface. */
+static void inetd_dgram_drop(int sd, int ifindex)
 {
-	char pkt_interface[IF_NAMESIZE + 1];
 	char buf[BUFSIZ];
 
-	while (1) {
-		inetd_dgram_peek(sd, pkt_interface, sizeof(pkt_interface));
-		if (string_compare(pkt_interface, ifname)) {
-			if (recv(sd, buf, sizeof(buf), 0) < 0)
-				break;
-			continue;
-		}
-		break;
+	while (inetd_dgram_peek(sd) == ifindex) {
+		if (recv(sd, buf, sizeof(buf), 0) < 0)
+			break;
 	}
 }
 
-/* Peek into SOCK_STREAM on accepted client socket to figure out inbound interface */
-static int inetd_stream_peek(int sd, char *ifname, size_t ilen)
+/*
+ * Peek into SOCK_STREAM on accepted client socket to figure out inbound
+ * interface.  The listening socket has IP_PKTINFO set, so the kernel
+ * records the ingress ifindex of the SYN, fall back to looking up the
+ * local address of the connection.
+ */
+static int inetd_stream_peek(int sd)
 {
 	struct ifaddrs *ifaddr, *ifa;
 	struct sockaddr_in sin;
-	socklen_t len = sizeof(sin);
+	struct msghdr msgh;
+	char cmbuf[0x100];
+	socklen_t len = sizeof(cmbuf);
+	int ifindex = 0;
+
+	if (!getsockopt(sd, SOL_IP, IP_PKTOPTIONS, cmbuf, &len)) {
+		memset(&msgh, 0, sizeof(msgh));
+		msgh.msg_control    = cmbuf;
+		msgh.msg_controllen = len;
+
+		ifindex = pktinfo_ifindex(&msgh);
+		if (ifindex > 0)
+			return ifindex;
+	}
 
-	memset(ifname, 0, ilen);
+	len = sizeof(sin);
 	if (-1 == getsockname(sd, (struct sockaddr *)&sin, &len))
-		return -1;
+		return 0;
 
 	if (-1 == getifaddrs(&ifaddr))
-		return -1;
+		return 0;
 
 	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
 		size_t len = sizeof(struct in_addr);
@@ -116,73 +146,114 @@ static int inetd_stream_peek(int sd, char *ifname, size_t ilen)
 
 		iin = (struct sockaddr_in *)ifa->ifa_addr;
 		if (!memcmp(&sin.sin_addr, &iin->sin_addr, len)) {
-			strlcpy(ifname, ifa->ifa_name, ilen);
+			ifindex = if_nametoindex(ifa->ifa_name);
 			break;
 		}
 	}
 
 	freeifaddrs(ifaddr);
 
-	return 0;
+	return ifindex;
+}
+
+/*
+ * Per-source rate limit, a fixed window per source address.  Sources
+ * share slots by hash, a new source simply takes over the slot, so the
+ * table is bounded but only approximate with many active sources.
+ */
+static int inetd_rate_check(inetd_t *inetd, struct sockaddr_in *sin)
+{
+	struct inetd_rate *slot;
+	in_addr_t addr;
+	long now;
+
+	if (!inetd->rate || !inetd->rates)
+		return 0;
+
+	addr = sin->sin_addr.s_addr;
+	slot = &inetd->rates[(ntohl(addr) * 2654435761U) % INETD_RATE_SLOTS];
+	now  = jiffies();
+	if (slot->addr != addr || now - slot->start >= inetd->window) {
+		slot->addr  = addr;
+		slot->start = now;
+		slot->count = 0;
+	}
+
+	return ++slot->count > inetd->rate;
 }
 
-static int get_stdin(svc_t *svc, char *iifname, size_t len)
+static int inetd_num_conns(inetd_t *inetd)
 {
-	int stdin = svc->inetd.watcher.fd;
-	char ifname[IF_NAMESIZE + 1] = "UNKNOWN";
+	svc_t *svc, *iter = NULL;
+	int num = inetd->nconns;
+
+	for (svc = svc_job_iterator(&iter, 1, inetd->svc->job); svc;
+	     svc = svc_job_iterator(&iter, 0, inetd->svc->job)) {
+		if (svc_is_inetd_conn(svc) && svc->state != SVC_DONE_STATE)
+			num++;
+	}
+
+	return num;
+}
+
+/*
+ * Returns descriptor for the connection, -1 on error or when there are
+ * no more connections to accept, or -2 if the connection was refused.
+ */
+static int get_stdin(svc_t *svc, int *ifindex)
+{
+	int stdin = svc->inetd->watcher.fd;
+
+	if (svc->inetd->type == SOCK_STREAM) {
+		struct sockaddr_in sin;
+		socklen_t slen = sizeof(sin);
 
-	memset(iifname, 0, len);
-	if (svc->inetd.type == SOCK_STREAM) {
 		/* Open new client socket from server socket */
-		stdin = accept(stdin, NULL, NULL);
+		stdin = accept4(stdin, (struct sockaddr *)&sin, &slen, SOCK_CLOEXEC);
 		if (stdin < 0) {
-			logit(LOG_CRIT, "Failed accepting inetd service %d/tcp", svc->inetd.port);
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return -1;
+			if (errno == ECONNABORTED)
+				return -2;
+			logit(LOG_CRIT, "Failed accepting inetd service %d/tcp", svc->inetd->port);
 			return -1;
 		}
 
-		_d("New client socket %d accepted for inetd service %d/tcp", stdin, svc->inetd.port);
+		_d("New client socket %d accepted for inetd service %d/tcp", stdin, svc->inetd->port);
+
+		if (inetd_rate_check(svc->inetd, &sin)) {
+			_d("Service %s rate limit reached for %s", svc->inetd->name, inet_ntoa(sin.sin_addr));
+			close(stdin);
+			return -2;
+		}
 
-		inetd_stream_peek(stdin, ifname, sizeof(ifname));
+		*ifindex = inetd_stream_peek(stdin);
 	} else {           /* SOCK_DGRAM */
-		inetd_dgram_peek(stdin, ifname, sizeof(ifname));
+		*ifindex = inetd_dgram_peek(stdin);
 	}
 
-	if (!inetd_is_allowed(&svc->inetd, ifname)) {
-		logit(LOG_INFO, "Service %s on %s:%d is not allowed", svc->inetd.name, ifname, svc->inetd.port);
-		if (svc->inetd.type == SOCK_STREAM)
+	if (!inetd_is_allowed_ifindex(svc->inetd, *ifindex)) {
+		char ifname[IF_NAMESIZE + 1] = "UNKNOWN";
+
+		if_indextoname(*ifindex, ifname);
+		logit(LOG_INFO, "Service %s on %s:%d is not allowed", svc->inetd->name, ifname, svc->inetd->port);
+		if (svc->inetd->type == SOCK_STREAM)
 			close(stdin);
 		else
-			inetd_dgram_drop(stdin, ifname);
+			inetd_dgram_drop(stdin, *ifindex);
 
-		return -1;
+		return -2;
 	}
 
-	/* Return ingress interface */
-	strlcpy(iifname, ifname, len);
-
 	return stdin;
 }
 
-/* Socket callback, looks up correct svc and starts it as an inetd service */
-static void socket_cb(uev_t *w, void *arg, int events)
+/* Start a connection, a clone of the inetd service, with stdin as socket */
+static void inetd_spawn(svc_t *svc, int stdin, int ifindex)
 {
-	svc_t *svc = (svc_t *)arg, *task;
 	const char *conn = " connection";
-	char iifname[IF_NAMESIZE + 1] = "UNKNOWN";
-	char id[MAX_ID_LEN];
-	int stdin;
-
-	_d("%s: Got socket event ...", svc->cmd);
-	if (UEV_ERROR == events) {
-		logit(LOG_INFO, "%s: Socket error, aborting: %m", svc->cmd);
-		return;
-	}
-
-	stdin = get_stdin(svc, iifname, sizeof(iifname));
-	if (stdin < 0) {
-		logit(LOG_CRIT, "%s: Unable to accept incoming connection", svc->cmd);
-		return;
-	}
+	char id[MAX_ID_LEN], desc[MAX_STR_LEN];
+	svc_t *task;
 
 	/*
 	 * Make sure to disable O_NONBLOCK on the descriptor before
@@ -190,21 +261,28 @@ static void socket_cb(uev_t *w, void *arg, int events)
 	 */
 	if (fcntl(stdin, F_SETFL, fcntl(stdin, F_GETFL, 0) & ~O_NONBLOCK) < 0) {
 		logit(LOG_CRIT, "Failed disabling non-blocking on %s socket", svc->cmd);
-		if (svc->inetd.type == SOCK_STREAM)
+		if (svc->inetd->type == SOCK_STREAM)
 			close(stdin);
 		return;
 	}
 
-	snprintf(id, sizeof(id), "%d", svc->inetd.next_id++);
+	snprintf(id, sizeof(id), "%d", svc->inetd->next_id++);
 	task = svc_new(svc->cmd, id, SVC_TYPE_INETD_CONN);
+	if (task) {
+		task->inetd = calloc(1, sizeof(*task->inetd));
+		if (!task->inetd) {
+			svc_del(task);
+			task = NULL;
+		}
+	}
 	if (!task) {
 		logit(LOG_CRIT, "%s: Unable to allocate service for inetd client", svc->cmd);
-		if (svc->inetd.type == SOCK_STREAM)
+		if (svc->inetd->type == SOCK_STREAM)
 			close(stdin);
 		return;
 	}
 
-	if (!svc->inetd.forking) {
+	if (!svc->inetd->forking) {
 		svc_busy(svc);
 		service_step(svc);
 	}
@@ -216,24 +294,409 @@ static void socket_cb(uev_t *w, void *arg, int events)
 	 * Only copy the most relevant parts of inetd, in particular we
 	 * must *not* copy the watcher data to the clone!
 	 */
-	task->inetd.svc  = svc;
-	task->inetd.cmd  = svc->inetd.cmd;
-	task->inetd.type = svc->inetd.type;
+	task->inetd->svc  = svc;
+	task->inetd->cmd  = svc->inetd->cmd;
+	task->inetd->type = svc->inetd->type;
 
-	memcpy(task->rlimit,   svc->rlimit,   sizeof(task->rlimit));
-	memcpy(task->cond,     svc->cond,     sizeof(task->cond));
+	svc_share_config(task, svc);
+	cond_svc_attach(task);
 	memcpy(task->username, svc->username, sizeof(task->username));
 	memcpy(task->group,    svc->group,    sizeof(task->group));
-	memcpy(task->args,     svc->args,     sizeof(task->args));
-	strlcpy(task->desc, svc->desc, sizeof(task->desc) - strlen(conn));
-	strlcat(task->desc, conn, sizeof(task->desc));
-	strlcpy(task->iifname, iifname, sizeof(task->iifname));
-	strlcpy(task->name, svc->name, sizeof(task->name));
+	svc_share_args(task, svc);
+	svc_share_exec(task, svc);
+	strlcpy(desc, svc->config->desc, sizeof(desc) - strlen(conn));
+	strlcat(desc, conn, sizeof(desc));
+	svc_set_desc(task, desc);
+	task->ifindex = ifindex;
+	svc_set_name(task, svc->name);
 
 	task->stdin_fd = stdin;
 	service_step(task);
 }
 
+/* At max connections, leave any new ones in the listen backlog */
+static int inetd_pause(inetd_t *inetd)
+{
+	int max = inetd->max;
+
+	/* Builtins run in PID 1, always limit them */
+	if (!max && inetd->reply)
+		max = INETD_FAST_MAX;
+
+	if (!max || inetd_num_conns(inetd) < max)
+		return 0;
+
+	if (!inetd->paused) {
+		_d("%s: max %d connections reached, pausing", inetd->name, max);
+		uev_io_stop(&inetd->watcher);
+		inetd->paused = 1;
+	}
+
+	return 1;
+}
+
+/*
+ * Fast path for UDP builtins, run in PID 1 without forking.  Receives
+ * a batch of datagrams with one recvmmsg(), filters them, lets reply()
+ * write the response in-place, and sends all replies with sendmmsg().
+ */
+static void inetd_fast_dgram(svc_t *svc)
+{
+	static char buf[INETD_BATCH][INETD_FAST_MTU];
+	static char cbuf[INETD_BATCH][CMSG_SPACE(sizeof(struct in_pktinfo))];
+	struct sockaddr_storage sa[INETD_BATCH];
+	struct mmsghdr rx[INETD_BATCH], tx[INETD_BATCH];
+	struct iovec riov[INETD_BATCH], tiov[INETD_BATCH];
+	inetd_t *inetd = svc->inetd;
+	int i, n, num = 0;
+
+	memset(rx, 0, sizeof(rx));
+	for (i = 0; i < INETD_BATCH; i++) {
+		struct msghdr *msg = &rx[i].msg_hdr;
+
+		riov[i].iov_base    = buf[i];
+		riov[i].iov_len     = sizeof(buf[i]);
+		msg->msg_name       = &sa[i];
+		msg->msg_namelen    = sizeof(sa[i]);
+		msg->msg_iov        = &riov[i];
+		msg->msg_iovlen     = 1;
+		msg->msg_control    = cbuf[i];
+		msg->msg_controllen = sizeof(cbuf[i]);
+	}
+
+	n = recvmmsg(inetd->watcher.fd, rx, INETD_BATCH, MSG_DONTWAIT, NULL);
+	if (n <= 0)
+		return;
+
+	memset(tx, 0, sizeof(tx));
+	for (i = 0; i < n; i++) {
+		struct msghdr *msg = &rx[i].msg_hdr;
+		ssize_t len;
+
+		if (!inetd_is_allowed_ifindex(inetd, pktinfo_ifindex(msg)))
+			continue;
+		if (inetd_check_loop(msg->msg_name, msg->msg_namelen, inetd->name))
+			continue;
+
+		len = inetd->reply(SOCK_DGRAM, buf[i], rx[i].msg_len, sizeof(buf[i]));
+		if (len <= 0)
+			continue;
+
+		tiov[num].iov_base          = buf[i];
+		tiov[num].iov_len           = len;
+		tx[num].msg_hdr.msg_name    = msg->msg_name;
+		tx[num].msg_hdr.msg_namelen = msg->msg_namelen;
+		tx[num].msg_hdr.msg_iov     = &tiov[num];
+		tx[num].msg_hdr.msg_iovlen  = 1;
+		num++;
+	}
+
+	if (num && sendmmsg(inetd->watcher.fd, tx, num, MSG_DONTWAIT) < 0)
+		_d("%s: failed sending %d replies: %s", inetd->name, num, strerror(errno));
+}
+
+static void inetd_fast_close(struct inetd_conn *conn)
+{
+	inetd_t *inetd = conn->inetd;
+
+	uev_io_stop(&conn->watcher);
+	uev_timer_stop(&conn->timer);
+	close(conn->watcher.fd);
+	TAILQ_REMOVE(&inetd->conns, conn, link);
+	inetd->nconns--;
+	free(conn);
+
+	if (inetd->paused && inetd->watcher.fd != -1) {
+		inetd->paused = 0;
+		uev_io_start(&inetd->watcher);
+	}
+}
+
+/* Close all in-process connections, when the inetd service stops */
+static void inetd_fast_flush(inetd_t *inetd)
+{
+	struct inetd_conn *conn;
+
+	while ((conn = TAILQ_FIRST(&inetd->conns)))
+		inetd_fast_close(conn);
+}
+
+/* Client neither sent nor received anything in INETD_FAST_IDLE sec */
+static void conn_idle(uev_t *w, void *arg, int events)
+{
+	struct inetd_conn *conn = (struct inetd_conn *)arg;
+
+	_d("%s: closing idle connection", conn->inetd->name);
+	inetd_fast_close(conn);
+}
+
+/*
+ * In-process stream connection.  Input is handed to reply(), with any
+ * reply written back before reading more, so a slow client is limited
+ * by its own receive window.  Flood services, like chargen, are polled
+ * for more output whenever the socket is writable, their input is only
+ * checked for EOF and dropped.
+ */
+static void conn_cb(uev_t *w, void *arg, int events)
+{
+	struct inetd_conn *conn = (struct inetd_conn *)arg;
+	inetd_t *inetd = conn->inetd;
+	int flood = inetd->reply_flags & INETD_REPLY_FLOOD;
+	ssize_t len;
+
+	if (UEV_ERROR == events)
+		goto close;
+
+	if (events & UEV_READ) {
+		static char scratch[BUFSIZ];
+		char *buf = flood ? scratch : conn->buf;
+
+		len = read(w->fd, buf, sizeof(conn->buf));
+		if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR))
+			goto close;
+		if (len > 0)
+			uev_timer_set(&conn->timer, INETD_FAST_IDLE * 1000, 0);
+
+		if (!flood && len > 0) {
+			len = inetd->reply(SOCK_STREAM, conn->buf, len, sizeof(conn->buf));
+			if (len < 0)
+				goto close;
+			conn->len = len;
+			conn->off = 0;
+		}
+	}
+
+	while (conn->off < conn->len) {
+		len = write(w->fd, &conn->buf[conn->off], conn->len - conn->off);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			goto close;
+		}
+		conn->off += len;
+		uev_timer_set(&conn->timer, INETD_FAST_IDLE * 1000, 0);
+	}
+
+	if (conn->off == conn->len) {
+		if (inetd->reply_flags & INETD_REPLY_ONCE)
+			goto close;
+
+		conn->len = conn->off = 0;
+		if (flood) {
+			len = inetd->reply(SOCK_STREAM, conn->buf, 0, sizeof(conn->buf));
+			if (len < 0)
+				goto close;
+			conn->len = len;
+		}
+	}
+
+	if (flood)
+		events = UEV_READ | UEV_WRITE;
+	else
+		events = conn->len ? UEV_WRITE : UEV_READ;
+	uev_io_set(w, w->fd, events);
+	return;
+close:
+	inetd_fast_close(conn);
+}
+
+/*
+ * Fast path for TCP builtins, run in PID 1 without forking.  Accepts a
+ * batch of connections and gives each one a non-blocking watcher, with
+ * the reply to connect, if any, as pending output.
+ */
+static void inetd_fast_accept(svc_t *svc)
+{
+	inetd_t *inetd = svc->inetd;
+
+	for (int i = 0; i < INETD_BATCH; i++) {
+		struct inetd_conn *conn;
+		struct sockaddr_in sin;
+		socklen_t slen = sizeof(sin);
+		ssize_t len;
+		int sd;
+
+		if (inetd_pause(inetd))
+			break;
+
+		sd = accept4(inetd->watcher.fd, (struct sockaddr *)&sin, &slen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sd < 0) {
+			if (errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		if (inetd_rate_check(inetd, &sin) ||
+		    !inetd_is_allowed_ifindex(inetd, inetd_stream_peek(sd))) {
+			close(sd);
+			continue;
+		}
+
+		conn = calloc(1, sizeof(*conn));
+		if (!conn) {
+			close(sd);
+			continue;
+		}
+
+		conn->inetd = inetd;
+		len = inetd->reply(SOCK_STREAM, conn->buf, 0, sizeof(conn->buf));
+		if (len < 0 || uev_io_init(ctx, &conn->watcher, conn_cb, conn, sd,
+					   len > 0 ? UEV_WRITE : UEV_READ)) {
+			close(sd);
+			free(conn);
+			continue;
+		}
+		if (uev_timer_init(ctx, &conn->timer, conn_idle, conn, INETD_FAST_IDLE * 1000, 0)) {
+			uev_io_stop(&conn->watcher);
+			close(sd);
+			free(conn);
+			continue;
+		}
+		conn->len = len;
+
+		TAILQ_INSERT_TAIL(&inetd->conns, conn, link);
+		inetd->nconns++;
+	}
+}
+
+/* Socket callback, looks up correct svc and starts it as an inetd service */
+static void socket_cb(uev_t *w, void *arg, int events)
+{
+	svc_t *svc = (svc_t *)arg;
+	int stdin, ifindex = 0;
+
+	_d("%s: Got socket event ...", svc->cmd);
+	if (UEV_ERROR == events) {
+		logit(LOG_INFO, "%s: Socket error, aborting: %m", svc->cmd);
+		return;
+	}
+
+	if (svc->inetd->reply) {
+		if (svc->inetd->type == SOCK_STREAM)
+			inetd_fast_accept(svc);
+		else
+			inetd_fast_dgram(svc);
+		return;
+	}
+
+	/*
+	 * Drain the listen queue of nowait stream services in batches,
+	 * instead of one connection per event loop wakeup.  Bounded to
+	 * not starve other events in a connection storm.
+	 */
+	if (svc->inetd->type == SOCK_STREAM && svc->inetd->forking) {
+		for (int i = 0; i < INETD_BATCH; i++) {
+			if (inetd_pause(svc->inetd))
+				break;
+
+			stdin = get_stdin(svc, &ifindex);
+			if (stdin == -2)
+				continue;
+			if (stdin < 0)
+				break;
+
+			inetd_spawn(svc, stdin, ifindex);
+		}
+		return;
+	}
+
+	stdin = get_stdin(svc, &ifindex);
+	if (stdin < 0) {
+		if (stdin == -1)
+			logit(LOG_CRIT, "%s: Unable to accept incoming connection", svc->cmd);
+		return;
+	}
+
+	inetd_spawn(svc, stdin, ifindex);
+}
+
+/**
+ * inetd_conn_done - Called when an inetd connection has been collected
+ * @task: Pointer to the &svc_t of the connection
+ *
+ * Resumes the socket watcher of the inetd service if it was paused at
+ * max connections, see inetd_pause().
+ */
+void inetd_conn_done(svc_t *task)
+{
+	inetd_t *inetd;
+	int num;
+
+	if (!task->inetd || !svc_is_inetd(task->inetd->svc) || !task->inetd->svc->inetd)
+		return;
+
+	inetd = task->inetd->svc->inetd;
+	if (!inetd->paused)
+		return;
+
+	/* The task is not yet unregistered, don't count it */
+	num = inetd_num_conns(inetd);
+	if (task->state != SVC_DONE_STATE)
+		num--;
+	if (inetd->max && num >= inetd->max)
+		return;
+
+	_d("%s: below max connections, resuming", inetd->name);
+	inetd->paused = 0;
+	if (inetd->watcher.fd != -1)
+		uev_io_start(&inetd->watcher);
+}
+
+/**
+ * inetd_limit - Parse connection limits of an inetd service
+ * @inetd: Pointer to an &inetd_t
+ * @arg:   Limits, "max:NUM,rate:NUM/SEC", or %NULL to reset
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on invalid argument.
+ */
+int inetd_limit(inetd_t *inetd, char *arg)
+{
+	const char *errstr;
+	char *tok;
+
+	inetd->max    = 0;
+	inetd->rate   = 0;
+	inetd->window = 1;
+	if (!arg)
+		goto done;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (!strncasecmp(tok, "max:", 4)) {
+			inetd->max = strtonum(&tok[4], 0, 65535, &errstr);
+			if (errstr)
+				goto error;
+		} else if (!strncasecmp(tok, "rate:", 5)) {
+			char *sec = strchr(&tok[5], '/');
+
+			if (sec) {
+				*sec++ = 0;
+				inetd->window = strtonum(sec, 1, 3600, &errstr);
+				if (errstr)
+					goto error;
+			}
+			inetd->rate = strtonum(&tok[5], 0, 65535, &errstr);
+			if (errstr)
+				goto error;
+		} else
+			goto error;
+	}
+done:
+	if (inetd->rate && !inetd->rates)
+		inetd->rates = calloc(INETD_RATE_SLOTS, sizeof(struct inetd_rate));
+	if (!inetd->rate && inetd->rates) {
+		free(inetd->rates);
+		inetd->rates = NULL;
+	}
+
+	return 0;
+error:
+	logit(LOG_WARNING, "%s: invalid conn: limit '%s'", inetd->name, tok);
+	inetd->max  = 0;
+	inetd->rate = 0;
+	goto done;
+}
+
 /*
  * Refuse service if the request specifies a reply port corresponding to any internal service.
  * This is done as a defense against looping attacks; the remote IP address is logged.
@@ -246,12 +709,12 @@ int inetd_check_loop(struct sockaddr *sa, socklen_t len, char *name)
         char pname[NI_MAXHOST];
 
         for (svc = svc_inetd_iterator(&iter, 1); svc; svc = svc_inetd_iterator(&iter, 0)) {
-		inetd_t *i = &svc->inetd;
+		inetd_t *i = svc->inetd;
 
                 if (!i->builtin || i->type != SOCK_DGRAM)
                         continue;
 
-		if (((const struct sockaddr_in *)sa)->sin_port == i->port) {
+		if (ntohs(((const struct sockaddr_in *)sa)->sin_port) == i->port) {
 			getnameinfo(sa, len, pname, sizeof(pname), NULL, 0, NI_NUMERICHOST);
 			logit(LOG_WARNING, "%s/%s:%s/%s loop request REFUSED from %s", i->name, "UDP", name, "UDP", pname);
 			return 1;
@@ -299,15 +762,15 @@ static int spawn_socket(inetd_t *inetd)
 	}
 
 	if (inetd->port) {
+		/* Set extra sockopt to get ifindex from inbound packets */
+		ENABLE_SOCKOPT(sd, SOL_IP, IP_PKTINFO);
+
 		if (inetd->type == SOCK_STREAM) {
 			if (-1 == listen(sd, 10)) {
 				logit(LOG_CRIT, "Failed listening to inetd service %s", inetd->name);
 				close(sd);
 				return -errno;
 			}
-		} else {           /* SOCK_DGRAM */
-			/* Set extra sockopt to get ifindex from inbound packets */
-			ENABLE_SOCKOPT(sd, SOL_IP, IP_PKTINFO);
 		}
 	}
 
@@ -343,6 +806,7 @@ int inetd_start(inetd_t *inetd)
 	}
 
 	_d("Re-starting %s socket watcher ...", inetd->svc->cmd);
+	inetd->paused = 0;
 	uev_io_start(&inetd->watcher);
 
 	return 0;
@@ -355,7 +819,7 @@ void inetd_stop_children(inetd_t *inetd, int check_allowed)
 	svc = svc_job_iterator(&iter, 1, inetd->svc->job);
 	while (svc) {
 		if (!svc_is_inetd(svc)) {
-			if (!check_allowed || !inetd_is_allowed(inetd, svc->iifname)) {
+			if (!check_allowed || !inetd_is_allowed_ifindex(inetd, svc->ifindex)) {
 				svc_stop(svc);
 				service_step(svc);
 			}
@@ -374,6 +838,7 @@ void inetd_stop(inetd_t *inetd)
 	if (inetd->watcher.fd != -1) {
 		_d("Stopping %s socket watcher ...", inetd->svc->cmd);
 		uev_io_stop(&inetd->watcher);
+		inetd->paused = 0;
 
 		/*
 		 * For dgram inetd services we block the parent SVC
@@ -384,6 +849,7 @@ void inetd_stop(inetd_t *inetd)
 			close(inetd->watcher.fd);
 			inetd->watcher.fd = -1;
 
+			inetd_fast_flush(inetd);
 			inetd_stop_children(inetd, 0);
 		}
 	}
@@ -491,6 +957,12 @@ static int getent(char *service, char *proto, struct servent **sv, struct protoe
 	return 0;
 }
 
+static void ifcache_flush(inetd_t *inetd)
+{
+	if (inetd->ifcache)
+		memset(inetd->ifcache, 0, INETD_IFCACHE * sizeof(struct inetd_ifcache));
+}
+
 /*
  * Find exact match.
  */
@@ -539,7 +1011,12 @@ int inetd_flush(inetd_t *inetd)
 
 	TAILQ_FOREACH_SAFE(filter, &inetd->filters, link, next) {
 		TAILQ_REMOVE(&inetd->filters, filter, link);
-		free(filter);
+		pool_free(&filter_pool, filter);
+	}
+
+	if (inetd->ifcache) {
+		free(inetd->ifcache);
+		inetd->ifcache = NULL;
 	}
 
 	return 0;
@@ -563,7 +1040,7 @@ int inetd_allow(inetd_t *inetd, char *ifname)
 	}
 
 	_d("Allow iface %s for service %s (port %d)", ifname, inetd->name, inetd->port);
-	filter = calloc(1, sizeof(*filter));
+	filter = pool_alloc(&filter_pool);
 	if (!filter) {
 		_e("Out of memory, cannot add filter to service %s", inetd->name);
 		return errno = ENOMEM;
@@ -572,6 +1049,7 @@ int inetd_allow(inetd_t *inetd, char *ifname)
 	filter->deny = 0;
 	strlcpy(filter->ifname, ifname, sizeof(filter->ifname));
 	TAILQ_INSERT_TAIL(&inetd->filters, filter, link);
+	ifcache_flush(inetd);
 
 	return 0;
 }
@@ -594,7 +1072,7 @@ int inetd_deny(inetd_t *inetd, char *ifname)
 	}
 
 	_d("Deny iface %s for service %s (port %d)", ifname, inetd->name, inetd->port);
-	filter = calloc(1, sizeof(*filter));
+	filter = pool_alloc(&filter_pool);
 	if (!filter) {
 		_e("Out of memory, cannot add filter to service %s", inetd->name);
 		return errno = ENOMEM;
@@ -603,6 +1081,7 @@ int inetd_deny(inetd_t *inetd, char *ifname)
 	filter->deny = 1;
 	strlcpy(filter->ifname, ifname, sizeof(filter->ifname));
 	TAILQ_INSERT_TAIL(&inetd->filters, filter, link);
+	ifcache_flush(inetd);
 
 	return 0;
 }
@@ -627,6 +1106,60 @@ int inetd_is_allowed(inetd_t *inetd, char *ifname)
 	return 0;
 }
 
+/**
+ * inetd_is_allowed_ifindex - Check filters for an ingress interface
+ * @inetd:   Pointer to an &inetd_t
+ * @ifindex: Ingress interface index, 0 if unknown
+ *
+ * Fast path of inetd_is_allowed() for each connection or datagram.  The
+ * verdict for each ifindex is cached, so the interface name is only
+ * looked up, and matched against the filter list, when the entry is
+ * missing or older than %INETD_IFCACHE_TTL seconds, which also covers
+ * interfaces being renamed.  The cache is flushed when filters change.
+ *
+ * Returns:
+ * %TRUE(1) if allowed, otherwise %FALSE(0).
+ */
+int inetd_is_allowed_ifindex(inetd_t *inetd, int ifindex)
+{
+	char ifname[IF_NAMESIZE + 1] = { 0 };
+	struct inetd_ifcache *entry = NULL;
+	struct timespec ts;
+	long now;
+
+	/* vDSO, unlike jiffies(), this is called for each datagram */
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	now = ts.tv_sec;
+
+	if (!inetd) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	if (!inetd->ifcache)
+		inetd->ifcache = calloc(INETD_IFCACHE, sizeof(struct inetd_ifcache));
+
+	/* ifindex are allocated in sequence, so direct mapped is enough */
+	if (inetd->ifcache) {
+		entry = &inetd->ifcache[ifindex % INETD_IFCACHE];
+		if (entry->stamp && entry->ifindex == ifindex &&
+		    now - entry->stamp < INETD_IFCACHE_TTL)
+			return entry->allow;
+	}
+
+	if (ifindex && !if_indextoname(ifindex, ifname))
+		ifname[0] = 0;
+
+	if (!entry)
+		return inetd_is_allowed(inetd, ifname);
+
+	entry->ifindex = ifindex;
+	entry->stamp   = now ?: 1;
+	entry->allow   = inetd_is_allowed(inetd, ifname);
+
+	return entry->allow;
+}
+
 int inetd_match(inetd_t *inetd, char *service, char *proto)
 {
 	struct servent *sv = NULL;
@@ -711,7 +1244,7 @@ svc_t *inetd_find_svc(char *path, char *service, char *proto)
 		if (strncmp(path, svc->cmd, strlen(svc->cmd)))
 			continue;
 
-		if (inetd_match(&svc->inetd, service, proto)) {
+		if (inetd_match(svc->inetd, service, proto)) {
 			_d("Found a matching inetd svc for %s %s %s", path, service, proto);
 			return svc;
 		}
@@ -764,6 +1297,7 @@ int inetd_new(inetd_t *inetd, char *name, char *service, char *proto, int forkin
 		name = service;
 	strlcpy(inetd->name, name, sizeof(inetd->name));
 	TAILQ_INIT(&inetd->filters);
+	TAILQ_INIT(&inetd->conns);
 
 	/* Naïve mapping tcp->stream, udp->dgram, other->dgram */
 	if (!strcasecmp(sv->s_proto, "tcp"))
@@ -791,6 +1325,7 @@ int inetd_del(inetd_t *inetd)
 {
 	svc_unblock(inetd->svc);
 	inetd_stop(inetd);
+	inetd_limit(inetd, NULL);
 
 	return inetd_flush(inetd);
 }
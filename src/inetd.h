@@ -31,12 +31,38 @@
 
 typedef struct svc svc_t;
 
+#define INETD_BATCH      32	/* Max connections accepted per wakeup */
+#define INETD_RATE_SLOTS 64	/* Sources tracked for rate limiting */
+#define INETD_IFCACHE    256	/* Filter verdicts cached by ifindex */
+#define INETD_IFCACHE_TTL 5	/* sec, before re-checking ifname */
+#define INETD_FAST_MAX   64	/* Default max in-process connections */
+#define INETD_FAST_MTU   2048	/* Max datagram size in fast path */
+#define INETD_FAST_IDLE  60	/* sec, idle in-process connection closed */
+
+/* Flags for stream builtins with a reply() fast path */
+#define INETD_REPLY_ONCE  1	/* Close after reply to connect, e.g. time */
+#define INETD_REPLY_FLOOD 2	/* Reply again whenever writable, chargen */
+
 typedef struct inetd_filter {
 	TAILQ_ENTRY(inetd_filter) link;
 	int  deny;		/* 0:allow, 1:deny */
 	char ifname[IFNAMSIZ];	/* E.g., eth0 */
 } inetd_filter_t;
 
+/* Connections per source address, see inetd_rate_check() */
+struct inetd_rate {
+	in_addr_t addr;
+	long      start;	/* jiffies() */
+	int       count;
+};
+
+/* Filter verdict per ingress ifindex, see inetd_is_allowed_ifindex() */
+struct inetd_ifcache {
+	int       ifindex;
+	int       allow;
+	long      stamp;	/* sec, CLOCK_MONOTONIC_COARSE */
+};
+
 typedef struct {
 	uev_t  watcher;
 	svc_t *svc;		/* svc_t pointer for the socket callback */
@@ -51,6 +77,20 @@ typedef struct {
 	char   name[10];
 	int  (*cmd)(int type);	/* internal inetd service, like 'time' */
 
+	/* In-process fast path of builtins, see inetd_fast_dgram() */
+	ssize_t (*reply)(int type, char *buf, size_t len, size_t size);
+	int    reply_flags;	/* INETD_REPLY_* */
+	int    nconns;		/* Active in-process stream connections */
+	TAILQ_HEAD(, inetd_conn) conns;
+
+	/* Limits, conn:max:NUM,rate:NUM/SEC, see inetd_limit() */
+	int    max;		/* Max concurrent connections, 0: unlimited */
+	int    rate;		/* Max connections per source and window */
+	int    window;		/* sec */
+	int    paused;		/* Watcher stopped at max connections */
+	struct inetd_rate *rates;
+	struct inetd_ifcache *ifcache;
+
 	TAILQ_HEAD(, inetd_filter) filters;
 } inetd_t;
 
@@ -59,6 +99,8 @@ int     inetd_check_loop(struct sockaddr *sa, socklen_t len, char *name);
 int     inetd_start     (inetd_t *inetd);
 void    inetd_stop      (inetd_t *inetd);
 void    inetd_stop_children (inetd_t *inetd, int check_allowed);
+void    inetd_conn_done (svc_t *task);
+int     inetd_limit     (inetd_t *inetd, char *arg);
 
 int     inetd_new       (inetd_t *inetd, char *name, char *service, char *proto, int forking, svc_t *svc);
 int     inetd_del       (inetd_t *inetd);
@@ -72,6 +114,7 @@ int     inetd_flush     (inetd_t *inetd);
 int     inetd_allow     (inetd_t *inetd, char *ifname);
 int     inetd_deny      (inetd_t *inetd, char *ifname);
 int     inetd_is_allowed(inetd_t *inetd, char *ifname);
+int     inetd_is_allowed_ifindex(inetd_t *inetd, int ifindex);
 
 #endif	/* FINIT_INETD_H_ */
 
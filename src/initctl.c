@@ -24,21 +24,29 @@
 #include "config.h"
 
 #include <err.h>
+#include <fcntl.h>
 #include <ftw.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <glob.h>
 #include <paths.h>
 #include <signal.h>
 #include <stdio.h>
 #include <time.h>
 #include <utmp.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <lite/lite.h>
 
 #include "client.h"
 #include "cond.h"
+#include "confcache.h"
 #include "serv.h"
+#include "pid.h"
 #include "service.h"
+#include "shm.h"
+#include "usage.h"
 #include "util.h"
 
 #define _PATH_COND _PATH_VARRUN "finit/cond/"
@@ -49,8 +57,35 @@ struct command {
 };
 
 int verbose  = 0;
+static int follow = 0;
+static int use_kexec = 0;
+static int json = 0;
+static int json_num = 0;		/* Array elements printed */
 int runlevel = 0;
 
+/* Quoted and escaped, names and descriptions are from .conf files */
+static void json_puts(const char *str)
+{
+	putchar('"');
+	for (; str && *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void json_key(const char *key, const char *str)
+{
+	printf("\"%s\":", key);
+	json_puts(str);
+}
+
 static int runlevel_get(int *prevlevel)
 {
 	int result;
@@ -80,22 +115,62 @@ static int toggle_debug(char *arg)
 	return client_send(&rq, sizeof(rq));
 }
 
-static int do_log(char *svc)
+static int log_grep(const char *name, int lines)
 {
 	char cmd[128];
 	char *logfile = "/var/log/messages";
 
-	if (!svc || !svc[0])
-		svc = "finit";
-
 	if (!fexist(logfile))
 		logfile = "/var/log/syslog";
 
-	snprintf(cmd, sizeof(cmd), "cat %s | grep %s | tail -10", logfile, svc);
+	snprintf(cmd, sizeof(cmd), "cat %s | grep %s | tail -%d", logfile, name, lines);
 
 	return system(cmd);
 }
 
+/*
+ * Last output of service @job from its log ring in Finit, no disk I/O,
+ * or if it has none, the last messages with @name from the syslog file.
+ */
+static int log_show(const char *job, const char *name, int lines)
+{
+	struct init_request rq = {
+		.magic     = INIT_MAGIC,
+		.cmd       = INIT_CMD_SVC_LOG,
+		.runlevel  = follow,
+		.sleeptime = lines,
+	};
+	char buf[BUFSIZ];
+	ssize_t len;
+	int sd;
+
+	strlcpy(rq.data, job, sizeof(rq.data));
+	sd = client_stream(&rq);
+	if (-1 == sd)
+		return 1;
+
+	if (read(sd, &rq, sizeof(rq)) != sizeof(rq) || rq.cmd != INIT_CMD_ACK) {
+		close(sd);
+		return log_grep(name, lines ? lines : 10);
+	}
+
+	while ((len = read(sd, buf, sizeof(buf))) > 0) {
+		fwrite(buf, len, 1, stdout);
+		fflush(stdout);
+	}
+	close(sd);
+
+	return len < 0;
+}
+
+static int do_log(char *svc)
+{
+	if (!svc || !svc[0])
+		return log_grep("finit", 10);
+
+	return log_show(svc, svc, 0);
+}
+
 /*
  * XXX: Convert to read UTMP instead, like runlevel(8) does
  */
@@ -130,46 +205,67 @@ static int do_runlevel(char *arg)
 
 static int do_svc(int cmd, char *arg)
 {
-	struct init_request rq = {
-		.magic = INIT_MAGIC,
-		.cmd = cmd,
-	};
-
-	strlcpy(rq.data, arg, sizeof(rq.data));
-
-	return client_send(&rq, sizeof(rq));
+	return client_request(cmd, arg, NULL, 0) != 0;
 }
 
 static int do_reload (char *arg) { return do_svc(INIT_CMD_RELOAD,      arg); }
 
 /*
- * This is a wrapper for do_svc() that adds a simple sanity check of
- * the service(s) provided as argument.  If a service does not exist
- * we make sure to return an error code.
+ * All jobs are sent in one request, Finit checks that they all exist
+ * before acting on any of them, and replies with the result per job.
  */
 static int do_startstop(int cmd, char *arg)
 {
-	struct init_request rq = {
-		.magic = INIT_MAGIC,
-		.cmd   = INIT_CMD_SVC_QUERY
-	};
-
-	strlcpy(rq.data, arg, sizeof(rq.data));
-	if (client_send(&rq, sizeof(rq))) {
-		fprintf(stderr, "No such job(s) or service(s): %s\n\n", rq.data);
-		fprintf(stderr, "Usage: initctl %s <JOB|NAME>[:ID]\n",
+	static char reply[8192];
+	int rc;
+
+	rc = client_request(cmd, arg, reply, sizeof(reply));
+	if (rc) {
+		if (rc > 0)
+			fprintf(stderr, "No such job(s) or service(s): %s\n\n", reply);
+		fprintf(stderr, "Usage: initctl %s <JOB|NAME>[:ID] ...\n",
 			cmd == INIT_CMD_START_SVC ? "start" :
 			(cmd == INIT_CMD_STOP_SVC ? "stop"  : "restart"));
 		return 1;
 	}
 
-	return do_svc(cmd, arg);
+	if (verbose)
+		fputs(reply, stdout);
+
+	return 0;
 }
 
 static int do_start  (char *arg) { return do_startstop(INIT_CMD_START_SVC,   arg); }
 static int do_stop   (char *arg) { return do_startstop(INIT_CMD_STOP_SVC,    arg); }
 static int do_restart(char *arg) { return do_startstop(INIT_CMD_RESTART_SVC, arg); }
 
+/*
+ * Show, or change, CPU and I/O scheduling of a service.  Changes apply
+ * to the running process and its next start, until the next reload.
+ */
+static int do_prio(char *arg)
+{
+	char reply[512];
+	int rc;
+
+	if (!arg || !arg[0]) {
+		fprintf(stderr, "Usage: initctl prio <JOB|NAME>[:ID] [OPTION ...]\n");
+		return 1;
+	}
+
+	rc = client_request(INIT_CMD_SVC_PRIO, arg, reply, sizeof(reply));
+	if (rc) {
+		if (rc > 0)
+			fprintf(stderr, "%s\n", reply);
+		return 1;
+	}
+
+	if (reply[0])
+		puts(reply);
+
+	return 0;
+}
+
 static void show_cond_one(const char *_conds)
 {
 	static char conds[MAX_COND_LEN];
@@ -177,6 +273,21 @@ static void show_cond_one(const char *_conds)
 
 	strlcpy(conds, _conds, sizeof(conds));
 
+	if (json) {
+		putchar('[');
+		for (cond = strtok(conds, ","); cond; cond = strtok(NULL, ",")) {
+			if (cond != conds)
+				putchar(',');
+			putchar('{');
+			json_key("name", cond);
+			putchar(',');
+			json_key("status", condstr(cond_get(cond)));
+			putchar('}');
+		}
+		putchar(']');
+		return;
+	}
+
 	putchar('<');
 
 	for (cond = strtok(conds, ","); cond; cond = strtok(NULL, ",")) {
@@ -212,16 +323,54 @@ static int dump_one_cond(const char *fpath, const struct stat *sb, int tflag, st
 		return 0;
 
 	len = strlen(_PATH_COND);
+	if (json) {
+		printf("%s{", json_num++ ? "," : "");
+		json_key("name", &fpath[len]);
+		putchar(',');
+		json_key("status", condstr(cond_get_path(fpath)));
+		putchar('}');
+		return 0;
+	}
+
 	printf("%-28s  %s\n", &fpath[len], condstr(cond_get_path(fpath)));
 
 	return 0;
 }
 
+/*
+ * All conditions, or only those in the subtree, or matching the pattern,
+ * in @arg, e.g. net/ or net/eth*, mirroring cond_walk() in PID 1.
+ */
 static int do_cond_dump(char *arg)
 {
-	printheader(NULL, "CONDITION                     STATUS", 0);
+	char path[PATH_MAX];
+	int rc = 0;
+	glob_t gl;
+
+	if (json)
+		putchar('[');
+	else
+		printheader(NULL, "CONDITION                     STATUS", 0);
+
+	if (arg && arg[0]) {
+		size_t len;
+
+		snprintf(path, sizeof(path), "%s%s", _PATH_COND, arg);
+		len = strlen(path);
+		while (len > 0 && path[len - 1] == '/')
+			path[--len] = 0;
+
+		if (!glob(path, 0, NULL, &gl)) {
+			for (size_t i = 0; rc != -1 && i < gl.gl_pathc; i++)
+				rc = nftw(gl.gl_pathv[i], dump_one_cond, 20, 0);
+			globfree(&gl);
+		}
+	} else
+		rc = nftw(_PATH_COND, dump_one_cond, 20, 0);
 
-	if (nftw(_PATH_COND, dump_one_cond, 20, 0) == -1) {
+	if (json)
+		puts("]");
+	if (rc == -1) {
 		warnx("Failed parsing %s", _PATH_COND);
 		return 1;
 	}
@@ -231,16 +380,36 @@ static int do_cond_dump(char *arg)
 
 static int do_cond_show(char *arg)
 {
-	svc_t *svc;
+	uint32_t mask = SVC_FIELD(SVC_FIELD_PID) | SVC_FIELD(SVC_FIELD_CMD) |
+		SVC_FIELD(SVC_FIELD_COND);
 	enum cond_state cond;
+	svc_t *svc;
+
+	/* cond show net/, only the conditions below */
+	if (arg && arg[0])
+		return do_cond_dump(arg);
 
-	printheader(NULL, "PID     SERVICE               STATUS  CONDITION (+ ON, ~ FLUX, - OFF)", 0);
+	if (json)
+		putchar('[');
+	else
+		printheader(NULL, "PID     SERVICE               STATUS  CONDITION (+ ON, ~ FLUX, - OFF)", 0);
 
-	for (svc = client_svc_iterator(1); svc; svc = client_svc_iterator(0)) {
-		if (!svc->cond[0])
+	for (svc = client_svc_list(1, mask); svc; svc = client_svc_list(0, mask)) {
+		if (!svc->config->cond[0])
 			continue;
 
-		cond = cond_get_agg(svc->cond);
+		cond = cond_get_agg(svc->config->cond);
+
+		if (json) {
+			printf("%s{\"pid\":%d,", json_num++ ? "," : "", svc->pid);
+			json_key("service", svc->cmd);
+			putchar(',');
+			json_key("status", condstr(cond));
+			printf(",\"conditions\":");
+			show_cond_one(svc->config->cond);
+			putchar('}');
+			continue;
+		}
 
 		printf("%-6d  %-20.20s  ", svc->pid, svc->cmd);
 
@@ -249,13 +418,49 @@ static int do_cond_show(char *arg)
 		else
 			printf("\e[1m%-6.6s\e[0m  ", condstr(cond));
 
-		show_cond_one(svc->cond);
+		show_cond_one(svc->config->cond);
 		puts("");
 	}
 
+	if (json)
+		puts("]");
+
 	return 0;
 }
 
+/* Conditions are set, or cleared, in one batch by Finit */
+static int do_cond_emit(char *arg, int clear)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_EMIT
+	};
+	char *cond;
+
+	if (!arg || !arg[0]) {
+		fprintf(stderr, "Usage: initctl cond %s <COND> [COND...]\n", clear ? "clear" : "set");
+		return 1;
+	}
+
+	for (cond = strtok(arg, " "); cond; cond = strtok(NULL, " ")) {
+		if (strncmp(cond, "usr/", 4) || !cond[4]) {
+			fprintf(stderr, "Invalid condition %s, only usr/ conditions can be changed.\n", cond);
+			return 1;
+		}
+
+		if (rq.data[0])
+			strlcat(rq.data, " ", sizeof(rq.data));
+		if (clear)
+			strlcat(rq.data, "-", sizeof(rq.data));
+		strlcat(rq.data, cond, sizeof(rq.data));
+	}
+
+	return client_send(&rq, sizeof(rq));
+}
+
+static int do_cond_set  (char *arg) { return do_cond_emit(arg, 0); }
+static int do_cond_clear(char *arg) { return do_cond_emit(arg, 1); }
+
 static int do_cond(char *cmd)
 {
 	int c;
@@ -263,6 +468,8 @@ static int do_cond(char *cmd)
 	struct command command[] = {
 		{ "show",    do_cond_show  },
 		{ "dump",    do_cond_dump  },
+		{ "set",     do_cond_set   },
+		{ "clear",   do_cond_clear },
 		{ NULL, NULL }
 	};
 
@@ -288,7 +495,21 @@ static int do_signal(int signo, const char *msg)
 
 static int do_halt    (char *arg) { return do_signal(SIGUSR1, "halt");      }
 static int do_poweroff(char *arg) { return do_signal(SIGUSR2, "power off"); }
-static int do_reboot  (char *arg) { return do_signal(SIGTERM, "reboot");    }
+
+static int do_reboot(char *arg)
+{
+	char reply[256];
+	int rc;
+
+	if (!use_kexec)
+		return do_signal(SIGTERM, "reboot");
+
+	rc = client_request(INIT_CMD_KEXEC, "", reply, sizeof(reply));
+	if (rc > 0)
+		fprintf(stderr, "%s\n", reply);
+
+	return rc != 0;
+}
 
 int utmp_show(char *file)
 {
@@ -299,7 +520,12 @@ int utmp_show(char *file)
 	int pid;
 	char id[sizeof(ut->ut_id) + 1], user[sizeof(ut->ut_user) + 1], when[80];
 
-	printheader(NULL, file, 0);
+	if (json) {
+		putchar('{');
+		json_key("file", file);
+		printf(",\"entries\":[");
+	} else
+		printheader(NULL, file, 0);
 	utmpname(file);
 
 	setutent();
@@ -322,21 +548,61 @@ int utmp_show(char *file)
 		else
 			inet_ntop(AF_INET, &ut->ut_addr, addr, sizeof(addr));
 
+		if (json) {
+			char line[sizeof(ut->ut_line) + 1], host[sizeof(ut->ut_host) + 1];
+
+			strlcpy(line, ut->ut_line, sizeof(line));
+			strlcpy(host, ut->ut_host, sizeof(host));
+
+			printf("%s{\"type\":%d,\"pid\":%d,", json_num++ ? "," : "", ut->ut_type, pid);
+			json_key("id", id);
+			putchar(',');
+			json_key("user", user);
+			putchar(',');
+			json_key("line", line);
+			putchar(',');
+			json_key("host", host);
+			putchar(',');
+			json_key("addr", addr);
+			printf(",\"time\":%lld}", (long long)sec);
+			continue;
+		}
+
 		printf("[%d] [%05d] [%-4.4s] [%-8.8s] [%-12.12s] [%-20.20s] [%-15.15s] [%-19.19s]\n",
 		       ut->ut_type, pid, id, user, ut->ut_line, ut->ut_host, addr, when);
 	}
 	endutent();
 
+	if (json) {
+		printf("]}");
+		json_num = 0;
+	}
+
 	return 0;
 }
 
 static int do_utmp(char *file)
 {
-	if (fexist(file))
-		return utmp_show(file);
+	int rc;
+
+	if (fexist(file)) {
+		rc = utmp_show(file);
+		goto done;
+	}
 
-	return  utmp_show(_PATH_WTMP) ||
-		utmp_show(_PATH_UTMP);
+	if (json)
+		putchar('[');
+	rc = utmp_show(_PATH_WTMP);
+	if (json)
+		putchar(',');
+	rc |= utmp_show(_PATH_UTMP);
+	if (json)
+		putchar(']');
+done:
+	if (json)
+		puts("");
+
+	return rc;
 }
 
 static int show_version(char *arg)
@@ -384,6 +650,127 @@ char *runlevel_string(int runlevel, int levels)
 	return lvl;
 }
 
+static const char *svc_typestr(svc_t *svc)
+{
+	switch (svc->type) {
+	case SVC_TYPE_SERVICE:
+		return "service";
+	case SVC_TYPE_TASK:
+		return "task";
+	case SVC_TYPE_RUN:
+		return "run";
+	case SVC_TYPE_INETD:
+		return "inetd";
+	case SVC_TYPE_INETD_CONN:
+		return "inetd-conn";
+	case SVC_TYPE_SYSV:
+		return "sysv";
+	default:
+		break;
+	}
+
+	return "unknown";
+}
+
+/* Status of @svc at state change @h, in the same words as svc_status() */
+static char *hist_status(svc_t *svc, struct svc_hist *h)
+{
+	static svc_t tmp;
+
+	tmp.state = h->state;
+	tmp.block = h->block;
+	tmp.type  = svc->type;
+
+	return svc_status(&tmp);
+}
+
+/* Nanoseconds since boot as seconds, with millisecond resolution */
+static char *stamp_str(long long ns, char *buf, size_t len)
+{
+	snprintf(buf, len, "%lld.%03lld", ns / 1000000000LL, ns / 1000000 % 1000);
+	return buf;
+}
+
+static void show_history(svc_t *svc)
+{
+	struct svc_hist hist[SVC_HIST_MAX];
+	int num;
+
+	num = svc_history_get(svc, hist);
+	for (int i = 0; i < num; i++) {
+		char buf[32];
+
+		printf("%-12s: %12s  %-8s  PID %d\n", i ? "" : "History",
+		       stamp_str(hist[i].ns, buf, sizeof(buf)), hist_status(svc, &hist[i]),
+		       hist[i].pid);
+	}
+}
+
+/*
+ * Same fields as the text output, but values are raw: runlevels are
+ * e.g. "S12345", uptime in seconds, usage in bytes and usec, and
+ * timestamps in nanoseconds since boot, 0 if not (yet) recorded.
+ */
+static void show_status_json(svc_t *svc, int details)
+{
+	char lvls[12] = "";
+	int pos = 0;
+
+	for (int i = 0; i < 10; i++) {
+		if (ISSET(svc->runlevels, i))
+			lvls[pos++] = i ? '0' + i : 'S';
+	}
+
+	printf("{\"job\":%d,", svc->job);
+	json_key("id", svc->id);
+	putchar(',');
+	json_key("name", svc->name);
+	putchar(',');
+	json_key("type", svc_typestr(svc));
+	putchar(',');
+	json_key("status", svc_status(svc));
+	printf(",\"pid\":%d,", svc->pid);
+	json_key("runlevels", lvls);
+	putchar(',');
+	json_key("command", svc->cmd);
+	putchar(',');
+	json_key("args", client_svc_args());
+	putchar(',');
+	json_key("description", svc->config->desc);
+
+	if (details) {
+		struct svc_hist hist[SVC_HIST_MAX];
+		struct svc_usage usage;
+		int num;
+
+		printf(",\"uptime\":%ld,\"restarts\":%d,",
+		       svc->pid ? jiffies() - svc->start_time : 0, svc->restart_cnt);
+		json_key("message", svc->notify_msg);
+		putchar(',');
+		json_key("scheduling", client_svc_prio());
+		printf(",\"timestamps\":{\"start\":%lld,\"ready\":%lld,\"stop\":%lld,\"exit\":%lld}",
+		       svc_stamp_get(svc, SVC_STAMP_START), svc_stamp_get(svc, SVC_STAMP_READY),
+		       svc_stamp_get(svc, SVC_STAMP_STOP), svc_stamp_get(svc, SVC_STAMP_EXIT));
+		printf(",\"history\":[");
+		num = svc_history_get(svc, hist);
+		for (int i = 0; i < num; i++) {
+			printf("%s{\"time\":%lld,", i ? "," : "", (long long)hist[i].ns);
+			json_key("status", hist_status(svc, &hist[i]));
+			printf(",\"pid\":%d}", hist[i].pid);
+		}
+		putchar(']');
+		if (svc->pid > 0 && !usage_get(svc, &usage)) {
+			printf(",\"usage\":{\"cgroup\":%s,\"cpu_usec\":%llu,\"mem\":%llu,"
+			       "\"mem_peak\":%llu,\"io_read\":%llu,\"io_write\":%llu}",
+			       usage.cgroup ? "true" : "false",
+			       (unsigned long long)usage.cpu_usec, (unsigned long long)usage.mem,
+			       (unsigned long long)usage.mem_peak, (unsigned long long)usage.io_read,
+			       (unsigned long long)usage.io_write);
+		}
+	}
+	putchar('}');
+}
+
 /*
  * In verbose mode we skip the header and each service description.
  * This in favor of having all info on one line so a machine can more
@@ -391,6 +778,7 @@ char *runlevel_string(int runlevel, int levels)
  */
 static int show_status(char *arg)
 {
+	uint32_t mask = 0;
 	svc_t *svc;
 
 	/* Fetch UTMP runlevel, needed for svc_status() call below */
@@ -399,26 +787,75 @@ static int show_status(char *arg)
 	if (arg && arg[0]) {
 		long now = jiffies();
 		char buf[42] = "N/A";
+		struct svc_usage usage;
 
 		svc = client_svc_find(arg);
 		if (!svc)
 			return 1;
 
+		if (json) {
+			show_status_json(svc, 1);
+			puts("");
+			return 0;
+		}
+
 		printf("Service     : %s\n", svc->cmd);
-		printf("Description : %s\n", svc->desc);
+		printf("Description : %s\n", svc->config->desc);
 		printf("PID         : %d\n", svc->pid);
 		printf("Uptime      : %s\n", svc->pid ? uptime(now - svc->start_time, buf, sizeof(buf)) : buf);
 		printf("Runlevels   : %s\n", runlevel_string(runlevel, svc->runlevels));
 		printf("Status      : %s\n", svc_status(svc));
+		if (svc->notify_msg[0])
+			printf("Message     : %s\n", svc->notify_msg);
+		printf("Restarts    : %d\n", svc->restart_cnt);
+		if (svc_stamp_get(svc, SVC_STAMP_READY) && svc_stamp_get(svc, SVC_STAMP_START)) {
+			long long ns = svc_stamp_get(svc, SVC_STAMP_READY) - svc_stamp_get(svc, SVC_STAMP_START);
+
+			printf("Ready       : %lld.%03lld msec after start\n", ns / 1000000, ns / 1000 % 1000);
+		}
+		if (client_svc_prio()[0])
+			printf("Scheduling  : %s\n", client_svc_prio());
+		if (svc->pid > 0 && !usage_get(svc, &usage)) {
+			char cur[16], peak[16] = "N/A";
+
+			if (usage.mem_peak)
+				usage_bytes(usage.mem_peak, peak, sizeof(peak));
+			printf("CPU time    : %s\n", usage_cpu(usage.cpu_usec, buf, sizeof(buf)));
+			printf("Memory      : %s (peak %s)\n", usage_bytes(usage.mem, cur, sizeof(cur)), peak);
+			printf("I/O         : %s read, ", usage_bytes(usage.io_read, cur, sizeof(cur)));
+			printf("%s written\n", usage_bytes(usage.io_write, cur, sizeof(cur)));
+			printf("Accounting  : %s\n", usage.cgroup ? "cgroup, all processes" : "main PID only");
+		}
+		show_history(svc);
 		printf("\n");
 
-		return do_log(svc->cmd);
+		return log_show(arg, svc->cmd, 10);
 	}
 
-	if (!verbose)
+	if (json) {
+		putchar('[');
+		for (svc = client_svc_list(1, mask); svc; svc = client_svc_list(0, mask)) {
+			if (json_num++)
+				putchar(',');
+			show_status_json(svc, 0);
+		}
+		puts("]");
+
+		return 0;
+	}
+
+	if (!verbose) {
 		printheader(NULL, "#           STATUS PID     RUNLEVELS     SERVICE           DESCRIPTION", 0);
 
-	for (svc = client_svc_iterator(1); svc; svc = client_svc_iterator(0)) {
+		/* Only what we show, verbose mode gets all fields */
+		mask = SVC_FIELD(SVC_FIELD_ID)    | SVC_FIELD(SVC_FIELD_PID)   |
+		       SVC_FIELD(SVC_FIELD_STATE) | SVC_FIELD(SVC_FIELD_BLOCK) |
+		       SVC_FIELD(SVC_FIELD_TYPE)  | SVC_FIELD(SVC_FIELD_RUNLEVELS) |
+		       SVC_FIELD(SVC_FIELD_NAME)  | SVC_FIELD(SVC_FIELD_DESC)  |
+		       SVC_FIELD(SVC_FIELD_ADMIT);
+	}
+
+	for (svc = client_svc_list(1, mask); svc; svc = client_svc_list(0, mask)) {
 		char jobid[20], args[512] = "", *lvls;
 
 		if (!svc->id[0])
@@ -440,7 +877,7 @@ static int show_status(char *arg)
 
 		if (!verbose) {
 			int adj = screen_cols - 60;
-			printf("%-16.16s  %-*.*s\n", svc->name, adj, adj, svc->desc);
+			printf("%-16.16s  %-*.*s\n", svc->name, adj, adj, svc->config->desc);
 			continue;
 		}
 
@@ -475,16 +912,231 @@ static int show_status(char *arg)
 		}
 		else
 #endif /* INETD_ENABLED */
-		{
-			int i;
+			printf("%s %s\n", svc->cmd, client_svc_args());
+	}
+
+	return 0;
+}
+
+/*
+ * Fast path for agents polling service state, reads the status page
+ * published by Finit, see shm.h, so PID 1 is never involved.
+ */
+static int shm_load(struct shm_page *copy)
+{
+	char path[MAX_ARG_LEN];
+	struct shm_page *page;
+	struct stat st;
+	int fd, rc;
+
+	pid_runpath(SHM_FILE, path, sizeof(path));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	/* Reading past the end of a short file is SIGBUS */
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*page)) {
+		close(fd);
+		return -1;
+	}
+
+	page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED)
+		return -1;
+
+	rc = shm_snapshot(page, copy);
+	munmap(page, sizeof(*page));
+
+	return rc;
+}
+
+/* JOB or NAME, with optional :ID, same as Finit's lookup by the API */
+static int shm_match(struct shm_svc *s, const char *name, const char *id)
+{
+	if (id && strcmp(s->id, id))
+		return 0;
+	if (isdigit(name[0]))
+		return s->job == atoi(name);
+
+	return !strcmp(s->name, name);
+}
+
+static int show_state(char *arg)
+{
+	static struct shm_page page;
+	char *name = NULL, *id = NULL;
+	int found = 0, running = 0;
+	long now = jiffies();
+
+	if (shm_load(&page)) {
+		warnx("Status page not available, is Finit running?");
+		return 1;
+	}
+
+	if (arg && arg[0]) {
+		name = arg;
+		id = strchr(arg, ':');
+		if (id)
+			*id++ = 0;
+	}
+
+	if (json)
+		putchar('[');
+	else
+		printheader(NULL, "#           STATUS PID     RESTARTS   UPTIME  SERVICE", 0);
 
-			for (i = 1; i < MAX_NUM_SVC_ARGS; i++) {
-				strlcat(args, svc->args[i], sizeof(args));
-				strlcat(args, " ", sizeof(args));
+	for (uint32_t i = 0; i < page.num_svc && i < SHM_SVC_MAX; i++) {
+		struct shm_svc *s = &page.svc[i];
+		char jobid[20], buf[42] = "N/A";
+		static svc_t svc;
+
+		if (!s->job || (name && !shm_match(s, name, id)))
+			continue;
+		found++;
+
+		/* Only the fields used by svc_status() */
+		svc.state      = s->state;
+		svc.block      = s->block;
+		svc.type       = s->type;
+		svc.admit_wait = s->queued;
+		if (s->state == SVC_RUNNING_STATE && !s->starting)
+			running++;
+
+		if (s->pid > 0)
+			uptime(now - s->start_time, buf, sizeof(buf));
+
+		if (json) {
+			printf("%s{\"job\":%d,", json_num++ ? "," : "", s->job);
+			json_key("id", s->id);
+			putchar(',');
+			json_key("name", s->name);
+			putchar(',');
+			json_key("status", svc_status(&svc));
+			printf(",\"pid\":%d,\"ready\":%s,\"restarts\":%d,\"uptime\":%ld}",
+			       s->pid, s->starting ? "false" : "true", s->restart_cnt,
+			       s->pid > 0 ? now - (long)s->start_time : 0);
+			continue;
+		}
+
+		if (!s->id[0])
+			snprintf(jobid, sizeof(jobid), "%d", s->job);
+		else
+			snprintf(jobid, sizeof(jobid), "%d:%s", s->job, s->id);
+
+		printf("%-9s %8s %-6d  %8d %8s  %s%s%s\n", jobid, svc_status(&svc), s->pid,
+		       s->restart_cnt, buf, s->name, s->id[0] ? ":" : "", s->id);
+	}
+
+	if (json)
+		puts("]");
+
+	/* For scripts, e.g. initctl -b state foo && ... */
+	if (name)
+		return !found || running != found;
+
+	return 0;
+}
+
+/* Previous sample, for CPU% in top view */
+struct top_sample {
+	int      job;
+	char     id[MAX_ID_LEN];
+	uint64_t cpu_usec;
+};
+
+#define TOP_MAX 256
+
+static struct top_sample *top_find(struct top_sample *s, int num, svc_t *svc)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (s[i].job == svc->job && !strcmp(s[i].id, svc->id))
+			return &s[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Continuously refreshing view of resource usage, like top(1).  The
+ * optional argument is the refresh interval in seconds, default 2.
+ */
+static int show_top(char *arg)
+{
+	static struct top_sample prev[TOP_MAX], curr[TOP_MAX];
+	int interval = 2, num_prev = 0;
+	struct timespec then = { 0 };
+
+	if (arg && arg[0]) {
+		interval = atoi(arg);
+		if (interval <= 0)
+			interval = 2;
+	}
+
+	while (1) {
+		struct timespec now;
+		uint64_t elapsed;
+		int num = 0, rows = 0;
+		svc_t *svc;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - then.tv_sec) * 1000000 + (now.tv_nsec - then.tv_nsec) / 1000;
+		then = now;
+
+		if (isatty(STDOUT_FILENO))
+			fputs("\e[H\e[2J", stdout);
+		printheader(NULL, "#         PID     CPU%      TIME     MEM    PEAK    READ   WRITE  RST SERVICE", 0);
+
+		for (svc = client_svc_list(1, 0); svc; svc = client_svc_list(0, 0)) {
+			char jobid[20], mem[16], peak[16] = "-", rd[16], wr[16], tm[20];
+			struct top_sample *p;
+			struct svc_usage usage;
+			double pct = 0.0;
+
+			if (svc->pid <= 0 || usage_get(svc, &usage))
+				continue;
+
+			if (num < TOP_MAX) {
+				curr[num].job = svc->job;
+				strlcpy(curr[num].id, svc->id, sizeof(curr[num].id));
+				curr[num].cpu_usec = usage.cpu_usec;
+				num++;
 			}
 
-			printf("%s %s\n", svc->cmd, args);
+			p = top_find(prev, num_prev, svc);
+			if (p && elapsed && usage.cpu_usec >= p->cpu_usec)
+				pct = 100.0 * (usage.cpu_usec - p->cpu_usec) / elapsed;
+
+			/* Leave room for header and cursor */
+			if (screen_rows > 0 && ++rows > screen_rows - 3)
+				continue;
+
+			if (!svc->id[0])
+				snprintf(jobid, sizeof(jobid), "%d", svc->job);
+			else
+				snprintf(jobid, sizeof(jobid), "%d:%s", svc->job, svc->id);
+			if (usage.mem_peak)
+				usage_bytes(usage.mem_peak, peak, sizeof(peak));
+
+			printf("%-9s %-6d %5.1f %9s %7s %7s %7s %7s %4d %s\n", jobid, svc->pid,
+			       p ? pct : 0.0, usage_cpu(usage.cpu_usec, tm, sizeof(tm)),
+			       usage_bytes(usage.mem, mem, sizeof(mem)), peak,
+			       usage_bytes(usage.io_read, rd, sizeof(rd)),
+			       usage_bytes(usage.io_write, wr, sizeof(wr)),
+			       svc->restart_cnt, svc->name);
 		}
+		fflush(stdout);
+
+		memcpy(prev, curr, sizeof(prev[0]) * num);
+		num_prev = num;
+
+		/* Batch mode, or output to a pipe, only once */
+		if (!isatty(STDOUT_FILENO))
+			break;
+
+		sleep(interval);
 	}
 
 	return 0;
@@ -498,6 +1150,7 @@ static int dump_cgroup(const char *fpath, const struct stat *sb, int tflag, stru
 	char buf[256];
 	int user = 0;
 	int num = 0;
+	int procs = 0;
 
 	if (tflag == FTW_F)
 		return 0;
@@ -519,8 +1172,14 @@ static int dump_cgroup(const char *fpath, const struct stat *sb, int tflag, stru
 		FILE *cfp;
 		int pid;
 
-		if (num == 0)
-			printf("%c  :- %s/", user ? ' ' : '|', group);
+		if (num == 0) {
+			if (json) {
+				printf("%s{", json_num++ ? "," : "");
+				json_key("group", group);
+				printf(",\"procs\":[");
+			} else
+				printf("%c  :- %s/", user ? ' ' : '|', group);
+		}
 		num++;
 
 		pid = atoi(chomp(buf));
@@ -528,15 +1187,25 @@ static int dump_cgroup(const char *fpath, const struct stat *sb, int tflag, stru
 		cfp = fopen(path, "r");
 		if (!cfp)
 			continue;
+		buf[0] = 0;
 		fgets(buf, sizeof(buf), cfp);
 		fclose(cfp);
 
+		if (json) {
+			printf("%s{\"pid\":%d,", procs++ ? "," : "", pid);
+			json_key("cmd", buf);
+			putchar('}');
+			continue;
+		}
+
 		printf("\n%c      :- %d %s", user ? ' ' : '|', pid, buf);
 	}
 
 err:
 	fclose(fp);
-	if (num)
+	if (num && json)
+		printf("]}");
+	else if (num)
 		printf("\r%c\n", user ? ' ' : '|');
 
 	return 0;
@@ -544,6 +1213,24 @@ err:
 
 static int show_cgroup(char *arg)
 {
+	if (json) {
+		const char *top[] = { "init", "system", "user" };
+
+		putchar('{');
+		for (size_t i = 0; i < NELEMS(top); i++) {
+			char path[64];
+
+			printf("%s\"%s\":[", i ? "," : "", top[i]);
+			snprintf(path, sizeof(path), "/sys/fs/cgroup/finit/%s", top[i]);
+			json_num = 0;
+			nftw(path, dump_cgroup, 20, 0);
+			putchar(']');
+		}
+		puts("}");
+
+		return 0;
+	}
+
 	puts("finit/");
 	puts("|- init/");
 	nftw("/sys/fs/cgroup/finit/init", dump_cgroup, 20, 0);
@@ -555,6 +1242,295 @@ static int show_cgroup(char *arg)
 	return 0;
 }
 
+static int show_pool(char *arg)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_POOL_STATS
+	};
+	char *line;
+
+	if (client_send(&rq, sizeof(rq)))
+		return 1;
+
+	strterm(rq.data, sizeof(rq.data));
+	printheader(NULL, "POOL           SIZE  SLABS  OBJECTS   USED   PEAK     ALLOCS", 0);
+	for (line = strtok(rq.data, "\n"); line; line = strtok(NULL, "\n")) {
+		char name[16];
+		size_t size;
+		unsigned int slabs, objs, used, peak;
+		unsigned long allocs;
+
+		if (sscanf(line, "%15s %zu %u %u %u %u %lu", name, &size,
+			   &slabs, &objs, &used, &peak, &allocs) != 7)
+			continue;
+
+		printf("%-12s %6zu %6u %8u %6u %6u %10lu\n", name, size,
+		       slabs, objs, used, peak, allocs);
+	}
+
+	return 0;
+}
+
+static int show_memory(char *arg)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_MEM_STATS
+	};
+	long rss = -1, peak = -1, boot = -1, trim = -1, heap = -1, avail = -1;
+	int unloaded = 0;
+	char *line;
+
+	if (client_send(&rq, sizeof(rq)))
+		return 1;
+
+	strterm(rq.data, sizeof(rq.data));
+	for (line = strtok(rq.data, "\n"); line; line = strtok(NULL, "\n")) {
+		sscanf(line, "rss %ld", &rss);
+		sscanf(line, "peak %ld", &peak);
+		sscanf(line, "boot %ld", &boot);
+		sscanf(line, "trim %ld", &trim);
+		sscanf(line, "heap %ld", &heap);
+		sscanf(line, "free %ld", &avail);
+		sscanf(line, "unloaded %d", &unloaded);
+	}
+
+	printf("Resident     : %ld kB, peak %ld kB\n", rss, peak);
+	if (boot < 0)
+		printf("Bootstrap    : not completed\n");
+	else
+		printf("Bootstrap    : %ld kB, %ld kB after trim, %d plugins unloaded\n",
+		       boot, trim, unloaded);
+	if (heap >= 0)
+		printf("Heap         : %ld kB used, %ld kB free\n", heap, avail);
+
+	return 0;
+}
+
+static int show_latency(char *arg)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_LOOP_STATS
+	};
+	unsigned long count[32], total = 0;
+	long limit[32], max = 0, prev = 0;
+	int i, num = 0;
+	char *line;
+
+	if (client_send(&rq, sizeof(rq)))
+		return 1;
+
+	strterm(rq.data, sizeof(rq.data));
+	for (line = strtok(rq.data, "\n"); line; line = strtok(NULL, "\n")) {
+		if (sscanf(line, "max %ld", &max) == 1 || num == NELEMS(count))
+			continue;
+		if (sscanf(line, "%ld %lu", &limit[num], &count[num]) != 2)
+			continue;
+		total += count[num++];
+	}
+
+	printheader(NULL, "LATENCY           COUNT       %", 0);
+	for (i = 0; i < num; i++) {
+		double pct = total ? 100.0 * count[i] / total : 0.0;
+
+		if (limit[i])
+			printf("%4ld - %4ld ms  %10lu  %5.1f\n", prev, limit[i], count[i], pct);
+		else
+			printf("  >= %4ld ms  %10lu  %5.1f\n", prev, count[i], pct);
+		prev = limit[i];
+	}
+	printf("\nWorst latency %ld ms, %lu samples\n", max, total);
+
+	return 0;
+}
+
+static int show_metrics(char *arg)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_METRICS
+	};
+	char buf[BUFSIZ];
+	ssize_t len;
+	int sd;
+
+	sd = client_stream(&rq);
+	if (-1 == sd)
+		return 1;
+
+	while ((len = read(sd, buf, sizeof(buf))) > 0)
+		fwrite(buf, len, 1, stdout);
+	close(sd);
+
+	return len < 0;
+}
+
+static int show_trace(char *arg)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_BOOT_TRACE
+	};
+	char buf[BUFSIZ];
+	ssize_t len;
+	int sd;
+
+	sd = client_stream(&rq);
+	if (-1 == sd)
+		return 1;
+
+	while ((len = read(sd, buf, sizeof(buf))) > 0)
+		fwrite(buf, len, 1, stdout);
+	close(sd);
+
+	return len < 0;
+}
+
+/*
+ * Print events from Finit as they happen, optionally only of the given
+ * kind(s): svc, cond, runlevel.  Runs until Finit closes the connection.
+ */
+static int do_events(char *arg)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_SUBSCRIBE
+	};
+	char buf[BUFSIZ], *kind;
+	ssize_t len;
+	int sd;
+
+	for (kind = strtok(arg, " "); kind; kind = strtok(NULL, " ")) {
+		if (string_match("svc", kind))
+			rq.runlevel |= INIT_EV_SVC;
+		else if (string_match("cond", kind))
+			rq.runlevel |= INIT_EV_COND;
+		else if (string_match("runlevel", kind))
+			rq.runlevel |= INIT_EV_RUNLEVEL;
+		else
+			errx(1, "Unknown event kind '%s'", kind);
+	}
+
+	sd = client_stream(&rq);
+	if (-1 == sd)
+		return 1;
+
+	if (read(sd, &rq, sizeof(rq)) != sizeof(rq) || rq.cmd != INIT_CMD_ACK) {
+		close(sd);
+		errx(1, "Finit does not support event subscription");
+	}
+
+	while ((len = read(sd, buf, sizeof(buf))) > 0) {
+		fwrite(buf, len, 1, stdout);
+		fflush(stdout);
+	}
+	close(sd);
+
+	return len < 0;
+}
+
+/*
+ * The connection is kept across the exec(), the second reply is from
+ * the new Finit when it has taken over all services.
+ */
+static int do_reexec(char *arg)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_REEXEC
+	};
+	int sd;
+
+	sd = client_stream(&rq);
+	if (-1 == sd)
+		return 1;
+
+	if (read(sd, &rq, sizeof(rq)) != sizeof(rq) || rq.cmd != INIT_CMD_ACK) {
+		close(sd);
+		if (rq.cmd == INIT_CMD_NACK && rq.data[0])
+			errx(1, "%.*s", (int)sizeof(rq.data), rq.data);
+		errx(1, "Finit does not support re-exec");
+	}
+
+	if (read(sd, &rq, sizeof(rq)) != sizeof(rq) || rq.cmd != INIT_CMD_ACK) {
+		close(sd);
+		errx(1, "Re-exec failed, check the system log");
+	}
+	close(sd);
+
+	if (verbose)
+		puts("Finit re-executed, all services kept running.");
+
+	return 0;
+}
+
+static int do_cache_build(char *arg)
+{
+	if (confcache_build(FINIT_CACHE))
+		err(1, "Failed building %s", FINIT_CACHE);
+
+	if (verbose)
+		printf("%s updated, used by Finit at next boot.\n", FINIT_CACHE);
+
+	return 0;
+}
+
+static int do_cache_verify(char *arg)
+{
+	struct confcache cc;
+	int rc;
+
+	rc = confcache_open(FINIT_CACHE, &cc);
+	if (rc) {
+		if (rc == ESTALE)
+			printf("%s is stale, run 'initctl cache build'\n", FINIT_CACHE);
+		else
+			printf("%s cannot be used: %s\n", FINIT_CACHE, strerror(rc));
+		return 1;
+	}
+
+	if (verbose) {
+		char *file;
+
+		while ((file = confcache_file(&cc))) {
+			int num = 0;
+
+			while (confcache_line(&cc))
+				num++;
+			printf("%-50s %4d lines\n", file, num);
+		}
+	}
+	confcache_close(&cc);
+
+	printf("%s is up to date\n", FINIT_CACHE);
+
+	return 0;
+}
+
+static int do_cache(char *cmd)
+{
+	int c;
+	char *arg;
+	struct command command[] = {
+		{ "build",   do_cache_build  },
+		{ "verify",  do_cache_verify },
+		{ NULL, NULL }
+	};
+
+	arg = strpbrk(cmd, " \0");
+	if (arg)
+		*arg++ = 0;
+
+	for (c = 0; command[c].cmd; c++) {
+		if (string_match(command[c].cmd, cmd))
+			return command[c].cb(arg);
+	}
+
+	return do_cache_verify(NULL);
+}
+
 static int usage(int rc)
 {
 	fprintf(stderr,
@@ -562,6 +1538,9 @@ static int usage(int rc)
 		"\n"
 		"Options:\n"
 		"  -b, --batch               Batch mode, no screen size probing\n"
+		"  -f, --follow              Follow log, new lines as they are logged\n"
+		"  -j, --json                JSON output from status, cond, ps, and utmp\n"
+		"      --kexec               Reboot using kexec, skipping firmware and boot loader\n"
 		"  -v, --verbose             Verbose output\n"
 		"  -h, --help                This help text\n"
 		"\n"
@@ -575,22 +1554,36 @@ static int usage(int rc)
 		"  disable  <CONF>           Disable  .conf in /etc/finit.d/[enabled/]\n"
 		"  touch    <CONF>           Mark     .conf in /etc/finit.d/ for reload\n"
 		"  reload                    Reload  *.conf in /etc/finit.d/ (activates changes)\n"
+		"  cache    build            Build cache of all .conf, for faster boot\n"
+		"  cache    verify           Check if cache is up to date, default\n"
 //		"  reload   <JOB|NAME>[:ID]  Reload (SIGHUP) service by job# or name\n"
 		"\n"
-		"  cond     show             Show condition status\n"
-		"  cond     dump             Dump all conditions and their status\n"
+		"  cond     show  [PREFIX]   Show condition status, or conditions in PREFIX\n"
+		"  cond     dump  [PREFIX]   Dump all conditions, or in PREFIX, and status\n"
+		"  cond     set   <COND>     Set (assert) user condition(s), usr/<COND>\n"
+		"  cond     clear <COND>     Clear (deassert) user condition(s)\n"
 		"\n"
-		"  log      [NAME]           Show ten last Finit, or NAME, messages from syslog\n"
-		"  start    <JOB|NAME>[:ID]  Start service by job# or name, with optional ID\n"
-		"  stop     <JOB|NAME>[:ID]  Stop/Pause a running service by job# or name\n"
-		"  restart  <JOB|NAME>[:ID]  Restart (stop/start) service by job# or name\n"
+		"  log      [JOB|NAME]       Show last output of service, or Finit messages\n"
+		"  start    <JOB|NAME>[:ID]  Start service(s) by job# or name, with optional ID\n"
+		"  stop     <JOB|NAME>[:ID]  Stop/Pause running service(s) by job# or name\n"
+		"  restart  <JOB|NAME>[:ID]  Restart (stop/start) service(s) by job# or name\n"
 		"  status   <JOB|NAME>[:ID]  Show service status, by job# or name\n"
 		"  status | show             Show status of services, default command\n"
+		"  state    [JOB|NAME[:ID]]  Show state of services, without asking Finit\n"
+		"  prio     <JOB|NAME> [OPT] Show or set CPU/IO scheduling, nice, OOM score\n"
 		"\n"
 		"  ps                        List processes based on cgroups\n"
+		"  top      [SEC]            Show resource usage of services, refresh every SEC\n"
+		"  pool                      Show memory pool statistics\n"
+		"  latency                   Show event loop latency histogram\n"
+		"  memory                    Show memory usage of PID 1 after bootstrap\n"
+		"  metrics                   Dump PID 1 metrics, Prometheus text format\n"
+		"  trace                     Dump boot trace, Chrome trace event JSON\n"
+		"  events   [KIND]            Follow svc, cond, and runlevel changes live\n"
+		"  reexec                    Re-exec Finit, e.g. after upgrade, keep services\n"
 		"\n"
 		"  runlevel [0-9]            Show or set runlevel: 0 halt, 6 reboot\n"
-		"  reboot                    Reboot system\n"
+		"  reboot                    Reboot system, with --kexec into the kexec kernel\n"
 		"  halt                      Halt system\n"
 		"  poweroff                  Halt and power off system\n"
 		"\n"
@@ -608,7 +1601,8 @@ static int do_help(char *arg)
 int main(int argc, char *argv[])
 {
 	int interactive = 1, c;
-	char *cmd, arg[120];
+	static char arg[INIT_FRAME_MAX];
+	char *cmd;
 	struct command command[] = {
 		{ "debug",    toggle_debug },
 		{ "help",     do_help      },
@@ -619,6 +1613,7 @@ int main(int argc, char *argv[])
 		{ "disable",  serv_disable },
 		{ "touch",    serv_touch   },
 		{ "reload",   do_reload    },
+		{ "cache",    do_cache     },
 
 		{ "cond",     do_cond      },
 
@@ -628,8 +1623,18 @@ int main(int argc, char *argv[])
 		{ "restart",  do_restart   },
 		{ "status",   show_status  },
 		{ "show",     show_status  }, /* Convenience alias */
+		{ "state",    show_state   },
+		{ "prio",     do_prio      },
 
 		{ "ps",       show_cgroup  },
+		{ "top",      show_top     },
+		{ "pool",     show_pool    },
+		{ "latency",  show_latency },
+		{ "memory",   show_memory  },
+		{ "metrics",  show_metrics },
+		{ "trace",    show_trace   },
+		{ "events",   do_events    },
+		{ "reexec",   do_reexec    },
 
 		{ "runlevel", do_runlevel  },
 		{ "reboot",   do_reboot    },
@@ -643,21 +1648,36 @@ int main(int argc, char *argv[])
 		{"batch",   0, NULL, 'b'},
 		{"help",    0, NULL, 'h'},
 		{"debug",   0, NULL, 'd'},
+		{"follow",  0, NULL, 'f'},
+		{"json",    0, NULL, 'j'},
+		{"kexec",   0, NULL, 'k'},
 		{"verbose", 0, NULL, 'v'},
 		{NULL, 0, NULL, 0}
 	};
 
 	progname(argv[0]);
-	while ((c = getopt_long(argc, argv, "bh?v", long_options, NULL)) != EOF) {
+	while ((c = getopt_long(argc, argv, "bfh?jv", long_options, NULL)) != EOF) {
 		switch(c) {
 		case 'b':
 			interactive = 0;
 			break;
 
+		case 'f':
+			follow = 1;
+			break;
+
 		case 'h':
 		case '?':
 			return usage(0);
 
+		case 'j':
+			json = 1;
+			break;
+
+		case 'k':
+			use_kexec = 1;
+			break;
+
 		case 'v':
 			verbose = 1;
 			break;
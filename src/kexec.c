@@ -0,0 +1,190 @@
+/* kexec reboot, straight into a new kernel without firmware and boot loader
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "helpers.h"
+#include "kexec.h"
+#include "log.h"
+
+#ifndef KEXEC_FILE_NO_INITRAMFS
+#define KEXEC_FILE_NO_INITRAMFS 0x00000004
+#endif
+
+/*
+ * The kexec setting in finit.conf, KERNEL [initrd:FILE] [default] [-- CMDLINE]
+ * without a CMDLINE the kernel is started with the current one.
+ */
+struct kexec_conf {
+	char kernel[PATH_MAX];
+	char initrd[PATH_MAX];
+	char cmdline[4096];
+	int  dflt;
+};
+
+static int parse(struct kexec_conf *kc)
+{
+	char buf[PATH_MAX * 2 + 64], *ptr, *tok;
+	FILE *fp;
+
+	memset(kc, 0, sizeof(*kc));
+	if (!kexec)
+		return 1;
+
+	strlcpy(buf, kexec, sizeof(buf));
+	ptr = strstr(buf, "--");
+	if (ptr) {
+		*ptr = 0;
+		strlcpy(kc->cmdline, strip_line(ptr + 2), sizeof(kc->cmdline));
+	}
+
+	for (tok = strtok(buf, " \t"); tok; tok = strtok(NULL, " \t")) {
+		if (!strncmp(tok, "initrd:", 7))
+			strlcpy(kc->initrd, &tok[7], sizeof(kc->initrd));
+		else if (!strcmp(tok, "default"))
+			kc->dflt = 1;
+		else
+			strlcpy(kc->kernel, tok, sizeof(kc->kernel));
+	}
+
+	if (!kc->kernel[0])
+		return 1;
+
+	if (!kc->cmdline[0]) {
+		fp = fopen("/proc/cmdline", "r");
+		if (fp) {
+			if (fgets(kc->cmdline, sizeof(kc->cmdline), fp))
+				chomp(kc->cmdline);
+			fclose(fp);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * kexec_check - Is a kexec reboot possible?
+ * @buf: Buffer for the reason, if not
+ * @len: Size of @buf
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if no kernel is configured, or it is missing.
+ */
+int kexec_check(char *buf, size_t len)
+{
+	struct kexec_conf kc;
+
+	if (parse(&kc)) {
+		snprintf(buf, len, "No kexec kernel in finit.conf");
+		return 1;
+	}
+
+	if (!fexist(kc.kernel) || (kc.initrd[0] && !fexist(kc.initrd))) {
+		snprintf(buf, len, "Cannot find kexec kernel or initrd");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Reboot using kexec even when not asked for it, kexec ... default */
+int kexec_default(void)
+{
+	struct kexec_conf kc;
+
+	if (parse(&kc))
+		return 0;
+
+	return kc.dflt;
+}
+
+/**
+ * kexec_prepare - Load kernel for reboot(RB_KEXEC)
+ *
+ * Called at shutdown, before file systems are unmounted.  On error the
+ * caller is expected to fall back to a regular reboot.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int kexec_prepare(void)
+{
+	struct kexec_conf kc;
+	int kfd, ifd = -1;
+	int flags = 0, rc;
+
+	if (parse(&kc)) {
+		_e("No kexec kernel configured");
+		return 1;
+	}
+
+	kfd = open(kc.kernel, O_RDONLY | O_CLOEXEC);
+	if (kfd == -1) {
+		_pe("Failed opening kexec kernel %s", kc.kernel);
+		return 1;
+	}
+
+	if (kc.initrd[0]) {
+		ifd = open(kc.initrd, O_RDONLY | O_CLOEXEC);
+		if (ifd == -1) {
+			_pe("Failed opening kexec initrd %s", kc.initrd);
+			close(kfd);
+			return 1;
+		}
+	} else {
+		flags |= KEXEC_FILE_NO_INITRAMFS;
+	}
+
+#ifdef SYS_kexec_file_load
+	rc = syscall(SYS_kexec_file_load, kfd, ifd, strlen(kc.cmdline) + 1, kc.cmdline, flags);
+#else
+	errno = ENOSYS;
+	rc = -1;
+#endif
+	if (rc)
+		_pe("Failed loading kexec kernel %s", kc.kernel);
+	else
+		_d("Loaded %s for kexec, cmdline: %s", kc.kernel, kc.cmdline);
+
+	if (ifd != -1)
+		close(ifd);
+	close(kfd);
+
+	return rc ? 1 : 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
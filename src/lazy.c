@@ -0,0 +1,391 @@
+/* On-demand start and idle-stop of services
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "cond.h"
+#include "lazy.h"
+#include "log.h"
+#include "service.h"
+
+/*
+ * Any other service running on the condition of @svc, or, unless
+ * @running, enabled and waiting for it?
+ */
+static int wanted(svc_t *svc, int running)
+{
+	char buf[MAX_COND_LEN];
+	struct cond_dep *dep;
+	struct cond *c;
+
+	c = cond_find(mkcond(svc, buf, sizeof(buf)));
+	if (!c)
+		return 0;
+
+	LIST_FOREACH(dep, &c->deps, link) {
+		if (dep->svc == svc)
+			continue;
+		if (dep->svc->pid > 0)
+			return 1;
+		if (!running && dep->svc->state == SVC_READY_STATE && svc_enabled(dep->svc))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Any established connection to one of the TCP sockets of @svc?  The
+ * daemon accepts them, so we look for the local port in the kernel's
+ * table, only done once per idle period.
+ */
+static int tcp_busy(svc_t *svc)
+{
+	static const struct {
+		const char *file;
+		int         family;
+	} tables[] = {
+		{ "/proc/net/tcp",  AF_INET  },
+		{ "/proc/net/tcp6", AF_INET6 },	/* Incl. IPv4 to dual-stack [::] */
+	};
+	unsigned int ports[SVC_MAX_SOCK];
+	int family[SVC_MAX_SOCK];
+	size_t i, j, num = 0;
+
+	for (i = 0; i < (size_t)svc_sock_num(svc); i++) {
+		struct sockaddr_storage ss;
+		socklen_t len;
+		int type;
+
+		len = sizeof(type);
+		if (getsockopt(svc->sock->fd[i], SOL_SOCKET, SO_TYPE, &type, &len) || type != SOCK_STREAM)
+			continue;
+		len = sizeof(ss);
+		if (getsockname(svc->sock->fd[i], (struct sockaddr *)&ss, &len))
+			continue;
+
+		if (ss.ss_family == AF_INET)
+			ports[num] = ntohs(((struct sockaddr_in *)&ss)->sin_port);
+		else if (ss.ss_family == AF_INET6)
+			ports[num] = ntohs(((struct sockaddr_in6 *)&ss)->sin6_port);
+		else
+			continue;
+		family[num++] = ss.ss_family;
+	}
+	if (!num)
+		return 0;
+
+	for (i = 0; i < NELEMS(tables); i++) {
+		char line[256];
+		FILE *fp;
+
+		for (j = 0; j < num; j++) {
+			if (family[j] == tables[i].family)
+				break;
+		}
+		if (j == num)
+			continue;
+
+		fp = fopen(tables[i].file, "r");
+		if (!fp)
+			continue;
+
+		while (fgets(line, sizeof(line), fp)) {
+			unsigned int port, state;
+
+			/* sl local_address rem_address st ..., header is skipped */
+			if (sscanf(line, "%*d: %*[0-9A-Fa-f]:%x %*[0-9A-Fa-f]:%*x %x", &port, &state) != 2)
+				continue;
+			if (state != 1)	/* TCP_ESTABLISHED */
+				continue;
+
+			for (j = 0; j < num; j++) {
+				if (family[j] == tables[i].family && ports[j] == port) {
+					fclose(fp);
+					return 1;
+				}
+			}
+		}
+		fclose(fp);
+	}
+
+	return 0;
+}
+
+/*
+ * The sockets are level triggered, so after the first event they are
+ * left to the daemon until the next idle check, or until it is started.
+ */
+static void sock_cb(uev_t *w, void *arg, int events)
+{
+	svc_t *svc = arg;
+	struct svc_lazy *lz = svc->lazy;
+
+	lazy_unwatch(svc);
+	if (svc->pid > 0) {
+		lz->active = 1;
+		return;
+	}
+
+	_d("%s: socket activity, starting on demand", svc->name);
+	lz->demand = 1;
+	service_schedule(svc);
+}
+
+static void watch(svc_t *svc)
+{
+	struct svc_lazy *lz = svc->lazy;
+
+	lazy_unwatch(svc);
+	for (int i = 0; i < svc_sock_num(svc); i++) {
+		if (uev_io_init(ctx, &lz->watcher[i], sock_cb, svc, svc->sock->fd[i], UEV_READ)) {
+			_pe("%s: failed watching socket %d", svc->name, i);
+			break;
+		}
+		lz->num++;
+	}
+}
+
+static void idle_cb(uev_t *w, void *arg, int events)
+{
+	svc_t *svc = arg;
+	struct svc_lazy *lz = svc->lazy;
+
+	if (svc->pid <= 0) {
+		uev_timer_stop(w);
+		return;
+	}
+	if (svc->state != SVC_RUNNING_STATE)
+		return;
+
+	if (lz->active || tcp_busy(svc) || wanted(svc, 1)) {
+		lz->active = 0;
+		if (!lz->num)
+			watch(svc);
+		return;
+	}
+
+	logit(LOG_NOTICE, "%s[%d]: idle for %d sec, stopping until next use",
+	      svc->name, svc->pid, lz->idle);
+	uev_timer_stop(w);
+	lazy_unwatch(svc);
+	lz->demand = 0;
+	service_schedule(svc);
+}
+
+/**
+ * lazy_parse - Parse idle:SEC option of a service
+ * @svc: Pointer to &svc_t
+ * @arg: Argument to idle:, or %NULL to always run @svc
+ *
+ * Without sockets the service is only started when another service
+ * waits for its condition, e.g. <pid/NAME>, or by initctl.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int lazy_parse(svc_t *svc, char *arg)
+{
+	const char *errstr;
+	int idle;
+
+	if (!arg) {
+		lazy_free(svc);
+		return 0;
+	}
+
+	idle = strtonum(arg, 1, 86400, &errstr);
+	if (errstr) {
+		logit(LOG_WARNING, "%s: invalid idle:%s, %s", svc->cmd, arg, errstr);
+		lazy_free(svc);
+		return errno = EINVAL;
+	}
+
+	/* Keep state across reloads, a running service stays running */
+	if (!svc->lazy) {
+		svc->lazy = calloc(1, sizeof(struct svc_lazy));
+		if (!svc->lazy) {
+			_pe("%s: failed allocating on-demand state", svc->cmd);
+			return errno;
+		}
+	}
+	svc->lazy->idle = idle;
+
+	return 0;
+}
+
+/**
+ * lazy_free - Release on-demand state, if any, of a service
+ * @svc: Pointer to &svc_t
+ */
+void lazy_free(svc_t *svc)
+{
+	if (!svc->lazy)
+		return;
+
+	lazy_unwatch(svc);
+	uev_timer_stop(&svc->lazy->timer);
+	free(svc->lazy);
+	svc->lazy = NULL;
+}
+
+/**
+ * lazy_hold - Check if a ready service should wait for demand
+ * @svc: Pointer to &svc_t
+ *
+ * Called by service_step() when @svc could be started.  An on-demand
+ * service that is not wanted yet is held back, with its sockets watched.
+ *
+ * Returns:
+ * Non-zero if @svc should not be started yet.
+ */
+int lazy_hold(svc_t *svc)
+{
+	struct svc_lazy *lz = svc->lazy;
+
+	if (!lz || lz->demand)
+		return 0;
+
+	if (wanted(svc, 0)) {
+		_d("%s: wanted by dependent, starting on demand", svc->name);
+		lz->demand = 1;
+		return 0;
+	}
+
+	if (!lz->num)
+		watch(svc);
+
+	return 1;
+}
+
+/**
+ * lazy_start - Start idle checks of an on-demand service
+ * @svc: Pointer to &svc_t, just started
+ */
+void lazy_start(svc_t *svc)
+{
+	struct svc_lazy *lz = svc->lazy;
+	int period;
+
+	if (!lz)
+		return;
+
+	lz->active = 0;
+	period = lz->idle * 1000;
+	uev_timer_stop(&lz->timer);
+	if (uev_timer_init(ctx, &lz->timer, idle_cb, svc, period, period))
+		_pe("%s: failed starting idle timer", svc->name);
+	watch(svc);
+}
+
+/**
+ * lazy_idle - Check if a running on-demand service should stop
+ * @svc: Pointer to &svc_t
+ *
+ * Returns:
+ * Non-zero if @svc has been idle for its idle:SEC.
+ */
+int lazy_idle(svc_t *svc)
+{
+	return svc->lazy && !svc->lazy->demand;
+}
+
+/**
+ * lazy_demand - Mark on-demand service as wanted, e.g. by initctl
+ * @svc: Pointer to &svc_t
+ */
+void lazy_demand(svc_t *svc)
+{
+	if (svc->lazy)
+		svc->lazy->demand = 1;
+}
+
+/**
+ * lazy_wake - Start on-demand services that @svc is waiting for
+ * @svc: Pointer to &svc_t, ready but with its conditions not satisfied
+ *
+ * This is the first use of the condition of an on-demand service, e.g.
+ * <pid/NAME>, by another service.
+ */
+void lazy_wake(svc_t *svc)
+{
+	svc_t *lazy, *iter = NULL;
+
+	if (!svc->num_conds)
+		return;
+
+	for (lazy = svc_iterator(&iter, 1); lazy; lazy = svc_iterator(&iter, 0)) {
+		char buf[MAX_COND_LEN];
+		struct cond *c;
+
+		if (!lazy->lazy || lazy->lazy->demand || lazy == svc)
+			continue;
+
+		c = cond_find(mkcond(lazy, buf, sizeof(buf)));
+		if (!c)
+			continue;
+
+		for (int i = 0; i < svc->num_conds; i++) {
+			if (svc->conds[i].cond != c)
+				continue;
+
+			_d("%s: wanted by %s, starting on demand", lazy->name, svc->name);
+			lazy->lazy->demand = 1;
+			service_schedule(lazy);
+			break;
+		}
+	}
+}
+
+/**
+ * lazy_unwatch - Stop watching the sockets of an on-demand service
+ * @svc: Pointer to &svc_t
+ *
+ * Called before the sockets are closed, see sock_close().
+ */
+void lazy_unwatch(svc_t *svc)
+{
+	struct svc_lazy *lz = svc->lazy;
+
+	if (!lz)
+		return;
+
+	while (lz->num > 0)
+		uev_io_stop(&lz->watcher[--lz->num]);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,62 @@
+/* On-demand start and idle-stop of services
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_LAZY_H_
+#define FINIT_LAZY_H_
+
+#include <uev/uev.h>
+#include "svc.h"
+
+/*
+ * State of a service with idle:SEC, allocated only for those.  The
+ * service is held in ready until it is wanted, by activity on one of
+ * its socket: sockets, or by a service waiting on its condition.
+ */
+struct svc_lazy {
+	int      idle;			/* sec, stop after idle this long */
+	int      demand;		/* Wanted, start, or keep running */
+	int      active;		/* Socket activity since last check */
+	uev_t    timer;			/* Idle check, while running */
+	uev_t    watcher[SVC_MAX_SOCK];
+	int      num;			/* Active watchers */
+};
+
+int  lazy_parse  (svc_t *svc, char *arg);
+void lazy_free   (svc_t *svc);
+
+int  lazy_hold   (svc_t *svc);
+void lazy_start  (svc_t *svc);
+int  lazy_idle   (svc_t *svc);
+void lazy_demand (svc_t *svc);
+void lazy_wake   (svc_t *svc);
+void lazy_unwatch(svc_t *svc);
+
+#endif /* FINIT_LAZY_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -28,6 +28,7 @@
 #include <lite/lite.h>
 
 #include "finit.h"
+#include "console.h"
 #include "log.h"
 #include "util.h"
 
@@ -154,7 +155,7 @@ void logit(int prio, const char *fmt, ...)
 
 	fp = fopen("/dev/kmsg", "w");
 	if (!fp) {
-		vfprintf(stderr, fmt, ap);
+		console_vprintf(fmt, ap);
 		goto done;
 	}
 
@@ -165,7 +166,7 @@ void logit(int prio, const char *fmt, ...)
 	if (debug) {
 		va_end(ap);
 		va_start(ap, fmt);
-		vfprintf(stderr, fmt, ap);
+		console_vprintf(fmt, ap);
 	}
 
 done:
@@ -22,23 +22,127 @@
 
 #include <config.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #define SYSLOG_NAMES
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef HAVE_ZLIB
+#include <pthread.h>
+#include <zlib.h>
+#endif
 
 static const char version_info[] = PACKAGE_NAME " v" PACKAGE_VERSION;
 
+static int    durable  = 0;	/* fsync() after each write */
+static int    interval = 1;	/* sec, max time to buffer log messages */
+static size_t bufsz    = 8192;	/* bytes, flush when buffer is full */
+
+#ifdef HAVE_ZLIB
+static pthread_t compressor;
+static int       compressing;
+#else
+static pid_t     compressor;
+#endif
 
 static int create(char *path, mode_t mode, uid_t uid, gid_t gid)
 {
 	return mknod(path, S_IFREG | mode, 0) || chown(path, uid, gid);
 }
 
+#ifdef HAVE_ZLIB
+/* Background thread, compress @arg to @arg.gz and remove @arg */
+static void *gzip_thread(void *arg)
+{
+	char *file = (char *)arg;
+	size_t len = strlen(file) + 4;
+	char gzfile[len], buf[BUFSIZ];
+	ssize_t num = -1;
+	gzFile gz;
+	int fd;
+
+	snprintf(gzfile, len, "%s.gz", file);
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		goto done;
+
+	gz = gzopen(gzfile, "wb");
+	if (!gz) {
+		close(fd);
+		goto done;
+	}
+
+	while ((num = read(fd, buf, sizeof(buf))) > 0) {
+		if (gzwrite(gz, buf, num) != num) {
+			num = -1;
+			break;
+		}
+	}
+	close(fd);
+
+	if (gzclose(gz) != Z_OK)
+		num = -1;
+	if (num)
+		remove(gzfile);
+	else
+		remove(file);
+done:
+	free(file);
+	return NULL;
+}
+#endif
+
+/*
+ * Wait for compression of the previous rotation to complete, before we
+ * age any files, or exit.
+ */
+static void gzip_wait(void)
+{
+#ifdef HAVE_ZLIB
+	if (compressing)
+		pthread_join(compressor, NULL);
+	compressing = 0;
+#else
+	if (compressor > 0)
+		waitpid(compressor, NULL, 0);
+	compressor = 0;
+#endif
+}
+
+/*
+ * Compress @file in the background, in a thread using zlib, or with a
+ * gzip process, started without a shell, if logit is built without it.
+ */
+static void gzip_start(char *file)
+{
+#ifdef HAVE_ZLIB
+	char *arg;
+
+	arg = strdup(file);
+	if (!arg)
+		return;
+
+	if (pthread_create(&compressor, NULL, gzip_thread, arg)) {
+		gzip_thread(arg);
+		return;
+	}
+	compressing = 1;
+#else
+	compressor = fork();
+	if (compressor == 0) {
+		execlp("gzip", "gzip", "-f", file, NULL);
+		_exit(1);
+	}
+#endif
+}
+
 /*
  * This function triggers a log rotates of @file when size >= @sz bytes
  * At most @num old versions are kept and by default it starts gzipping
@@ -59,6 +163,9 @@ static int logrotate(char *file, int num, off_t sz)
 			char   ofile[len];
 			char   nfile[len];
 
+			/* Compressor may still be working on .2 */
+			gzip_wait();
+
 			/* First age zipped log files */
 			for (cnt = num; cnt > 2; cnt--) {
 				snprintf(ofile, len, "%s.%d.gz", file, cnt - 1);
@@ -75,15 +182,8 @@ static int logrotate(char *file, int num, off_t sz)
 				/* May fail because ofile doesn't exist yet, ignore. */
 				(void)rename(ofile, nfile);
 
-				if (cnt == 2 && !access(nfile, F_OK)) {
-					size_t len = 5 + strlen(nfile) + 1;
-					char cmd[len];
-
-					snprintf(cmd, len, "gzip %s", nfile);
-					system(cmd);
-
-					remove(nfile);
-				}
+				if (cnt == 2 && !access(nfile, F_OK))
+					gzip_start(nfile);
 			}
 
 			if (rename(file, nfile))
@@ -99,51 +199,146 @@ static int logrotate(char *file, int num, off_t sz)
 	return 0;
 }
 
-static int checksz(FILE *fp, off_t sz)
+static time_t now(void)
 {
-	struct stat st;
+	struct timespec ts;
 
-	if (sz <= 0)
-		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	if (!fstat(fileno(fp), &st) && st.st_size > sz) {
-		fclose(fp);
-		return 1;
+	return ts.tv_sec;
+}
+
+/*
+ * Write buffered log messages to @fd.  Only complete lines, unless @all
+ * is set, so rotation happens on line boundaries.  Returns number of
+ * bytes written, -1 on error.
+ */
+static ssize_t flush(int fd, char *buf, size_t *used, int all)
+{
+	size_t len = *used, pos = 0;
+
+	if (!all) {
+		char *nl = memrchr(buf, '\n', len);
+
+		if (!nl)
+			return 0;
+		len = nl - buf + 1;
 	}
 
-	return 0;
+	while (pos < len) {
+		ssize_t num;
+
+		num = write(fd, &buf[pos], len - pos);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += num;
+	}
+
+	if (durable)
+		fsync(fd);
+
+	*used -= len;
+	memmove(buf, &buf[len], *used);
+
+	return len;
 }
 
-static int flogit(char *logfile, int num, off_t sz, char *buf, size_t len)
+/*
+ * Log to file, with log rotation when the file has grown to @sz bytes.
+ * Messages from stdin are buffered for at most @interval seconds, or
+ * until @bufsz bytes are pending, unless in @durable mode.  The size of
+ * the file is tracked with a byte counter, letting the kernel do the
+ * job of batching writes to flash.
+ */
+static int flogit(char *logfile, int num, off_t sz, char *buf)
 {
-	FILE *fp;
-
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	struct stat st;
+	size_t used = 0;
+	time_t first = 0;
+	char *pending;
+	off_t pos;
+	int fd, eof = 0;
+
+	pending = malloc(bufsz);
+	if (!pending)
+		return 1;
 reopen:
-	fp = fopen(logfile, "a");
-	if (!fp) {
+	fd = open(logfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+	if (fd == -1) {
 		syslog(LOG_ERR | LOG_PERROR, "Failed opening %s: %s", logfile, strerror(errno));
+		free(pending);
+		gzip_wait();
 		return 1;
 	}
+	pos = fstat(fd, &st) ? 0 : st.st_size;
 
 	if (buf[0]) {
-		fprintf(fp, "%s\n", buf);
-		fsync(fileno(fp));
-		if (checksz(fp, sz))
-			return logrotate(logfile, num, sz);
-	} else {
-		while ((fgets(buf, len, stdin))) {
-			fputs(buf, fp);
-			fsync(fileno(fp));
-
-			if (checksz(fp, sz)) {
-				logrotate(logfile, num, sz);
-				buf[0] = 0;
-				goto reopen;
+		size_t n = strlen(buf);
+
+		buf[n++] = '\n';
+		used = n < bufsz ? n : bufsz;
+		memcpy(pending, buf, used);
+		buf[0] = 0;
+		eof = 1;
+	}
+
+	while (!eof || used) {
+		int full, expired = 0;
+		ssize_t n;
+
+		if (!eof && used < bufsz) {
+			int timeout = -1;
+
+			if (used) {
+				timeout = (first + interval - now()) * 1000;
+				if (timeout < 0)
+					timeout = 0;
 			}
+
+			n = poll(&pfd, 1, timeout);
+			if (n > 0) {
+				n = read(STDIN_FILENO, &pending[used], bufsz - used);
+				if (n > 0) {
+					if (!used)
+						first = now();
+					used += n;
+				} else if (n == 0 || errno != EINTR)
+					eof = 1;
+			} else if (n < 0 && errno != EINTR)
+				eof = 1;
+
+			expired = used && now() - first >= interval;
+			if (!eof && !durable && !expired && used < bufsz)
+				continue;
+		}
+
+		/* Whole lines, unless at EOF, or a line is stuck */
+		full = used == bufsz;
+		n = flush(fd, pending, &used, eof);
+		if (!n && (expired || full))
+			n = flush(fd, pending, &used, 1);
+		if (n < 0) {
+			syslog(LOG_ERR | LOG_PERROR, "Failed writing %s: %s", logfile, strerror(errno));
+			break;
+		}
+		first = now();
+		pos  += n;
+
+		if (sz > 0 && pos > sz) {
+			close(fd);
+			logrotate(logfile, num, sz);
+			goto reopen;
 		}
 	}
 
-	return fclose(fp);
+	free(pending);
+	gzip_wait();
+
+	return close(fd);
 }
 
 static int logit(int level, char *buf, size_t len)
@@ -201,6 +396,9 @@ static int usage(int code)
 		"  -f FILE  File to write log messages to, instead of syslog\n"
 		"  -n SIZE  Number of bytes before rotating, default: 200 kB\n"
 		"  -r NUM   Number of rotated files to keep, default: 5\n"
+		"  -b SIZE  Buffer size for log file, default: 8 kB\n"
+		"  -i SEC   Max seconds to buffer log messages, default: 1\n"
+		"  -d       Durable, write and fsync() each line to log file\n"
 		"  -v       Show program version\n"
 		"\n"
 		"This version of logit is distributed as part of Finit.\n"
@@ -219,8 +417,18 @@ int main(int argc, char *argv[])
 	char *ident = NULL, *logfile = NULL;
 	char buf[512] = "";
 
-	while ((c = getopt(argc, argv, "f:hn:p:r:st:v")) != EOF) {
+	while ((c = getopt(argc, argv, "b:df:hi:n:p:r:st:v")) != EOF) {
 		switch (c) {
+		case 'b':
+			bufsz = atoi(optarg);
+			if (bufsz < sizeof(buf))
+				bufsz = sizeof(buf);
+			break;
+
+		case 'd':
+			durable = 1;
+			break;
+
 		case 'f':
 			logfile = optarg;
 			break;
@@ -228,6 +436,12 @@ int main(int argc, char *argv[])
 		case 'h':
 			return usage(0);
 
+		case 'i':
+			interval = atoi(optarg);
+			if (interval < 0)
+				interval = 0;
+			break;
+
 		case 'n':
 			size = atoi(optarg);
 			break;
@@ -276,7 +490,7 @@ int main(int argc, char *argv[])
 	openlog(ident, log_opts, facility);
 
 	if (logfile)
-		rc = flogit(logfile, num, size, buf, sizeof(buf));
+		rc = flogit(logfile, num, size, buf);
 	else
 		rc = logit(level, buf, sizeof(buf));
 
@@ -0,0 +1,642 @@
+/* Log multiplexer, collects service output for syslog in PID 1
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define SYSLOG_NAMES		/* facilitynames[] and prioritynames[] */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <lite/lite.h>
+#include <lite/queue.h>
+#include <uev/uev.h>
+
+#include "finit.h"
+#include "helpers.h"
+#include "private.h"
+#include "svc.h"
+
+#define LOGMUX_BATCH  32	/* Max lines sent per sendmmsg() */
+#define LOGMUX_LINE   1024	/* Max line length, longer lines are split */
+#define LOGMUX_RING   65536	/* Default size of log ring, per service */
+
+/*
+ * Last output of a service, for initctl log.  Kept in the svc_t across
+ * restarts, and referenced by each struct logmux still reading output,
+ * so it outlives both.  Clients following the log are sent new lines
+ * as they are collected, and are closed when the ring is freed.
+ */
+struct logring {
+	int    refs;
+	size_t size;
+	size_t head;		/* Next byte to write */
+	size_t len;		/* Bytes used, equals size when wrapped */
+	char  *buf;
+	TAILQ_HEAD(, logfollow) followers;
+};
+
+struct logfollow {
+	TAILQ_ENTRY(logfollow) link;
+	uev_t  watcher;
+	struct logring *ring;
+};
+
+/*
+ * One per started service with log to syslog, reads the master side of
+ * the pty the service has as stdout/stderr.  Does not reference the
+ * svc_t, which may be gone before its last output has been read.
+ */
+struct logmux {
+	TAILQ_ENTRY(logmux) link;
+	uev_t  watcher;
+	pid_t  pid;
+	struct logring *ring;
+	int    prio;		/* facility | level */
+	char   tag[32];
+	size_t len;
+	char   buf[LOGMUX_LINE];
+};
+
+static TAILQ_HEAD(, logmux) mux_list = TAILQ_HEAD_INITIALIZER(mux_list);
+static int log_sd = -1;
+
+/* Same as logit -p facility.level, default daemon.info */
+static int parse_prio(char *arg)
+{
+	char buf[sizeof(((svc_t *)0)->log.prio)];
+	int facility = LOG_DAEMON, level = LOG_INFO;
+	char *ptr;
+
+	if (!arg || !arg[0])
+		return facility | level;
+
+	strlcpy(buf, arg, sizeof(buf));
+	arg = buf;
+	ptr = strchr(arg, '.');
+	if (ptr) {
+		*ptr++ = 0;
+
+		for (int i = 0; facilitynames[i].c_name; i++) {
+			if (!strcmp(facilitynames[i].c_name, arg)) {
+				facility = facilitynames[i].c_val;
+				break;
+			}
+		}
+
+		arg = ptr;
+	}
+
+	for (int i = 0; prioritynames[i].c_name; i++) {
+		if (!strcmp(prioritynames[i].c_name, arg)) {
+			level = prioritynames[i].c_val;
+			break;
+		}
+	}
+
+	return facility | level;
+}
+
+/* Byte @n, counted from 1, backwards from the end of @ring */
+#define RING_AT(ring, n) (ring)->buf[((ring)->head + (ring)->size - (n)) % (ring)->size]
+
+static void ring_put(struct logring *ring, const char *data, size_t len)
+{
+	if (len > ring->size) {
+		data += len - ring->size;
+		len   = ring->size;
+	}
+
+	while (len > 0) {
+		size_t num = ring->size - ring->head;
+
+		if (num > len)
+			num = len;
+		memcpy(&ring->buf[ring->head], data, num);
+		ring->head = (ring->head + num) % ring->size;
+		ring->len += num;
+		data += num;
+		len  -= num;
+	}
+
+	if (ring->len > ring->size)
+		ring->len = ring->size;
+}
+
+/* Write the last @len bytes of @ring to @sd, in at most two chunks */
+static ssize_t ring_write(struct logring *ring, int sd, size_t len)
+{
+	struct iovec iov[2];
+	size_t start;
+	int num = 0;
+
+	if (len > ring->len)
+		len = ring->len;
+	if (!len)
+		return 0;
+
+	start = (ring->head + ring->size - len) % ring->size;
+	iov[num].iov_base = &ring->buf[start];
+	iov[num].iov_len  = len;
+	if (start + len > ring->size) {
+		iov[num].iov_len = ring->size - start;
+		num++;
+		iov[num].iov_base = ring->buf;
+		iov[num].iov_len  = len - iov[0].iov_len;
+	}
+
+	return writev(sd, iov, num + 1);
+}
+
+static void follow_close(struct logfollow *f)
+{
+	uev_io_stop(&f->watcher);
+	close(f->watcher.fd);
+	TAILQ_REMOVE(&f->ring->followers, f, link);
+	free(f);
+}
+
+/* Client is not expected to send anything, only to hang up */
+static void follow_cb(uev_t *w, void *arg, int events)
+{
+	follow_close((struct logfollow *)arg);
+}
+
+/* Send the last @len bytes to all followers, lines are lost if slow */
+static void ring_notify(struct logring *ring, size_t len)
+{
+	struct logfollow *f, *tmp;
+
+	TAILQ_FOREACH_SAFE(f, &ring->followers, link, tmp) {
+		if (ring_write(ring, f->watcher.fd, len) < 0 && errno != EAGAIN)
+			follow_close(f);
+	}
+}
+
+static void ring_unref(struct logring *ring)
+{
+	struct logfollow *f;
+
+	if (!ring || --ring->refs > 0)
+		return;
+
+	while ((f = TAILQ_FIRST(&ring->followers)))
+		follow_close(f);
+	free(ring->buf);
+	free(ring);
+}
+
+/* Ring of @svc, created or resized, according to log:ring:SIZE */
+static struct logring *ring_get(svc_t *svc)
+{
+	struct logring *ring = svc->log.ring;
+	size_t size = LOGMUX_RING;
+
+	if (svc->log.ring_size < 0) {
+		logmux_release(svc);
+		return NULL;
+	}
+	if (svc->log.ring_size > 0)
+		size = svc->log.ring_size;
+
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring));
+		if (!ring)
+			return NULL;
+
+		ring->refs = 1;
+		TAILQ_INIT(&ring->followers);
+		svc->log.ring = ring;
+	}
+
+	if (ring->size != size) {
+		char *buf;
+
+		buf = malloc(size);
+		if (!buf)
+			return ring->buf ? ring : NULL;
+
+		free(ring->buf);
+		ring->buf  = buf;
+		ring->size = size;
+		ring->head = ring->len = 0;
+	}
+
+	return ring;
+}
+
+/* Connect to syslogd, retried for each batch until it is up */
+static int log_connect(void)
+{
+	struct sockaddr_un sun = {
+		.sun_family = AF_UNIX,
+		.sun_path   = _PATH_LOG,
+	};
+
+	if (log_sd != -1)
+		return 0;
+
+	log_sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (log_sd == -1)
+		return -1;
+
+	if (connect(log_sd, (struct sockaddr *)&sun, sizeof(sun))) {
+		close(log_sd);
+		log_sd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Dropped if syslogd is not running, like syslog(3) */
+static void log_send(struct mmsghdr *hdr, int num)
+{
+	if (log_connect())
+		return;
+
+	if (sendmmsg(log_sd, hdr, num, MSG_DONTWAIT) < 0 && errno != EAGAIN) {
+		close(log_sd);
+		log_sd = -1;
+	}
+}
+
+/*
+ * Send all complete lines in the buffer of @mux to syslog, in batches,
+ * or also a trailing partial line if @all is set.
+ */
+static void logmux_flush(struct logmux *mux, int all)
+{
+	static char msg[LOGMUX_BATCH][LOGMUX_LINE + 64];
+	struct mmsghdr hdr[LOGMUX_BATCH];
+	struct iovec iov[LOGMUX_BATCH];
+	struct logring *ring = mux->ring;
+	char stamp[16], *line = mux->buf;
+	size_t left = mux->len, total = 0;
+	struct tm tm;
+	time_t now;
+	int num = 0;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm);
+
+	memset(hdr, 0, sizeof(hdr));
+	while (left > 0) {
+		char *nl = memchr(line, '\n', left);
+		size_t len, skip;
+		int n;
+
+		if (!nl && !all)
+			break;
+
+		len  = nl ? (size_t)(nl - line) : left;
+		skip = nl ? len + 1 : len;
+		while (len > 0 && line[len - 1] == '\r')
+			len--;
+
+		if (len > 0) {
+			n = snprintf(msg[num], sizeof(msg[num]), "<%d>%s %s[%d]: %.*s",
+				     mux->prio, stamp, mux->tag, mux->pid, (int)len, line);
+			if (n >= (int)sizeof(msg[num]))
+				n = sizeof(msg[num]) - 1;
+
+			/* Ring has the same line, without <prio> */
+			if (ring) {
+				char *ptr = strchr(msg[num], '>') + 1;
+				size_t sz = n - (ptr - msg[num]);
+
+				ring_put(ring, ptr, sz);
+				ring_put(ring, "\n", 1);
+				total += sz + 1;
+			}
+
+			iov[num].iov_base = msg[num];
+			iov[num].iov_len  = n;
+			hdr[num].msg_hdr.msg_iov    = &iov[num];
+			hdr[num].msg_hdr.msg_iovlen = 1;
+			if (++num == LOGMUX_BATCH) {
+				log_send(hdr, num);
+				num = 0;
+			}
+		}
+
+		line += skip;
+		left -= skip;
+	}
+
+	if (num)
+		log_send(hdr, num);
+	if (ring && total)
+		ring_notify(ring, total);
+
+	memmove(mux->buf, line, left);
+	mux->len = left;
+}
+
+static void logmux_close(struct logmux *mux)
+{
+	logmux_flush(mux, 1);
+	uev_io_stop(&mux->watcher);
+	close(mux->watcher.fd);
+	TAILQ_REMOVE(&mux_list, mux, link);
+	ring_unref(mux->ring);
+	free(mux);
+}
+
+static void logmux_cb(uev_t *w, void *arg, int events)
+{
+	struct logmux *mux = (struct logmux *)arg;
+	ssize_t len;
+
+	if (UEV_ERROR == events)
+		goto close;
+
+	len = read(w->fd, &mux->buf[mux->len], sizeof(mux->buf) - mux->len);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0)		/* EIO when all slaves are closed */
+		goto close;
+
+	mux->len += len;
+	logmux_flush(mux, mux->len == sizeof(mux->buf));
+	return;
+close:
+	logmux_close(mux);
+}
+
+/* Log as @svc, to its ring, from now on */
+static void logmux_add(struct logmux *m, svc_t *svc)
+{
+	m->ring = ring_get(svc);
+	if (m->ring)
+		m->ring->refs++;
+	m->prio = parse_prio(svc->log.prio);
+	strlcpy(m->tag, svc->log.ident[0] ? svc->log.ident : basename(svc->cmd), sizeof(m->tag));
+	TAILQ_INSERT_TAIL(&mux_list, m, link);
+}
+
+/**
+ * logmux_open - Set up log collection for a service about to start
+ * @svc: Pointer to &svc_t, with log to syslog
+ * @mux: Handle, for logmux_pid() when the PID is known
+ *
+ * Opens a pty, since a pty is not buffered like a pipe, with the master
+ * side read by Finit and the slave side for the service's stdout and
+ * stderr.  Replaces one logit process per service.
+ *
+ * Returns:
+ * Slave descriptor, or -1 on error, in which case the caller falls back
+ * to the logit tool.
+ */
+int logmux_open(svc_t *svc, struct logmux **mux)
+{
+	struct termios term;
+	struct logmux *m;
+	char *name;
+	int fd, sd;
+
+	if (!ctx)
+		return -1;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return -1;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+		goto error;
+	if (grantpt(fd) || unlockpt(fd) || !(name = ptsname(fd)))
+		goto fail;
+
+	sd = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (sd == -1)
+		goto fail;
+
+	/* No \r\n translation or echo */
+	if (!tcgetattr(sd, &term)) {
+		cfmakeraw(&term);
+		tcsetattr(sd, TCSANOW, &term);
+	}
+
+	if (uev_io_init(ctx, &m->watcher, logmux_cb, m, fd, UEV_READ)) {
+		close(sd);
+		goto fail;
+	}
+
+	logmux_add(m, svc);
+	*mux = m;
+
+	return sd;
+fail:
+	close(fd);
+error:
+	free(m);
+	return -1;
+}
+
+/**
+ * logmux_pid - Set PID to tag log messages with
+ * @mux: Handle from logmux_open()
+ * @pid: PID of service
+ */
+void logmux_pid(struct logmux *mux, pid_t pid)
+{
+	if (mux)
+		mux->pid = pid;
+}
+
+/**
+ * logmux_save - Keep log collection across a re-exec of Finit
+ * @fd: State file, see reexec.c
+ *
+ * Sends what has been read so far, and writes one "mux PID FD" line per
+ * pty, with %FD_CLOEXEC cleared so the new Finit can logmux_adopt() it.
+ * The ring contents are not kept.
+ */
+void logmux_save(int fd)
+{
+	struct logmux *mux;
+
+	TAILQ_FOREACH(mux, &mux_list, link) {
+		logmux_flush(mux, 1);
+		if (fcntl(mux->watcher.fd, F_SETFD, 0))
+			continue;
+		dprintf(fd, "mux %d %d\n", mux->pid, mux->watcher.fd);
+	}
+}
+
+/**
+ * logmux_adopt - Resume log collection after a re-exec of Finit
+ * @svc: Pointer to &svc_t of the running service
+ * @pid: PID of the service, to tag log messages with
+ * @fd:  Master side of the pty, from logmux_save()
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, in which case @fd is not closed.
+ */
+int logmux_adopt(svc_t *svc, pid_t pid, int fd)
+{
+	struct logmux *m;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return -1;
+
+	if (uev_io_init(ctx, &m->watcher, logmux_cb, m, fd, UEV_READ)) {
+		free(m);
+		return -1;
+	}
+
+	m->pid = pid;
+	logmux_add(m, svc);
+
+	return 0;
+}
+
+/**
+ * logmux_ring - Log ring of a service
+ * @svc: Pointer to &svc_t
+ *
+ * Returns:
+ * The ring, or %NULL if @svc has not logged to syslog since it was
+ * registered, or has log:ring:0.
+ */
+struct logring *logmux_ring(svc_t *svc)
+{
+	return svc->log.ring;
+}
+
+/**
+ * logmux_tail - Send the last lines of a log ring to a client
+ * @ring:  Log ring from logmux_ring()
+ * @sd:    Client socket
+ * @lines: Number of lines, or zero for all
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error writing to @sd.
+ */
+int logmux_tail(struct logring *ring, int sd, int lines)
+{
+	size_t len, i;
+
+	/* Each line ends with \n, count them backwards from the end */
+	len = ring->len;
+	for (i = 2; lines > 0 && i <= ring->len; i++) {
+		if (RING_AT(ring, i) == '\n' && --lines == 0) {
+			len = i - 1;
+			break;
+		}
+	}
+
+	/* Skip any partial line overwritten when the ring wrapped */
+	if (len == ring->size) {
+		while (len > 0 && RING_AT(ring, len) != '\n')
+			len--;
+		if (len > 0)
+			len--;
+	}
+
+	return ring_write(ring, sd, len) != (ssize_t)len;
+}
+
+/**
+ * logmux_follow - Send new lines in a log ring to a client
+ * @ring: Log ring from logmux_ring()
+ * @sd:   Client socket, owned by the ring on success
+ *
+ * The client is closed when it hangs up or when the ring is freed,
+ * i.e. when the service is removed.  Lines are dropped for a client
+ * that does not keep up, Finit never blocks on it.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, @sd is then not touched.
+ */
+int logmux_follow(struct logring *ring, int sd)
+{
+	struct logfollow *f;
+	int flags;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return 1;
+
+	flags = fcntl(sd, F_GETFL);
+	if (flags == -1 || fcntl(sd, F_SETFL, flags | O_NONBLOCK) ||
+	    fcntl(sd, F_SETFD, FD_CLOEXEC) ||
+	    uev_io_init(ctx, &f->watcher, follow_cb, f, sd, UEV_READ)) {
+		free(f);
+		return 1;
+	}
+
+	f->ring = ring;
+	TAILQ_INSERT_TAIL(&ring->followers, f, link);
+
+	return 0;
+}
+
+/**
+ * logmux_release - Drop the log ring of a service being removed
+ * @svc: Pointer to &svc_t
+ *
+ * The ring is freed when the last output of @svc has been collected.
+ */
+void logmux_release(svc_t *svc)
+{
+	ring_unref(svc->log.ring);
+	svc->log.ring = NULL;
+}
+
+/**
+ * logmux_exit - Flush and close all log collection, at shutdown
+ *
+ * Returns:
+ * POSIX OK(0).
+ */
+int logmux_exit(void)
+{
+	struct logmux *mux;
+
+	while ((mux = TAILQ_FIRST(&mux_list)))
+		logmux_close(mux);
+
+	if (log_sd != -1)
+		close(log_sd);
+	log_sd = -1;
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,201 @@
+/* Event loop and hot path metrics of PID 1
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "helpers.h"
+#include "metrics.h"
+
+#define METRIC_BUCKETS 32
+
+/* Time spent in one event loop callback, by name */
+struct metric {
+	struct metric *next;
+	char          *name;
+	unsigned long  calls;
+	uint64_t       total;	/* nsec */
+	uint64_t       max;	/* nsec */
+};
+
+static struct metric *metrics[METRIC_BUCKETS];
+static unsigned long  counters[METRIC_COUNTERS];
+
+static const char *counter_name[METRIC_COUNTERS] = {
+	[METRIC_FORK]       = "forks",
+	[METRIC_SPAWN]      = "service_starts",
+	[METRIC_COND_SET]   = "cond_set",
+	[METRIC_COND_CLEAR] = "cond_clear",
+};
+
+static const char *counter_help[METRIC_COUNTERS] = {
+	[METRIC_FORK]       = "Processes forked by PID 1",
+	[METRIC_SPAWN]      = "Services, tasks and run commands started",
+	[METRIC_COND_SET]   = "Conditions asserted",
+	[METRIC_COND_CLEAR] = "Conditions deasserted",
+};
+
+static unsigned int hash(const char *name)
+{
+	unsigned int h = 5381;
+
+	while (*name)
+		h = h * 33 + *name++;
+
+	return h % METRIC_BUCKETS;
+}
+
+static struct metric *find(const char *name)
+{
+	unsigned int key = hash(name);
+	struct metric *m;
+
+	for (m = metrics[key]; m; m = m->next) {
+		if (!strcmp(m->name, name))
+			return m;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+	m->name = strdup(name);
+	if (!m->name) {
+		free(m);
+		return NULL;
+	}
+
+	m->next = metrics[key];
+	metrics[key] = m;
+
+	return m;
+}
+
+/**
+ * metric_start - Start timing a callback
+ *
+ * Returns:
+ * Current monotonic time, in nsec, to pass to metric_stop().
+ */
+uint64_t metric_start(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * metric_stop - Account time spent in a callback
+ * @name:  Name of callback, e.g. "api" or "netlink.so"
+ * @start: Time from metric_start()
+ */
+void metric_stop(const char *name, uint64_t start)
+{
+	uint64_t spent = metric_start() - start;
+	struct metric *m;
+
+	m = find(name);
+	if (!m)
+		return;
+
+	m->calls++;
+	m->total += spent;
+	if (spent > m->max)
+		m->max = spent;
+}
+
+/**
+ * metric_inc - Count a hot path event
+ * @counter: One of %METRIC_FORK, %METRIC_SPAWN, ...
+ */
+void metric_inc(int counter)
+{
+	if (counter < 0 || counter >= METRIC_COUNTERS)
+		return;
+
+	counters[counter]++;
+}
+
+static int dump_callbacks(int sd, const char *metric, const char *type, const char *help, int field)
+{
+	if (dprintf(sd, "# HELP finit_callback_%s %s\n# TYPE finit_callback_%s %s\n",
+		    metric, help, metric, type) < 0)
+		return 1;
+
+	for (int i = 0; i < METRIC_BUCKETS; i++) {
+		struct metric *m;
+
+		for (m = metrics[i]; m; m = m->next) {
+			int rc;
+
+			if (field == 0)
+				rc = dprintf(sd, "finit_callback_%s{callback=\"%s\"} %lu\n",
+					     metric, m->name, m->calls);
+			else
+				rc = dprintf(sd, "finit_callback_%s{callback=\"%s\"} %.9f\n",
+					     metric, m->name, (field == 1 ? m->total : m->max) / 1e9);
+			if (rc < 0)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * metric_dump - Send all metrics, Prometheus text exposition format
+ * @sd: Socket or file descriptor to write to
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error writing to @sd.
+ */
+int metric_dump(int sd)
+{
+	if (dump_callbacks(sd, "calls_total", "counter", "Number of calls per event loop callback", 0) ||
+	    dump_callbacks(sd, "seconds_total", "counter", "Time spent per event loop callback", 1) ||
+	    dump_callbacks(sd, "max_seconds", "gauge", "Longest single call per event loop callback", 2))
+		return 1;
+
+	for (int i = 0; i < METRIC_COUNTERS; i++) {
+		if (dprintf(sd, "# HELP finit_%s_total %s\n# TYPE finit_%s_total counter\n"
+			    "finit_%s_total %lu\n", counter_name[i], counter_help[i],
+			    counter_name[i], counter_name[i], counters[i]) < 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -21,9 +21,60 @@
  * THE SOFTWARE.
  */
 
+#include "config.h"		/* Generated by configure script */
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_FSTAB_H
+#include <fstab.h>
+#endif
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
-#include <mntent.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "cond.h"
+#include "helpers.h"
+#include "metrics.h"
+#include "mount.h"
+#include "sig.h"
+#include "util.h"
+
+/*
+ * A fsck or mount job per /etc/fstab entry.  The key is what jobs that
+ * must not run at the same time have in common: the physical disk for
+ * fsck.  Mounts are ordered on their mount point and source, and the
+ * directories of an overlay, see fs_depends().
+ */
+struct fs_job {
+	pid_t pid;
+	int   state;		/* FS_PENDING, FS_RUNNING, FS_DONE */
+	int   status;
+	int   pass;
+	int   nofail;
+	FILE *out;		/* Output of fsck/mount, shown on failure */
+	char *opts;		/* Mount options, only for mount jobs */
+	char  type[32];
+	char  spec[PATH_MAX];
+	char  file[PATH_MAX];
+	char  key[PATH_MAX];
+};
+
+#define FS_PENDING 0
+#define FS_RUNNING 1
+#define FS_DONE    2
+
+static struct fs_job *mnt;
+static int            mnt_num;
 
 /*
  * SysV init on Debian/Ubuntu skips these protected mount points
@@ -59,47 +110,814 @@ static int is_protected(char *dir)
 	return 0;
 }
 
-static struct mntent *iterator(char *fstab)
+/*
+ * A mount from /proc/self/mountinfo, for unmounting at shutdown.  The
+ * pending counter is mounts below it still mounted, it is unmounted
+ * when that reaches zero.
+ */
+struct fs_node {
+	int   id;
+	int   parent_id;
+	int   parent;		/* Index in tree, or -1 */
+	int   pending;
+	int   state;		/* FS_PENDING, FS_RUNNING, FS_DONE */
+	pid_t pid;
+	long  start;		/* msec, CLOCK_MONOTONIC */
+	char  type[32];
+	char  dir[PATH_MAX];
+};
+
+#define UMOUNT_TIMEOUT 5000	/* msec, per mount, then detached */
+
+static long msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Space, tab, newline and backslash are \ooo in mountinfo */
+static void unescape(char *str)
 {
-	static FILE *fp = NULL;
-	static struct mntent *mnt;
+	char *src = str, *dst = str;
 
-	if (!fp && fstab) {
-		fp = setmntent(fstab, "r");
-		if (!fp)
-			return NULL;
+	while (*src) {
+		if (src[0] == '\\' && src[1] >= '0' && src[1] <= '3' &&
+		    src[2] >= '0' && src[2] <= '7' && src[3] >= '0' && src[3] <= '7') {
+			*dst++ = (src[1] - '0') * 64 + (src[2] - '0') * 8 + (src[3] - '0');
+			src += 4;
+		} else {
+			*dst++ = *src++;
+		}
 	}
+	*dst = 0;
+}
 
-	while ((mnt = getmntent(fp))) {
-		if (is_protected(mnt->mnt_dir))
+/* Read all mounts, linked to their parent, returns number of mounts */
+static int fs_tree(struct fs_node **tree)
+{
+	struct fs_node *nodes = NULL, *node;
+	char *line = NULL, *sep;
+	size_t len = 0;
+	int num = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/mountinfo", "r");
+	if (!fp)
+		return 0;
+
+	while (getline(&line, &len, fp) > 0) {
+		char dir[PATH_MAX];
+		int id, parent;
+		void *ptr;
+
+		if (sscanf(line, "%d %d %*s %*s %4095s", &id, &parent, dir) != 3)
+			continue;
+		sep = strstr(line, " - ");
+		if (!sep)
 			continue;
 
-		return mnt;
+		ptr = realloc(nodes, (num + 1) * sizeof(*nodes));
+		if (!ptr)
+			break;
+		nodes = ptr;
+
+		node = &nodes[num++];
+		memset(node, 0, sizeof(*node));
+		node->id        = id;
+		node->parent_id = parent;
+		node->parent    = -1;
+		unescape(dir);
+		strlcpy(node->dir, dir, sizeof(node->dir));
+		sscanf(sep + 3, "%31s", node->type);
 	}
+	free(line);
+	fclose(fp);
 
-	endmntent(fp);
-	fp = NULL;
+	for (int i = 0; i < num; i++) {
+		for (int j = 0; j < num; j++) {
+			if (j == i || nodes[j].id != nodes[i].parent_id)
+				continue;
 
-	return NULL;
+			nodes[i].parent = j;
+			nodes[j].pending++;
+			break;
+		}
+	}
+
+	*tree = nodes;
+	return num;
 }
 
-void unmount_tmpfs(void)
+/* Sync and unmount in a child, so slow disks can be unmounted in parallel */
+static pid_t fs_umount_one(struct fs_node *node)
 {
-	struct mntent *mnt;
+	pid_t pid;
+	int fd;
+
+	pid = fork();
+	if (pid)
+		return pid;
 
-	while ((mnt = iterator("/proc/mounts"))) {
-		if (!strcmp("tmpfs", mnt->mnt_fsname))
-			umount(mnt->mnt_dir);
+	fd = open(node->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd != -1) {
+		syncfs(fd);
+		close(fd);
 	}
+
+	_exit(umount(node->dir) ? 1 : 0);
+}
+
+static void fs_umount_done(struct fs_node *tree, struct fs_node *node, int status)
+{
+	if (status)
+		_d("Failed unmounting %s", node->dir);
+
+	node->state = FS_DONE;
+	if (node->parent >= 0)
+		tree[node->parent].pending--;
+}
+
+/*
+ * Unmount all mounts that are not protected and match @filter, leaves
+ * first.  Every mount with nothing left mounted below it is unmounted
+ * at the same time, in a child of its own, so independent subtrees do
+ * not wait for each other.  Mounts that are not unmounted in time are
+ * detached, and any mount with a protected mount below it is left.
+ */
+static void fs_umount(int (*filter)(struct fs_node *))
+{
+	struct fs_node *tree, *node;
+	int num, running = 0;
+	int status;
+	pid_t pid;
+
+	num = fs_tree(&tree);
+	if (!num)
+		return;
+
+	for (int i = 0; i < num; i++) {
+		node = &tree[i];
+		if (is_protected(node->dir) || (filter && !filter(node)))
+			node->state = FS_DONE; /* Still counted in parent */
+	}
+
+	while (1) {
+		for (int i = 0; i < num; i++) {
+			node = &tree[i];
+			if (node->state != FS_PENDING || node->pending)
+				continue;
+
+			node->pid = fs_umount_one(node);
+			if (node->pid == -1) {
+				fs_umount_done(tree, node, umount(node->dir));
+				i = -1;	/* May have freed a parent, start over */
+				continue;
+			}
+
+			node->state = FS_RUNNING;
+			node->start = msec();
+			running++;
+		}
+
+		if (!running)
+			break;
+
+		pid = waitpid(-1, &status, WNOHANG);
+		if (pid > 0) {
+			for (int i = 0; i < num; i++) {
+				node = &tree[i];
+				if (node->state != FS_RUNNING || node->pid != pid)
+					continue;
+
+				fs_umount_done(tree, node, !WIFEXITED(status) || WEXITSTATUS(status));
+				running--;
+				break;
+			}
+			continue;
+		}
+
+		for (int i = 0; i < num; i++) {
+			node = &tree[i];
+			if (node->state != FS_RUNNING || msec() - node->start < UMOUNT_TIMEOUT)
+				continue;
+
+			logit(LOG_WARNING, "Timeout unmounting %s, detaching it", node->dir);
+			kill(node->pid, SIGKILL);
+			fs_umount_done(tree, node, umount2(node->dir, MNT_DETACH));
+			running--;
+		}
+
+		poll(NULL, 0, 10);
+	}
+
+	free(tree);
+}
+
+static int is_tmpfs(struct fs_node *node)
+{
+	return !strcmp(node->type, "tmpfs");
+}
+
+void unmount_tmpfs(void)
+{
+	fs_umount(is_tmpfs);
 }
 
 void unmount_regular(void)
 {
-	struct mntent *mnt;
+	fs_umount(NULL);
+}
+
+/*
+ * We sit on / so it cannot be unmounted, remount it read-only instead.
+ * It may still be busy for a short while after the last writer exited.
+ */
+void unmount_root(void)
+{
+	int retry = 10;
+
+	sync();
+	while (mount(NULL, "/", NULL, MS_REMOUNT | MS_RDONLY, NULL)) {
+		if (errno != EBUSY || !retry--) {
+			_pe("Failed remounting / read-only");
+			break;
+		}
+		poll(NULL, 0, 100);
+	}
+}
+
+/*
+ * Find the whole disk a block device lives on.  For partitions the
+ * sysfs directory of the disk is the parent of the partition's, e.g.
+ * /sys/devices/.../block/sda/sda1.  Devices we cannot resolve get the
+ * spec as their key, i.e., they are assumed to be on a disk of their
+ * own.
+ */
+static void fs_disk(const char *spec, char *key, size_t len)
+{
+	const char *dev = spec;
+	char path[PATH_MAX], real[PATH_MAX];
+	struct stat st;
+	char *ptr;
+
+	strlcpy(key, spec, len);
+
+	if (string_match(spec, "UUID=")) {
+		snprintf(path, sizeof(path), "/dev/disk/by-uuid/%s", &spec[5]);
+		dev = path;
+	} else if (string_match(spec, "LABEL=")) {
+		snprintf(path, sizeof(path), "/dev/disk/by-label/%s", &spec[6]);
+		dev = path;
+	}
+
+	if (stat(dev, &st) || !S_ISBLK(st.st_mode))
+		return;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	if (!realpath(path, real))
+		return;
+
+	snprintf(path, sizeof(path), "%s/partition", real);
+	if (fexist(path)) {
+		ptr = strrchr(real, '/');
+		if (ptr)
+			*ptr = 0;
+	}
+
+	strlcpy(key, real, len);
+}
+
+/*
+ * Like run_interactive(), but without waiting for the child.  Output
+ * is saved in a tempfile, the progress line printed by the caller
+ * covers all jobs, and fs_output() shows the output of failed jobs
+ * after it.
+ */
+static pid_t fs_spawn(struct fs_job *job, char *args[])
+{
+	pid_t pid;
+	int fd;
+
+	if (!log_is_debug())
+		job->out = tempfile();
+
+	metric_inc(METRIC_FORK);
+	pid = fork();
+	if (pid)
+		return pid;
+
+	sig_unblock();
+	setsid();
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd != -1) {
+		dup2(fd, STDIN_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+	if (job->out) {
+		dup2(fileno(job->out), STDOUT_FILENO);
+		dup2(fileno(job->out), STDERR_FILENO);
+	}
+
+	execvp(args[0], args);
+	_exit(1);
+}
+
+/* After [FAIL], like run_interactive(), dump output of failed job */
+static void fs_output(struct fs_job *job, int fail)
+{
+	char buf[LINE_SIZE];
+	size_t len;
+
+	if (!job->out)
+		return;
+
+	if (fail) {
+		rewind(job->out);
+		while ((len = fread(buf, 1, sizeof(buf), job->out)) > 0) {
+			if (fwrite(buf, 1, len, stderr) != len)
+				break;
+		}
+	}
+
+	fclose(job->out);
+	job->out = NULL;
+}
+
+static struct fs_job *fs_find(struct fs_job *jobs, int num, pid_t pid)
+{
+	for (int i = 0; i < num; i++) {
+		if (jobs[i].state == FS_RUNNING && jobs[i].pid == pid)
+			return &jobs[i];
+	}
+
+	return NULL;
+}
+
+/* Wait for any of the running jobs, returns it or NULL if none left */
+static struct fs_job *fs_wait(struct fs_job *jobs, int num)
+{
+	struct fs_job *job;
+	int status;
+	pid_t pid;
+
+	while (1) {
+		pid = waitpid(-1, &status, 0);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			return NULL;
+		}
+
+		job = fs_find(jobs, num, pid);
+		if (!job)
+			continue;
+
+		job->state  = FS_DONE;
+		job->status = status;
+
+		return job;
+	}
+}
+
+static int fs_status(struct fs_job *job)
+{
+	if (job->pid == -1 || !WIFEXITED(job->status))
+		return 1;
+
+	return WEXITSTATUS(job->status);
+}
+
+/* Add a job for the current fstab entry */
+static struct fs_job *fs_add(struct fs_job **jobs, int *num, struct fstab *fs)
+{
+	struct fs_job *job;
+
+	job = realloc(*jobs, (*num + 1) * sizeof(struct fs_job));
+	if (!job) {
+		_pe("Failed allocating job for %s", fs->fs_file);
+		return NULL;
+	}
+	*jobs = job;
+
+	job = &(*jobs)[(*num)++];
+	memset(job, 0, sizeof(*job));
+	job->pass = fs->fs_passno;
+	strlcpy(job->spec, fs->fs_spec, sizeof(job->spec));
+	strlcpy(job->file, fs->fs_file, sizeof(job->file));
+
+	return job;
+}
+
+/*
+ * Check one fsck pass, at most one fsck per disk at a time, since
+ * parallel checks on the same spindle only make the disk head seek
+ * between them.  Returns the sum of all fsck exit codes.
+ */
+static int fs_check_pass(struct fs_job *jobs, int num, int pass)
+{
+	struct fs_job *job;
+	int rc = 0;
+
+	while (1) {
+		int busy = 0;
+
+		for (int i = 0; i < num; i++) {
+			char *args[] = { "fsck", "-a", jobs[i].spec, NULL };
+			int j;
+
+			if (jobs[i].pass != pass || jobs[i].state != FS_PENDING)
+				continue;
+
+			for (j = 0; j < num; j++) {
+				if (jobs[j].state == FS_RUNNING && !strcmp(jobs[j].key, jobs[i].key))
+					break;
+			}
+			if (j < num)
+				continue;
+
+			_d("Checking %s on %s", jobs[i].spec, jobs[i].key);
+			jobs[i].pid   = fs_spawn(&jobs[i], args);
+			jobs[i].state = FS_RUNNING;
+			if (jobs[i].pid == -1) {
+				_pe("Failed starting fsck of %s", jobs[i].spec);
+				jobs[i].state = FS_DONE;
+				rc++;
+			}
+		}
+
+		for (int i = 0; i < num; i++)
+			busy += jobs[i].state == FS_RUNNING;
+		if (!busy)
+			break;
+
+		job = fs_wait(jobs, num);
+		if (!job)
+			break;
+
+		if (fs_status(job)) {
+			_d("fsck of %s failed, exit code %d", job->spec, fs_status(job));
+			rc += fs_status(job);
+		}
+	}
+
+	return rc;
+}
+
+/**
+ * fs_check - Check all filesystems in /etc/fstab with a fs_passno > 0
+ *
+ * Filesystems in the same pass are checked in parallel, except when on
+ * the same disk.  Like fsck -A, the next pass is started only when the
+ * previous is done, and the remaining passes are skipped on failure.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if fsck failed on any of the filesystems.
+ */
+int fs_check(void)
+{
+	struct fs_job *jobs = NULL;
+	struct fstab *fs;
+	int num = 0;
+	int rc = 0;
+
+	if (!setfsent()) {
+		_pe("Failed opening fstab");
+		return 1;
+	}
+
+	while ((fs = getfsent())) {
+		struct fs_job *job;
+		struct stat st;
+
+		if (fs->fs_passno < 1 || fs->fs_passno > 9)
+			continue;
+
+		errno = 0;
+		if (stat(fs->fs_spec, &st) || !S_ISBLK(st.st_mode)) {
+			if (!string_match(fs->fs_spec, "UUID=") && !string_match(fs->fs_spec, "LABEL=")) {
+				_d("Cannot fsck %s, not a block device: %s", fs->fs_spec, strerror(errno));
+				continue;
+			}
+		}
+
+		if (ismnt("/proc/mounts", fs->fs_file, "rw")) {
+			_d("Skipping fsck of %s, already mounted rw on %s.", fs->fs_spec, fs->fs_file);
+			continue;
+		}
+
+		job = fs_add(&jobs, &num, fs);
+		if (!job)
+			break;
+
+		fs_disk(job->spec, job->key, sizeof(job->key));
+	}
+	endfsent();
+
+	for (int pass = 1; pass < 10 && !rc; pass++) {
+		char desc[32];
+		int cnt = 0;
+
+		for (int i = 0; i < num; i++)
+			cnt += jobs[i].pass == pass;
+		if (!cnt)
+			continue;
+
+		snprintf(desc, sizeof(desc), "filesystems, pass %d", pass);
+		print_desc("Checking ", desc);
+		rc = print_result(fs_check_pass(jobs, num, pass));
+
+		for (int i = 0; i < num; i++) {
+			if (jobs[i].pass == pass)
+				fs_output(&jobs[i], fs_status(&jobs[i]));
+		}
+	}
+
+	if (jobs)
+		free(jobs);
+
+	return rc;
+}
+
+/* The mount/ condition for a mount point, mount/var/log for /var/log */
+static void fs_cond(struct fs_job *job)
+{
+	char cond[PATH_MAX + 8];
+
+	snprintf(cond, sizeof(cond), "mount/%s", &job->file[1]);
+	cond_set_oneshot(cond);
+}
+
+/* Is @path @dir, or below it? */
+static int fs_under(const char *path, const char *dir)
+{
+	size_t len = strlen(dir);
+
+	if (len < 2 || strncmp(path, dir, len))
+		return 0;
+
+	return path[len] == 0 || path[len] == '/';
+}
+
+/* Any of the lowerdir=, upperdir= or workdir= of an overlay below @dir? */
+static int fs_overlay_under(const char *opts, const char *dir)
+{
+	char buf[PATH_MAX], *opt, *ptr = NULL;
+
+	strlcpy(buf, opts, sizeof(buf));
+	for (opt = strtok_r(buf, ",", &ptr); opt; opt = strtok_r(NULL, ",", &ptr)) {
+		char *path, *pos = NULL;
+
+		if (!string_match(opt, "lowerdir=") && !string_match(opt, "upperdir=") &&
+		    !string_match(opt, "workdir="))
+			continue;
+
+		for (path = strtok_r(strchr(opt, '=') + 1, ":", &pos); path; path = strtok_r(NULL, ":", &pos)) {
+			if (fs_under(path, dir))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Must @job wait for @other to mount first?  Yes, if it is mounted on a
+ * directory, or its source is a directory, on the file system of @other,
+ * e.g., a bind mount or overlay, or if they are mounted on the same mount
+ * point and @other is before @job in /etc/fstab.
+ */
+static int fs_depends(struct fs_job *job, struct fs_job *other)
+{
+	if (job == other)
+		return 0;
+
+	if (!strcmp(job->file, other->file))
+		return other < job;
+
+	if (fs_under(job->file, other->file))
+		return 1;
+
+	if (job->spec[0] == '/' && fs_under(job->spec, other->file))
+		return 1;
+
+	if (!strcmp(job->type, "overlay") && job->opts && fs_overlay_under(job->opts, other->file))
+		return 1;
+
+	return 0;
+}
+
+/* Does @job have to wait for any of the other jobs to mount first? */
+static int fs_blocked(struct fs_job *job)
+{
+	for (int i = 0; i < mnt_num; i++) {
+		if (mnt[i].state != FS_DONE && fs_depends(job, &mnt[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* More than one entry in /etc/fstab for the mount point of @job? */
+static int fs_stacked(struct fs_job *job)
+{
+	for (int i = 0; i < mnt_num; i++) {
+		if (&mnt[i] != job && !strcmp(mnt[i].file, job->file))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Mount by mount point, like mount -a, so mount(8) reads the rest from
+ * /etc/fstab.  Except when stacking mounts on the same mount point, then
+ * it would pick the same entry each time.
+ */
+static void fs_mount_start(struct fs_job *job)
+{
+	char *args[] = { "mount", "-n", job->file, NULL, NULL, NULL, NULL, NULL, NULL };
+
+	if (fs_stacked(job) && job->opts) {
+		char *stacked[] = { "mount", "-n", "-t", job->type, "-o", job->opts, job->spec, job->file, NULL };
 
-	while ((mnt = iterator("/proc/mounts"))) {
-		umount(mnt->mnt_dir);
+		memcpy(args, stacked, sizeof(args));
 	}
+
+	_d("Mounting %s%s", job->file, job->nofail ? " in background" : "");
+	job->pid   = fs_spawn(job, args);
+	job->state = FS_RUNNING;
+	if (job->pid == -1) {
+		_pe("Failed mounting %s", job->file);
+		job->state = FS_DONE;
+	}
+}
+
+/* Start all mounts that can start now, both foreground and background */
+static void fs_mount_ready(void)
+{
+	int running = 0, first = -1;
+
+	for (int i = 0; i < mnt_num; i++) {
+		struct fs_job *job = &mnt[i];
+
+		if (job->state == FS_RUNNING)
+			running++;
+		if (job->state != FS_PENDING || fs_blocked(job))
+			continue;
+
+		fs_mount_start(job);
+		running++;
+	}
+	if (running)
+		return;
+
+	/* Only blocked mounts left, e.g., sources on each other */
+	for (int i = 0; i < mnt_num && first < 0; i++) {
+		if (mnt[i].state == FS_PENDING)
+			first = i;
+	}
+	if (first >= 0) {
+		_w("Circular dependency between mounts, mounting %s", mnt[first].file);
+		fs_mount_start(&mnt[first]);
+	}
+}
+
+
+/*
+ * A mount is done.  Foreground mounts are reported as one, by the
+ * caller, background mounts get their own progress line.
+ */
+static void fs_mount_done(struct fs_job *job)
+{
+	int rc = fs_status(job);
+
+	if (rc)
+		_d("Failed mounting %s, exit code %d", job->file, rc);
+	else
+		fs_cond(job);
+
+	if (job->nofail) {
+		print(rc, "Mounting %s", job->file);
+		fs_output(job, rc);
+	}
+}
+
+/**
+ * fs_mount - Mount all filesystems in /etc/fstab, replaces mount -na
+ *
+ * Filesystems are mounted in parallel, except those with a mount point,
+ * or source directory, below another one in /etc/fstab, which wait for
+ * the parent to mount.  Mounts on the same mount point are done in the
+ * order of /etc/fstab.
+ * Filesystems with the nofail option, and any below them, are mounted
+ * in the background, i.e., we do not wait for them before continuing
+ * the boot.  For every successful mount the condition mount/<PATH> is
+ * set, so services that need a late mount can depend on it.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if any of the foreground mounts failed.
+ */
+int fs_mount(void)
+{
+	struct fs_job *job;
+	struct fstab *fs;
+	int rc = 0;
+
+	if (!setfsent()) {
+		_pe("Failed opening fstab");
+		return 1;
+	}
+
+	while ((fs = getfsent())) {
+		if (fs->fs_file[0] != '/' || !strcmp(fs->fs_file, "/"))
+			continue;
+		if (!strcmp(fs->fs_vfstype, "swap") || hasopt(fs->fs_mntops, "noauto"))
+			continue;
+
+		job = fs_add(&mnt, &mnt_num, fs);
+		if (!job)
+			break;
+
+		if (hasopt(fs->fs_mntops, "nofail"))
+			job->nofail = 1;
+		strlcpy(job->type, fs->fs_vfstype, sizeof(job->type));
+		job->opts = strdup(fs->fs_mntops);
+
+		if (ismnt("/proc/mounts", job->file, NULL)) {
+			_d("Skipping %s, already mounted", job->file);
+			job->state = FS_DONE;
+			fs_cond(job);
+		}
+	}
+	endfsent();
+
+	/* Anything waiting for a background mount is also in the background */
+	for (int i = 0; i < mnt_num; i++) {
+		for (int j = 0; j < mnt_num; j++) {
+			if (mnt[j].nofail && mnt[j].state != FS_DONE && fs_depends(&mnt[i], &mnt[j]))
+				mnt[i].nofail = 1;
+		}
+	}
+
+	print_desc("Mounting ", "filesystems");
+	while (1) {
+		int busy = 0;
+
+		fs_mount_ready();
+		for (int i = 0; i < mnt_num; i++)
+			busy += !mnt[i].nofail && mnt[i].state != FS_DONE;
+		if (!busy)
+			break;
+
+		job = fs_wait(mnt, mnt_num);
+		if (!job)
+			break;
+
+		if (!job->nofail && fs_status(job))
+			rc++;
+		fs_mount_done(job);
+	}
+	print_result(rc);
+
+	for (int i = 0; i < mnt_num; i++) {
+		if (!mnt[i].nofail)
+			fs_output(&mnt[i], fs_status(&mnt[i]));
+	}
+
+	return rc;
+}
+
+/**
+ * fs_collect - Collect background mount
+ * @pid:    PID of collected process
+ * @status: Exit status from waitpid()
+ *
+ * Called by service_monitor() for each collected child, mounts with the
+ * nofail option in /etc/fstab that fs_mount() did not wait for are
+ * handled here, starting any mounts waiting for them.
+ *
+ * Returns:
+ * %TRUE(1) if @pid was a background mount, otherwise %FALSE(0).
+ */
+int fs_collect(pid_t pid, int status)
+{
+	struct fs_job *job;
+
+	job = fs_find(mnt, mnt_num, pid);
+	if (!job)
+		return 0;
+
+	job->state  = FS_DONE;
+	job->status = status;
+	fs_mount_done(job);
+	fs_mount_ready();
+
+	return 1;
 }
 
 /**
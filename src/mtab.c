@@ -0,0 +1,322 @@
+/* In-memory cache of the mount table and /etc/fstab
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <mntent.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "cond.h"
+#include "log.h"
+#include "mtab.h"
+
+#define MTAB_HASH_SIZE  64
+
+/*
+ * Two generations of each table, a refresh parses into the spare one
+ * so the mount/ conditions can be updated from the difference.
+ */
+struct mtab {
+	const char *file;
+	FILE       *fp;			/* Kept open, for MTAB_MOUNTS */
+	struct stat st;			/* When parsed, for MTAB_FSTAB */
+	int         valid;
+	int         cur;
+	LIST_HEAD(, mtab_ent) hash[2][MTAB_HASH_SIZE];
+};
+
+static struct mtab mounts = { .file = MTAB_MOUNTS };
+static struct mtab fstab  = { .file = MTAB_FSTAB  };
+
+static int   watching;			/* mount/ conditions follow mounts */
+static uev_t watcher;
+
+static unsigned int mtab_key(const char *dir)
+{
+	unsigned int hash = 5381;
+
+	while (*dir)
+		hash = ((hash << 5) + hash) + (unsigned char)*dir++;
+
+	return hash & (MTAB_HASH_SIZE - 1);
+}
+
+static struct mtab_ent *find(struct mtab *tab, int gen, const char *dir)
+{
+	struct mtab_ent *e;
+
+	LIST_FOREACH(e, &tab->hash[gen][mtab_key(dir)], link) {
+		if (!strcmp(e->dir, dir))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void add(struct mtab *tab, int gen, struct mntent *mnt)
+{
+	size_t dlen = strlen(mnt->mnt_dir) + 1;
+	size_t slen = strlen(mnt->mnt_fsname) + 1;
+	size_t tlen = strlen(mnt->mnt_type) + 1;
+	size_t olen = strlen(mnt->mnt_opts) + 1;
+	struct mtab_ent *e;
+
+	/* Over-mounted, the one on top is listed last */
+	e = find(tab, gen, mnt->mnt_dir);
+	if (e) {
+		LIST_REMOVE(e, link);
+		free(e);
+	}
+
+	e = malloc(sizeof(*e) + dlen + slen + tlen + olen);
+	if (!e) {
+		_pe("Failed caching %s", mnt->mnt_dir);
+		return;
+	}
+
+	memcpy(e->dir, mnt->mnt_dir, dlen);
+	e->spec = &e->dir[dlen];
+	memcpy(e->spec, mnt->mnt_fsname, slen);
+	e->type = &e->spec[slen];
+	memcpy(e->type, mnt->mnt_type, tlen);
+	e->opts = &e->type[tlen];
+	memcpy(e->opts, mnt->mnt_opts, olen);
+
+	LIST_INSERT_HEAD(&tab->hash[gen][mtab_key(e->dir)], e, link);
+}
+
+static void flush(struct mtab *tab, int gen)
+{
+	for (int i = 0; i < MTAB_HASH_SIZE; i++) {
+		struct mtab_ent *e, *tmp;
+
+		LIST_FOREACH_SAFE(e, &tab->hash[gen][i], link, tmp) {
+			LIST_REMOVE(e, link);
+			free(e);
+		}
+	}
+}
+
+static void parse(struct mtab *tab, FILE *fp)
+{
+	struct mntent *mnt;
+	int gen = !tab->cur;
+
+	flush(tab, gen);
+	while ((mnt = getmntent(fp)))
+		add(tab, gen, mnt);
+}
+
+/*
+ * Everything in /etc/fstab, and what is mounted outside the pseudo
+ * file systems, gets a mount/ condition, mount/var/log for /var/log
+ */
+static void mtab_cond(struct mtab_ent *e, int on)
+{
+	const char *skip[] = { "/dev", "/proc", "/sys" };
+	char cond[PATH_MAX + 8];
+
+	if (!strcmp(e->dir, "/"))
+		return;
+
+	if (!mtab_find(MTAB_FSTAB, e->dir)) {
+		for (size_t i = 0; i < NELEMS(skip); i++) {
+			size_t len = strlen(skip[i]);
+
+			if (!strncmp(e->dir, skip[i], len) && (!e->dir[len] || e->dir[len] == '/'))
+				return;
+		}
+	}
+
+	snprintf(cond, sizeof(cond), "mount/%s", &e->dir[1]);
+	if (on)
+		cond_set_oneshot(cond);
+	else
+		cond_clear(cond);
+}
+
+/* Set conditions for new mounts and clear them for those gone */
+static void mtab_diff(struct mtab *tab, int old, int new)
+{
+	cond_batch_begin();
+	for (int i = 0; i < MTAB_HASH_SIZE; i++) {
+		struct mtab_ent *e;
+
+		LIST_FOREACH(e, &tab->hash[new][i], link) {
+			if (!find(tab, old, e->dir))
+				mtab_cond(e, 1);
+		}
+		LIST_FOREACH(e, &tab->hash[old][i], link) {
+			if (!find(tab, new, e->dir))
+				mtab_cond(e, 0);
+		}
+	}
+	cond_batch_commit();
+}
+
+/*
+ * The kernel flags every change to the mount table with POLLPRI on an
+ * open /proc/mounts, so a cheap poll() tells if our copy is stale.
+ */
+static struct mtab *mounts_get(void)
+{
+	struct pollfd pfd;
+
+	if (!mounts.fp) {
+		mounts.fp = setmntent(MTAB_MOUNTS, "re");
+		if (!mounts.fp)
+			return NULL;	/* No /proc yet */
+		mounts.valid = 0;
+	}
+
+	pfd.fd = fileno(mounts.fp);
+	pfd.events = POLLPRI;
+	if (poll(&pfd, 1, 0) > 0)
+		mounts.valid = 0;
+
+	if (!mounts.valid) {
+		rewind(mounts.fp);
+		parse(&mounts, mounts.fp);
+		if (watching)
+			mtab_diff(&mounts, mounts.cur, !mounts.cur);
+		flush(&mounts, mounts.cur);
+		mounts.cur = !mounts.cur;
+		mounts.valid = 1;
+	}
+
+	return &mounts;
+}
+
+/* Re-read /etc/fstab only when it has been modified */
+static struct mtab *fstab_get(void)
+{
+	struct stat st;
+	FILE *fp;
+
+	if (stat(MTAB_FSTAB, &st))
+		return NULL;
+
+	if (fstab.valid && st.st_ino == fstab.st.st_ino && st.st_size == fstab.st.st_size &&
+	    st.st_mtim.tv_sec == fstab.st.st_mtim.tv_sec && st.st_mtim.tv_nsec == fstab.st.st_mtim.tv_nsec)
+		return &fstab;
+
+	fp = setmntent(MTAB_FSTAB, "re");
+	if (!fp)
+		return NULL;
+
+	parse(&fstab, fp);
+	endmntent(fp);
+
+	flush(&fstab, fstab.cur);
+	fstab.cur   = !fstab.cur;
+	fstab.st    = st;
+	fstab.valid = 1;
+
+	return &fstab;
+}
+
+/**
+ * mtab_find - Look up a mount point in the mount table or fstab
+ * @file: Either %MTAB_MOUNTS or %MTAB_FSTAB
+ * @dir:  Mount point
+ *
+ * Answers from memory, the mount table is only re-read after it has
+ * changed, and /etc/fstab after it has been modified.
+ *
+ * Returns:
+ * The cached entry for @dir, or %NULL if not found, or unknown @file.
+ */
+struct mtab_ent *mtab_find(const char *file, const char *dir)
+{
+	struct mtab *tab;
+
+	if (!file || !dir)
+		return NULL;
+
+	if (!strcmp(file, MTAB_MOUNTS) || !strcmp(file, "/proc/self/mounts"))
+		tab = mounts_get();
+	else if (!strcmp(file, MTAB_FSTAB))
+		tab = fstab_get();
+	else
+		return NULL;
+
+	if (!tab)
+		return NULL;
+
+	return find(tab, tab->cur, dir);
+}
+
+static void mtab_cb(uev_t *w, void *arg, int events)
+{
+	/* Our poll() in mounts_get() will not see what epoll already did */
+	mounts.valid = 0;
+	mounts_get();
+
+	/* A change is flagged with EPOLLERR as well, keep watching */
+	if (!uev_io_active(w))
+		uev_io_start(w);
+}
+
+/**
+ * mtab_init - Start following the mount table
+ * @ctx: Event loop context
+ *
+ * Sets the mount/ condition for every file system mounted now, and
+ * from then on as they are mounted, or clears them at unmount.  Must
+ * be called after cond_init().
+ */
+void mtab_init(uev_ctx_t *ctx)
+{
+	if (!mounts_get()) {
+		_pe("Cannot follow %s", MTAB_MOUNTS);
+		return;
+	}
+
+	if (uev_io_init(ctx, &watcher, mtab_cb, NULL, fileno(mounts.fp), UEV_PRI)) {
+		_pe("Failed watching %s", MTAB_MOUNTS);
+		return;
+	}
+
+	cond_batch_begin();
+	for (int i = 0; i < MTAB_HASH_SIZE; i++) {
+		struct mtab_ent *e;
+
+		LIST_FOREACH(e, &mounts.hash[mounts.cur][i], link)
+			mtab_cond(e, 1);
+	}
+	cond_batch_commit();
+
+	watching = 1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,55 @@
+/* In-memory cache of the mount table and /etc/fstab
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef FINIT_MTAB_H_
+#define FINIT_MTAB_H_
+
+#include <lite/queue.h>		/* BSD sys/queue.h API */
+#include <uev/uev.h>
+
+#define MTAB_MOUNTS   "/proc/mounts"
+#define MTAB_FSTAB    "/etc/fstab"
+
+struct mtab_ent {
+	LIST_ENTRY(mtab_ent) link;
+
+	char *spec;			/* Device, or remote */
+	char *type;			/* File system type */
+	char *opts;			/* Mount options */
+	int   seen;			/* Still in table after refresh */
+
+	char  dir[];			/* Mount point, the key */
+};
+
+struct mtab_ent *mtab_find(const char *file, const char *dir);
+void             mtab_init(uev_ctx_t *ctx);
+
+#endif /* FINIT_MTAB_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,291 @@
+/* Readiness notification, sd_notify(3) compatible
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <lite/lite.h>
+#include <uev/uev.h>
+
+#include "finit.h"
+#include "admit.h"
+#include "boot.h"
+#include "cond.h"
+#include "helpers.h"
+#include "metrics.h"
+#include "private.h"
+#include "service.h"
+#include "shm.h"
+#include "sock.h"
+#include "util.h"
+
+static uev_t notify_watcher;
+
+/*
+ * Service is ready, same as when the PID file of a service is created,
+ * see the pidfile plugin, but without any file system access.
+ */
+static void notify_ready(svc_t *svc)
+{
+	char cond[MAX_COND_LEN];
+
+	_d("%s: READY=1", svc->name);
+	svc_started(svc);
+	boot_job_ready(svc);
+	admit_done(svc);
+	shm_svc(svc);
+	cond_set(mkcond(svc, cond, sizeof(cond)));
+}
+
+/* Descriptors sent with a message, closed unless taken by sock_store() */
+static void close_fds(int fds[], int num)
+{
+	for (int i = 0; i < num; i++)
+		close(fds[i]);
+}
+
+/*
+ * A new main PID is only accepted from root, or if it is in the same
+ * session as the current main PID, i.e., forked by the service itself.
+ * Otherwise an unprivileged service could make PID 1 signal and move
+ * any process on the system.
+ */
+static int mainpid_ok(svc_t *svc, uid_t uid, pid_t pid)
+{
+	pid_t sid;
+
+	if (uid == 0)
+		return 1;
+
+	sid = getsid(pid);
+	if (sid > 0 && sid == getsid(svc->pid))
+		return 1;
+
+	return 0;
+}
+
+/* Few services send STATUS=, so the message is allocated on the first */
+static void notify_status(svc_t *svc, const char *msg)
+{
+	if (!svc->notify_msg) {
+		svc->notify_msg = malloc(MAX_STR_LEN);
+		if (!svc->notify_msg)
+			return;
+	}
+
+	strlcpy(svc->notify_msg, msg, MAX_STR_LEN);
+}
+
+static void notify_msg(svc_t *svc, uid_t uid, char *msg, int fds[], int num)
+{
+	char *line, *ptr = NULL, *name = NULL;
+	int store = 0, remove = 0;
+
+	for (line = strtok_r(msg, "\n", &ptr); line; line = strtok_r(NULL, "\n", &ptr)) {
+		if (!strcmp(line, "FDSTORE=1"))
+			store = 1;
+		else if (!strcmp(line, "FDSTOREREMOVE=1"))
+			remove = 1;
+		else if (!strncmp(line, "FDNAME=", 7))
+			name = &line[7];
+		else if (!strcmp(line, "READY=1"))
+			notify_ready(svc);
+		else if (!strncmp(line, "STATUS=", 7))
+			notify_status(svc, &line[7]);
+		else if (!strcmp(line, "WATCHDOG=1"))
+			svc->notify_wdog = jiffies();
+		else if (!strncmp(line, "MAINPID=", 8)) {
+			const char *errstr;
+			pid_t pid;
+
+			pid = strtonum(&line[8], 2, INT32_MAX, &errstr);
+			if (errstr)
+				continue;
+
+			if (!mainpid_ok(svc, uid, pid)) {
+				logit(LOG_WARNING, "%s: not allowed to change main PID to %d", svc->name, pid);
+				continue;
+			}
+
+			_d("%s: changed PID from %d to %d", svc->name, svc->pid, pid);
+			svc_set_pid(svc, pid);
+			service_schedule(svc);
+		}
+		/* Ignore unsupported, e.g. STOPPING=1 */
+	}
+
+	/* As sd_pid_notify_with_fds(3), remove requires a name */
+	if (remove && name)
+		sock_store_remove(svc, name);
+
+	if (store && num && svc->fdstore)
+		sock_store(svc, fds, num, name);
+	else
+		close_fds(fds, num);
+}
+
+static void notify_recv(uev_t *w, void *arg, int events)
+{
+	char buf[BUF_SIZE];
+	union {
+		struct cmsghdr cmh;
+		char   control[CMSG_SPACE(sizeof(struct ucred)) +
+			       CMSG_SPACE(sizeof(int) * SVC_MAX_STORE)];
+	} ctrl;
+
+	if (UEV_ERROR == events) {
+		_e("Unrecoverable error on notify socket");
+		return;
+	}
+
+	while (1) {
+		struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) - 1 };
+		struct msghdr msg = {
+			.msg_iov        = &iov,
+			.msg_iovlen     = 1,
+			.msg_control    = ctrl.control,
+			.msg_controllen = sizeof(ctrl.control),
+		};
+		struct ucred *cred = NULL;
+		struct cmsghdr *cmsg;
+		int fds[SVC_MAX_STORE];
+		int num = 0;
+		ssize_t len;
+		svc_t *svc;
+
+		len = recvmsg(w->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				_pe("Failed reading notify socket");
+			break;
+		}
+		buf[len] = 0;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET)
+				continue;
+
+			if (cmsg->cmsg_type == SCM_CREDENTIALS)
+				cred = (struct ucred *)CMSG_DATA(cmsg);
+			else if (cmsg->cmsg_type == SCM_RIGHTS) {
+				size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+				for (size_t i = 0; i < n; i++) {
+					int fd;
+
+					memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+					if (num < SVC_MAX_STORE)
+						fds[num++] = fd;
+					else
+						close(fd);
+				}
+			}
+		}
+		if (!cred) {
+			_d("Notification without credentials, dropping.");
+			close_fds(fds, num);
+			continue;
+		}
+
+		/* Only the main PID of a service with notify:systemd */
+		svc = svc_find_by_pid(cred->pid);
+		if (!svc || !svc->notify) {
+			_d("Notification from unknown PID %d, dropping.", cred->pid);
+			close_fds(fds, num);
+			continue;
+		}
+
+		notify_msg(svc, cred->uid, buf, fds, num);
+	}
+}
+
+/* Timed, like all hot callbacks in PID 1 */
+static void notify_cb(uev_t *w, void *arg, int events)
+{
+	uint64_t start = metric_start();
+
+	notify_recv(w, arg, events);
+	metric_stop("notify", start);
+}
+
+/**
+ * notify_init - Set up readiness notification socket
+ * @ctx: Main event loop context
+ *
+ * Services with notify:systemd are started with $NOTIFY_SOCKET set to
+ * this socket, to which they send READY=1 etc. with sd_notify(3).
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int notify_init(uev_ctx_t *ctx)
+{
+	struct sockaddr_un sun = {
+		.sun_family = AF_UNIX,
+		.sun_path   = INIT_NOTIFY,
+	};
+	int sd, on = 1;
+
+	sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (-1 == sd) {
+		_pe("Failed creating notify socket");
+		return 1;
+	}
+
+	erase(INIT_NOTIFY);
+	if (-1 == bind(sd, (struct sockaddr *)&sun, sizeof(sun)))
+		goto error;
+
+	/* Services run as non-root must be able to notify us as well */
+	chmod(INIT_NOTIFY, 0666);
+
+	if (setsockopt(sd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)))
+		goto error;
+
+	if (!uev_io_init(ctx, &notify_watcher, notify_cb, NULL, sd, UEV_READ))
+		return 0;
+
+error:
+	_pe("Failed initializing notify socket");
+	close(sd);
+	return 1;
+}
+
+int notify_exit(void)
+{
+	uev_io_stop(&notify_watcher);
+
+	return close(notify_watcher.fd);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
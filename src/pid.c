@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <lite/lite.h>
 
 #include "pid.h"
@@ -51,6 +52,48 @@ int pid_alive(pid_t pid)
 }
 
 
+/**
+ * pid_open - Open a pidfd for a process
+ * @pid: Process ID to open
+ *
+ * The descriptor is readable, with poll(), when the process exits, and
+ * unlike @pid it cannot refer to another process later on.
+ *
+ * Returns:
+ * A pidfd, with close-on-exec set, or -1 on error with errno set, e.g.
+ * %ESRCH if the process is gone, or %ENOSYS on a kernel older than 5.3.
+ */
+int pid_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+/**
+ * pid_signal - Send a signal to a process using its pidfd
+ * @pidfd: Descriptor from pid_open()
+ * @signo: Signal to send
+ *
+ * Returns:
+ * POSIX OK(0), or -1 on error with errno set, e.g. %ESRCH if the
+ * process has exited, even if its PID has been reused since.
+ */
+int pid_signal(int pidfd, int signo)
+{
+#ifdef SYS_pidfd_send_signal
+	return syscall(SYS_pidfd_send_signal, pidfd, signo, NULL, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
 /**
  * pid_get_name - Find name of a process
  * @pid:  PID of process to find.
@@ -98,7 +141,7 @@ char *pid_file(svc_t *svc)
 	static char path[256];
 	char fn[MAX_ARG_LEN];
 
-	if (svc->pidfile[0]) {
+	if (svc->pidfile) {
 		if (svc->pidfile[0] == '!')
 			return &svc->pidfile[1];
 		return svc->pidfile;
@@ -132,7 +175,7 @@ int pid_file_create(svc_t *svc)
 {
 	FILE *fp;
 
-	if (!svc->pidfile[0] || svc->pidfile[0] == '!')
+	if (!svc->pidfile || svc->pidfile[0] == '!')
 		return 1;
 
 	fp = fopen(svc->pidfile, "w");
@@ -145,6 +188,7 @@ int pid_file_create(svc_t *svc)
 
 static int pid_realpath(svc_t *svc, char *file)
 {
+	char path[256];
 	int not = 0;
 
 	if (!file)
@@ -155,9 +199,16 @@ static int pid_realpath(svc_t *svc, char *file)
 		file++;
 	}
 
-	pid_runpath(file, &svc->pidfile[not], sizeof(svc->pidfile) - not);
+	pid_runpath(file, &path[not], sizeof(path) - not);
 	if (not)
-		svc->pidfile[0] = '!';
+		path[0] = '!';
+
+	file = strdup(path);
+	if (!file)
+		return 1;
+
+	free(svc->pidfile);
+	svc->pidfile = file;
 
 	return 0;
 }
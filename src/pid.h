@@ -28,6 +28,8 @@
 #include "svc.h"
 
 int   pid_alive       (pid_t pid);
+int   pid_open        (pid_t pid);
+int   pid_signal      (int pidfd, int signo);
 char *pid_get_name    (pid_t pid, char *name, size_t len);
 
 char *pid_file        (svc_t *svc);
@@ -26,16 +26,22 @@
 #include <dirent.h>		/* readdir() et al */
 #include <poll.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <lite/lite.h>
 #include <lite/queue.h>		/* BSD sys/queue.h API */
 
 #include "config.h"
+#include "boot.h"
 #include "cond.h"
 #include "finit.h"
 #include "helpers.h"
+#include "metrics.h"
+#include "pid.h"
 #include "plugin.h"
 #include "private.h"
 #include "service.h"
+#include "sig.h"
 
 #define is_io_plugin(p) ((p)->io.cb && (p)->io.fd > 0)
 #define SEARCH_PLUGIN(str)						\
@@ -47,10 +53,6 @@
 static char *plugpath = NULL; /* Set by first load. */
 static TAILQ_HEAD(plugin_head, plugin) plugins  = TAILQ_HEAD_INITIALIZER(plugins);
 
-#ifndef ENABLE_STATIC
-static void check_plugin_depends(plugin_t *plugin);
-#endif
-
 
 static char *trim_ext(char *name)
 {
@@ -95,19 +97,24 @@ int plugin_register(plugin_t *plugin)
 		return 0;
 	}
 
-#ifndef ENABLE_STATIC
-	/* Resolve plugin dependencies */
-	check_plugin_depends(plugin);
-#endif
-
+	/* Dependencies are resolved by plugin_sort(), when all are loaded */
 	TAILQ_INSERT_TAIL(&plugins, plugin, link);
 
 	return 0;
 }
 
-/* Not called, at the moment plugins cannot be unloaded. */
+/* Called by plugin_prune_bootstrap(), and again by PLUGIN_EXIT() */
 int plugin_unregister(plugin_t *plugin)
 {
+	plugin_t *p, *tmp;
+
+	PLUGIN_ITERATOR(p, tmp) {
+		if (p == plugin)
+			break;
+	}
+	if (!p)
+		return 0;
+
 	if (is_io_plugin(plugin))
 		uev_io_stop(&plugin->watcher);
 
@@ -116,6 +123,7 @@ int plugin_unregister(plugin_t *plugin)
 
 	_d("%s exiting ...", plugin->name);
 	free(plugin->name);
+	plugin->name = NULL;
 #else
 	_d("Finit built statically, cannot unload %s ...", plugin->name);
 #endif
@@ -189,19 +197,153 @@ int plugin_exists(hook_point_t no)
 	return 0;
 }
 
-/* Some hooks are called with a fixed argument */
+/* An async hook, running in a child process */
+struct hook_job {
+	plugin_t  *p;
+	pid_t      pid;
+	int        pidfd;
+	int        id;		/* In boot trace */
+	long long  deadline;	/* usec, from boot_usec() */
+};
+
+static int hook_async(hook_point_t no)
+{
+	plugin_t *p, *tmp;
+	int num = 0;
+
+	PLUGIN_ITERATOR(p, tmp) {
+		if (p->hook[no].cb && p->hook[no].async > 0)
+			num++;
+	}
+
+	return num;
+}
+
+static int hook_fork(plugin_t *p, hook_point_t no, void *arg, struct hook_job *job)
+{
+	pid_t pid;
+
+	metric_inc(METRIC_FORK);
+	pid = fork();
+	if (!pid) {
+		sig_unblock();
+		p->hook[no].cb(arg);
+		_exit(0);
+	}
+	if (pid < 0) {
+		_pe("Failed forking %s hook, calling it directly", basename(p->name));
+		return -1;
+	}
+
+	job->p        = p;
+	job->pid      = pid;
+	job->pidfd    = pid_open(pid);
+	job->id       = boot_begin("plugin", basename(p->name));
+	job->deadline = boot_usec() + (long long)p->hook[no].async * 1000;
+
+	return 0;
+}
+
+/*
+ * Wait for async hooks to complete, or overrun their deadline.  Like
+ * run_parts() we cannot use waitpid(-1), so poll the pidfds, or check
+ * each job at a short interval on kernels without pidfd.
+ */
+static void hook_wait(hook_point_t no, struct hook_job *jobs, int num)
+{
+	while (num > 0) {
+		struct pollfd pfd[num];
+		int i, n = 0, timeout = -1;
+		long long now = boot_usec();
+
+		for (i = 0; i < num; ) {
+			struct hook_job *job = &jobs[i];
+			int status = 0;
+			pid_t pid;
+
+			pid = waitpid(job->pid, &status, WNOHANG);
+			if (pid == job->pid || (pid == -1 && errno == ECHILD)) {
+				if (WIFSIGNALED(status))
+					logit(LOG_WARNING, "%s hook %s killed by signal %d", basename(job->p->name),
+					      hook_cond[no], WTERMSIG(status));
+			} else if (now >= job->deadline) {
+				logit(LOG_WARNING, "%s hook %s did not complete in %d msec, skipping",
+				      basename(job->p->name), hook_cond[no], job->p->hook[no].async);
+			} else {
+				i++;
+				continue;
+			}
+
+			boot_end(job->id);
+			if (job->pidfd >= 0)
+				close(job->pidfd);
+			jobs[i] = jobs[--num];
+		}
+
+		for (i = 0; i < num; i++) {
+			int msec = (jobs[i].deadline - now) / 1000 + 1;
+
+			if (jobs[i].pidfd >= 0) {
+				pfd[n].fd = jobs[i].pidfd;
+				pfd[n].events = POLLIN;
+				n++;
+			} else if (msec > 20) {
+				msec = 20;
+			}
+
+			if (timeout < 0 || msec < timeout)
+				timeout = msec;
+		}
+
+		if (num && poll(pfd, n, timeout) < 0 && errno != EINTR) {
+			_pe("Failed waiting for %s hooks", hook_cond[no]);
+			break;
+		}
+	}
+}
+
+/*
+ * Some hooks are called with a fixed argument.  Hooks are called in
+ * the order of the plugins, async hooks are forked off when it's their
+ * turn and run in parallel with the async hooks following them.  They
+ * are waited for before the next regular hook is called, and before
+ * the hook condition is set.
+ */
 void plugin_run_hook(hook_point_t no, void *arg)
 {
+	struct hook_job jobs[hook_async(no) + 1];
+	long long start = boot_usec();
 	plugin_t *p, *tmp;
+	int num = 0;
 
 	PLUGIN_ITERATOR(p, tmp) {
+		void *cb_arg = arg ? arg : p->hook[no].arg;
+
 		if (p->hook[no].cb) {
+			int id;
+
+			if (p->hook[no].async > 0) {
+				_d("Forking %s hook n:o %d (arg: %p) ...", basename(p->name), no, arg);
+				if (!hook_fork(p, no, cb_arg, &jobs[num])) {
+					num++;
+					continue;
+				}
+			}
+
+			/* Regular hooks may depend on all hooks before them */
+			hook_wait(no, jobs, num);
+			num = 0;
+
 			_d("Calling %s hook n:o %d (arg: %p) ...", basename(p->name), no, arg);
-			p->hook[no].cb(arg ? arg : p->hook[no].arg);
+			id = boot_begin("plugin", basename(p->name));
+			p->hook[no].cb(cb_arg);
+			boot_end(id);
 		}
 	}
+	hook_wait(no, jobs, num);
 
 	cond_set_oneshot(hook_cond[no]);
+	boot_hook(hook_cond[no], start);
 	service_step_all(SVC_TYPE_RUNTASK);
 }
 
@@ -221,11 +363,15 @@ static void generic_io_cb(uev_t *w, void *arg, int events)
 	plugin_t *p = (plugin_t *)arg;
 
 	if (is_io_plugin(p) && p->io.fd == w->fd) {
+		uint64_t start;
+
 		/* Stop watcher, callback may close descriptor on us ... */
 		uev_io_stop(w);
 
 		_d("Calling I/O %s from runloop...", basename(p->name));
+		start = metric_start();
 		p->io.cb(p->io.arg, w->fd, events);
+		metric_stop(basename(p->name), start);
 
 		/* Update fd, may be changed by plugin callback, e.g., if FIFO */
 		uev_io_set(w, p->io.fd, p->io.flags);
@@ -280,7 +426,7 @@ static int load_one(char *path, char *name)
 	int noext;
 	char sofile[CMD_SIZE];
 	void *handle;
-	plugin_t *plugin;
+	plugin_t *last, *plugin;
 
 	if (!path || !fisdir(path) || !name) {
 		errno = EINVAL;
@@ -292,6 +438,7 @@ static int load_one(char *path, char *name)
 	snprintf(sofile, sizeof(sofile), "%s/%s%s", path, name, noext ? ".so" : "");
 
 	_d("Loading plugin %s ...", basename(sofile));
+	last = TAILQ_LAST(&plugins, plugin_head);
 	handle = dlopen(sofile, RTLD_LAZY | RTLD_LOCAL);
 	if (!handle) {
 		_e("Failed loading plugin %s: %s", sofile, dlerror());
@@ -299,7 +446,7 @@ static int load_one(char *path, char *name)
 	}
 
 	plugin = TAILQ_LAST(&plugins, plugin_head);
-	if (!plugin) {
+	if (!plugin || plugin == last) {
 		_e("Plugin %s failed to register, unloading from memory", sofile);
 		dlclose(handle);
 		return 1;
@@ -311,75 +458,205 @@ static int load_one(char *path, char *name)
 	return 0;
 }
 
-/**
- * check_plugin_depends - Check and load any plugins this one depends on.
- * @plugin: Plugin with possible depends to check
- *
- * Very simple dependency resolver, should actually load the plugin of
- * the correct .name, but currently loads a matching filename.
- *
- * Works, but only for now.  A better way might be to have a try_load()
- * that actually loads all plugins and checks their &plugin_t for the
- * correct .name.
- */
-static void check_plugin_depends(plugin_t *plugin)
-{
-	int i;
-
-	for (i = 0; i < PLUGIN_DEP_MAX && plugin->depends[i]; i++) {
-//		_d("Plugin %s depends on %s ...", plugin->name, plugin->depends[i]);
-		if (plugin_find(plugin->depends[i])) {
-//			_d("OK plugin %s was already loaded.", plugin->depends[i]);
-			continue;
-		}
-
-		load_one(plugpath, plugin->depends[i]);
-	}
-}
-
 static int load_plugins(char *path)
 {
-	int fail = 0;
-	DIR *dp;
-	struct dirent *entry;
+	struct dirent **e;
+	int i, num, fail = 0;
 
-	dp = opendir(path);
-	if (!dp) {
+	/* Sorted, for same load order, and fallback for plugin_sort() */
+	num = scandir(path, &e, NULL, alphasort);
+	if (num < 0) {
 		_e("Failed, cannot open plugin directory %s: %s", path, strerror(errno));
 		return 1;
 	}
 	plugpath = path;
 
-	while ((entry = readdir(dp))) {
-		if (entry->d_name[0] == '.')
-			continue; /* Skip . and .. directories */
+	for (i = 0; i < num; i++) {
+		char *name = e[i]->d_name;
+		size_t len = strlen(name);
+
+		/* Skip . and .., and anything not a plugin */
+		if (name[0] == '.' || len < 4 || strcmp(&name[len - 3], ".so"))
+			continue;
 
-		if (load_one(path, entry->d_name))
+		if (load_one(path, name))
 			fail++;
 	}
 
-	closedir(dp);
+	while (num--)
+		free(e[num]);
+	free(e);
 
 	return fail;
 }
 #else
+/*
+ * Built-in plugins, PLUGIN_INIT() adds its function to this table at
+ * link time, in the finit_plugins section, instead of as a constructor.
+ */
+extern plugin_init_t __start_finit_plugins[] __attribute__((weak));
+extern plugin_init_t __stop_finit_plugins[] __attribute__((weak));
+
 static int load_plugins(char *path)
 {
+	plugin_init_t *fn;
+
 	print_desc("Initializing plugins", NULL);
+	for (fn = __start_finit_plugins; fn < __stop_finit_plugins; fn++)
+		(*fn)();
+
 	return 0;
 }
 #endif	/* ENABLE_STATIC */
 
+/* Match a .depends entry, e.g. "bootmisc", to name of plugin */
+static int plugin_is(plugin_t *p, char *name)
+{
+	char buf[CMD_SIZE];
+
+	strlcpy(buf, name, sizeof(buf));
+	return !strcmp(basename(p->name), basename(trim_ext(buf)));
+}
+
+/* Find @name in a list of plugins, not the global one */
+static plugin_t *plugin_in(struct plugin_head *head, char *name)
+{
+	plugin_t *p;
+
+	TAILQ_FOREACH(p, head, link) {
+		if (plugin_is(p, name))
+			return p;
+	}
+
+	return NULL;
+}
+
+static int plugin_ready(plugin_t *p, struct plugin_head *pending)
+{
+	for (int i = 0; i < PLUGIN_DEP_MAX && p->depends[i]; i++) {
+		if (plugin_in(pending, p->depends[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Topological sort of all loaded plugins, by their .depends, so that
+ * each plugin is after the plugins it depends on.  Otherwise plugins
+ * keep their load order.  This is the order hooks are called in.
+ */
+static void plugin_sort(void)
+{
+	struct plugin_head sorted = TAILQ_HEAD_INITIALIZER(sorted);
+	plugin_t *p, *tmp;
+
+	PLUGIN_ITERATOR(p, tmp) {
+		for (int i = 0; i < PLUGIN_DEP_MAX && p->depends[i]; i++) {
+			if (!plugin_in(&plugins, p->depends[i]))
+				_w("Plugin %s depends on %s, which is not loaded",
+				   basename(p->name), p->depends[i]);
+		}
+	}
+
+	while (!TAILQ_EMPTY(&plugins)) {
+		PLUGIN_ITERATOR(p, tmp) {
+			if (plugin_ready(p, &plugins))
+				break;
+		}
+
+		/* Dependency loop, break it at the first one */
+		if (!p) {
+			p = TAILQ_FIRST(&plugins);
+			_e("Plugin %s has circular dependencies", basename(p->name));
+		}
+
+		TAILQ_REMOVE(&plugins, p, link);
+		TAILQ_INSERT_TAIL(&sorted, p, link);
+	}
+
+	while ((p = TAILQ_FIRST(&sorted))) {
+		TAILQ_REMOVE(&sorted, p, link);
+		TAILQ_INSERT_TAIL(&plugins, p, link);
+	}
+}
+
 int plugin_init(uev_ctx_t *ctx)
 {
 	int fail = 1;
 
-	if (!load_plugins(PLUGIN_PATH))
-	    fail = init_plugins(ctx);
+	if (!load_plugins(PLUGIN_PATH)) {
+		plugin_sort();
+		fail = init_plugins(ctx);
+	}
 
 	return fail;
 }
 
+/*
+ * Hooks that can be called after bootstrap.  Runtime and shutdown hooks,
+ * and %HOOK_NETWORK_UP, which networking() calls again when changing to
+ * a runlevel with networking.
+ */
+#ifndef ENABLE_STATIC
+static int hook_runtime(hook_point_t no)
+{
+	return no == HOOK_NETWORK_UP || no >= HOOK_SVC_RECONF;
+}
+#endif
+
+/**
+ * plugin_prune_bootstrap - Unload plugins only used at bootstrap
+ *
+ * Called when bootstrap is done, after %HOOK_SYSTEM_UP.  Plugins that
+ * have @bootonly set are unregistered and unloaded, unless they also
+ * have I/O, an inetd service, or hooks that can be called after the
+ * bootstrap, see hook_runtime().
+ *
+ * Nothing is unloaded while a switch-root is still possible, the hooks
+ * of all plugins run again on the real root, see root_switched().
+ *
+ * Returns:
+ * Number of unloaded plugins.
+ */
+int plugin_prune_bootstrap(void)
+{
+	int num = 0;
+#ifndef ENABLE_STATIC
+	plugin_t *p, *tmp;
+
+	if (sysroot) {
+		_d("Switch-root to %s pending, keeping all plugins", sysroot);
+		return 0;
+	}
+
+	PLUGIN_ITERATOR(p, tmp) {
+		void *handle = p->handle;
+		int i;
+
+		if (!p->bootonly || !handle)
+			continue;
+
+		for (i = 0; i < HOOK_MAX_NUM; i++) {
+			if (p->hook[i].cb && hook_runtime(i))
+				break;
+		}
+		if (i < HOOK_MAX_NUM || is_io_plugin(p) || p->inetd.cmd) {
+			_w("Plugin %s is used after bootstrap, not unloading", basename(p->name));
+			continue;
+		}
+
+		_d("Unloading bootstrap plugin %s ...", basename(p->name));
+		plugin_unregister(p);
+		if (dlclose(handle))
+			_e("Failed unloading plugin: %s", dlerror());
+		num++;
+	}
+#endif
+
+	return num;
+}
+
 void plugin_exit(void)
 {
 #ifndef ENABLE_STATIC
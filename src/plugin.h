@@ -41,7 +41,21 @@
 #define PLUGIN_IO_HUP   UEV_HUP
 #define PLUGIN_IO_RDHUP UEV_RDHUP
 
+/*
+ * When built into finit (--enable-static), PLUGIN_INIT() instead adds
+ * the function to a table at link time, called by finit at plugin_init()
+ */
+typedef void (*plugin_init_t)(void);
+
+#ifdef ENABLE_STATIC
+#define PLUGIN_INIT(x)							\
+	static void x(void);						\
+	static plugin_init_t x##_entry					\
+		__attribute__ ((used, section("finit_plugins"))) = x;	\
+	static void x(void)
+#else
 #define PLUGIN_INIT(x) static void __attribute__ ((constructor)) x(void)
+#endif
 #define PLUGIN_EXIT(x) static void __attribute__ ((destructor))  x(void)
 
 #define PLUGIN_ITERATOR(x, tmp) TAILQ_FOREACH_SAFE(x, &plugins, link, tmp)
@@ -124,10 +138,17 @@ typedef struct plugin {
 	 * NOTE: Must match cmd for services or inetd plugins! */
 	char *name;
 
-	/* List of hook callbacks. */
+	/* List of hook callbacks.  A hook that only does external work,
+	 * e.g. restoring HW state, can set @async to a deadline in msec
+	 * to be called in a child process, in parallel with later async
+	 * hooks at the same hook point.  Regular hooks are only called
+	 * when all async hooks before them are done.  To not block Finit,
+	 * a hook that has not returned by the deadline is logged and left
+	 * running. */
 	struct {
 		void  *arg;      /* Optional argument to callback func. */
 		void (*cb)(void *arg);
+		int    async;    /* Deadline (msec) in child, 0: in PID 1 */
 	} hook[HOOK_MAX_NUM];
 
 	/* I/O Plugin */
@@ -141,9 +162,21 @@ typedef struct plugin {
 	 * @type argument will be either SOCK_DGRAM or SOCK_STREAM */
 	struct {
 		int (*cmd)(int type);
+
+		/* Optional in-process fast path, run by Finit without
+		 * forking.  Called with each request in @buf, of @len
+		 * bytes, or @len 0 when a stream client connects or a
+		 * INETD_REPLY_FLOOD stream is writable.  The reply is
+		 * written to @buf, max @size bytes.  Returns length of
+		 * reply, 0 for none, or -1 to close the connection. */
+		ssize_t (*reply)(int type, char *buf, size_t len, size_t size);
+		int      flags;	/* INETD_REPLY_* */
 	} inetd;
 
 	char *depends[PLUGIN_DEP_MAX]; /* List of other .name's this depends on. */
+
+	/* Only bootstrap hooks, unloaded when bootstrap is done */
+	int bootonly;
 } plugin_t;
 
 /* Public plugin API */
@@ -0,0 +1,152 @@
+/* Fixed-size object pools
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "finit.h"
+#include "log.h"
+#include "pool.h"
+
+/* Free objects are linked through their first word */
+struct pool_obj {
+	struct pool_obj *next;
+};
+
+static LIST_HEAD(, pool) pools = LIST_HEAD_INITIALIZER(pools);
+
+/* Round up to keep every object in a slab properly aligned */
+static size_t pool_objsize(struct pool *pool)
+{
+	size_t align = sizeof(long double);
+
+	if (pool->size < sizeof(struct pool_obj))
+		return sizeof(struct pool_obj);
+
+	return (pool->size + align - 1) & ~(align - 1);
+}
+
+static int pool_grow(struct pool *pool)
+{
+	size_t i, sz = pool_objsize(pool);
+	char *slab;
+
+	if (!pool->per_slab)
+		pool->per_slab = 1;
+
+	slab = malloc(sz * pool->per_slab);
+	if (!slab)
+		return -1;
+
+	/* First slab, register pool for statistics */
+	if (!pool->slabs)
+		LIST_INSERT_HEAD(&pools, pool, link);
+	pool->slabs++;
+
+	for (i = 0; i < pool->per_slab; i++) {
+		struct pool_obj *obj = (struct pool_obj *)&slab[i * sz];
+
+		obj->next  = pool->free;
+		pool->free = obj;
+	}
+
+	return 0;
+}
+
+/**
+ * pool_alloc - Allocate an object from a pool
+ * @pool: Pointer to &struct pool, see POOL_INIT()
+ *
+ * Like calloc(), the object is zeroed.  A new slab is allocated when
+ * the free list of @pool is empty.
+ *
+ * Returns:
+ * Pointer to object, or %NULL with @errno set to %ENOMEM.
+ */
+void *pool_alloc(struct pool *pool)
+{
+	struct pool_obj *obj;
+
+	if (!pool->free && pool_grow(pool)) {
+		_e("Out of memory, cannot grow %s pool", pool->name);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	obj = pool->free;
+	pool->free = obj->next;
+
+	pool->allocs++;
+	pool->used++;
+	if (pool->used > pool->peak)
+		pool->peak = pool->used;
+
+	memset(obj, 0, pool->size);
+
+	return obj;
+}
+
+/**
+ * pool_free - Return an object to its pool
+ * @pool: Pointer to &struct pool the object was allocated from
+ * @obj:  Object to free, may be %NULL
+ */
+void pool_free(struct pool *pool, void *obj)
+{
+	struct pool_obj *o = obj;
+
+	if (!obj)
+		return;
+
+	o->next    = pool->free;
+	pool->free = o;
+	pool->used--;
+}
+
+/**
+ * pool_iterator - Iterate over all pools in use
+ * @first: Set to restart from the first pool
+ *
+ * Returns:
+ * Pointer to next pool, or %NULL when done.
+ */
+struct pool *pool_iterator(int first)
+{
+	static struct pool *iter = NULL;
+
+	if (first)
+		iter = LIST_FIRST(&pools);
+	else if (iter)
+		iter = LIST_NEXT(iter, link);
+
+	return iter;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,69 @@
+/* Fixed-size object pools
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_POOL_H_
+#define FINIT_POOL_H_
+
+#include <stddef.h>
+#include <lite/queue.h>
+
+/*
+ * Objects are carved out of slabs, of @per_slab objects each, which are
+ * never returned to the C library.  Freed objects go on a free list for
+ * reuse, so long running PID 1 does not fragment the heap with the churn
+ * of, e.g., inetd connections.
+ */
+struct pool {
+	LIST_ENTRY(pool) link;		/* All pools, for pool_iterator() */
+
+	const char      *name;
+	size_t           size;		/* Object size */
+	size_t           per_slab;	/* Objects per slab */
+	void            *free;		/* Free list */
+
+	/* Statistics */
+	unsigned int     slabs;		/* Slabs allocated */
+	unsigned int     used;		/* Objects in use */
+	unsigned int     peak;		/* High water mark of @used */
+	unsigned long    allocs;	/* Total number of pool_alloc() */
+};
+
+#define POOL_INIT(nm, type, num) {		\
+	.name     = nm,				\
+	.size     = sizeof(type),		\
+	.per_slab = num,			\
+}
+
+void        *pool_alloc   (struct pool *pool);
+void         pool_free    (struct pool *pool, void *obj);
+struct pool *pool_iterator(int first);
+
+#endif /* FINIT_POOL_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
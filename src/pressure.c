@@ -0,0 +1,344 @@
+/* Pressure stall information (PSI) monitor and shedding of services
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "cgroup.h"
+#include "cond.h"
+#include "log.h"
+#include "pressure.h"
+#include "service.h"
+
+/*
+ * Trigger of one resource in /proc/pressure.  The kernel signals when
+ * tasks have been stalled for @stall msec in any @window msec, at most
+ * once per window.  There is no event when pressure subsides, so it is
+ * considered gone after PRESSURE_HOLD msec without a new event.
+ */
+struct psi {
+	char    *name;			/* File in PRESSURE_PATH, and condition */
+	int      bit;
+	int      full;			/* All, not some, tasks stalled */
+	int      stall;			/* msec, 0: disabled */
+	int      window;		/* msec, 500 - 10000 */
+	int      fd;
+	uev_t    watcher;
+	uev_t    timer;
+};
+
+static struct psi psi[] = {
+	{ .name = "cpu",    .bit = PRESSURE_CPU, .stall = 800, .window = 1000, .fd = -1 },
+	{ .name = "memory", .bit = PRESSURE_MEM, .stall = 150, .window = 1000, .fd = -1 },
+	{ .name = "io",     .bit = PRESSURE_IO,  .stall = 500, .window = 1000, .fd = -1 },
+};
+
+int pressure_active;
+
+static char *psi_cond(struct psi *p, char *buf, size_t len)
+{
+	snprintf(buf, len, "sys/pressure/%s", p->name);
+	return buf;
+}
+
+static struct psi *psi_find(const char *name)
+{
+	for (size_t i = 0; i < NELEMS(psi); i++) {
+		if (!strcmp(psi[i].name, name))
+			return &psi[i];
+	}
+
+	return NULL;
+}
+
+/* Step all services that shed on @p, to stop, or start, them */
+static void psi_step(struct psi *p)
+{
+	svc_t *svc, *iter = NULL;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (svc->shed & p->bit)
+			service_schedule(svc);
+	}
+}
+
+static void psi_clear(uev_t *w, void *arg, int events)
+{
+	struct psi *p = arg;
+	char cond[64];
+
+	if (!(pressure_active & p->bit))
+		return;
+
+	logit(LOG_NOTICE, "System %s pressure back to normal", p->name);
+	pressure_active &= ~p->bit;
+	cond_clear(psi_cond(p, cond, sizeof(cond)));
+	psi_step(p);
+}
+
+static void psi_cb(uev_t *w, void *arg, int events)
+{
+	struct psi *p = arg;
+	int hold = PRESSURE_HOLD;
+	char cond[64];
+
+	/* Errors are flagged too, keep watching */
+	if (!uev_io_active(w))
+		uev_io_start(w);
+	if (!(events & UEV_PRI))
+		return;
+
+	/* Cleared when no new event within hold, at least two windows */
+	if (hold < 2 * p->window)
+		hold = 2 * p->window;
+	uev_timer_set(&p->timer, hold, 0);
+	if (pressure_active & p->bit)
+		return;
+
+	logit(LOG_WARNING, "High system %s pressure, %s %d of %d msec stalled",
+	      p->name, p->full ? "all tasks" : "some tasks", p->stall, p->window);
+	pressure_active |= p->bit;
+	cond_set_oneshot(psi_cond(p, cond, sizeof(cond)));
+	psi_step(p);
+}
+
+static int psi_open(uev_ctx_t *ctx, struct psi *p)
+{
+	char path[64], trig[64];
+	size_t len;
+
+	snprintf(path, sizeof(path), "%s/%s", PRESSURE_PATH, p->name);
+	p->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (p->fd == -1)
+		return 1;
+
+	/* Trigger is in usec, the terminating zero is part of it */
+	len = snprintf(trig, sizeof(trig), "%s %d %d", p->full ? "full" : "some",
+		       p->stall * 1000, p->window * 1000) + 1;
+	if (write(p->fd, trig, len) != (ssize_t)len) {
+		_pe("Failed setting %s pressure trigger '%s'", p->name, trig);
+		goto fail;
+	}
+
+	if (uev_io_init(ctx, &p->watcher, psi_cb, p, p->fd, UEV_PRI))
+		goto fail;
+	if (uev_timer_init(ctx, &p->timer, psi_clear, p, 0, 0)) {
+		uev_io_stop(&p->watcher);
+		goto fail;
+	}
+
+	return 0;
+fail:
+	close(p->fd);
+	p->fd = -1;
+	return 1;
+}
+
+/**
+ * pressure_conf - Parse pressure setting in finit.conf
+ * @arg: RES [some|full] STALL WINDOW, in msec, or RES off
+ *
+ * Takes effect at boot, or re-exec, when the triggers are set up.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int pressure_conf(char *arg)
+{
+	const char *err = NULL;
+	int stall, window, full = 0;
+	char *res, *tok;
+	struct psi *p;
+
+	res = strtok(arg, " \t");
+	p = res ? psi_find(res) : NULL;
+	if (!p) {
+		_e("Invalid pressure resource %s, must be cpu, memory, or io", res ?: "");
+		return errno = EINVAL;
+	}
+
+	tok = strtok(NULL, " \t");
+	if (tok && !strcmp(tok, "off")) {
+		p->stall = 0;
+		return 0;
+	}
+	if (tok && (!strcmp(tok, "some") || !strcmp(tok, "full"))) {
+		full = tok[0] == 'f';
+		tok = strtok(NULL, " \t");
+	}
+	if (!tok)
+		goto fail;
+
+	stall = strtonum(tok, 1, 10000, &err);
+	if (err)
+		goto fail;
+
+	tok = strtok(NULL, " \t");
+	if (!tok)
+		goto fail;
+	window = strtonum(tok, 500, 10000, &err);
+	if (err || stall > window)
+		goto fail;
+
+	p->full   = full;
+	p->stall  = stall;
+	p->window = window;
+
+	return 0;
+fail:
+	_e("Invalid pressure %s setting, should be: [some|full] STALL WINDOW", p->name);
+	return errno = EINVAL;
+}
+
+/**
+ * pressure_parse - Parse shed:RES[,RES][,freeze] option of a service
+ * @svc: Pointer to &svc_t
+ * @arg: Argument to shed:, or %NULL if not set
+ *
+ * A low priority service with shed:memory is stopped when the system
+ * is under memory pressure, and started again when it has passed.
+ * With freeze it is frozen, and thawed, instead.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int pressure_parse(svc_t *svc, char *arg)
+{
+	char *tok, *ptr;
+
+	svc->shed = 0;
+	if (!arg)
+		return 0;
+
+	for (tok = strtok_r(arg, ",", &ptr); tok; tok = strtok_r(NULL, ",", &ptr)) {
+		struct psi *p;
+
+		if (!strcmp(tok, "freeze"))
+			svc->shed |= PRESSURE_FREEZE;
+		else if (!strcmp(tok, "all"))
+			svc->shed |= PRESSURE_ALL;
+		else if ((p = psi_find(tok)))
+			svc->shed |= p->bit;
+		else {
+			logit(LOG_WARNING, "%s: invalid shed:%s, ignoring", svc->cmd, tok);
+			svc->shed = 0;
+			return errno = EINVAL;
+		}
+	}
+
+	/* Just freeze, same as all */
+	if (!(svc->shed & PRESSURE_ALL))
+		svc->shed |= PRESSURE_ALL;
+
+	return 0;
+}
+
+/**
+ * pressure_pause - Freeze a running service that sheds on pressure
+ * @svc: Pointer to &svc_t, running
+ *
+ * All processes in the cgroup of @svc are frozen, on systems without
+ * cgroup freezer the main process gets SIGSTOP.
+ *
+ * Returns:
+ * POSIX OK(0) if @svc is paused, or non-zero if it should be stopped
+ * instead.
+ */
+int pressure_pause(svc_t *svc)
+{
+	if (!(svc->shed & PRESSURE_FREEZE))
+		return 1;
+
+	if (!cgroup_freeze(svc->cgroup_fd, 1))
+		svc->frozen = 1;
+	else if (!svc_signal(svc, SIGSTOP))
+		svc->frozen = 2;
+	else
+		return 1;
+
+	_d("%s: paused, system under pressure", svc->name);
+	return 0;
+}
+
+/**
+ * pressure_resume - Thaw a service paused by pressure_pause()
+ * @svc: Pointer to &svc_t
+ *
+ * Safe to call for any service, also if it was never paused.
+ */
+void pressure_resume(svc_t *svc)
+{
+	switch (svc->frozen) {
+	case 1:
+		cgroup_freeze(svc->cgroup_fd, 0);
+		break;
+	case 2:
+		svc_signal(svc, SIGCONT);
+		break;
+	default:
+		return;
+	}
+
+	_d("%s: resumed", svc->name);
+	svc->frozen = 0;
+}
+
+/**
+ * pressure_init - Set up pressure stall triggers
+ * @ctx: Event loop context
+ *
+ * Requires Linux v5.2, or later, with PSI enabled.  The conditions
+ * sys/pressure/cpu, memory, and io are set while the system is under
+ * pressure.  Must be called after cond_init().
+ */
+void pressure_init(uev_ctx_t *ctx)
+{
+	if (!fisdir(PRESSURE_PATH)) {
+		_d("No %s, kernel without PSI support", PRESSURE_PATH);
+		return;
+	}
+
+	for (size_t i = 0; i < NELEMS(psi); i++) {
+		struct psi *p = &psi[i];
+
+		if (!p->stall || p->fd != -1)
+			continue;
+
+		if (psi_open(ctx, p))
+			_d("Cannot monitor %s pressure: %s", p->name, strerror(errno));
+	}
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,67 @@
+/* Pressure stall information (PSI) monitor and shedding of services
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_PRESSURE_H_
+#define FINIT_PRESSURE_H_
+
+#include <uev/uev.h>
+#include "svc.h"
+
+#define PRESSURE_PATH   "/proc/pressure"
+#define PRESSURE_HOLD   10000		/* msec without trigger to clear */
+
+/* Resources, bits in pressure_active and in svc->shed */
+#define PRESSURE_CPU    0x01
+#define PRESSURE_MEM    0x02
+#define PRESSURE_IO     0x04
+#define PRESSURE_ALL    (PRESSURE_CPU | PRESSURE_MEM | PRESSURE_IO)
+#define PRESSURE_FREEZE 0x80		/* shed:...,freeze */
+
+extern int pressure_active;		/* Resources under pressure now */
+
+/*
+ * Should a service with shed:RES be held back, or stopped, now?  Only
+ * acted on in service_step(), the monitor steps affected services.
+ */
+static inline int pressure_shed(svc_t *svc)
+{
+	return svc->shed & pressure_active & PRESSURE_ALL;
+}
+
+int  pressure_conf  (char *arg);
+int  pressure_parse (svc_t *svc, char *arg);
+
+int  pressure_pause (svc_t *svc);
+void pressure_resume(svc_t *svc);
+
+void pressure_init  (uev_ctx_t *ctx);
+
+#endif /* FINIT_PRESSURE_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,574 @@
+/* CPU affinity, scheduling policy, nice, I/O priority and OOM score of services
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "log.h"
+#include "prio.h"
+
+/* Not in the C library, from linux/ioprio.h */
+#define IOPRIO_CLASS_NONE       0
+#define IOPRIO_CLASS_RT         1
+#define IOPRIO_CLASS_BE         2
+#define IOPRIO_CLASS_IDLE       3
+#define IOPRIO_WHO_PROCESS      1
+#define IOPRIO_CLASS_SHIFT      13
+#define IOPRIO_PRIO_VALUE(c, l) (((c) << IOPRIO_CLASS_SHIFT) | (l))
+
+static const struct {
+	char *name;
+	int   val;
+} policies[] = {
+	{ "other", SCHED_OTHER },
+	{ "batch", SCHED_BATCH },
+	{ "idle",  SCHED_IDLE  },
+	{ "fifo",  SCHED_FIFO  },
+	{ "rr",    SCHED_RR    },
+}, ioclasses[] = {
+	{ "none",  IOPRIO_CLASS_NONE },
+	{ "rt",    IOPRIO_CLASS_RT   },
+	{ "be",    IOPRIO_CLASS_BE   },
+	{ "idle",  IOPRIO_CLASS_IDLE },
+};
+
+static const char *options[] = { "cpus:", "sched:", "nice:", "ioprio:", "oom:" };
+
+/*
+ * cpus:LIST -- comma separated CPUs and ranges, e.g. cpus:0-3,6
+ */
+static int parse_cpus(struct svc_prio *prio, const char *arg)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	while (*arg) {
+		char *ep;
+		long lo, hi;
+
+		if (!isdigit(*arg))
+			return errno = EINVAL;
+		lo = hi = strtol(arg, &ep, 10);
+		if (*ep == '-') {
+			arg = ep + 1;
+			if (!isdigit(*arg))
+				return errno = EINVAL;
+			hi = strtol(arg, &ep, 10);
+		}
+		if (lo > hi || hi >= CPU_SETSIZE)
+			return errno = EINVAL;
+		if (*ep && *ep != ',')
+			return errno = EINVAL;
+
+		while (lo <= hi)
+			CPU_SET(lo++, &set);
+
+		arg = *ep ? ep + 1 : ep;
+	}
+
+	if (!CPU_COUNT(&set))
+		return errno = EINVAL;
+
+	prio->cpus = set;
+	prio->set |= SVC_PRIO_CPUS;
+
+	return 0;
+}
+
+static int lookup(const char *arg, size_t len, int *val, int is_io)
+{
+	size_t i, num = is_io ? NELEMS(ioclasses) : NELEMS(policies);
+
+	for (i = 0; i < num; i++) {
+		const char *name = is_io ? ioclasses[i].name : policies[i].name;
+
+		if (strlen(name) == len && !strncasecmp(arg, name, len)) {
+			*val = is_io ? ioclasses[i].val : policies[i].val;
+			return 0;
+		}
+	}
+
+	return errno = EINVAL;
+}
+
+/*
+ * sched:POLICY[:PRIO] -- other, batch, idle, or fifo:PRIO and rr:PRIO
+ * with a real-time priority of 1-99.
+ */
+static int parse_sched(struct svc_prio *prio, const char *arg)
+{
+	const char *errstr = NULL, *val;
+	int policy, rt = 0;
+
+	val = strchr(arg, ':');
+	if (lookup(arg, val ? (size_t)(val - arg) : strlen(arg), &policy, 0))
+		return errno;
+
+	if (policy == SCHED_FIFO || policy == SCHED_RR) {
+		if (!val)
+			return errno = EINVAL;
+		rt = strtonum(&val[1], 1, 99, &errstr);
+	} else if (val)
+		return errno = EINVAL;
+	if (errstr)
+		return errno = EINVAL;
+
+	prio->policy = policy;
+	prio->rtprio = rt;
+	prio->set |= SVC_PRIO_SCHED;
+
+	return 0;
+}
+
+/*
+ * ioprio:CLASS[:LEVEL] -- rt or be with level 0-7, default 4, or idle
+ */
+static int parse_ioprio(struct svc_prio *prio, const char *arg)
+{
+	const char *errstr = NULL, *val;
+	int class, level = 0;
+
+	val = strchr(arg, ':');
+	if (lookup(arg, val ? (size_t)(val - arg) : strlen(arg), &class, 1))
+		return errno;
+
+	if (class == IOPRIO_CLASS_RT || class == IOPRIO_CLASS_BE) {
+		level = 4;
+		if (val)
+			level = strtonum(&val[1], 0, 7, &errstr);
+	} else if (val)
+		return errno = EINVAL;
+	if (errstr)
+		return errno = EINVAL;
+
+	prio->ioclass = class;
+	prio->iolevel = level;
+	prio->set |= SVC_PRIO_IO;
+
+	return 0;
+}
+
+static int parse_num(int *val, const char *arg, int min, int max)
+{
+	const char *errstr;
+	int num;
+
+	num = strtonum(arg, min, max, &errstr);
+	if (errstr)
+		return errno = EINVAL;
+	*val = num;
+
+	return 0;
+}
+
+/**
+ * prio_option - Check if stanza option is handled by prio_parse()
+ * @opt: Option from a service stanza, e.g. "nice:-5"
+ *
+ * Returns:
+ * Non-zero if @opt is one of cpus:, sched:, nice:, ioprio:, or oom:
+ */
+int prio_option(const char *opt)
+{
+	size_t i;
+
+	for (i = 0; i < NELEMS(options); i++) {
+		if (!strncasecmp(opt, options[i], strlen(options[i])))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * prio_parse - Parse one stanza option into @prio
+ * @prio: Scheduling settings of a service
+ * @opt:  One of cpus:LIST, sched:POLICY[:PRIO], nice:NUM,
+ *        ioprio:CLASS[:LEVEL], or oom:ADJ
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on unknown option or invalid value, in which
+ * case @prio is left unmodified.
+ */
+int prio_parse(struct svc_prio *prio, char *opt)
+{
+	char *arg;
+
+	arg = strchr(opt, ':');
+	if (!arg || !arg[1])
+		return errno = EINVAL;
+	arg++;
+
+	if (!strncasecmp(opt, "cpus:", 5))
+		return parse_cpus(prio, arg);
+	if (!strncasecmp(opt, "sched:", 6))
+		return parse_sched(prio, arg);
+	if (!strncasecmp(opt, "ioprio:", 7))
+		return parse_ioprio(prio, arg);
+
+	if (!strncasecmp(opt, "nice:", 5)) {
+		if (parse_num(&prio->nice, arg, -20, 19))
+			return errno;
+		prio->set |= SVC_PRIO_NICE;
+		return 0;
+	}
+	if (!strncasecmp(opt, "oom:", 4)) {
+		if (parse_num(&prio->oom, arg, -1000, 1000))
+			return errno;
+		prio->set |= SVC_PRIO_OOM;
+		return 0;
+	}
+
+	return errno = EINVAL;
+}
+
+/* Formatted by hand, also called between vfork() and exec() */
+static int oom_adj(pid_t pid, int adj)
+{
+	char path[32] = "/proc/self/oom_score_adj";
+	char num[12], *ptr = &num[sizeof(num)];
+	unsigned int val = adj < 0 ? -adj : adj;
+	int fd, rc = 0;
+	ssize_t len;
+
+	if (pid > 0)
+		snprintf(path, sizeof(path), "/proc/%d/oom_score_adj", pid);
+
+	do
+		*--ptr = '0' + val % 10;
+	while (val /= 10);
+	if (adj < 0)
+		*--ptr = '-';
+	len = &num[sizeof(num)] - ptr;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	if (write(fd, ptr, len) != len)
+		rc = -1;
+	close(fd);
+
+	return rc;
+}
+
+/**
+ * prio_apply - Apply scheduling settings to a process
+ * @prio: Scheduling settings of a service, %NULL if it has none
+ * @pid:  Process, or thread, to change, zero for the calling process
+ *
+ * Called in the child, before it drops privileges, since raising the
+ * real-time priority, negative nice values, and lowering the OOM score
+ * all require root.  Safe to call between vfork() and exec().
+ *
+ * Returns:
+ * POSIX OK(0), or the SVC_PRIO_* flags of the settings that failed.
+ */
+int prio_apply(struct svc_prio *prio, pid_t pid)
+{
+	int failed = 0;
+
+	if (!prio)
+		return 0;
+
+	if (prio->set & SVC_PRIO_CPUS) {
+		if (sched_setaffinity(pid, sizeof(prio->cpus), &prio->cpus))
+			failed |= SVC_PRIO_CPUS;
+	}
+
+	if (prio->set & SVC_PRIO_SCHED) {
+		struct sched_param param = { .sched_priority = prio->rtprio };
+
+		if (sched_setscheduler(pid, prio->policy, &param))
+			failed |= SVC_PRIO_SCHED;
+	}
+
+	if (prio->set & SVC_PRIO_NICE) {
+		if (setpriority(PRIO_PROCESS, pid, prio->nice))
+			failed |= SVC_PRIO_NICE;
+	}
+
+	if (prio->set & SVC_PRIO_IO) {
+		if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid,
+			    IOPRIO_PRIO_VALUE(prio->ioclass, prio->iolevel)))
+			failed |= SVC_PRIO_IO;
+	}
+
+	if (prio->set & SVC_PRIO_OOM) {
+		if (oom_adj(pid, prio->oom))
+			failed |= SVC_PRIO_OOM;
+	}
+
+	return failed;
+}
+
+/**
+ * prio_warn - Log settings that prio_apply() failed to apply
+ * @svc:    Service being started
+ * @failed: SVC_PRIO_* flags, from prio_apply()
+ */
+void prio_warn(svc_t *svc, int failed)
+{
+	struct svc_prio prio = { 0 };
+	char buf[128];
+
+	if (svc->prio)
+		prio = *svc->prio;
+	prio.set = failed;
+	logit(LOG_WARNING, "%s: prio: Failed setting %s", svc->cmd,
+	      prio_str(&prio, buf, sizeof(buf)));
+}
+
+/* All threads of a running service, the OOM score is per process */
+static int apply_threads(struct svc_prio *prio, pid_t pid)
+{
+	struct dirent *d;
+	char path[32];
+	int failed = 0;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	dir = opendir(path);
+	if (!dir)
+		return prio_apply(prio, pid);
+
+	while ((d = readdir(dir))) {
+		pid_t tid = atoi(d->d_name);
+
+		if (tid > 0)
+			failed |= prio_apply(prio, tid);
+	}
+	closedir(dir);
+
+	return failed;
+}
+
+/**
+ * prio_set - Change scheduling settings of a service at runtime
+ * @svc:  Service to change
+ * @opts: Space separated stanza options, or %NULL to only show current
+ * @buf:  Reply buffer, current settings, or reason for failure
+ * @len:  Size of @buf
+ *
+ * All options are validated before any is changed.  They are applied to
+ * all threads of the running process, if any, and are used on the next
+ * start of @svc, until its .conf is reloaded.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on invalid option or failure to apply.
+ */
+int prio_set(svc_t *svc, char *opts, char *buf, size_t len)
+{
+	struct svc_prio prio = { 0 };
+	struct svc_prio diff = { 0 };
+	char *opt, *ptr = NULL;
+	int failed;
+
+	if (svc->prio)
+		prio = *svc->prio;
+
+	for (opt = strtok_r(opts, " ", &ptr); opt; opt = strtok_r(NULL, " ", &ptr)) {
+		if (!prio_option(opt) || prio_parse(&diff, opt)) {
+			snprintf(buf, len, "invalid %s", opt);
+			return 1;
+		}
+	}
+
+	if (diff.set) {
+		if (diff.set & SVC_PRIO_CPUS)
+			prio.cpus = diff.cpus;
+		if (diff.set & SVC_PRIO_SCHED) {
+			prio.policy = diff.policy;
+			prio.rtprio = diff.rtprio;
+		}
+		if (diff.set & SVC_PRIO_NICE)
+			prio.nice = diff.nice;
+		if (diff.set & SVC_PRIO_IO) {
+			prio.ioclass = diff.ioclass;
+			prio.iolevel = diff.iolevel;
+		}
+		if (diff.set & SVC_PRIO_OOM)
+			prio.oom = diff.oom;
+		prio.set |= diff.set;
+		if (prio_update(svc, &prio)) {
+			snprintf(buf, len, "%s", strerror(errno));
+			return 1;
+		}
+	}
+
+	if (diff.set && svc->pid > 1) {
+		failed = apply_threads(&diff, svc->pid);
+		if (failed) {
+			char set[128];
+
+			diff.set = failed;
+			snprintf(buf, len, "failed applying %s to PID %d",
+				 prio_str(&diff, set, sizeof(set)), svc->pid);
+			return 1;
+		}
+		logit(LOG_NOTICE, "%s[%d]: changed %s", svc->name, svc->pid,
+		      prio_str(&diff, buf, len));
+	}
+
+	prio_str(svc->prio, buf, len);
+
+	return 0;
+}
+
+/**
+ * prio_update - Set scheduling settings of a service
+ * @svc:  Service to change
+ * @prio: New settings, copied
+ *
+ * Most services have no scheduling settings, so they are only allocated
+ * when any is set, and released when none are.  Freed in svc_gc().
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on out of memory.
+ */
+int prio_update(svc_t *svc, struct svc_prio *prio)
+{
+	if (!prio->set) {
+		free(svc->prio);
+		svc->prio = NULL;
+		return 0;
+	}
+
+	if (!svc->prio) {
+		svc->prio = malloc(sizeof(*svc->prio));
+		if (!svc->prio)
+			return errno = ENOMEM;
+	}
+	*svc->prio = *prio;
+
+	return 0;
+}
+
+static void cpus_str(cpu_set_t *set, char *buf, size_t len)
+{
+	int cpu, lo = -1;
+
+	for (cpu = 0; cpu <= CPU_SETSIZE; cpu++) {
+		char num[24];
+
+		if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, set)) {
+			if (lo < 0)
+				lo = cpu;
+			continue;
+		}
+		if (lo < 0)
+			continue;
+
+		if (lo == cpu - 1)
+			snprintf(num, sizeof(num), "%s%d", buf[5] ? "," : "", lo);
+		else
+			snprintf(num, sizeof(num), "%s%d-%d", buf[5] ? "," : "", lo, cpu - 1);
+		strlcat(buf, num, len);
+		lo = -1;
+	}
+}
+
+static const char *name(int val, int is_io)
+{
+	size_t i, num = is_io ? NELEMS(ioclasses) : NELEMS(policies);
+
+	for (i = 0; i < num; i++) {
+		if ((is_io ? ioclasses[i].val : policies[i].val) == val)
+			return is_io ? ioclasses[i].name : policies[i].name;
+	}
+
+	return "?";
+}
+
+/**
+ * prio_str - Scheduling settings as stanza options
+ * @prio: Scheduling settings of a service, %NULL if it has none
+ * @buf:  Buffer to write to
+ * @len:  Size of @buf
+ *
+ * Returns:
+ * @buf with space separated options, e.g. "cpus:2-3 nice:-5", or an
+ * empty string if none are set.
+ */
+char *prio_str(struct svc_prio *prio, char *buf, size_t len)
+{
+	char opt[32];
+
+	buf[0] = 0;
+	if (!prio)
+		return buf;
+
+	if (prio->set & SVC_PRIO_CPUS) {
+		strlcpy(buf, "cpus:", len);
+		cpus_str(&prio->cpus, buf, len);
+	}
+
+	if (prio->set & SVC_PRIO_SCHED) {
+		if (prio->rtprio)
+			snprintf(opt, sizeof(opt), " sched:%s:%d", name(prio->policy, 0), prio->rtprio);
+		else
+			snprintf(opt, sizeof(opt), " sched:%s", name(prio->policy, 0));
+		strlcat(buf, opt, len);
+	}
+
+	if (prio->set & SVC_PRIO_NICE) {
+		snprintf(opt, sizeof(opt), " nice:%d", prio->nice);
+		strlcat(buf, opt, len);
+	}
+
+	if (prio->set & SVC_PRIO_IO) {
+		if (prio->ioclass == IOPRIO_CLASS_RT || prio->ioclass == IOPRIO_CLASS_BE)
+			snprintf(opt, sizeof(opt), " ioprio:%s:%d", name(prio->ioclass, 1), prio->iolevel);
+		else
+			snprintf(opt, sizeof(opt), " ioprio:%s", name(prio->ioclass, 1));
+		strlcat(buf, opt, len);
+	}
+
+	if (prio->set & SVC_PRIO_OOM) {
+		snprintf(opt, sizeof(opt), " oom:%d", prio->oom);
+		strlcat(buf, opt, len);
+	}
+
+	if (buf[0] == ' ')
+		memmove(buf, &buf[1], strlen(buf));
+
+	return buf;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -30,6 +30,27 @@
 
 int       api_init         (uev_ctx_t *ctx);
 int       api_exit         (void);
+void      api_event        (int ev, const char *fmt, ...);
+
+int       notify_init      (uev_ctx_t *ctx);
+int       notify_exit      (void);
+
+int       heartbeat_init   (uev_ctx_t *ctx);
+int       heartbeat_exit   (void);
+int       heartbeat_stats  (char *buf, size_t len);
+int       heartbeat_dump   (int sd);
+
+struct logmux;
+struct logring;
+int       logmux_exit      (void);
+int       logmux_open      (svc_t *svc, struct logmux **mux);
+void      logmux_pid       (struct logmux *mux, pid_t pid);
+void      logmux_save      (int fd);
+int       logmux_adopt     (svc_t *svc, pid_t pid, int fd);
+struct logring *logmux_ring(svc_t *svc);
+int       logmux_tail      (struct logring *ring, int sd, int lines);
+int       logmux_follow    (struct logring *ring, int sd);
+void      logmux_release   (svc_t *svc);
 
 int       client           (int argc, char *argv[]);
 
@@ -42,6 +63,10 @@ void      plugin_run_hooks (hook_point_t no);
 
 int       plugin_init      (uev_ctx_t *ctx);
 void      plugin_exit      (void);
+int       plugin_prune_bootstrap(void);
+
+void      mem_trim         (void);
+int       mem_stats        (char *buf, size_t len);
 
 #endif /* FINIT_PRIVATE_H_ */
 
@@ -0,0 +1,638 @@
+/* Live re-exec of PID 1, keeping running services
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>		/* memfd_create() */
+#include <sys/stat.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "cond.h"
+#include "console.h"
+#include "helpers.h"
+#include "log.h"
+#include "private.h"
+#include "reexec.h"
+#include "schedule.h"
+#include "service.h"
+#include "sm.h"
+#include "sock.h"
+#include "tty.h"
+#include "utmp-api.h"
+
+/*
+ * The state is a memfd, inherited across the exec(), with one line of
+ * text per object.  Descriptors listed in it are kept open as well:
+ *
+ *     finit-state VERSION
+ *     level RUNLEVEL PREVLEVEL
+ *     client FD                      initctl waiting for the reply
+ *     svc NAME ID PID STATE BLOCK RESTARTS ONCE STARTED START_TIME START READY
+ *     store NAME ID FD:FDNAME ...    fd store of the service above
+ *     sock NAME ID SPEC FD ...       socket: of the service above
+ *     tty NAME PID
+ *     mux PID FD                     log collection, see logmux.c
+ *     cond ONESHOT NAME
+ *
+ * An ID of "-" means no ID.  Unknown lines are skipped.  Bump VERSION
+ * when the format of a line changes.
+ */
+#define REEXEC_ENV     "FINIT_REEXEC"
+#define REEXEC_VERSION 2
+#define REEXEC_LINE    1024
+
+static void reexec_work(void *arg);
+
+static struct wq work = {
+	.cb   = reexec_work,
+	.name = "reexec_work",
+};
+
+static char *state;		/* From the previous Finit, see reexec_load() */
+static int   reply_sd = -1;	/* Connection to initctl, kept across exec() */
+
+/* Copy next line of @pos to @buf, for strtok(), returns it, or NULL */
+static char *next_line(char **pos, char *buf, size_t len)
+{
+	char *line = *pos, *nl;
+	size_t n;
+
+	if (!line || !*line)
+		return NULL;
+
+	nl = strchr(line, '\n');
+	n  = nl ? (size_t)(nl - line) : strlen(line);
+	*pos = line + n + (nl ? 1 : 0);
+
+	if (n >= len)
+		n = len - 1;
+	memcpy(buf, line, n);
+	buf[n] = 0;
+
+	return line;
+}
+
+static int num(void)
+{
+	char *word = strtok(NULL, " ");
+
+	return word ? atoi(word) : 0;
+}
+
+/*
+ * Is @buf a line of @kind, and if @svc is set, also for @svc?  Leaves
+ * strtok() at the next word.
+ */
+static int is(char *buf, const char *kind, svc_t *svc)
+{
+	char *word, *id;
+
+	word = strtok(buf, " ");
+	if (!word || strcmp(word, kind))
+		return 0;
+	if (!svc)
+		return 1;
+
+	word = strtok(NULL, " ");
+	id   = strtok(NULL, " ");
+	if (!word || !id || strcmp(word, svc->name))
+		return 0;
+
+	return !strcmp(id, "-") ? !svc->id[0] : !strcmp(id, svc->id);
+}
+
+static char *slurp(int fd)
+{
+	struct stat st;
+	char *buf;
+
+	if (fstat(fd, &st))
+		return NULL;
+
+	buf = malloc(st.st_size + 1);
+	if (!buf)
+		return NULL;
+
+	if (pread(fd, buf, st.st_size, 0) != st.st_size) {
+		free(buf);
+		return NULL;
+	}
+	buf[st.st_size] = 0;
+
+	return buf;
+}
+
+/*
+ * Set %FD_CLOEXEC again on all descriptors listed in @text, so they are
+ * not leaked to services we start.
+ */
+static void cloexec(char *text)
+{
+	char buf[REEXEC_LINE], *pos = text, *word;
+
+	while (next_line(&pos, buf, sizeof(buf))) {
+		word = strtok(buf, " ");
+		if (!word)
+			continue;
+
+		if (!strcmp(word, "sock")) {
+			strtok(NULL, " ");
+			strtok(NULL, " ");
+			strtok(NULL, " ");
+		} else if (!strcmp(word, "mux")) {
+			strtok(NULL, " ");
+		} else if (strcmp(word, "client")) {
+			continue;
+		}
+
+		while ((word = strtok(NULL, " ")))
+			fcntl(atoi(word), F_SETFD, FD_CLOEXEC);
+	}
+}
+
+/* Close descriptors of a "sock" line not taken by reexec_sock() */
+static void sock_drop(void)
+{
+	char *word;
+
+	strtok(NULL, " ");
+	strtok(NULL, " ");
+	strtok(NULL, " ");
+	while ((word = strtok(NULL, " ")))
+		close(atoi(word));
+}
+
+/* Answer initctl, ACK from the new Finit or NACK if the exec failed */
+static void reply(int cmd)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = cmd,
+	};
+
+	if (reply_sd == -1)
+		return;
+
+	if (write(reply_sd, &rq, sizeof(rq)) != sizeof(rq))
+		_pe("Failed replying to re-exec request");
+	close(reply_sd);
+	reply_sd = -1;
+}
+
+static void save(int fd)
+{
+	svc_t *svc, *iter = NULL;
+	struct cond *c;
+
+	dprintf(fd, "finit-state %d\n", REEXEC_VERSION);
+	dprintf(fd, "level %d %d\n", runlevel, prevlevel);
+	if (reply_sd != -1 && !fcntl(reply_sd, F_SETFD, 0))
+		dprintf(fd, "client %d\n", reply_sd);
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (svc_is_inetd_conn(svc))
+			continue;
+
+		dprintf(fd, "svc %s %s %d %d %d %d %d %d %ld %lld %lld\n", svc->name,
+			svc->id[0] ? svc->id : "-", svc->pid, svc->state, svc->block,
+			svc->restart_cnt, svc->once, svc->started, svc->start_time,
+			svc_stamp_get(svc, SVC_STAMP_START), svc_stamp_get(svc, SVC_STAMP_READY));
+		if (svc->store) {
+			struct svc_store *st = svc->store;
+
+			dprintf(fd, "store %s %s", svc->name, svc->id[0] ? svc->id : "-");
+			for (int i = 0; i < st->num; i++) {
+				if (!fcntl(st->fd[i], F_SETFD, 0))
+					dprintf(fd, " %d:%s", st->fd[i], st->name[i]);
+			}
+			dprintf(fd, "\n");
+		}
+		if (!svc->sock)
+			continue;
+
+		dprintf(fd, "sock %s %s %s", svc->name, svc->id[0] ? svc->id : "-", svc->sock->spec);
+		for (int i = 0; i < svc->sock->num; i++) {
+			if (!fcntl(svc->sock->fd[i], F_SETFD, 0))
+				dprintf(fd, " %d", svc->sock->fd[i]);
+		}
+		dprintf(fd, "\n");
+	}
+
+	tty_save(fd);
+	logmux_save(fd);
+
+	for (c = cond_iterator(1); c; c = cond_iterator(0)) {
+		if (cond_get_state(c) == COND_ON)
+			dprintf(fd, "cond %d %s\n", c->oneshot, c->name);
+	}
+}
+
+static void reexec_work(void *arg)
+{
+	char path[PATH_MAX], env[16], *ptr, *text;
+	char *argv[] = { path, NULL };
+	ssize_t len;
+	int fd;
+
+	/* A package upgrade replaces the file, so exec the new one */
+	len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (len <= 0) {
+		_pe("Cannot find Finit executable");
+		goto fail;
+	}
+	path[len] = 0;
+	ptr = strstr(path, " (deleted)");
+	if (ptr)
+		*ptr = 0;
+
+	fd = memfd_create("finit-state", 0);
+	if (fd == -1) {
+		_pe("Failed creating re-exec state");
+		goto fail;
+	}
+
+	save(fd);
+	snprintf(env, sizeof(env), "%d", fd);
+	setenv(REEXEC_ENV, env, 1);
+
+	logit(LOG_NOTICE, "Re-executing %s ...", path);
+	utmp_flush();
+	console_exit();
+	execv(path, argv);
+	logit(LOG_ERR, "Failed re-executing %s: %m", path);
+	unsetenv(REEXEC_ENV);
+	console_init(ctx);
+
+	text = slurp(fd);
+	if (text) {
+		cloexec(text);
+		free(text);
+	}
+	close(fd);
+fail:
+	reply(INIT_CMD_NACK);
+}
+
+/**
+ * reexec_check - Can Finit re-exec itself now?
+ * @buf: Buffer for the reason, if not
+ * @len: Size of @buf
+ *
+ * Only a system that has settled can be picked up by the new Finit,
+ * not one in bootstrap, changing runlevel, or stopping a service.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if a re-exec must wait.
+ */
+int reexec_check(char *buf, size_t len)
+{
+	svc_t *svc, *iter = NULL;
+
+	if (getpid() != 1) {
+		snprintf(buf, len, "Finit is not PID 1");
+		return 1;
+	}
+
+	if (reply_sd != -1) {
+		snprintf(buf, len, "Re-exec already in progress");
+		return 1;
+	}
+
+	if (runlevel == 0 || runlevel == 6 || sm.state != SM_RUNNING_STATE) {
+		snprintf(buf, len, "Cannot re-exec during bootstrap, runlevel change, or reload");
+		return 1;
+	}
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (svc->state == SVC_STOPPING_STATE) {
+			snprintf(buf, len, "Cannot re-exec while %s is stopping", svc->name);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * reexec - Re-exec Finit, keeping all services running
+ * @sd: Connection to initctl, for the reply from the new Finit
+ *
+ * The state is saved and exec() called from the event loop, after the
+ * reply to the request has been sent.
+ */
+void reexec(int sd)
+{
+	reply_sd = sd;
+	schedule_work(&work);
+}
+
+/**
+ * reexec_load - Load state saved by Finit before a re-exec
+ *
+ * Called early by main(), before any .conf is read, restores runlevel
+ * so bootstrap-only run/task are not registered again.
+ *
+ * Returns:
+ * Non-zero if Finit was re-executed, i.e., bootstrap must be skipped.
+ */
+int reexec_load(void)
+{
+	char buf[REEXEC_LINE], *env, *pos;
+	int fd, ver = 0;
+
+	env = getenv(REEXEC_ENV);
+	if (!env)
+		return 0;
+
+	fd = atoi(env);
+	unsetenv(REEXEC_ENV);
+
+	state = slurp(fd);
+	close(fd);
+	if (!state) {
+		_pe("Failed reading state from before re-exec");
+		return 1;
+	}
+
+	cloexec(state);
+	if (sscanf(state, "finit-state %d", &ver) != 1 || ver != REEXEC_VERSION) {
+		_e("Unsupported re-exec state version %d, services not adopted", ver);
+		free(state);
+		state = NULL;
+		return 1;
+	}
+
+	pos = state;
+	while (next_line(&pos, buf, sizeof(buf))) {
+		if (!is(buf, "level", NULL))
+			continue;
+
+		runlevel  = num();
+		prevlevel = num();
+	}
+
+	return 1;
+}
+
+/**
+ * reexec_sock - Take over listening sockets of a service after re-exec
+ * @svc:  Pointer to &svc_t
+ * @spec: Argument to socket:
+ *
+ * Called by sock_parse(), with an empty svc->sock, instead of binding
+ * new sockets.  Sockets of an unchanged @spec are taken over, otherwise
+ * they are closed.
+ *
+ * Returns:
+ * Number of sockets taken over, zero if none.
+ */
+int reexec_sock(svc_t *svc, char *spec)
+{
+	char buf[REEXEC_LINE], *pos = state, *line, *word;
+	struct svc_sock *sk = svc->sock;
+
+	if (!state)
+		return 0;
+
+	while ((line = next_line(&pos, buf, sizeof(buf)))) {
+		if (!is(buf, "sock", svc))
+			continue;
+
+		/* Taken, or closed, by us now */
+		*line = '#';
+
+		word = strtok(NULL, " ");
+		if (!word || strcmp(word, spec)) {
+			while ((word = strtok(NULL, " ")))
+				close(atoi(word));
+			return 0;
+		}
+
+		while ((word = strtok(NULL, " ")) && sk->num < SVC_MAX_SOCK)
+			sk->fd[sk->num++] = atoi(word);
+		_d("%s: took over %d listening sockets", svc->name, sk->num);
+
+		return sk->num;
+	}
+
+	return 0;
+}
+
+static void restore_svc(void)
+{
+	char *name, *id, *word;
+	int state, block, restarts, once, started;
+	long long stamp[2] = { 0 };
+	long start_time = 0;
+	pid_t pid;
+	svc_t *svc;
+
+	name = strtok(NULL, " ");
+	id   = strtok(NULL, " ");
+	if (!name || !id)
+		return;
+	if (!strcmp(id, "-"))
+		id = NULL;
+
+	pid      = num();
+	state    = num();
+	block    = num();
+	restarts = num();
+	once     = num();
+	started  = num();
+	word     = strtok(NULL, " ");
+	if (word)
+		start_time = atol(word);
+	for (int i = 0; i < 2 && (word = strtok(NULL, " ")); i++)
+		stamp[i] = atoll(word);
+
+	/* Zombies still exist, they are collected as usual */
+	if (pid > 0 && kill(pid, 0))
+		pid = 0;
+
+	svc = svc_find_by_nameid(name, id);
+	if (!svc) {
+		if (pid > 0)
+			logit(LOG_WARNING, "%s[%d] no longer in configuration, not monitored", name, pid);
+		return;
+	}
+
+	/* Listening socket is set up again by inetd_new() */
+	if (svc_is_inetd(svc))
+		return;
+
+	svc->block      = block;
+	svc->once       = once;
+	svc->started    = started;
+	svc->start_time = start_time;
+	if (stamp[0] && svc_stats(svc)) {
+		svc->stats->stamp[SVC_STAMP_START] = stamp[0];
+		svc->stats->stamp[SVC_STAMP_READY] = stamp[1];
+	}
+	service_adopt(svc, pid, state, restarts);
+}
+
+/* Stored descriptors, fdstore:NUM of the service may have changed */
+static void restore_store(void)
+{
+	char *name, *id, *word;
+	svc_t *svc;
+
+	name = strtok(NULL, " ");
+	id   = strtok(NULL, " ");
+	if (!name || !id)
+		return;
+
+	svc = svc_find_by_nameid(name, strcmp(id, "-") ? id : NULL);
+	while ((word = strtok(NULL, " "))) {
+		char *fdname;
+		int fd;
+
+		fdname = strchr(word, ':');
+		if (fdname)
+			*fdname++ = 0;
+		fd = atoi(word);
+		if (fd <= 2)
+			continue;
+
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if (svc && svc->fdstore)
+			sock_store(svc, &fd, 1, fdname);
+		else
+			close(fd);
+	}
+}
+
+static void restore_tty(void)
+{
+	struct tty *tty;
+	char *name;
+	pid_t pid;
+
+	name = strtok(NULL, " ");
+	pid  = num();
+	if (!name || pid <= 0 || kill(pid, 0))
+		return;
+
+	tty = tty_find(name);
+	if (tty)
+		tty_adopt(tty, pid);
+}
+
+static void restore_mux(void)
+{
+	svc_t *svc;
+	pid_t pid;
+	int fd;
+
+	pid = num();
+	fd  = num();
+	if (fd <= 0)
+		return;
+
+	svc = svc_find_by_pid(pid);
+	if (!svc || logmux_adopt(svc, pid, fd))
+		close(fd);
+}
+
+static void restore_cond(void)
+{
+	int oneshot;
+	char *name;
+
+	oneshot = num();
+	name    = strtok(NULL, " ");
+	if (!name)
+		return;
+
+	if (oneshot)
+		cond_set_oneshot(name);
+	else
+		cond_set(name);
+}
+
+/**
+ * reexec_restore - Resume from the state saved before a re-exec
+ *
+ * Called by main() instead of bootstrap, when all .conf have been read.
+ * Services and TTYs still running are adopted, conditions asserted, and
+ * stepped, before initctl is told the re-exec has completed.
+ */
+void reexec_restore(void)
+{
+	char buf[REEXEC_LINE], *pos = state, *kind;
+
+	sm_init(&sm);
+	sm.state = SM_RUNNING_STATE;
+
+	cond_batch_begin();
+	while (next_line(&pos, buf, sizeof(buf))) {
+		kind = strtok(buf, " ");
+		if (!kind)
+			continue;
+
+		if (!strcmp(kind, "svc"))
+			restore_svc();
+		else if (!strcmp(kind, "sock"))
+			sock_drop();
+		else if (!strcmp(kind, "store"))
+			restore_store();
+		else if (!strcmp(kind, "tty"))
+			restore_tty();
+		else if (!strcmp(kind, "mux"))
+			restore_mux();
+		else if (!strcmp(kind, "cond"))
+			restore_cond();
+		else if (!strcmp(kind, "client"))
+			reply_sd = num();
+	}
+	cond_batch_commit();
+
+	free(state);
+	state = NULL;
+
+	log_silent();
+	tty_runlevel();
+	service_step_all(SVC_TYPE_ANY);
+
+	/* Collect anything that exited while we were in exec() */
+	raise(SIGCHLD);
+
+	logit(LOG_NOTICE, "Re-exec complete, runlevel %d", runlevel);
+	reply(INIT_CMD_ACK);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -23,6 +23,7 @@
 
 #include "config.h"
 #include "finit.h"
+#include "metrics.h"
 #include "schedule.h"
 
 #define SC_INIT 0x494E4954	/* "INIT", see ascii(7) */
@@ -33,13 +34,16 @@
 static void cb(uev_t *w, void *arg, int events)
 {
 	struct wq *work = (struct wq *)arg;
+	uint64_t start;
 
 	if (UEV_ERROR == events) {
 		uev_timer_start(w);
 		return;
 	}
 
+	start = metric_start();
 	work->cb(work);
+	metric_stop(work->name ?: "work", start);
 }
 
 /*
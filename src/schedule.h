@@ -30,6 +30,7 @@ struct wq {
 	int     delay;		/* msec delay before starting work */
 	void  (*cb)(void *);
 	void   *arg;
+	char   *name;		/* For initctl metrics, default "work" */
 };
 
 int   schedule_work(struct wq *work);
@@ -27,6 +27,7 @@
 #include <ctype.h>		/* isblank() */
 #include <sched.h>		/* sched_yield() */
 #include <string.h>
+#include <time.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <net/if.h>
@@ -37,24 +38,84 @@
 #include "cond.h"
 #include "finit.h"
 #include "helpers.h"
+#include "admit.h"
+#include "boot.h"
 #include "inetd.h"
+#include "health.h"
+#include "lazy.h"
+#include "metrics.h"
+#include "mount.h"
 #include "pid.h"
+#include "pressure.h"
+#include "prio.h"
 #include "private.h"
 #include "sig.h"
 #include "service.h"
+#include "shm.h"
 #include "sm.h"
+#include "sock.h"
 #include "tty.h"
 #include "util.h"
 #include "utmp-api.h"
 #include "schedule.h"
 
-#define RESPAWN_MAX    10	/* Prevent endless respawn of faulty services. */
-
 static struct wq work = {
 	.cb = service_worker,
+	.name = "service_worker",
 };
 
 static void svc_set_state(svc_t *svc, svc_state_t new);
+static int  register_one(int type, char *cfg, struct rlimit rlimit[], char *file,
+			 char *inst, svc_t *tmpl, svc_t **result);
+
+/*
+ * A run job in progress.  Run jobs are started asynchronously, but are
+ * serialized, and any service registered after one waits for it.
+ */
+static svc_t *run_gate;
+
+static int service_blocked(svc_t *svc)
+{
+	/* Limit parallel run/task at bootstrap, see bootstrap-jobs */
+	if (runlevel == 0 && boot_jobs > 0 && svc_is_runtask(svc) &&
+	    boot_active >= boot_jobs)
+		return 1;
+
+	if (!run_gate || run_gate == svc)
+		return 0;
+
+	return svc->type == SVC_TYPE_RUN || svc->seq > run_gate->seq;
+}
+
+/*
+ * Run/task completed, or removed, let services waiting for it to
+ * complete, or for a free bootstrap job slot, start.
+ */
+static void service_job_done(svc_t *svc)
+{
+	svc_t *iter = NULL;
+	int release = 0;
+
+	if (svc->boot_job) {
+		svc->boot_job = 0;
+		boot_active--;
+		release = 1;
+	}
+
+	if (run_gate == svc) {
+		run_gate = NULL;
+		release = 1;
+	}
+
+	if (!release)
+		return;
+
+	_d("%s done, releasing any waiting services", svc->cmd);
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (svc->state == SVC_READY_STATE)
+			service_schedule(svc);
+	}
+}
 
 /**
  * service_timeout_cb - libuev callback wrapper for service timeouts
@@ -177,6 +238,15 @@ static int lredirect(svc_t *svc)
 	pid_t pid;
 	int fd;
 
+	/* Collected by Finit, see logmux.c */
+	if (svc->log.mux_fd > 0) {
+		dup2(svc->log.mux_fd, STDOUT_FILENO);
+		dup2(svc->log.mux_fd, STDERR_FILENO);
+		close(svc->log.mux_fd);
+
+		return 0;
+	}
+
 	/*
 	 * Open PTY to connect to logger.  A pty isn't buffered
 	 * like a pipe, and it eats newlines so they aren't logged
@@ -195,6 +265,7 @@ static int lredirect(svc_t *svc)
 	dup2(fd, STDOUT_FILENO);
 	dup2(fd, STDERR_FILENO);
 
+	metric_inc(METRIC_FORK);
 	pid = fork();
 	if (pid == 0) {
 		int fds;
@@ -210,14 +281,17 @@ static int lredirect(svc_t *svc)
 		/* Reset signals */
 		sig_unblock();
 
-		if (svc->log.file[0] == '/') {
+		if (svc->log.file) {
 #ifdef LOGIT_ENABLED
 			char sz[20], num[3];
 
 			snprintf(sz, sizeof(sz), "%d", logfile_size_max);
 			snprintf(num, sizeof(num), "%d", logfile_count_max);
 
-			execlp("logit", "logit", "-f", svc->log.file, "-n", sz, "-r", num, NULL);
+			if (svc->log.durable)
+				execlp("logit", "logit", "-d", "-f", svc->log.file, "-n", sz, "-r", num, NULL);
+			else
+				execlp("logit", "logit", "-f", svc->log.file, "-n", sz, "-r", num, NULL);
 			_exit(0);
 #else
 			logit(LOG_INFO, "logit disabled, logging %s to syslog instead", svc->name);
@@ -278,6 +352,174 @@ static int redirect(svc_t *svc)
 	return 0;
 }
 
+/*
+ * Can @svc be started by service_spawn()?  Internal inetd services run
+ * code in the child, and logging via logit forks off a logger, so they
+ * are started with fork().  As are non-root services without absolute
+ * path, their PATH is only set in the child, and services with sockets
+ * or stored descriptors to pass, $LISTEN_PID must be the PID of the child.
+ */
+static int service_can_spawn(svc_t *svc)
+{
+	if (svc_is_internal(svc))
+		return 0;
+
+	if (svc->log.enabled && !svc->log.null && !svc->log.console && !svc->log.mux_fd)
+		return 0;
+
+	if (svc->sock || svc->store)
+		return 0;
+
+	if (!svc_is_runtask(svc) && !strchr(svc->cmd, '/') &&
+	    svc->username[0] && strcmp(svc->username, "root"))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Fast path of service_start(), using vfork() to save copying the page
+ * tables of PID 1.  The child borrows our memory until it calls exec,
+ * so all lookups, argv, and environment are prepared here, the child
+ * only makes system calls.  Called with SIGCHLD blocked.
+ *
+ * Returns:
+ * PID of child, or -1 on error.
+ */
+static pid_t service_spawn(svc_t *svc)
+{
+	extern char **environ;
+	char *args[3] = { svc->cmd, NULL, NULL };
+	char *sh[4] = { "sh", "-c", NULL, NULL };
+	char **argv = args, **envp = environ;
+	char *path, *home = NULL;
+	struct svc_exec *exec = NULL;
+	char cmdline[1024], envhome[CMD_SIZE], envwdog[32];
+	char *xargv[MAX_NUM_SVC_ARGS + 1], xbuf[LINE_SIZE];
+	volatile int err = 0;	/* Set by child, we share memory */
+	volatile int prio = 0;
+	int uid, gid, num = 0;
+	pid_t pid;
+
+#ifdef ENABLE_STATIC
+	uid = 0; /* XXX: Fix better warning that dropprivs is disabled. */
+	gid = 0;
+#else
+	uid = getuser(svc->username, &home);
+	gid = getgroup(svc->group);
+#endif
+
+	while (environ[num])
+		num++;
+	char *env[num + 5];
+
+	/* Same environment as the fork() path sets up in the child */
+	if (uid >= 0 && (uid > 0 || home)) {
+		int i, j = 0;
+
+		for (i = 0; i < num; i++) {
+			if (!strncmp(environ[i], "HOME=", 5) ||
+			    (uid > 0 && !strncmp(environ[i], "PATH=", 5)))
+				continue;
+			env[j++] = environ[i];
+		}
+		if (uid > 0)
+			env[j++] = "PATH=" _PATH_DEFPATH;
+		if (home) {
+			snprintf(envhome, sizeof(envhome), "HOME=%s", home);
+			env[j++] = envhome;
+		}
+		env[j] = NULL;
+		envp = env;
+	}
+
+	/* Readiness notification, appended to whichever env we use */
+	if (svc->notify) {
+		int i, j = 0;
+
+		if (envp == environ) {
+			for (i = 0; i < num; i++)
+				env[j++] = environ[i];
+		} else {
+			while (env[j])
+				j++;
+		}
+
+		for (i = 0; i < j; i++) {
+			if (strncmp(env[i], "NOTIFY_SOCKET=", 14) &&
+			    strncmp(env[i], "WATCHDOG_USEC=", 14))
+				continue;
+			env[i--] = env[--j];
+		}
+		env[j++] = "NOTIFY_SOCKET=" INIT_NOTIFY;
+		if (svc->watchdog) {
+			snprintf(envwdog, sizeof(envwdog), "WATCHDOG_USEC=%lld",
+				 (long long)svc->watchdog * 1000000);
+			env[j++] = envwdog;
+		}
+		env[j] = NULL;
+		envp = env;
+	}
+
+	if (svc_is_sysv(svc))
+		args[1] = "start";
+	else if (svc->args)
+		argv = svc_get_argv(svc, xargv, xbuf, sizeof(xbuf));
+
+	if (svc_is_runtask(svc)) {
+		sh[2] = runtask_cmdline(svc->cmd, argv, cmdline, sizeof(cmdline));
+		argv  = sh;
+		path  = _PATH_BSHELL;
+	} else {
+		/* Resolved by service_start(), opened for fexecve() */
+		exec  = svc->exec;
+		if (!exec)
+			return -1;
+		path  = exec->path;
+	}
+
+	metric_inc(METRIC_FORK);
+	pid = vfork();
+	if (pid == 0) {
+		for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+			if (setrlimit(i, &svc->config->rlimit[i]) == -1)
+				err = i + 1;
+		}
+		prio = prio_apply(svc->prio, 0);
+
+		if (gid >= 0)
+			setgid(gid);
+		if (uid >= 0) {
+			setuid(uid);
+			if (home)
+				chdir(home);
+		}
+
+		if (svc->cgroup_fd >= 0)
+			cgroup_join(svc->cgroup_fd);
+
+		/* See service_start() for details */
+		setsid();
+
+		redirect(svc);
+		sig_unblock();
+
+		if (exec && exec->fd >= 0)
+			fexecve(exec->fd, argv, envp);
+		else
+			execve(path, argv, envp);
+		_exit(-1);
+	}
+
+	if (err)
+		logit(LOG_WARNING, "%s: rlimit: Failed setting %s",
+		      svc->cmd, rlim2str(err - 1));
+	if (prio)
+		prio_warn(svc, prio);
+
+	return pid;
+}
+
 static int is_norespawn(void)
 {
 	return  sig_stopped()            ||
@@ -294,7 +536,8 @@ static int is_norespawn(void)
  */
 static int service_start(svc_t *svc)
 {
-	int i, result = 0, do_progress = 1;
+	int result = 0, do_progress = 1;
+	struct logmux *mux = NULL;
 	pid_t pid;
 	sigset_t nmask, omask;
 
@@ -306,7 +549,7 @@ static int service_start(svc_t *svc)
 		return 1;
 
 	/* Don't try and start service if it doesn't exist. */
-	if (!whichp(svc->cmd) && !svc->inetd.cmd) {
+	if (!svc_is_internal(svc) && !svc_get_exec(svc)) {
 		print(1, "Service %s does not exist", svc->cmd);
 		svc_missing(svc);
 		return 1;
@@ -314,32 +557,53 @@ static int service_start(svc_t *svc)
 
 #ifdef INETD_ENABLED
 	if (svc_is_inetd(svc))
-		return inetd_start(&svc->inetd);
+		return inetd_start(svc->inetd);
 #endif
 	if (svc_is_sysv(svc)) {
 		logit(LOG_CONSOLE | LOG_NOTICE, "Calling '%s start' ...", svc->cmd);
 	}
 
-	if (!svc->desc[0])
+	if (!svc->config->desc[0])
 		do_progress = 0;
 
 	if (do_progress) {
 		if (svc_is_daemon(svc) || svc_is_sysv(svc))
-			print_desc("Starting ", svc->desc);
+			print_desc("Starting ", svc->config->desc);
 		else
-			print_desc("", svc->desc);
+			print_desc("", svc->config->desc);
 	}
 
 	/* Declare we're waiting for svc to create its pidfile */
 	svc_starting(svc);
+	if (svc->notify_msg)
+		svc->notify_msg[0] = 0;
+	svc->notify_wdog = 0;
 
 	/* Block SIGCHLD while forking.  */
 	sigemptyset(&nmask);
 	sigaddset(&nmask, SIGCHLD);
 	sigprocmask(SIG_BLOCK, &nmask, &omask);
 
-	pid = fork();
-	cgroup_service(svc->name, svc->id, pid);
+	/* Started directly in its cgroup, unless cgroup v1 */
+	if (svc->cgroup_fd < 0) {
+		svc->cgroup_fd = cgroup_service_open(svc->name, svc->id);
+		cgroup_service_config(svc->cgroup_fd, svc->cgroup);
+	}
+
+	/* Output to syslog is collected by us, instead of a logit per service */
+	if (svc->log.enabled && !svc->log.null && !svc->log.console && !svc->log.file) {
+		svc->log.mux_fd = logmux_open(svc, &mux);
+		if (svc->log.mux_fd < 0)
+			svc->log.mux_fd = 0;
+	}
+
+	if (service_can_spawn(svc))
+		pid = service_spawn(svc);
+	else
+		pid = cgroup_fork(svc->cgroup_fd);
+	metric_inc(METRIC_SPAWN);
+	if (svc->cgroup_fd < 0)
+		cgroup_service(svc->name, svc->id, pid);
 
 	if (pid == 0) {
 		int status;
@@ -351,16 +615,22 @@ static int service_start(svc_t *svc)
 		int uid = getuser(svc->username, &home);
 		int gid = getgroup(svc->group);
 #endif
-		char *args[MAX_NUM_SVC_ARGS];
+		char *args[3] = { svc->cmd, NULL, NULL };
+		char *xargv[MAX_NUM_SVC_ARGS + 1], xbuf[LINE_SIZE];
+		char **argv = args;
 
 		/* Set configured limits */
 		for (int i = 0; i < RLIMIT_NLIMITS; i++) {
-			if (setrlimit(i, &svc->rlimit[i]) == -1)
+			if (setrlimit(i, &svc->config->rlimit[i]) == -1)
 				logit(LOG_WARNING,
 				      "%s: rlimit: Failed setting %s",
 				      svc->cmd, rlim2str(i));
 		}
 
+		/* CPU and I/O scheduling, before dropping privileges */
+		if ((status = prio_apply(svc->prio, 0)))
+			prio_warn(svc, status);
+
 		/* Set desired user+group */
 		if (gid >= 0)
 			setgid(gid);
@@ -377,15 +647,22 @@ static int service_start(svc_t *svc)
 			}
 		}
 
-		if (!svc_is_sysv(svc)) {
-			for (i = 0; i < (MAX_NUM_SVC_ARGS - 1) && svc->args[i][0] != 0; i++)
-				args[i] = svc->args[i];
-		} else {
-			i = 0;
-			args[i++] = svc->cmd;
-			args[i++] = "start";
+		if (svc->notify) {
+			setenv("NOTIFY_SOCKET", INIT_NOTIFY, 1);
+			if (svc->watchdog) {
+				char usec[24];
+
+				snprintf(usec, sizeof(usec), "%lld", (long long)svc->watchdog * 1000000);
+				setenv("WATCHDOG_USEC", usec, 1);
+			}
 		}
-		args[i] = NULL;
+		if (sock_pass(svc))
+			_pe("%s: failed passing listening sockets", svc->cmd);
+
+		if (svc_is_sysv(svc))
+			args[1] = "start";
+		else if (svc->args)
+			argv = svc_get_argv(svc, xargv, xbuf, sizeof(xbuf));
 
 		/*
 		 * The setsid() call is the most humble of all in this
@@ -404,16 +681,20 @@ static int service_start(svc_t *svc)
 		redirect(svc);
 		sig_unblock();
 
-		if (svc->inetd.cmd)
-			status = svc->inetd.cmd(svc->inetd.type);
+		if (svc_is_internal(svc))
+			status = svc->inetd->cmd(svc->inetd->type);
 		else if (svc_is_runtask(svc))
-			status = exec_runtask(svc->cmd, args);
+			status = exec_runtask(svc->cmd, argv);
+		else if (!svc->exec || (uid > 0 && !strchr(svc->cmd, '/')))
+			status = execvp(svc->cmd, argv); /* User's $PATH */
+		else if (svc->exec->fd >= 0)
+			status = fexecve(svc->exec->fd, argv, environ);
 		else
-			status = execvp(svc->cmd, args);
+			status = execv(svc->exec->path, argv);
 
 #ifdef INETD_ENABLED
 		if (svc_is_inetd_conn(svc)) {
-			if (svc->inetd.type == SOCK_STREAM) {
+			if (svc->inetd->type == SOCK_STREAM) {
 				close(STDIN_FILENO);
 				close(STDOUT_FILENO);
 				close(STDERR_FILENO);
@@ -422,34 +703,37 @@ static int service_start(svc_t *svc)
 #endif
 		_exit(status);
 	} else if (log_is_debug()) {
-		char buf[CMD_SIZE] = "";
+		char buf[CMD_SIZE];
 
-		for (i = 0; i < (MAX_NUM_SVC_ARGS - 1) && svc->args[i][0] != 0; i++) {
-			char arg[MAX_ARG_LEN + 1];
+		_d("Starting %s: %s", svc->cmd, svc_args_str(svc, 0, buf, sizeof(buf)));
+	}
 
-			snprintf(arg, sizeof(arg), "%s ", svc->args[i]);
-			if (strlen(arg) < (sizeof(buf) - strlen(buf)))
-				strlcat(buf, arg, sizeof(buf));
-		}
-		_d("Starting %s: %s", svc->cmd, buf);
+	if (svc->log.mux_fd > 0) {
+		close(svc->log.mux_fd);
+		svc->log.mux_fd = 0;
 	}
+	logmux_pid(mux, pid);
 
 	logit(LOG_CONSOLE | LOG_NOTICE, "Starting %s:%s, PID: %d",
 	      basename(svc->cmd), svc->id, pid);
 
-	svc->pid = pid;
+	svc_set_pid(svc, pid);
 	svc->start_time = jiffies();
+	svc_stamp(svc, SVC_STAMP_START);
+
+	if (pid > 0) {
+		boot_job_start(svc);
+		if (runlevel == 0 && svc_is_runtask(svc)) {
+			svc->boot_job = 1;
+			boot_active++;
+		}
+	}
 
 	switch (svc->type) {
 	case SVC_TYPE_RUN:
-		svc->status = complete(svc->cmd, pid);
-		if (WIFEXITED(svc->status) && !WEXITSTATUS(svc->status))
-			result = 0;
-		else
-			result = 1;
-		svc->start_time = svc->pid = 0;
-		svc->once++;
-		svc_set_state(svc, SVC_STOPPING_STATE);
+		/* Collected by service_monitor(), like a task */
+		if (pid > 0)
+			run_gate = svc;
 		break;
 
 	case SVC_TYPE_SERVICE:
@@ -458,7 +742,7 @@ static int service_start(svc_t *svc)
 
 #ifdef INETD_ENABLED
 	case SVC_TYPE_INETD_CONN:
-		if (svc->inetd.type == SOCK_STREAM)
+		if (svc->inetd->type == SOCK_STREAM)
 			close(svc->stdin_fd);
 		break;
 #endif
@@ -494,9 +778,11 @@ static void service_kill(svc_t *svc)
 	logit(LOG_CONSOLE | LOG_NOTICE, "Stopping %s:%s, PID: %d, sending SIGKILL ...",
 	      basename(svc->cmd), svc->id, svc->pid);
 	if (runlevel != 1)
-		print_desc("Killing ", svc->desc);
+		print_desc("Killing ", svc->config->desc);
 
-	kill(-svc->pid, SIGKILL);
+	/* Entire cgroup, even processes that left the process group */
+	if (cgroup_kill(svc->cgroup_fd))
+		kill(-svc->pid, SIGKILL);
 
 	/* Let SIGKILLs stand out, show result as [WARN] */
 	if (runlevel != 1)
@@ -525,9 +811,9 @@ static int service_stop(svc_t *svc)
 		int do_progress = runlevel != 1 && !svc_is_busy(svc);
 
 		if (do_progress)
-			print_desc("Stopping ", svc->desc);
+			print_desc("Stopping ", svc->config->desc);
 
-		inetd_stop(&svc->inetd);
+		inetd_stop(svc->inetd);
 
 		if (do_progress)
 			print_result(0);
@@ -550,15 +836,18 @@ static int service_stop(svc_t *svc)
 		logit(LOG_CONSOLE | LOG_NOTICE, "Calling '%s stop' ...", svc->cmd);
 	}
 
+	svc_stamp(svc, SVC_STAMP_STOP);
 	svc_set_state(svc, SVC_STOPPING_STATE);
 
 	if (runlevel != 1)
-		print_desc("Stopping ", svc->desc);
+		print_desc("Stopping ", svc->config->desc);
 
 	if (!svc_is_sysv(svc)) {
 		if (svc->pid <= 1)
 			goto cleanup;
 
+		/* A frozen cgroup cannot act on the signal, see shed: */
+		pressure_resume(svc);
 		res = kill(-svc->pid, svc->sighalt);
 
 		/* PID lost or forking process never really started */
@@ -573,12 +862,15 @@ static int service_stop(svc_t *svc)
 				      basename(svc->cmd), fn);
 
 			/* No longer running, update books. */
-			svc->start_time = svc->pid = 0;
+			svc_stamp(svc, SVC_STAMP_EXIT);
+			svc_set_pid(svc, 0);
+			svc->start_time = 0;
 		}
 	} else {
 		char *args[] = { svc->cmd, "stop", NULL };
 		pid_t pid;
 
+		metric_inc(METRIC_FORK);
 		pid = fork();
 		switch (pid) {
 		case 0:
@@ -626,21 +918,22 @@ static int service_restart(svc_t *svc)
 
 	if (svc->pid <= 1) {
 		_d("Bad PID %d for %s, SIGHUP", svc->pid, svc->cmd);
-		svc->start_time = svc->pid = 0;
+		svc_set_pid(svc, 0);
+		svc->start_time = 0;
 		return 1;
 	}
 
 	/* Skip progress if desc disabled or bootstrap task */
-	if (!svc->desc[0] || svc_in_runlevel(svc, 0))
+	if (!svc->config->desc[0] || svc_in_runlevel(svc, 0))
 		do_progress = 0;
 
 	if (do_progress)
-		print_desc("Restarting ", svc->desc);
+		print_desc("Restarting ", svc->config->desc);
 
 	_d("Sending SIGHUP to PID %d", svc->pid);
 	logit(LOG_CONSOLE | LOG_NOTICE, "Restarting %s:%s, PID: %d, sending SIGHUP ...",
 	      basename(svc->cmd), svc->id, svc->pid);
-	rc = kill(svc->pid, SIGHUP);
+	rc = svc_signal(svc, SIGHUP);
 
 	/* Declare we're waiting for svc to re-assert/touch its pidfile */
 	svc_starting(svc);
@@ -689,6 +982,24 @@ void service_runlevel(int newlevel)
 		networking(0);
 }
 
+/* log:ring:SIZE -- size of in-memory log, in bytes, 0 to disable */
+static void parse_ring(svc_t *svc, char *arg)
+{
+	const char *errstr;
+	long long size;
+
+	if (!arg)
+		return;
+
+	size = strtonum(arg, 0, 1024 * 1024, &errstr);
+	if (errstr) {
+		_e("%s: log ring size %s is %s (0-1048576)", svc->cmd, arg, errstr);
+		return;
+	}
+
+	svc->log.ring_size = size ? (int)size : -1;
+}
+
 /*
  * log:/path/to/logfile,priority:facility.level,tag:ident
  */
@@ -704,8 +1015,14 @@ static void parse_log(svc_t *svc, char *arg)
 			svc->log.null = 1;
 		else if (!strcmp(tok, "console") || !strcmp(tok, "/dev/console"))
 			svc->log.console = 1;
-		else if (tok[0] == '/')
-			strlcpy(svc->log.file, tok, sizeof(svc->log.file));
+		else if (!strcmp(tok, "durable"))
+			svc->log.durable = 1;
+		else if (!strcmp(tok, "ring"))
+			parse_ring(svc, strtok(NULL, ","));
+		else if (tok[0] == '/') {
+			free(svc->log.file);
+			svc->log.file = strdup(tok);
+		}
 		else if (!strcmp(tok, "priority") || !strcmp(tok, "prio"))
 			strlcpy(svc->log.prio, strtok(NULL, ","), sizeof(svc->log.prio));
 		else if (!strcmp(tok, "tag") || !strcmp(tok, "identity") || !strcmp(tok, "ident"))
@@ -741,6 +1058,132 @@ static void parse_killdelay(svc_t *svc, char *delay)
 	svc->killdelay = (int)(sec * 1000);
 }
 
+/*
+ * notify:systemd -- service signals readiness with sd_notify(3) on the
+ * socket in $NOTIFY_SOCKET instead of creating a PID file.
+ */
+static void parse_notify(svc_t *svc, char *arg)
+{
+	svc->notify = 0;
+	if (!arg)
+		return;
+
+	if (!strcasecmp(arg, "systemd"))
+		svc->notify = 1;
+	else if (strcasecmp(arg, "pid"))
+		logit(LOG_WARNING, "%s: unsupported notify:%s, using PID file", svc->cmd, arg);
+}
+
+/*
+ * watchdog:SEC -- service with notify:systemd must send WATCHDOG=1 at
+ * least every SEC seconds, or the bundled watchdogd stops kicking the
+ * hardware watchdog and the system reboots.  For critical services.
+ */
+static void parse_watchdog(svc_t *svc, char *arg)
+{
+	const char *errstr;
+
+	svc->watchdog = 0;
+	if (!arg)
+		return;
+
+	svc->watchdog = strtonum(arg, 1, 3600, &errstr);
+	if (errstr) {
+		logit(LOG_WARNING, "%s: invalid watchdog:%s, %s", svc->cmd, arg, errstr);
+		svc->watchdog = 0;
+	} else if (!svc->notify) {
+		logit(LOG_WARNING, "%s: watchdog:%s requires notify:systemd", svc->cmd, arg);
+		svc->watchdog = 0;
+	}
+}
+
+/*
+ * fdstore:NUM -- hold up to NUM descriptors sent by the service with
+ * FDSTORE=1 across its restarts, see sock_store().  A service can then
+ * keep, e.g., accepted connections or a memfd cache, when restarted.
+ */
+static void parse_fdstore(svc_t *svc, char *arg)
+{
+	const char *errstr;
+
+	svc->fdstore = 0;
+	if (arg) {
+		svc->fdstore = strtonum(arg, 1, SVC_MAX_STORE, &errstr);
+		if (errstr) {
+			logit(LOG_WARNING, "%s: invalid fdstore:%s, %s", svc->cmd, arg, errstr);
+			svc->fdstore = 0;
+		} else if (!svc->notify) {
+			logit(LOG_WARNING, "%s: fdstore:%s requires notify:systemd", svc->cmd, arg);
+			svc->fdstore = 0;
+		}
+	}
+
+	sock_store_trim(svc);
+}
+
+/*
+ * respawn:delay:SEC,max:SEC,limit:NUM/SEC,healthy:SEC
+ *
+ * All optional, unset ones get the default.  Called also without any
+ * @arg, on reload, to reset to defaults.
+ */
+static void parse_respawn(svc_t *svc, char *arg)
+{
+	char *tok, *ptr = NULL;
+
+	svc->respawn.delay   = SVC_RESPAWN_DELAY;
+	svc->respawn.max     = SVC_RESPAWN_MAX;
+	svc->respawn.limit   = SVC_RESPAWN_LIMIT;
+	svc->respawn.window  = SVC_RESPAWN_WINDOW;
+	svc->respawn.healthy = SVC_RESPAWN_HEALTHY;
+	if (!arg)
+		return;
+
+	for (tok = strtok_r(arg, ",", &ptr); tok; tok = strtok_r(NULL, ",", &ptr)) {
+		const char *errstr = NULL;
+		char *val, *win;
+		int num;
+
+		val = strchr(tok, ':');
+		if (!val)
+			goto invalid;
+		*val++ = 0;
+
+		if (!strcmp(tok, "limit")) {
+			win = strchr(val, '/');
+			if (win) {
+				*win++ = 0;
+				num = strtonum(win, 1, 86400, &errstr);
+				if (errstr)
+					goto invalid;
+				svc->respawn.window = num;
+			}
+			num = strtonum(val, 1, SVC_RESPAWN_LOG, &errstr);
+		} else {
+			num = strtonum(val, 0, 86400, &errstr);
+		}
+		if (errstr)
+			goto invalid;
+
+		if (!strcmp(tok, "delay") && num <= 3600)
+			svc->respawn.delay = num * 1000;
+		else if (!strcmp(tok, "max") && num <= 3600)
+			svc->respawn.max = num * 1000;
+		else if (!strcmp(tok, "healthy") && num > 0)
+			svc->respawn.healthy = num;
+		else if (!strcmp(tok, "limit"))
+			svc->respawn.limit = num;
+		else
+			goto invalid;
+		continue;
+	invalid:
+		_e("%s: invalid respawn setting '%s', using default", svc->cmd, tok);
+	}
+
+	if (svc->respawn.max < svc->respawn.delay)
+		svc->respawn.max = svc->respawn.delay;
+}
+
 /*
  * name:<name>
  */
@@ -755,7 +1198,7 @@ static void parse_name(svc_t *svc, char *arg)
 		name = name ? name + 1 : svc->cmd;
 	}
 
-	strlcpy(svc->name, name, sizeof(svc->name));
+	svc_set_name(svc, name);
 }
 
 /**
@@ -768,27 +1211,44 @@ static void parse_name(svc_t *svc, char *arg)
  */
 static void parse_cmdline_args(svc_t *svc, char *cmd)
 {
+	char *argv[MAX_NUM_SVC_ARGS];
 	int i;
-	char *arg;
 
-	strlcpy(svc->args[0], cmd, sizeof(svc->args[0]));
+	argv[0] = cmd;
 
 	/*
-	 * Copy supplied args. Stop at MAX_NUM_SVC_ARGS-1 to allow the args
-	 * array to be zero-terminated.
+	 * Stop at MAX_NUM_SVC_ARGS-1 to allow the args array to be
+	 * zero-terminated.  Any args set earlier are replaced.
 	 */
-	for (i = 1; (arg = strtok(NULL, " ")) && i < (MAX_NUM_SVC_ARGS - 1); i++)
-		strlcpy(svc->args[i], arg, sizeof(svc->args[0]));
+	for (i = 1; i < (MAX_NUM_SVC_ARGS - 1) && (argv[i] = strtok(NULL, " ")); i++)
+		;
 
-	/*
-	 * Clear remaining args in case they were set earlier.
-	 * This also zero-terminates the args array.
-	 */
-	for (; i < MAX_NUM_SVC_ARGS; i++)
-		svc->args[i][0] = 0;
+	if (svc_set_args(svc, argv, i))
+		_pe("Failed allocating arguments for %s", cmd);
 }
 
 
+/*
+ * FNV-1a of everything that makes up a service definition, the line in
+ * the .conf file and any rlimits set before it in the same file.
+ */
+static uint64_t conf_hash(int type, char *cfg, struct rlimit rlimit[])
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	unsigned char *ptr;
+	size_t i;
+
+	hash = (hash ^ (unsigned char)type) * 0x100000001b3ULL;
+	for (ptr = (unsigned char *)cfg; *ptr; ptr++)
+		hash = (hash ^ *ptr) * 0x100000001b3ULL;
+
+	ptr = (unsigned char *)rlimit;
+	for (i = 0; i < RLIMIT_NLIMITS * sizeof(struct rlimit); i++)
+		hash = (hash ^ ptr[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
 /**
  * service_register - Register service, task or run commands
  * @type:   %SVC_TYPE_SERVICE(0), %SVC_TYPE_TASK(1), %SVC_TYPE_RUN(2)
@@ -839,10 +1299,176 @@ static void parse_cmdline_args(svc_t *svc, char *cmd)
  * Without the :ID syntax Finit will overwrite the first service line
  * with the contents of the second.  The :ID must be [1,MAXINT].
  *
+ * Many instances of the same command can instead be declared once, as
+ * a template, with a range or a list of IDs.  Any %i in the rest of the
+ * line, e.g. in the arguments or pid:, is replaced with the ID:
+ *
+ *     service :1-16 pid:/run/worker-%i.pid /sbin/worker -n %i
+ *     service :eth1,eth2 /sbin/udhcpc -i %i
+ *
  * Returns:
  * POSIX OK(0) on success, or non-zero errno exit status on failure.
  */
 int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
+{
+	return register_one(type, cfg, rlimit, file, NULL, NULL, NULL);
+}
+
+/*
+ * @cfg with the ID spec at @off (@len bytes) replaced by @inst.  Any %i
+ * is left for register_one(), and in the arguments for svc_get_argv().
+ * Free after use.
+ */
+static char *tmpl_expand(char *cfg, size_t off, size_t len, char *inst)
+{
+	size_t ilen = strlen(inst);
+	char *buf;
+
+	buf = malloc(strlen(cfg) - len + ilen + 1);
+	if (!buf)
+		return NULL;
+
+	memcpy(buf, cfg, off);
+	memcpy(&buf[off], inst, ilen);
+	strcpy(&buf[off + ilen], &cfg[off + len]);
+
+	return buf;
+}
+
+/*
+ * Copy @str, with all %i replaced by @inst, to @*pos in the line buffer
+ * of register_one(), which has room for it, and advance @*pos.
+ */
+static char *tmpl_subst(char *str, char *inst, char **pos)
+{
+	char *buf = *pos, *ptr = buf;
+
+	while (*str) {
+		if (str[0] == '%' && str[1] == 'i') {
+			ptr = stpcpy(ptr, inst);
+			str += 2;
+		} else
+			*ptr++ = *str++;
+	}
+	*ptr++ = 0;
+	*pos = ptr;
+
+	return buf;
+}
+
+/*
+ * Templates have an ID spec that is a range of numbers, 1-16, or a list
+ * of names, a,b,c.  Plain IDs, including ones like foo-bar, are not.
+ * Returns 1 for a range, -1 for a range out of bounds, otherwise 0.
+ */
+static int tmpl_range(char *spec, int *lo, int *hi)
+{
+	char buf[MAX_ID_LEN * 2], *ptr;
+	const char *errstr;
+
+	if (!isdigit(spec[0]))
+		return 0;
+
+	strlcpy(buf, spec, sizeof(buf));
+	ptr = strchr(buf, '-');
+	if (!ptr || !isdigit(ptr[1]) || strspn(&ptr[1], "0123456789") != strlen(&ptr[1]))
+		return 0;
+	*ptr++ = 0;
+	if (strspn(buf, "0123456789") != strlen(buf))
+		return 0;
+
+	*lo = strtonum(buf, 0, INT_MAX, &errstr);
+	if (errstr)
+		return -1;
+	*hi = strtonum(ptr, 0, INT_MAX, &errstr);
+	if (errstr)
+		return -1;
+
+	return 1;
+}
+
+static int tmpl_is(char *spec)
+{
+	int lo, hi;
+
+	return strchr(spec, ',') || tmpl_range(spec, &lo, &hi);
+}
+
+#define TMPL_MAX 1024		/* Max instances of a template */
+
+/*
+ * Register all instances of a template.  The line is parsed for each
+ * instance, but only the options with %i differ.  All instances share
+ * the resolved executable, the arguments, with %i expanded when each
+ * instance is started, and the limits, conditions and description,
+ * unless they differ because of %i.
+ */
+static int register_template(int type, char *cfg, size_t off, char *spec,
+			     struct rlimit rlimit[], char *file)
+{
+	char inst[MAX_ID_LEN], *list, *ptr = NULL, *line;
+	svc_t *tmpl = NULL;
+	int lo = 0, hi = -1, num = 0, rc = 0;
+	size_t len = strlen(spec);
+
+	list = strdup(spec);
+	if (!list)
+		return errno = ENOMEM;
+
+	rc = tmpl_range(list, &lo, &hi);
+	if (rc) {
+		if (rc < 0 || hi < lo || hi - lo >= TMPL_MAX) {
+			_e("Invalid template range :%s", spec);
+			free(list);
+			return errno = EINVAL;
+		}
+		rc = 0;
+	} else
+		ptr = list;
+
+	while (num < TMPL_MAX) {
+		svc_t *svc = NULL;
+
+		if (ptr) {
+			char *tok = strsep(&ptr, ",");
+
+			if (!tok)
+				break;
+			if (!tok[0])
+				continue;
+			strlcpy(inst, tok, sizeof(inst));
+		} else {
+			if (num > hi - lo)
+				break;
+			snprintf(inst, sizeof(inst), "%d", lo + num);
+		}
+
+		line = tmpl_expand(cfg, off, len, inst);
+		if (!line) {
+			rc = errno = ENOMEM;
+			break;
+		}
+
+		if (register_one(type, line, rlimit, file, inst, tmpl, &svc))
+			rc = errno;
+		else if (!tmpl)
+			tmpl = svc;
+		free(line);
+		num++;
+	}
+
+	free(list);
+	return rc;
+}
+
+/*
+ * Register one service, see service_register().  For the instances of
+ * a template, @inst is the ID, and @tmpl is the first instance, once
+ * registered.  The svc_t is returned in @result, when set, unless
+ * skipped.
+ */
+static int register_one(int type, char *cfg, struct rlimit rlimit[], char *file,
+			char *inst, svc_t *tmpl, svc_t **result)
 {
 #ifdef INETD_ENABLED
 	char id_str[MAX_ID_LEN];
@@ -855,18 +1481,31 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 	char *username = NULL, *log = NULL, *pid = NULL;
 	char *service = NULL, *proto = NULL, *ifaces = NULL;
 	char *cmd, *desc, *runlevels = NULL, *cond = NULL;
-	char *name = NULL, *halt = NULL, *delay = NULL;
+	char *name = NULL, *halt = NULL, *delay = NULL, *cgroup = NULL;
+	char *respawn = NULL, *notify = NULL, *conn = NULL, *sock = NULL;
+	char *watchdog = NULL, *idle = NULL, *admit = NULL, *health = NULL;
+	char *shed = NULL, *fdstore = NULL;
+	char *prio[8];
+	int nprio = 0;
+	struct svc_prio sched;
+	uint64_t hash;
 	svc_t *svc;
 	plugin_t *plugin = NULL;
+	char *xpos = NULL;
+	size_t len;
 
 	if (!cfg) {
 		_e("Invalid input argument");
 		return errno = EINVAL;
 	}
 
-	line = strdup(cfg);
+	/* Room after the line for options of an instance with %i expanded */
+	len  = strlen(cfg) + 1;
+	line = malloc(inst ? len * (MAX_ID_LEN + 2) : len);
 	if (!line)
 		return 1;
+	memcpy(line, cfg, len);
+	xpos = &line[len];
 
 	desc = strstr(line, "-- ");
 	if (desc) {
@@ -885,6 +1524,8 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 			desc = &line[pos];
 		}
 	}
+	if (inst && desc && strstr(desc, "%i"))
+		desc = tmpl_subst(desc, inst, &xpos);
 
 	cmd = strtok(line, " ");
 	if (!cmd) {
@@ -895,6 +1536,10 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 	}
 
 	while (cmd) {
+		/* Only arguments keep %i, see svc_get_argv() */
+		if (inst && strstr(cmd, "%i"))
+			cmd = tmpl_subst(cmd, inst, &xpos);
+
 		if (cmd[0] == '@')	/* @username[:group] */
 			username = &cmd[1];
 		else if (cmd[0] == '[')	/* [runlevels] */
@@ -921,6 +1566,32 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 			halt = &cmd[5];
 		else if (!strncasecmp(cmd, "kill:", 5))
 			delay = &cmd[5];
+		else if (!strncasecmp(cmd, "cgroup:", 7))
+			cgroup = &cmd[7];
+		else if (!strncasecmp(cmd, "respawn:", 8))
+			respawn = &cmd[8];
+		else if (!strncasecmp(cmd, "notify:", 7))
+			notify = &cmd[7];
+		else if (!strncasecmp(cmd, "watchdog:", 9))
+			watchdog = &cmd[9];
+		else if (!strncasecmp(cmd, "conn:", 5))
+			conn = &cmd[5];
+		else if (!strncasecmp(cmd, "socket:", 7))
+			sock = &cmd[7];
+		else if (!strncasecmp(cmd, "idle:", 5))
+			idle = &cmd[5];
+		else if (!strncasecmp(cmd, "admit:", 6))
+			admit = &cmd[6];
+		else if (!strncasecmp(cmd, "health:", 7))
+			health = &cmd[7];
+		else if (!strncasecmp(cmd, "shed:", 5))
+			shed = &cmd[5];
+		else if (!strncasecmp(cmd, "fdstore:", 8))
+			fdstore = &cmd[8];
+		else if (prio_option(cmd)) {
+			if (nprio < (int)NELEMS(prio))
+				prio[nprio++] = cmd;
+		}
 		else if (cmd[0] != '/' && strchr(cmd, '/'))
 			service = cmd;   /* inetd service/proto */
 		else
@@ -939,6 +1610,15 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 		return 0;
 	}
 
+	/* :1-16 or :a,b,c, strtok() only replaced separators in @line */
+	if (id && !inst && type != SVC_TYPE_INETD && tmpl_is(id)) {
+		int rc;
+
+		rc = register_template(type, cfg, id - line, id, rlimit, file);
+		free(line);
+		return rc;
+	}
+
 	/* Example: inetd ssh/tcp@eth0,eth1 or 222/tcp@eth2 */
 	if (service) {
 		ifaces = strchr(service, '@');
@@ -1009,18 +1689,41 @@ recreate:
 	else {
 		if (svc_is_inetd(svc) && type != SVC_TYPE_INETD) {
 			_d("Service was previously inetd, deregistering ...");
-			inetd_del(&svc->inetd);
+			inetd_del(svc->inetd);
 			svc_del(svc);
 			goto recreate;
 		}
 	}
+
+	if (type == SVC_TYPE_INETD && !svc->inetd) {
+		svc->inetd = calloc(1, sizeof(*svc->inetd));
+		if (!svc->inetd) {
+			_e("Out of memory, cannot register inetd service %s", cmd);
+			svc_del(svc);
+			free(line);
+			return errno = ENOMEM;
+		}
+	}
 #endif
 
+	/* Instances share what they can with the first one, see svc_get_argv() */
+	svc->tmpl = inst != NULL;
+	if (tmpl)
+		svc_share_config(svc, tmpl);
+
 	/* Always clear svc PID file, for now.  See TODO */
-	svc->pidfile[0] = 0;
+	free(svc->pidfile);
+	svc->pidfile = NULL;
 	/* Decode any optional pid:/optional/path/to/file.pid */
 	if (pid && svc_is_daemon(svc) && pid_file_parse(svc, pid))
 		_e("Invalid 'pid' argument to service: %s", pid);
+	svc_set_pidfile(svc);
+
+	/* Resolve executable now, saves a $PATH walk on each (re)start */
+	if (tmpl && tmpl->exec && !strcmp(tmpl->cmd, svc->cmd))
+		svc_share_exec(svc, tmpl);
+	else if (type != SVC_TYPE_INETD || !plugin)
+		svc_resolve(svc);
 
 	if (username) {
 		char *ptr = strchr(username, ':');
@@ -1034,9 +1737,13 @@ recreate:
 
 	if (plugin) {
 		/* Internal plugin provides this service */
-		svc->inetd.cmd = plugin->inetd.cmd;
-		svc->inetd.builtin = 1;
-	} else
+		svc->inetd->cmd = plugin->inetd.cmd;
+		svc->inetd->reply = plugin->inetd.reply;
+		svc->inetd->reply_flags = plugin->inetd.flags;
+		svc->inetd->builtin = 1;
+	} else if (tmpl && tmpl->args && !strcmp(tmpl->cmd, svc->cmd))
+		svc_share_args(svc, tmpl);
+	else
 		parse_cmdline_args(svc, cmd);
 
 	svc->runlevels = levels;
@@ -1049,52 +1756,88 @@ recreate:
 		parse_sighalt(svc, halt);
 	if (delay)
 		parse_killdelay(svc, delay);
+	parse_respawn(svc, respawn);
+	parse_notify(svc, notify);
+	parse_watchdog(svc, watchdog);
+	sock_parse(svc, svc_is_daemon(svc) ? sock : NULL);
+	parse_fdstore(svc, svc_is_daemon(svc) ? fdstore : NULL);
+	lazy_parse(svc, svc_is_daemon(svc) ? idle : NULL);
+	admit_parse(svc, admit);
+	health_parse(svc, svc_is_daemon(svc) ? health : NULL);
+	pressure_parse(svc, svc_is_daemon(svc) ? shed : NULL);
 	if (log)
 		parse_log(svc, log);
 	if (desc)
-		strlcpy(svc->desc, desc, sizeof(svc->desc));
+		svc_set_desc(svc, desc);
 
 #ifdef INETD_ENABLED
 	if (svc_is_inetd(svc)) {
 		char *iface, *name = service;
 
-		if (svc->inetd.cmd && plugin)
+		if (svc_is_internal(svc) && plugin)
 			name = plugin->name;
 
-		if (inetd_new(&svc->inetd, name, service, proto, forking, svc)) {
+		if (inetd_new(svc->inetd, name, service, proto, forking, svc)) {
 			_e("Failed registering new inetd service %s/%s", service, proto);
 			free(line);
 			return svc_del(svc);
 		}
 
 	inetd_setup:
-		inetd_flush(&svc->inetd);
+		inetd_flush(svc->inetd);
+		inetd_limit(svc->inetd, conn);
 
 		if (!ifaces) {
 			_d("No specific iface listed for %s, allowing ANY", service);
-			inetd_allow(&svc->inetd, NULL);
+			inetd_allow(svc->inetd, NULL);
 		} else {
 			for (iface = strtok(ifaces, ","); iface; iface = strtok(NULL, ",")) {
 				if (iface[0] == '!')
-					inetd_deny(&svc->inetd, &iface[1]);
+					inetd_deny(svc->inetd, &iface[1]);
 				else
-					inetd_allow(&svc->inetd, iface);
+					inetd_allow(svc->inetd, iface);
 			}
 		}
 	}
 #endif
 	/* Set configured limits */
-	memcpy(svc->rlimit, rlimit, sizeof(svc->rlimit));
+	svc_set_rlimit(svc, rlimit);
 
-	/* New, recently modified or unchanged ... used on reload. */
-	if (file && conf_changed(file))
+	/* CPU affinity, scheduling, etc. also reset on reload */
+	memset(&sched, 0, sizeof(sched));
+	for (int i = 0; i < nprio; i++) {
+		if (prio_parse(&sched, prio[i]))
+			logit(LOG_WARNING, "%s: invalid %s, ignoring", svc->cmd, prio[i]);
+	}
+	if (prio_update(svc, &sched))
+		_pe("%s: failed setting scheduling", svc->cmd);
+
+	/*
+	 * New, recently modified or unchanged ... used on reload.  Only
+	 * services whose definition actually changed are marked dirty,
+	 * editing another line in the same .conf does not restart them.
+	 */
+	hash = conf_hash(type, cfg, rlimit);
+	if (file && conf_changed(file) && svc->conf_hash != hash)
 		svc_mark_dirty(svc);
 	else
 		svc_mark_clean(svc);
+	svc->conf_hash = hash;
+	strlcpy(svc->conf, file ? basename(file) : "", sizeof(svc->conf));
 
 	if (!file)
 		svc->protect = 1;
 
+	/* Create cgroup now, saves time when starting the service */
+	free(svc->cgroup);
+	svc->cgroup = cgroup ? strndup(cgroup, MAX_CGROUP_LEN - 1) : NULL;
+	if (svc->cgroup_fd < 0)
+		svc->cgroup_fd = cgroup_service_open(svc->name, svc->id);
+	cgroup_service_config(svc->cgroup_fd, svc->cgroup);
+
+	if (result)
+		*result = svc;
+
 	/* Free duped line, from above */
 	free(line);
 	return 0;
@@ -1123,14 +1866,17 @@ void service_unregister(svc_t *svc)
 	switch (svc->type) {
 #ifdef INETD_ENABLED
 	case SVC_TYPE_INETD:
-		inetd_del(&svc->inetd);
+		inetd_del(svc->inetd);
 		break;
 
 	case SVC_TYPE_INETD_CONN:
+		/* inetd connection, resume parent if paused at max: */
+		inetd_conn_done(svc);
+
 		/* inetd connection, if UDP unblock parent */
-		if (svc_is_busy(svc->inetd.svc)) {
-			svc_unblock(svc->inetd.svc);
-			service_step(svc->inetd.svc);
+		if (svc_is_busy(svc->inetd->svc)) {
+			svc_unblock(svc->inetd->svc);
+			service_step(svc->inetd->svc);
 		}
 		break;
 #endif
@@ -1140,9 +1886,43 @@ void service_unregister(svc_t *svc)
 		break;
 	}
 
+	service_job_done(svc);
+	admit_done(svc);
 	svc_del(svc);
 }
 
+/**
+ * service_adopt - Take over a service started before a re-exec of Finit
+ * @svc:      Pointer to &svc_t, just registered
+ * @pid:      PID of the service, or zero if not running
+ * @state:    State of the service before the re-exec
+ * @restarts: Restart counter before the re-exec
+ *
+ * Only the books are updated, a running service is not started again.
+ * Its exit is collected by service_monitor(), as usual.
+ */
+void service_adopt(svc_t *svc, pid_t pid, svc_state_t state, int restarts)
+{
+	int *restart_cnt = &svc->restart_cnt;
+
+	if (pid > 0) {
+		if (svc->cgroup_fd < 0)
+			svc->cgroup_fd = cgroup_service_open(svc->name, svc->id);
+		svc_set_pid(svc, pid);
+	}
+
+	*restart_cnt = restarts;
+	svc_mark_clean(svc);
+	svc_set_state(svc, state);
+
+	if (state == SVC_RUNNING_STATE && svc->lazy) {
+		svc->lazy->demand = 1;
+		lazy_start(svc);
+	}
+	if (state == SVC_RUNNING_STATE && pid > 0)
+		health_start(svc);
+}
+
 void service_monitor(pid_t lost, int status)
 {
 	svc_t *svc;
@@ -1153,6 +1933,12 @@ void service_monitor(pid_t lost, int status)
 	if (tty_respawn(lost))
 		return;
 
+	if (fs_collect(lost, status))
+		return;
+
+	if (health_collect(lost, status))
+		return;
+
 	svc = svc_find_by_pid(lost);
 	if (!svc) {
 		_d("collected unknown PID %d", lost);
@@ -1179,13 +1965,24 @@ void service_monitor(pid_t lost, int status)
 			svc->started = 1;
 		else
 			svc->started = 0;
+
+		if (svc->type == SVC_TYPE_RUN && !svc->started)
+			print(1, "%s exited with status %d",
+			      svc->config->desc[0] ? svc->config->desc : svc->cmd,
+			      WIFEXITED(status) ? WEXITSTATUS(status) : -1);
 	}
 
 	/* Terminate any children in the same proess group, e.g. logit */
 	kill(-svc->pid, SIGTERM);
 
 	/* No longer running, update books. */
-	svc->start_time = svc->pid = 0;
+	health_stop(svc);
+	svc_stamp(svc, SVC_STAMP_EXIT);
+	svc_set_pid(svc, 0);
+	svc->start_time = 0;
+	if (svc_is_runtask(svc))
+		boot_job_done(svc);
+	service_job_done(svc);
 
 	if (!service_step(svc)) {
 		/* Clean out any bootstrap tasks, they've had their time in the sun. */
@@ -1196,10 +1993,81 @@ void service_monitor(pid_t lost, int status)
 	sm_step(&sm);
 }
 
+/*
+ * Delay before restarting a crashed service.  The first crash after
+ * being healthy is restarted directly, then the respawn delay doubles
+ * for each crash, up to max.  With a +/- 25% jitter, so services that
+ * crash because of the same reason do not restart in lockstep.
+ */
+static int service_backoff(svc_t *svc)
+{
+	static int seeded = 0;
+	long long delay;
+	int i, jitter;
+
+	if (svc->restart_cnt == 0)
+		return 1;
+
+	delay = svc->respawn.delay;
+	for (i = 1; i < svc->restart_cnt && delay < svc->respawn.max; i++)
+		delay *= 2;
+	if (delay > svc->respawn.max)
+		delay = svc->respawn.max;
+
+	if (!seeded) {
+		srandom(time(NULL) ^ getpid());
+		seeded = 1;
+	}
+
+	jitter = delay / 4;
+	if (jitter > 0)
+		delay += random() % (2 * jitter + 1) - jitter;
+
+	return delay > 0 ? (int)delay : 1;
+}
+
+/*
+ * Restart budget, a sliding window of restart times.  Returns non-zero
+ * if the service has been restarted limit times within the window.
+ */
+static int service_respawn_exceeded(svc_t *svc)
+{
+	long now = jiffies();
+	int i, num = 0;
+
+	/* Drop restarts older than the window */
+	for (i = 0; i < svc->respawn.num; i++) {
+		if (now - svc->respawn.log[i] < svc->respawn.window)
+			svc->respawn.log[num++] = svc->respawn.log[i];
+	}
+	svc->respawn.num = num;
+
+	return num >= svc->respawn.limit;
+}
+
+static void service_respawn_log(svc_t *svc)
+{
+	if (!svc->respawn.log) {
+		svc->respawn.log = calloc(SVC_RESPAWN_LOG, sizeof(svc->respawn.log[0]));
+		if (!svc->respawn.log)
+			return;
+	}
+
+	if (svc->respawn.num >= SVC_RESPAWN_LOG) {
+		memmove(&svc->respawn.log[0], &svc->respawn.log[1],
+			sizeof(svc->respawn.log[0]) * (SVC_RESPAWN_LOG - 1));
+		svc->respawn.num--;
+	}
+	svc->respawn.log[svc->respawn.num++] = jiffies();
+}
+
+/*
+ * Called after the back-off delay of a crashed service, and when it has
+ * run for its healthy uptime after a restart.
+ */
 static void service_retry(svc_t *svc)
 {
-	int timeout;
-	char *restart_cnt = (char *)&svc->restart_cnt;
+	int *restart_cnt = &svc->restart_cnt;
 
 	service_timeout_cancel(svc);
 
@@ -1210,33 +2078,53 @@ static void service_retry(svc_t *svc)
 		return;
 	}
 
-	if (*restart_cnt >= RESPAWN_MAX) {
-		logit(LOG_CONSOLE | LOG_WARNING, "Service %s:%s keeps crashing, not restarting.",
-		      basename(svc->cmd), svc->id);
+	if (service_respawn_exceeded(svc)) {
+		logit(LOG_CONSOLE | LOG_WARNING, "Service %s:%s keeps crashing, %d restarts in %d sec, not restarting.",
+		      basename(svc->cmd), svc->id, svc->respawn.num, svc->respawn.window);
 		svc_crashing(svc);
 		*restart_cnt = 0;
+		svc->respawn.num = 0;
 		service_step(svc);
 		return;
 	}
 
 	(*restart_cnt)++;
+	service_respawn_log(svc);
 
 	_d("%s crashed, trying to start it again, attempt %d", svc->cmd, *restart_cnt);
 	logit(LOG_CONSOLE | LOG_WARNING, "Service %s:%s died, restarting (%d/%d)",
-	      basename(svc->cmd), svc->id, *restart_cnt, RESPAWN_MAX);
+	      basename(svc->cmd), svc->id, svc->respawn.num, svc->respawn.limit);
 	svc_unblock(svc);
 	service_step(svc);
 
-	/* Wait 2s for the first 5 respawns, then back off to 5s */
-	timeout = ((*restart_cnt) <= (RESPAWN_MAX / 2)) ? 2000 : 5000;
-	service_timeout_after(svc, timeout, service_retry);
+	/* Reset back-off if still running after healthy uptime */
+	service_timeout_after(svc, svc->respawn.healthy * 1000, service_retry);
 }
 
+static int planning;
+
 static void svc_set_state(svc_t *svc, svc_state_t new)
 {
-	svc_state_t *state = (svc_state_t *)&svc->state;
+	svc_state_t *state = &svc->state;
+	svc_state_t old = *state;
+
+	/* No longer queued for a start slot, see admit_hold() */
+	if (new != SVC_READY_STATE)
+		svc->admit_wait = 0;
+
+	/* Runlevel change waits for everything stopping, see service_plan() */
+	if (new == SVC_STOPPING_STATE && planning)
+		svc_plan(svc, SVC_PLAN_WAIT);
+	else if (new == SVC_HALTED_STATE || new == SVC_DONE_STATE)
+		svc_plan_stopped(svc);
 
 	*state = new;
+	if (old != new) {
+		svc_history(svc);
+		api_event(INIT_EV_SVC, "svc %d%s%s %s %s", svc->job, svc->id[0] ? ":" : "",
+			  svc->id, svc->name, svc_status(svc));
+	}
+	shm_svc(svc);
 
 	/* if PID isn't collected within SVC_TERM_TIMEOUT msec, kill it! */
 	if ((*state == SVC_STOPPING_STATE) && !svc_is_inetd(svc)) {
@@ -1247,6 +2135,87 @@ static void svc_set_state(svc_t *svc, svc_state_t new)
 	}
 }
 
+static int shutdown_force;
+
+/* Any service depending on @svc, with its svc/ condition, still running? */
+static int service_has_dependents(svc_t *svc)
+{
+	char buf[MAX_COND_LEN];
+	struct cond_dep *dep;
+	struct cond *c;
+
+	c = cond_find(mkcond(svc, buf, sizeof(buf)));
+	if (!c)
+		return 0;
+
+	LIST_FOREACH(dep, &c->deps, link) {
+		if (dep->svc != svc && dep->svc->pid > 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * At shutdown services are stopped in reverse dependency order, all at
+ * once except those with dependents still running, which are held back
+ * and stepped again by service_shutdown_step().
+ */
+static int service_stop_deferred(svc_t *svc)
+{
+	svc->stop_deferred = 0;
+	if (shutdown_force || (runlevel != 0 && runlevel != 6) || !sm_is_in_teardown(&sm))
+		return 0;
+
+	if (!service_has_dependents(svc))
+		return 0;
+
+	_d("%s: waiting for dependents to stop first", svc->cmd);
+	svc->stop_deferred = 1;
+
+	return 1;
+}
+
+/**
+ * service_shutdown_step - Stop services held back for their dependents
+ *
+ * Called by the state machine at shutdown while waiting for services to
+ * stop.  If none are stopping and some are still held back, there is a
+ * dependency loop, or a dependent that remains in runlevel 0 or 6, so
+ * the remaining services are stopped regardless.
+ *
+ * Returns:
+ * Number of services still held back.
+ */
+int service_shutdown_step(void)
+{
+	svc_t *svc, *iter = NULL;
+	int num = 0;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (svc->stop_deferred)
+			service_step(svc);
+	}
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (svc->stop_deferred)
+			num++;
+	}
+
+	if (num && !svc_stop_completed()) {
+		_d("No progress stopping services, stopping %d remaining", num);
+		shutdown_force = 1;
+		for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+			if (svc->stop_deferred)
+				service_step(svc);
+		}
+		shutdown_force = 0;
+		num = 0;
+	}
+
+	return num;
+}
+
 /*
  * Transition inetd/task/run/service
  *
@@ -1257,7 +2226,7 @@ int service_step(svc_t *svc)
 	cond_state_t cond;
 	svc_state_t old_state;
 	svc_cmd_t enabled;
-	char *restart_cnt = (char *)&svc->restart_cnt;
+	int *restart_cnt = &svc->restart_cnt;
 	int changed = 0;
 	int err;
 
@@ -1267,12 +2236,14 @@ restart:
 
 	_d("%20s(%4d): %8s %3sabled/%-7s cond:%-4s", svc->cmd, svc->pid,
 	   svc_status(svc), enabled ? "en" : "dis", svc_dirtystr(svc),
-	   condstr(cond_get_agg(svc->cond)));
+	   condstr(cond_svc_get(svc)));
 
 	switch (svc->state) {
 	case SVC_HALTED_STATE:
 		if (enabled)
 			svc_set_state(svc, SVC_READY_STATE);
+		else if (svc->store && svc->block != SVC_BLOCK_RESTARTING)
+			sock_store_remove(svc, NULL); /* Stopped, not restarting */
 		break;
 
 	case SVC_DONE_STATE:
@@ -1315,14 +2286,34 @@ restart:
 	case SVC_READY_STATE:
 		if (!enabled) {
 			svc_set_state(svc, SVC_HALTED_STATE);
-		} else if (cond_get_agg(svc->cond) == COND_ON) {
+		} else if (cond_svc_get(svc) == COND_ON) {
 			/* wait until all processes have been stopped before continuing... */
-			if (sm_is_in_teardown(&sm))
+			if (sm_is_in_teardown(&sm) && !(svc->plan & SVC_PLAN_EARLY)) {
+				if (planning)
+					svc_plan(svc, SVC_PLAN_HOLD);
+				break;
+			}
+
+			/* wait for any run job before us, or a free job slot */
+			if (service_blocked(svc))
+				break;
+
+			/* on-demand service, wait until it is used */
+			if (lazy_hold(svc))
+				break;
+
+			/* low priority service, held while system is under pressure */
+			if (pressure_shed(svc))
+				break;
+
+			/* too many starts in flight, queue until a slot is free */
+			if (admit_hold(svc))
 				break;
 
 			err = service_start(svc);
 			if (err) {
 				(*restart_cnt)++;
+				admit_done(svc);
 				if (!svc_is_inetd_conn(svc))
 					break;
 			}
@@ -1330,26 +2321,34 @@ restart:
 			/* Everything went fine, clean and set state */
 			svc_mark_clean(svc);
 			svc_set_state(svc, SVC_RUNNING_STATE);
+			lazy_start(svc);
+			health_start(svc);
+		} else {
+			/* first use of the condition of an on-demand service */
+			lazy_wake(svc);
 		}
 		break;
 
 	case SVC_RUNNING_STATE:
 		if (!enabled) {
+			if (service_stop_deferred(svc))
+				break;
 			service_stop(svc);
 			break;
 		}
 
 		if (!svc->pid) {
 			if (svc_is_daemon(svc)) {
+				int delay;
+
 				svc_restarting(svc);
 				svc_set_state(svc, SVC_HALTED_STATE);
 
-				/*
-				 * Restart directly after the first crash,
-				 * then retry after 2 sec
-				 */
-				_d("delayed restart of %s", svc->cmd);
-				service_timeout_after(svc, 1, service_retry);
+				/* Replaces any pending healthy uptime check */
+				delay = service_backoff(svc);
+				_d("delayed restart of %s, in %d msec", svc->cmd, delay);
+				service_timeout_cancel(svc);
+				service_timeout_after(svc, delay, service_retry);
 				break;
 			}
 
@@ -1371,14 +2370,29 @@ restart:
 			}
 		}
 
-		cond = cond_get_agg(svc->cond);
+		/* on-demand service unused for idle:SEC, see lazy.c */
+		if (lazy_idle(svc)) {
+			service_stop(svc);
+			break;
+		}
+
+		/* shed:RES, make room while the system is under pressure */
+		if (pressure_shed(svc)) {
+			if (!pressure_pause(svc))
+				svc_set_state(svc, SVC_WAITING_STATE);
+			else
+				service_stop(svc);
+			break;
+		}
+
+		cond = cond_svc_get(svc);
 		switch (cond) {
 		case COND_OFF:
 			service_stop(svc);
 			break;
 
 		case COND_FLUX:
-			kill(svc->pid, SIGSTOP);
+			svc_signal(svc, SIGSTOP);
 			svc_set_state(svc, SVC_WAITING_STATE);
 			break;
 
@@ -1386,13 +2400,16 @@ restart:
 			if (svc_is_changed(svc)) {
 				if (svc->sighup) {
 					/* wait until all processes has been stopped before continuing... */
-					if (sm_is_in_teardown(&sm))
+					if (sm_is_in_teardown(&sm)) {
+						if (planning)
+							svc_plan(svc, SVC_PLAN_HOLD);
 						break;
+					}
 					service_restart(svc);
 				} else {
 #ifdef INETD_ENABLED
 					if (svc_is_inetd(svc))
-						inetd_stop_children(&svc->inetd, 1);
+						inetd_stop_children(svc->inetd, 1);
 					else
 #endif
 						service_stop(svc);
@@ -1405,21 +2422,28 @@ restart:
 
 	case SVC_WAITING_STATE:
 		if (!enabled) {
-			kill(svc->pid, SIGCONT);
+			pressure_resume(svc);
+			svc_signal(svc, SIGCONT);
 			service_stop(svc);
 			break;
 		}
 
 		if (!svc->pid) {
+			svc->frozen = 0;
 			(*restart_cnt)++;
 			svc_set_state(svc, SVC_READY_STATE);
 			break;
 		}
 
-		cond = cond_get_agg(svc->cond);
+		cond = cond_svc_get(svc);
 		switch (cond) {
 		case COND_ON:
-			kill(svc->pid, SIGCONT);
+			/* paused by shed:RES,freeze, until pressure has passed */
+			if (pressure_shed(svc) && svc->frozen)
+				break;
+
+			pressure_resume(svc);
+			svc_signal(svc, SIGCONT);
 			svc_set_state(svc, SVC_RUNNING_STATE);
 			/* Reassert condition if we go from waiting and no change */
 			if (!svc_is_changed(svc)) {
@@ -1427,13 +2451,14 @@ restart:
 
 				mkcond(svc, name, sizeof(name));
 				_d("Reassert condition %s", name);
-				cond_set_path(cond_path(name), COND_ON);
+				cond_set_noupdate(name);
 			}
 			break;
 
 		case COND_OFF:
 			_d("Condition for %s is off, sending SIGCONT + SIGTERM", svc->name);
-			kill(svc->pid, SIGCONT);
+			pressure_resume(svc);
+			svc_signal(svc, SIGCONT);
 			service_stop(svc);
 			break;
 
@@ -1449,12 +2474,8 @@ restart:
 		goto restart;
 	}
 
-	/*
-	 * When a run/task/service changes state, e.g. transitioning from
-	 * waiting to running, other services may need to change state too.
-	 */
 	if (changed)
-		schedule_work(&work);
+		_d("%20s(%4d): settled after %d transitions", svc->cmd, svc->pid, changed);
 
 	return 0;
 }
@@ -1464,9 +2485,196 @@ void service_step_all(int types)
 	svc_foreach_type(types, service_step);
 }
 
+/**
+ * service_step_learned - Step all services of @types, longest first
+ * @types: Mask of service types
+ *
+ * Like service_step_all(), but through the step queue, sorted by start
+ * times learned at the previous boot.  Used at bootstrap, when most of
+ * runlevel S can start at once, so what the rest of the boot waited the
+ * longest for is started first.  After bootstrap, or if nothing has been
+ * learned, the order is the same as service_step_all().
+ */
+void service_step_learned(int types)
+{
+	svc_t *svc, *iter = NULL;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (svc->type & types)
+			service_schedule(svc);
+	}
+
+	service_worker(NULL);
+}
+
+/* Does @svc depend on the condition of a service being stopped? */
+static int plan_needs_stopped(svc_t *svc)
+{
+	svc_t *stop, *iter = NULL;
+
+	if (!svc->num_conds)
+		return 0;
+
+	for (stop = svc_plan_iterator(&iter, 1); stop; stop = svc_plan_iterator(&iter, 0)) {
+		char buf[MAX_COND_LEN];
+		struct cond *c;
+
+		if (stop == svc || !(stop->plan & SVC_PLAN_STOP))
+			continue;
+
+		c = cond_find(mkcond(stop, buf, sizeof(buf)));
+		if (!c)
+			continue;
+
+		for (int i = 0; i < svc->num_conds; i++) {
+			if (svc->conds[i].cond == c)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * A service to start conflicts with the teardown if it would be stopped
+ * again when a service it depends on stops, or if it runs the same
+ * command as one being stopped, which likely uses the same PID file or
+ * ports.  Run/tasks may rely on the runlevel change hooks, so they, and
+ * everything at shutdown, always wait.
+ */
+static int plan_conflicts(svc_t *svc)
+{
+	svc_t *stop, *iter = NULL;
+
+	if (svc_is_runtask(svc) || runlevel == 0 || runlevel == 6)
+		return 1;
+
+	for (stop = svc_plan_iterator(&iter, 1); stop; stop = svc_plan_iterator(&iter, 0)) {
+		if ((stop->plan & SVC_PLAN_STOP) && !strcmp(stop->cmd, svc->cmd))
+			return 1;
+	}
+
+	return plan_needs_stopped(svc);
+}
+
+/**
+ * service_plan - Plan a runlevel change, and start carrying it out
+ *
+ * Called by the state machine when the new runlevel has been set.  The
+ * services are sorted into a stop set and a start set, once, from their
+ * runlevel masks.  The rest are unchanged and left alone, unless their
+ * configuration has changed.
+ *
+ * The stop set is stepped first, services that depend on another one
+ * being stopped before that one.  Everything that goes to stopping from
+ * here on is counted, see svc_plan_stopping().  Services to start that
+ * do not conflict with the stop set are started directly, the rest are
+ * held for service_plan_done().
+ */
+void service_plan(void)
+{
+	svc_t *svc, *iter = NULL;
+
+	planning = 1;
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		int active, enabled;
+
+		active  = svc->pid > 0 || svc->state == SVC_RUNNING_STATE ||
+			  svc->state == SVC_WAITING_STATE;
+		enabled = svc_enabled(svc);
+
+		if (svc->state == SVC_STOPPING_STATE)
+			svc_plan(svc, SVC_PLAN_STOP | SVC_PLAN_WAIT);
+		else if (active && !enabled)
+			svc_plan(svc, SVC_PLAN_STOP);
+		else if (active && svc_is_changed(svc))
+			svc_plan(svc, svc->sighup ? SVC_PLAN_HOLD : SVC_PLAN_STOP | SVC_PLAN_HOLD);
+		else if (!active && enabled)
+			svc_plan(svc, SVC_PLAN_HOLD);
+		else if (svc->state == SVC_READY_STATE)
+			service_step(svc); /* Disabled, nothing to stop */
+	}
+
+	/* Dependents first, then the services they depend on */
+	for (int pass = 0; pass < 2; pass++) {
+		for (svc = svc_plan_iterator(&iter, 1); svc; svc = svc_plan_iterator(&iter, 0)) {
+			if (!(svc->plan & SVC_PLAN_STOP))
+				continue;
+			if (plan_needs_stopped(svc) == pass)
+				continue;
+
+			service_step(svc);
+		}
+	}
+
+	for (svc = svc_plan_iterator(&iter, 1); svc; svc = svc_plan_iterator(&iter, 0)) {
+		if (svc->plan != SVC_PLAN_HOLD || plan_conflicts(svc))
+			continue;
+
+		svc->plan = SVC_PLAN_EARLY;
+		service_step(svc);
+	}
+
+	_d("Runlevel change, %d services to stop", svc_plan_stopping());
+}
+
+/**
+ * service_plan_pending - Number of planned stops not yet collected
+ */
+int service_plan_pending(void)
+{
+	return svc_plan_stopping();
+}
+
+/**
+ * service_plan_done - Complete the runlevel change
+ *
+ * Called by the state machine when all stops have been collected, and
+ * the runlevel change hooks have run.  Starts the services held back,
+ * without walking all services again.
+ */
+void service_plan_done(void)
+{
+	svc_t *svc, *iter = NULL;
+
+	planning = 0;
+	for (svc = svc_plan_iterator(&iter, 1); svc; svc = svc_plan_iterator(&iter, 0)) {
+		int hold = svc->plan & SVC_PLAN_HOLD;
+
+		svc_plan_clear(svc);
+		if (hold)
+			service_step(svc);
+	}
+}
+
+/**
+ * service_schedule - Step service from the event loop
+ * @svc: Pointer to &svc_t object
+ *
+ * Used when an input of @svc has changed, e.g., its PID or a condition
+ * it depends on, but stepping it directly is not safe or desirable.
+ * Services are stepped in the order queued, each only once per pass,
+ * at bootstrap those that took the longest at the previous boot first.
+ */
+void service_schedule(svc_t *svc)
+{
+	svc->weight = boot_learned(svc);
+	svc_enqueue(svc);
+	schedule_work(&work);
+}
+
+/*
+ * Only steps queued services, a service changing state does not affect
+ * other services directly, only through its condition, which queues its
+ * dependents.  Full sweeps, service_step_all(), are done by the state
+ * machine on runlevel change and reload.
+ */
 void service_worker(void *unused)
 {
-	service_step_all(SVC_TYPE_SERVICE | SVC_TYPE_RUNTASK | SVC_TYPE_INETD);
+	svc_t *svc;
+
+	while ((svc = svc_dequeue()))
+		service_step(svc);
 }
 
 /**
@@ -1513,9 +2721,9 @@ int service_completed(void)
 		if (!svc_enabled(svc))
 			continue;
 
-		if (strstr(svc->cond, plugin_hook_str(HOOK_SVC_UP)) ||
-		    strstr(svc->cond, plugin_hook_str(HOOK_SYSTEM_UP))) {
-			_d("Skipping %s(%s), post-strap hook", svc->desc, svc->cmd);
+		if (strstr(svc->config->cond, plugin_hook_str(HOOK_SVC_UP)) ||
+		    strstr(svc->config->cond, plugin_hook_str(HOOK_SYSTEM_UP))) {
+			_d("Skipping %s(%s), post-strap hook", svc->config->desc, svc->cmd);
 			continue;
 		}
 
@@ -30,12 +30,19 @@
 void	  service_runlevel	 (int newlevel);
 int	  service_register	 (int type, char *line, struct rlimit rlimit[], char *file);
 void      service_unregister     (svc_t *svc);
+void      service_adopt          (svc_t *svc, pid_t pid, svc_state_t state, int restarts);
 
 void      service_runtask_clean  (void);
 void      service_reload_dynamic (void);
 
 int       service_step           (svc_t *svc);
 void      service_step_all       (int types);
+void      service_step_learned   (int types);
+int       service_shutdown_step  (void);
+void      service_plan           (void);
+int       service_plan_pending   (void);
+void      service_plan_done      (void);
+void      service_schedule       (svc_t *svc);
 void      service_worker         (void *unused);
 
 int       service_completed      (void);
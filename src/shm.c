@@ -0,0 +1,286 @@
+/* Read-only status page of services and conditions, see shm.h
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "cond.h"
+#include "log.h"
+#include "pid.h"
+#include "shm.h"
+#include "svc.h"
+
+static struct shm_page *page;
+
+/*
+ * Writer side of the seqlock, readers see an odd seq while the page is
+ * being updated.  There is only one writer, PID 1.
+ */
+static void shm_begin(void)
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shm_end(void)
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void svc_publish(svc_t *svc)
+{
+	struct shm_svc *s;
+
+	if (!svc->shm) {
+		int i;
+
+		for (i = 0; i < SHM_SVC_MAX; i++) {
+			if (!page->svc[i].job)
+				break;
+		}
+		if (i == SHM_SVC_MAX) {
+			static int warned;
+
+			if (!warned++)
+				_w("Status page full, %s and later services not published", svc->name);
+			return;
+		}
+		svc->shm = i + 1;
+	}
+
+	s = &page->svc[svc->shm - 1];
+	s->job         = svc->job;
+	s->pid         = svc->pid;
+	s->state       = svc->state;
+	s->block       = svc->block;
+	s->type        = svc->type;
+	s->starting    = svc->starting ? 1 : 0;
+	s->queued      = svc->admit_wait ? 1 : 0;
+	s->restart_cnt = svc->restart_cnt;
+	s->start_time  = svc->start_time;
+	strlcpy(s->id, svc->id, sizeof(s->id));
+	strlcpy(s->name, svc->name, sizeof(s->name));
+
+	if ((uint32_t)svc->shm > page->num_svc)
+		page->num_svc = svc->shm;
+}
+
+static void cond_publish(struct cond *c)
+{
+	struct shm_cond *p;
+
+	if (c->wild || strlen(c->name) >= SHM_COND_LEN)
+		return;
+
+	if (!c->shm) {
+		int i;
+
+		for (i = 0; i < SHM_COND_MAX; i++) {
+			if (!page->cond[i].used)
+				break;
+		}
+		if (i == SHM_COND_MAX) {
+			static int warned;
+
+			if (!warned++)
+				_w("Status page full, %s and later conditions not published", c->name);
+			return;
+		}
+		c->shm = i + 1;
+	}
+
+	p = &page->cond[c->shm - 1];
+	p->gen     = c->gen;
+	p->oneshot = c->oneshot ? 1 : 0;
+	p->used    = 1;
+	strlcpy(p->name, c->name, sizeof(p->name));
+
+	if ((uint32_t)c->shm > page->num_cond)
+		page->num_cond = c->shm;
+}
+
+/**
+ * shm_svc - Publish current state of a service
+ * @svc: Pointer to an &svc_t object
+ *
+ * Called on every change of state, PID, or readiness of @svc.  The
+ * first call allocates a slot in the page for @svc.
+ */
+void shm_svc(svc_t *svc)
+{
+	if (!page || !svc)
+		return;
+
+	shm_begin();
+	svc_publish(svc);
+	shm_end();
+}
+
+/**
+ * shm_svc_del - Release slot of a service that is being removed
+ * @svc: Pointer to an &svc_t object
+ */
+void shm_svc_del(svc_t *svc)
+{
+	if (!page || !svc || !svc->shm)
+		return;
+
+	shm_begin();
+	memset(&page->svc[svc->shm - 1], 0, sizeof(page->svc[0]));
+	while (page->num_svc && !page->svc[page->num_svc - 1].job)
+		page->num_svc--;
+	shm_end();
+
+	svc->shm = 0;
+}
+
+/**
+ * shm_cond - Publish current state of a condition
+ * @c: Pointer to a &struct cond
+ *
+ * Wildcard patterns are not conditions of their own and are skipped,
+ * as are conditions with a name that does not fit %SHM_COND_LEN.
+ */
+void shm_cond(struct cond *c)
+{
+	if (!page || !c)
+		return;
+
+	shm_begin();
+	cond_publish(c);
+	shm_end();
+}
+
+/**
+ * shm_cond_del - Release slot of a condition that is being freed
+ * @c: Pointer to a &struct cond
+ */
+void shm_cond_del(struct cond *c)
+{
+	if (!page || !c || !c->shm)
+		return;
+
+	shm_begin();
+	memset(&page->cond[c->shm - 1], 0, sizeof(page->cond[0]));
+	while (page->num_cond && !page->cond[page->num_cond - 1].used)
+		page->num_cond--;
+	shm_end();
+
+	c->shm = 0;
+}
+
+/* New reconf generation, flips state of all conditions not reasserted */
+void shm_rgen(unsigned int gen)
+{
+	if (!page)
+		return;
+
+	shm_begin();
+	page->rgen = gen;
+	shm_end();
+}
+
+void shm_runlevel(int level)
+{
+	if (!page)
+		return;
+
+	shm_begin();
+	page->runlevel = level;
+	shm_end();
+}
+
+/**
+ * shm_init - Map status page and publish all services and conditions
+ *
+ * The page is a file in /run/finit, on tmpfs.  It is reused, not
+ * recreated, on re-exec so clients that keep it mapped remain valid.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, in which case the page is never
+ * updated and clients fall back to the API.
+ */
+int shm_init(void)
+{
+	char path[MAX_ARG_LEN];
+	struct cond *c;
+	svc_t *svc, *iter = NULL;
+	void *ptr;
+	int fd;
+
+	pid_runpath(SHM_FILE, path, sizeof(path));
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		_pe("Failed opening status page %s", path);
+		return 1;
+	}
+
+	if (ftruncate(fd, sizeof(*page))) {
+		_pe("Failed sizing status page %s", path);
+		close(fd);
+		return 1;
+	}
+
+	ptr = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		_pe("Failed mapping status page %s", path);
+		return 1;
+	}
+	page = ptr;
+
+	shm_begin();
+	memset(page->svc, 0, sizeof(page->svc));
+	memset(page->cond, 0, sizeof(page->cond));
+	page->magic    = SHM_MAGIC;
+	page->version  = SHM_VERSION;
+	page->rgen     = cond_rgen;
+	page->runlevel = runlevel;
+	page->num_svc  = 0;
+	page->num_cond = 0;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		svc->shm = 0;
+		svc_publish(svc);
+	}
+	for (c = cond_iterator(1); c; c = cond_iterator(0)) {
+		c->shm = 0;
+		cond_publish(c);
+	}
+	shm_end();
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
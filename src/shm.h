@@ -0,0 +1,148 @@
+/* Read-only status page of services and conditions, for local clients
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_SHM_H_
+#define FINIT_SHM_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "cond.h"
+#include "svc.h"
+
+#define SHM_FILE      "finit/status"
+#define SHM_MAGIC     0x46494e53	/* "FINS" */
+#define SHM_VERSION   1
+
+#define SHM_SVC_MAX   512
+#define SHM_COND_MAX  512
+#define SHM_COND_LEN  128		/* Longer names are not published */
+
+/* One service, job 0 marks an unused slot */
+struct shm_svc {
+	int32_t  job;
+	int32_t  pid;
+	uint8_t  state;			/* svc_state_t */
+	uint8_t  block;			/* svc_block_t */
+	uint8_t  type;			/* svc_type_t */
+	uint8_t  starting;		/* Not yet ready, see svc_started() */
+	uint8_t  queued;		/* Held by admission control */
+	uint8_t  pad[3];
+	int32_t  restart_cnt;
+	int64_t  start_time;		/* Seconds since boot */
+	char     id[MAX_ID_LEN];
+	char     name[MAX_ARG_LEN];
+};
+
+/*
+ * One condition, same as in PID 1: off if gen is zero, on if oneshot
+ * or gen is the reconf generation of the page, otherwise in flux.
+ */
+struct shm_cond {
+	uint32_t gen;
+	uint8_t  oneshot;
+	uint8_t  used;
+	uint8_t  pad[2];
+	char     name[SHM_COND_LEN];
+};
+
+/*
+ * The page is only written by PID 1.  Readers copy what they need and
+ * retry if seq was odd, i.e. an update in progress, or changed meanwhile.
+ * The num_* fields are high-water marks of used slots.
+ */
+struct shm_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t rgen;			/* Condition reconf generation */
+	int32_t  runlevel;
+	uint32_t num_svc;
+	uint32_t num_cond;
+	uint32_t pad;
+
+	struct shm_svc  svc[SHM_SVC_MAX];
+	struct shm_cond cond[SHM_COND_MAX];
+};
+
+/**
+ * shm_snapshot - Consistent copy of the status page
+ * @page: Mapped status page
+ * @copy: Buffer to copy page to
+ *
+ * Returns:
+ * POSIX OK(0), or -1 if PID 1 kept updating the page, or if it does
+ * not look like a status page of this version.
+ */
+static inline int shm_snapshot(const struct shm_page *page, struct shm_page *copy)
+{
+	for (int i = 0; i < 100; i++) {
+		uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1)
+			continue;
+
+		memcpy(copy, (const void *)page, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (copy->magic != SHM_MAGIC || copy->version != SHM_VERSION)
+			return -1;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Condition state of a published condition, see cond_get_state() */
+static inline enum cond_state shm_cond_state(const struct shm_page *page, const struct shm_cond *c)
+{
+	if (!c->gen)
+		return COND_OFF;
+	if (c->oneshot || c->gen == page->rgen)
+		return COND_ON;
+
+	return COND_FLUX;
+}
+
+int  shm_init    (void);
+
+void shm_svc     (svc_t *svc);
+void shm_svc_del (svc_t *svc);
+
+void shm_cond    (struct cond *c);
+void shm_cond_del(struct cond *c);
+
+void shm_rgen    (unsigned int gen);
+void shm_runlevel(int level);
+
+#endif /* FINIT_SHM_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
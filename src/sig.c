@@ -66,16 +66,26 @@
  *      Finit currently forwards this to SIGUSR2.
  */
 
-#include <dirent.h>
+#include <ctype.h>
+#include <dirent.h>		/* DT_DIR */
+#include <fcntl.h>
+#include <poll.h>
 #include <string.h>		/* strerror() */
+#include <time.h>
 #include <sys/reboot.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <lite/lite.h>
 
 #include "finit.h"
 #include "conf.h"
 #include "config.h"
+#include "console.h"
 #include "helpers.h"
+#include "kexec.h"
+#include "metrics.h"
+#include "mount.h"
+#include "pid.h"
 #include "plugin.h"
 #include "private.h"
 #include "sig.h"
@@ -83,6 +93,9 @@
 #include "util.h"
 #include "utmp-api.h"
 
+#define KILL_TIMEOUT  2000	/* msec, for remaining processes to exit on SIGTERM */
+#define REAP_TIMEOUT  500	/* msec, for the kernel to finish off SIGKILL'ed */
+
 extern svc_t *wdog;
 
 /*
@@ -93,6 +106,25 @@ extern svc_t *wdog;
 shutop_t halt = SHUT_DEFAULT;
 
 static int   stopped = 0;
+
+/* Sorted up to @sorted, new PIDs are appended until the sweep is done */
+struct pidlist {
+	pid_t *pids;
+	int    num, sorted, max;
+};
+
+static struct pidlist killed;	/* Signalled by do_kill(), for do_wait() */
+static struct pidlist prev;	/* Signalled by the previous do_kill() */
+static struct pidlist skipped;	/* Kernel threads and "special" processes */
+
+/* From getdents64(2), not in all C libraries */
+struct proc_dirent {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
 static uev_t sigterm_watcher, sigusr1_watcher, sigusr2_watcher;
 static uev_t sighup_watcher,  sigint_watcher,  sigpwr_watcher;
 static uev_t sigchld_watcher;
@@ -154,84 +186,290 @@ static struct sigmap {
 };
 
 void mdadm_wait(void);
-void unmount_tmpfs(void);
-void unmount_regular(void);
+
+static void pidlist_add(struct pidlist *list, pid_t pid)
+{
+	if (list->num == list->max) {
+		pid_t *pids;
+
+		pids = realloc(list->pids, (list->max + 64) * sizeof(pid_t));
+		if (!pids)
+			return;
+
+		list->pids = pids;
+		list->max += 64;
+	}
+
+	list->pids[list->num++] = pid;
+}
+
+static int pidcmp(const void *a, const void *b)
+{
+	return *(const pid_t *)a - *(const pid_t *)b;
+}
+
+static void pidlist_sort(struct pidlist *list)
+{
+	qsort(list->pids, list->num, sizeof(pid_t), pidcmp);
+	list->sorted = list->num;
+}
+
+static int pidlist_has(struct pidlist *list, pid_t pid)
+{
+	return list->sorted && bsearch(&pid, list->pids, list->sorted, sizeof(pid_t), pidcmp);
+}
 
 /*
- * Kernel threads have no cmdline so fgets() returns NULL for them.  We
- * also skip "special" processes, e.g. mdadm/mdmon or watchdogd that must
- * not be stopped here, for various reasons.
+ * Kernel threads have an empty cmdline.  We also skip "special"
+ * processes, e.g. mdadm/mdmon or watchdogd that must not be stopped
+ * here, for various reasons.
  *
  * https://www.freedesktop.org/wiki/Software/systemd/RootStorageDaemons/
+ *
+ * Returns 0 if the process should be signalled, 1 if skipped, and -1
+ * if it is gone.
+ */
+static int pid_skip(int procfd, const char *pid)
+{
+	char file[LINE_SIZE];
+	ssize_t len;
+	int fd;
+
+	snprintf(file, sizeof(file), "%s/cmdline", pid);
+	fd = openat(procfd, file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	len = read(fd, file, sizeof(file) - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	if (len == 0)
+		return 1;
+	file[len] = 0;
+
+	if (strstr(file, "gdbserver")) {
+		_d("Skipping %s ...", file);
+		return 1;
+	}
+	if (file[0] == '@') {
+		_d("Skipping %s ...", &file[1]);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Signal all processes, except ourselves and those skipped above, in
+ * one getdents64() pass over /proc, without stdio.  The cmdline is only
+ * read for new PIDs, those already skipped or signalled by the previous
+ * call are known, so the SIGKILL sweep at shutdown mostly just lists
+ * /proc.  The signalled PIDs are saved for do_wait().
  */
 void do_kill(int signo)
 {
-	DIR *dirp;
+	struct pidlist tmp;
+	char buf[4096];
+	long len;
+	int procfd;
+
+	procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (procfd == -1)
+		return;
+
+	tmp    = prev;
+	prev   = killed;
+	killed = tmp;
+	killed.num = killed.sorted = 0;
+	pidlist_sort(&prev);
 
-	dirp = opendir("/proc");
-	if (dirp) {
-		struct dirent *d;
+	while ((len = syscall(SYS_getdents64, procfd, buf, sizeof(buf))) > 0) {
+		long pos;
 
-		while ((d = readdir(dirp))) {
-			int pid;
-			FILE *fp;
-			char file[LINE_SIZE] = "";
+		for (pos = 0; pos < len; pos += ((struct proc_dirent *)&buf[pos])->d_reclen) {
+			struct proc_dirent *d = (struct proc_dirent *)&buf[pos];
+			pid_t pid;
 
-			if (d->d_type != DT_DIR)
+			if (d->d_type != DT_DIR || !isdigit((unsigned char)d->d_name[0]))
 				continue;
 
 			pid = atoi(d->d_name);
-			if (!pid)
+			if (pid <= 1 || pidlist_has(&skipped, pid))
 				continue;
 
-			snprintf(file, sizeof(file), "/proc/%s/cmdline", d->d_name);
-			fp = fopen(file, "r");
-			if (!fp)
-				continue;
+			if (!pidlist_has(&prev, pid)) {
+				int rc;
+
+				rc = pid_skip(procfd, d->d_name);
+				if (rc > 0)
+					pidlist_add(&skipped, pid);
+				if (rc)
+					continue;
+			}
+
+			if (!kill(pid, signo))
+				pidlist_add(&killed, pid);
+		}
+	}
+	close(procfd);
+
+	pidlist_sort(&skipped);
+}
+
+static long elapsed(struct timespec *start)
+{
+	struct timespec now;
 
-			if (fgets(file, sizeof(file), fp)) {
-				if (strstr(file, "gdbserver"))
-					_d("Skipping %s ...", file);
-				else if (file[0] != '@')
-					kill(pid, signo);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Wait at most @timeout msec for the processes signalled by do_kill()
+ * to exit, returning as soon as all are done.  With a pidfd for each we
+ * sleep in poll(), on older kernels we probe every 10 msec.  Orphans
+ * are reparented to us, so all are reaped here as well.
+ *
+ * Returns the number of processes still running.
+ */
+static int do_wait(int timeout)
+{
+	struct timespec start;
+	struct pollfd *pfd;
+	int i, left, probe = 0;
+
+	if (!killed.num)
+		return 0;
+
+	pfd = calloc(killed.num, sizeof(*pfd));
+	if (!pfd) {
+		do_sleep((timeout + 999) / 1000);
+		return killed.num;
+	}
+
+	for (i = 0; i < killed.num; i++) {
+		pfd[i].fd = pid_open(killed.pids[i]);
+		pfd[i].events = POLLIN;
+		if (pfd[i].fd == -1) {
+			if (errno == ESRCH)
+				killed.pids[i] = 0;
+			else
+				probe = 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (1) {
+		long remain;
+
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+
+		left = 0;
+		for (i = 0; i < killed.num; i++) {
+			if (pfd[i].fd != -1) {
+				if (!pfd[i].revents) {
+					left++;
+					continue;
+				}
+				close(pfd[i].fd);
+				pfd[i].fd = -1;
+				killed.pids[i] = 0;
+			} else if (killed.pids[i]) {
+				if (!kill(killed.pids[i], 0))
+					left++;
 				else
-					_d("Skipping %s ...", &file[1]);
+					killed.pids[i] = 0;
 			}
-			fclose(fp);
 		}
-		closedir(dirp);
+
+		remain = timeout - elapsed(&start);
+		if (!left || remain <= 0)
+			break;
+
+		if (probe && remain > 10)
+			remain = 10;
+		if (poll(pfd, killed.num, remain) == -1 && errno != EINTR)
+			break;
 	}
+
+	for (i = 0; i < killed.num; i++) {
+		if (pfd[i].fd != -1)
+			close(pfd[i].fd);
+	}
+	free(pfd);
+
+	return left;
+}
+
+/*
+ * Close all descriptors from @lowfd and up.  PID 1 holds quite a few
+ * per service, e.g., pidfds, cgroups, sockets, and stored fds, any of
+ * them left open may keep a file system busy at unmount.
+ */
+static void close_from(int lowfd)
+{
+	long max;
+
+#ifdef SYS_close_range
+	if (!syscall(SYS_close_range, lowfd, ~0U, 0))
+		return;
+#endif
+	max = sysconf(_SC_OPEN_MAX);
+	if (max < 0)
+		max = 1024;
+
+	for (int fd = lowfd; fd < max; fd++)
+		close(fd);
 }
 
 void do_shutdown(shutop_t op)
 {
+	int left;
+
 	touch(SYNC_SHUTDOWN);
 
 	if (sdown)
 		run_interactive(sdown, "Calling shutdown hook: %s", sdown);
 
+	/* Load the kexec kernel while /boot is still mounted */
+	if (op == SHUT_REBOOT && kexec_default())
+		op = SHUT_KEXEC;
+	if (op == SHUT_KEXEC && kexec_prepare()) {
+		logit(LOG_WARNING, "Cannot kexec, falling back to regular reboot");
+		op = SHUT_REBOOT;
+	}
+
 	/* Update UTMP db */
 	utmp_set_halt();
 
 	/*
 	 * Tell all remaining non-monitored processes to exit, give them
-	 * some time to exit gracefully, 2 sec is customary.
+	 * some time to exit gracefully, 2 sec is customary, but there is
+	 * no need to wait that long when they are done sooner.
 	 */
 	do_kill(SIGTERM);
-	do_sleep(2);
+	left = do_wait(KILL_TIMEOUT);
+	_d("%d processes remaining after SIGTERM", left);
 	do_kill(SIGKILL);
+	do_wait(REAP_TIMEOUT);
 
 	/* Exit plugins and API gracefully */
 	plugin_exit();
 	api_exit();
+	notify_exit();
+	heartbeat_exit();
+	logmux_exit();
+	console_exit();
 
 	/* Reap 'em */
 	while (waitpid(-1, NULL, WNOHANG) > 0)
 		;
 
 	/* Close all local non-console descriptors */
-	for (int fd = 3; fd < 128; fd++)
-		close(fd);
+	close_from(3);
 
 	if (vfork()) {
 		/*
@@ -243,7 +481,7 @@ void do_shutdown(shutop_t op)
 	}
 
 	if (wdog) {
-		print(kill(wdog->pid, SIGPWR) == 1, "Advising watchdog, system going down");
+		print(svc_signal(wdog, SIGPWR) == 1, "Advising watchdog, system going down");
 		do_sleep(2);
 	}
 
@@ -254,22 +492,27 @@ void do_shutdown(shutop_t op)
 	/* ... unmount remaining regular file systems. */
 	unmount_regular();
 
-	/* We sit on / so we must remount it ro, try all the things! */
-	sync();
-	run("mount -n -o remount,ro -t dummytype dummydev /");
-	run("mount -n -o remount,ro dummydev /");
-	run("mount -n -o remount,ro /");
+	/* We sit on / so we must remount it ro */
+	unmount_root();
 
 	/* Call mdadm to mark any RAID array(s) as clean before halting. */
 	mdadm_wait();
 
+	/* Straight into the loaded kernel, regular reboot if that fails */
+	if (op == SHUT_KEXEC) {
+		_e("Rebooting via kexec ...");
+		reboot(RB_KEXEC);
+		_pe("Failed kexec reboot");
+		op = SHUT_REBOOT;
+	}
+
 	/* Reboot via watchdog or kernel, or shutdown? */
 	if (op == SHUT_REBOOT) {
 		if (wdog) {
 			int timeout = 10;
 
 			/* Wait here until the WDT reboots, or timeout with fallback */
-			print(kill(wdog->pid, SIGTERM) == 1, "Pending watchdog reboot");
+			print(svc_signal(wdog, SIGTERM) == 1, "Pending watchdog reboot");
 			while (timeout--)
 				do_sleep(1);
 		}
@@ -291,6 +534,8 @@ void do_shutdown(shutop_t op)
  */
 static void sighup_cb(uev_t *w, void *arg, int events)
 {
+	uint64_t start = metric_start();
+
 	_d("...");
 	if (UEV_ERROR == events) {
 		_e("Unrecoverable error in signal watcher");
@@ -303,6 +548,7 @@ static void sighup_cb(uev_t *w, void *arg, int events)
 
 	/* INIT_CMD_RELOAD: 'init q', 'initctl reload', and SIGHUP */
 	service_reload_dynamic();
+	metric_stop("sighup", start);
 }
 
 /*
@@ -310,6 +556,8 @@ static void sighup_cb(uev_t *w, void *arg, int events)
  */
 static void sigint_cb(uev_t *w, void *arg, int events)
 {
+	uint64_t start = metric_start();
+
 	_d("...");
 	if (UEV_ERROR == events) {
 		_e("Unrecoverable error in signal watcher");
@@ -318,6 +566,7 @@ static void sigint_cb(uev_t *w, void *arg, int events)
 
 	halt = SHUT_REBOOT;
 	service_runlevel(6);
+	metric_stop("sigint", start);
 }
 
 /*
@@ -325,6 +574,8 @@ static void sigint_cb(uev_t *w, void *arg, int events)
  */
 static void sigusr1_cb(uev_t *w, void *arg, int events)
 {
+	uint64_t start = metric_start();
+
 	_d("...");
 	if (UEV_ERROR == events) {
 		_e("Unrecoverable error in signal watcher");
@@ -333,6 +584,7 @@ static void sigusr1_cb(uev_t *w, void *arg, int events)
 
 	halt = SHUT_HALT;
 	service_runlevel(0);
+	metric_stop("sigusr1", start);
 }
 
 /*
@@ -340,6 +592,8 @@ static void sigusr1_cb(uev_t *w, void *arg, int events)
  */
 static void sigusr2_cb(uev_t *w, void *arg, int events)
 {
+	uint64_t start = metric_start();
+
 	_d("...");
 	if (UEV_ERROR == events) {
 		_e("Unrecoverable error in signal watcher");
@@ -348,6 +602,7 @@ static void sigusr2_cb(uev_t *w, void *arg, int events)
 
 	halt = SHUT_OFF;
 	service_runlevel(0);
+	metric_stop("sigusr2", start);
 }
 
 /*
@@ -355,6 +610,8 @@ static void sigusr2_cb(uev_t *w, void *arg, int events)
  */
 static void sigterm_cb(uev_t *w, void *arg, int events)
 {
+	uint64_t start = metric_start();
+
 	_d("...");
 	if (UEV_ERROR == events) {
 		_e("Unrecoverable error in signal watcher");
@@ -363,6 +620,7 @@ static void sigterm_cb(uev_t *w, void *arg, int events)
 
 	halt = SHUT_REBOOT;
 	service_runlevel(6);
+	metric_stop("sigterm", start);
 }
 
 /*
@@ -372,6 +630,7 @@ static void sigchld_cb(uev_t *w, void *arg, int events)
 {
 	pid_t pid;
 	int status;
+	uint64_t start = metric_start();
 
 	if (UEV_ERROR == events) {
 		_e("Unrecoverable error in signal watcher");
@@ -386,6 +645,7 @@ static void sigchld_cb(uev_t *w, void *arg, int events)
 			service_monitor(pid, status);
 		}
 	} while (pid > 0);
+	metric_stop("sigchld", start);
 }
 
 /*
@@ -393,6 +653,8 @@ static void sigchld_cb(uev_t *w, void *arg, int events)
  */
 static void sigstop_cb(uev_t *w, void *arg, int events)
 {
+	uint64_t start = metric_start();
+
 	if (UEV_ERROR == events) {
 		_e("Unrecoverable error in signal watcher");
 		return;
@@ -400,6 +662,7 @@ static void sigstop_cb(uev_t *w, void *arg, int events)
 
 	touch(SYNC_STOPPED);
 	stopped++;
+	metric_stop("sigstop", start);
 }
 
 /*
@@ -407,6 +670,8 @@ static void sigstop_cb(uev_t *w, void *arg, int events)
  */
 static void sigcont_cb(uev_t *w, void *arg, int events)
 {
+	uint64_t start = metric_start();
+
 	if (UEV_ERROR == events) {
 		_e("Unrecoverable error in signal watcher");
 		return;
@@ -414,6 +679,7 @@ static void sigcont_cb(uev_t *w, void *arg, int events)
 
 	stopped = 0;
 	erase(SYNC_STOPPED);
+	metric_stop("sigcont", start);
 }
 
 /*
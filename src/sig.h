@@ -63,7 +63,8 @@
 typedef enum {
 	SHUT_OFF,
 	SHUT_HALT,
-	SHUT_REBOOT
+	SHUT_REBOOT,
+	SHUT_KEXEC
 } shutop_t;
 
 extern shutop_t halt;
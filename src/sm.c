@@ -32,6 +32,7 @@
 #include "private.h"
 #include "service.h"
 #include "sig.h"
+#include "shm.h"
 #include "tty.h"
 #include "sm.h"
 #include "utmp-api.h"
@@ -107,6 +108,7 @@ void sm_step(sm_t *sm)
 {
 	svc_t *svc;
 	sm_state_t old_state;
+	int num;
 
 restart:
 	old_state = sm->state;
@@ -117,7 +119,7 @@ restart:
 	switch (sm->state) {
 	case SM_BOOTSTRAP_STATE:
 		_d("Bootstrapping all services in runlevel S from %s", FINIT_CONF);
-		service_step_all(SVC_TYPE_RUNTASK | SVC_TYPE_SERVICE);
+		service_step_learned(SVC_TYPE_RUNTASK | SVC_TYPE_SERVICE);
 		sm->state = SM_RUNNING_STATE;
 		break;
 
@@ -142,6 +144,8 @@ restart:
 		prevlevel    = runlevel;
 		runlevel     = sm->newlevel;
 		sm->newlevel = -1;
+		api_event(INIT_EV_RUNLEVEL, "runlevel %d %d", prevlevel, runlevel);
+		shm_runlevel(runlevel);
 
 		/* Restore terse mode and run hooks before shutdown */
 		if (runlevel == 0 || runlevel == 6) {
@@ -165,19 +169,25 @@ restart:
 
 		_d("Stopping services not allowed in new runlevel ...");
 		sm->in_teardown = 1;
-		service_step_all(SVC_TYPE_ANY);
+		service_plan();
 
 		sm->state = SM_RUNLEVEL_WAIT_STATE;
 		break;
 
 	case SM_RUNLEVEL_WAIT_STATE:
+		/* At shutdown, services held back until their dependents stop */
+		if ((runlevel == 0 || runlevel == 6) && service_shutdown_step()) {
+			_d("Waiting for dependents to stop ...");
+			break;
+		}
+
 		/*
 		 * Need to wait for any services to stop? If so, exit early
 		 * and perform second stage from service_monitor later.
 		 */
-		svc = svc_stop_completed();
-		if (svc) {
-			_d("Waiting to collect %s(%d) ...", svc->cmd, svc->pid);
+		num = service_plan_pending();
+		if (num) {
+			_d("Waiting to collect %d services ...", num);
 			break;
 		}
 
@@ -185,9 +195,9 @@ restart:
 		_d("All services have been stoppped, calling runlevel change hooks ...");
 		plugin_run_hooks(HOOK_RUNLEVEL_CHANGE);  /* Reconfigure HW/VLANs/etc here */
 
-		_d("Starting services new to this runlevel ...");
+		_d("Starting services held for the new runlevel ...");
 		sm->in_teardown = 0;
-		service_step_all(SVC_TYPE_ANY);
+		service_plan_done();
 
 		/* Cleanup stale services */
 		svc_clean_dynamic(service_unregister);
@@ -0,0 +1,551 @@
+/* Socket activation, bind listening sockets on behalf of services
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/kcmp.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "helpers.h"
+#include "lazy.h"
+#include "reexec.h"
+#include "sock.h"
+
+#define LISTEN_FDS_START 3	/* SD_LISTEN_FDS_START */
+
+/* Access of UNIX socket files, mode:OCTAL and owner:USER[:GROUP] */
+struct sock_perm {
+	mode_t mode;		/* 0: from umask */
+	int    uid;		/* -1: unchanged, root */
+	int    gid;
+};
+
+/*
+ * Bind and listen to a UNIX stream socket, replacing any stale socket
+ * file left by a previous run.  Without mode: the socket file gets the
+ * permissions of Finit's umask, and without owner: it is owned by root.
+ */
+static int sock_unix(svc_t *svc, char *path, struct sock_perm *perm)
+{
+	struct sockaddr_un sun;
+	int sd;
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+		return -1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+	unlink(path);
+
+	if (bind(sd, (struct sockaddr *)&sun, sizeof(sun)) || listen(sd, SOMAXCONN)) {
+		logit(LOG_ERR, "%s: failed binding socket %s: %m", svc->cmd, path);
+		close(sd);
+		return -1;
+	}
+
+	if (perm->mode && chmod(path, perm->mode))
+		logit(LOG_WARNING, "%s: failed setting mode of %s: %m", svc->cmd, path);
+	if ((perm->uid != -1 || perm->gid != -1) && chown(path, perm->uid, perm->gid))
+		logit(LOG_WARNING, "%s: failed setting owner of %s: %m", svc->cmd, path);
+
+	return sd;
+}
+
+/* mode:OCTAL, or owner:USER[:GROUP], returns 1 if @tok was one of them */
+static int sock_perm(svc_t *svc, char *tok, struct sock_perm *perm)
+{
+	char *home, *group, *end;
+	long mode;
+
+	if (!strncasecmp(tok, "mode:", 5)) {
+		errno = 0;
+		mode = strtol(&tok[5], &end, 8);
+		if (errno || end == &tok[5] || *end || mode <= 0 || mode > 07777)
+			logit(LOG_ERR, "%s: invalid socket:%s", svc->cmd, tok);
+		else
+			perm->mode = mode;
+		return 1;
+	}
+
+	if (strncasecmp(tok, "owner:", 6))
+		return 0;
+
+	group = strchr(&tok[6], ':');
+	if (group)
+		*group++ = 0;
+
+	perm->uid = getuser(&tok[6], &home);
+	if (perm->uid < 0)
+		logit(LOG_ERR, "%s: invalid socket:owner:%s, no such user", svc->cmd, &tok[6]);
+	if (group) {
+		perm->gid = getgroup(group);
+		if (perm->gid < 0)
+			logit(LOG_ERR, "%s: invalid socket:owner:%s:%s, no such group", svc->cmd, &tok[6], group);
+	}
+
+	return 1;
+}
+
+/*
+ * Bind to [ADDR:]SERVICE/PROTO, where SERVICE is a port number or a
+ * name from /etc/services, like inetd.  With @reuseport each socket of
+ * the same address is set SO_REUSEPORT, letting the kernel distribute
+ * new connections between them.
+ */
+static int sock_inet(svc_t *svc, char *arg, int reuseport)
+{
+	struct sockaddr_in sin;
+	struct servent *sv;
+	char spec[sizeof(svc->sock->spec)];
+	char *addr = NULL, *service = spec, *proto, *ptr;
+	int sd, type, val = 1;
+
+	strlcpy(spec, arg, sizeof(spec));
+	ptr = strrchr(spec, ':');
+	if (ptr) {
+		*ptr++  = 0;
+		addr    = spec;
+		service = ptr;
+	}
+
+	proto = strchr(service, '/');
+	if (!proto)
+		goto error;
+	*proto++ = 0;
+
+	if (!strcasecmp(proto, "tcp"))
+		type = SOCK_STREAM;
+	else if (!strcasecmp(proto, "udp"))
+		type = SOCK_DGRAM;
+	else
+		goto error;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family      = AF_INET;
+	sin.sin_addr.s_addr = INADDR_ANY;
+	if (addr && inet_pton(AF_INET, addr, &sin.sin_addr) != 1)
+		goto error;
+
+	sv = getservbyname(service, proto);
+	if (sv) {
+		sin.sin_port = sv->s_port;
+	} else {
+		const char *errstr = NULL;
+		int port;
+
+		port = strtonum(service, 1, 65535, &errstr);
+		if (errstr)
+			goto error;
+		sin.sin_port = htons(port);
+	}
+
+	sd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+		return -1;
+
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+#ifdef SO_REUSEPORT
+	if (reuseport)
+		setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+#endif
+
+	if (bind(sd, (struct sockaddr *)&sin, sizeof(sin)) ||
+	    (type == SOCK_STREAM && listen(sd, SOMAXCONN))) {
+		logit(LOG_ERR, "%s: failed binding socket %s/%s: %m", svc->cmd, service, proto);
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+error:
+	logit(LOG_ERR, "%s: invalid socket:%s", svc->cmd, arg);
+	return -1;
+}
+
+/**
+ * sock_close - Close all listening sockets of a service
+ * @svc: Pointer to &svc_t
+ */
+void sock_close(svc_t *svc)
+{
+	lazy_unwatch(svc);
+	if (!svc->sock)
+		return;
+
+	for (int i = 0; i < svc->sock->num; i++)
+		close(svc->sock->fd[i]);
+
+	free(svc->sock);
+	svc->sock = NULL;
+}
+
+/**
+ * sock_parse - Parse socket activation option and bind sockets
+ * @svc: Pointer to &svc_t
+ * @arg: Argument to socket:, or %NULL to close any sockets
+ *
+ * The argument is a comma separated list of [ADDR:]SERVICE/PROTO or
+ * /path/to/unix.sock, and an optional reuseport:NUM to open NUM copies
+ * of each inet socket using SO_REUSEPORT.  The mode:OCTAL and
+ * owner:USER[:GROUP] options apply to all UNIX sockets in the list.  Sockets are bound when the
+ * service is registered and kept open by Finit across restarts of the
+ * service, and across reloads as long as the option is unchanged.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int sock_parse(svc_t *svc, char *arg)
+{
+	struct sock_perm perm = { .mode = 0, .uid = -1, .gid = -1 };
+	char spec[sizeof(svc->sock->spec)];
+	char *list[SVC_MAX_SOCK], *tok;
+	int i, num = 0, reuseport = 1;
+	struct svc_sock *sk;
+
+	if (!arg) {
+		sock_close(svc);
+		return 0;
+	}
+
+	if (svc->sock && !strcmp(svc->sock->spec, arg))
+		return 0;
+
+	sock_close(svc);
+
+	sk = calloc(1, sizeof(*sk));
+	if (!sk)
+		return errno = ENOMEM;
+	strlcpy(sk->spec, arg, sizeof(sk->spec));
+	svc->sock = sk;
+
+	/* Still open from before a re-exec of Finit */
+	if (reexec_sock(svc, arg))
+		return 0;
+
+	strlcpy(spec, arg, sizeof(spec));
+
+	for (tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+		if (!strncasecmp(tok, "reuseport:", 10)) {
+			const char *errstr = NULL;
+
+			reuseport = strtonum(&tok[10], 1, SVC_MAX_SOCK, &errstr);
+			if (errstr) {
+				logit(LOG_ERR, "%s: invalid socket:%s", svc->cmd, tok);
+				reuseport = 1;
+			}
+			continue;
+		}
+		if (sock_perm(svc, tok, &perm))
+			continue;
+
+		if (num < (int)NELEMS(list))
+			list[num++] = tok;
+	}
+
+	for (i = 0; i < num; i++) {
+		int copies = list[i][0] == '/' ? 1 : reuseport;
+
+		for (int j = 0; j < copies; j++) {
+			int sd;
+
+			if (sk->num >= SVC_MAX_SOCK) {
+				logit(LOG_WARNING, "%s: too many sockets, max %d", svc->cmd, SVC_MAX_SOCK);
+				goto done;
+			}
+
+			if (list[i][0] == '/')
+				sd = sock_unix(svc, list[i], &perm);
+			else
+				sd = sock_inet(svc, list[i], reuseport > 1);
+			if (sd == -1)
+				break;
+
+			sk->fd[sk->num++] = sd;
+		}
+	}
+done:
+	_d("%s: %d listening sockets for %s", svc->cmd, sk->num, sk->spec);
+
+	if (!sk->num) {
+		free(sk);
+		svc->sock = NULL;
+		return errno = EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Same open file description?  Without kcmp(2), only sockets and memfds
+ * are compared by inode, all anon inode descriptors, e.g., eventfd and
+ * timerfd, share one inode.
+ */
+static int same_file(int fd1, int fd2)
+{
+	struct stat st1, st2;
+
+#ifdef SYS_kcmp
+	pid_t pid = getpid();
+	int rc;
+
+	rc = syscall(SYS_kcmp, pid, pid, KCMP_FILE, fd1, fd2);
+	if (rc >= 0)
+		return rc == 0;
+#endif
+	if (fstat(fd1, &st1) || fstat(fd2, &st2))
+		return 0;
+	if (!S_ISSOCK(st1.st_mode) && fcntl(fd1, F_GET_SEALS) == -1)
+		return 0;
+
+	return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+/* A valid FDNAME=, see sd_pid_notify_with_fds(3), and must fit svc_store */
+static int fdname_ok(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (len >= sizeof(((struct svc_store *)0)->name[0]))
+		return 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (!isgraph((unsigned char)name[i]) || name[i] == ':')
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Same open file already in the store?  E.g., sent again after restart */
+static int store_has(struct svc_store *st, int fd)
+{
+	for (int i = 0; i < st->num; i++) {
+		if (same_file(fd, st->fd[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Release the store of @svc when it is empty */
+static void store_release(svc_t *svc)
+{
+	if (svc->store && !svc->store->num) {
+		free(svc->store);
+		svc->store = NULL;
+	}
+}
+
+/**
+ * sock_store - Keep file descriptors sent by a service with FDSTORE=1
+ * @svc:  Pointer to &svc_t
+ * @fds:  Descriptors received with %SCM_RIGHTS, with %FD_CLOEXEC
+ * @num:  Number of descriptors in @fds
+ * @name: From FDNAME=, or %NULL
+ *
+ * Finit owns @fds after this call.  Those already stored, or beyond
+ * the fdstore:NUM limit, are closed.  The rest are held across exits
+ * and restarts of @svc, and passed to its next instance after any
+ * listening sockets, see sock_pass().
+ */
+void sock_store(svc_t *svc, int fds[], int num, const char *name)
+{
+	/*
+	 * Names are passed on colon separated in $LISTEN_FDNAMES, and
+	 * space separated in the re-exec state, like sd_notify(3) only
+	 * printable ASCII without ':' is allowed.
+	 */
+	if (name && !fdname_ok(name)) {
+		logit(LOG_WARNING, "%s: invalid FDNAME=%s, using 'stored'", svc->name, name);
+		name = NULL;
+	}
+	if (!name || !name[0])
+		name = "stored";
+
+	for (int i = 0; i < num; i++) {
+		struct svc_store *st = svc->store;
+
+		if (st && store_has(st, fds[i])) {
+			close(fds[i]);
+			continue;
+		}
+
+		if ((st ? st->num : 0) >= svc->fdstore) {
+			logit(LOG_WARNING, "%s: fd store full, max %d, dropping fd", svc->name, svc->fdstore);
+			close(fds[i]);
+			continue;
+		}
+
+		if (!st) {
+			st = calloc(1, sizeof(*st));
+			if (!st) {
+				_pe("%s: failed storing fd", svc->name);
+				close(fds[i]);
+				continue;
+			}
+			svc->store = st;
+		}
+
+		st->fd[st->num] = fds[i];
+		strlcpy(st->name[st->num], name, sizeof(st->name[0]));
+		st->num++;
+	}
+
+	_d("%s: %d descriptors in fd store", svc->name, svc_store_num(svc));
+}
+
+/**
+ * sock_store_remove - Close stored descriptors, FDSTOREREMOVE=1
+ * @svc:  Pointer to &svc_t
+ * @name: FDNAME= of descriptors to close, or %NULL for all
+ *
+ * Also called with %NULL when @svc is stopped for good, i.e., not only
+ * restarted, and when it is removed.
+ */
+void sock_store_remove(svc_t *svc, const char *name)
+{
+	struct svc_store *st = svc->store;
+	int i, j = 0;
+
+	if (!st)
+		return;
+
+	for (i = 0; i < st->num; i++) {
+		if (!name || !strcmp(st->name[i], name)) {
+			close(st->fd[i]);
+			continue;
+		}
+
+		if (i != j) {
+			st->fd[j] = st->fd[i];
+			strlcpy(st->name[j], st->name[i], sizeof(st->name[j]));
+		}
+		j++;
+	}
+
+	st->num = j;
+	store_release(svc);
+}
+
+/**
+ * sock_store_trim - Close stored descriptors beyond fdstore:NUM
+ * @svc: Pointer to &svc_t
+ *
+ * Called on reload, the limit may have been lowered, or removed.
+ */
+void sock_store_trim(svc_t *svc)
+{
+	struct svc_store *st = svc->store;
+
+	if (!st)
+		return;
+
+	while (st->num > svc->fdstore)
+		close(st->fd[--st->num]);
+	store_release(svc);
+}
+
+/**
+ * sock_pass - Pass listening sockets to service, called in the child
+ * @svc: Pointer to &svc_t
+ *
+ * Moves the sockets, and then any stored descriptors, to descriptors
+ * 3..N+2, without %FD_CLOEXEC, and sets $LISTEN_FDS and $LISTEN_PID as
+ * expected by sd_listen_fds(3).  With stored descriptors the names are
+ * also set in $LISTEN_FDNAMES, sockets are named after the service.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int sock_pass(svc_t *svc)
+{
+	int fds[SVC_MAX_SOCK + SVC_MAX_STORE], tmp[SVC_MAX_SOCK + SVC_MAX_STORE];
+	char buf[16], names[SVC_MAX_STORE * (MAX_ID_LEN * 2 + 1) + SVC_MAX_SOCK * (MAX_ARG_LEN + 1)];
+	int i, num = 0;
+
+	unsetenv("LISTEN_FDNAMES");
+	if (!svc->sock && !svc->store) {
+		unsetenv("LISTEN_FDS");
+		unsetenv("LISTEN_PID");
+		return 0;
+	}
+
+	names[0] = 0;
+	for (i = 0; i < svc_sock_num(svc); i++) {
+		fds[num++] = svc->sock->fd[i];
+		if (names[0])
+			strlcat(names, ":", sizeof(names));
+		strlcat(names, svc->name, sizeof(names));
+	}
+	for (i = 0; i < svc_store_num(svc); i++) {
+		fds[num++] = svc->store->fd[i];
+		if (names[0])
+			strlcat(names, ":", sizeof(names));
+		strlcat(names, svc->store->name[i], sizeof(names));
+	}
+
+	/* Move out of the way first, the descriptors may already be at 3..N+2 */
+	for (i = 0; i < num; i++) {
+		tmp[i] = fcntl(fds[i], F_DUPFD, LISTEN_FDS_START + num);
+		if (tmp[i] == -1)
+			return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (dup2(tmp[i], LISTEN_FDS_START + i) == -1)
+			return -1;
+		close(tmp[i]);
+	}
+
+	snprintf(buf, sizeof(buf), "%d", num);
+	setenv("LISTEN_FDS", buf, 1);
+	snprintf(buf, sizeof(buf), "%d", getpid());
+	setenv("LISTEN_PID", buf, 1);
+	if (svc->store)
+		setenv("LISTEN_FDNAMES", names, 1);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
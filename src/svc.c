@@ -23,26 +23,140 @@
  */
 
 #include <err.h>
+#include <errno.h>
 #include <ctype.h>		/* isdigit() */
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <time.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <lite/queue.h>		/* BSD sys/queue.h API */
 
 #include "finit.h"
 #include "svc.h"
+#include "cgroup.h"
 #include "helpers.h"
+#include "health.h"
+#include "lazy.h"
+#include "metrics.h"
 #include "pid.h"
+#include "pool.h"
 #include "util.h"
 #include "cond.h"
+#include "private.h"
 #include "schedule.h"
+#include "shm.h"
+#include "sock.h"
 
 /* Each svc_t needs a unique job# */
 static int jobcounter = 1;
+static unsigned int seqcounter = 1;
 static TAILQ_HEAD(, svc) svc_list = TAILQ_HEAD_INITIALIZER(svc_list);
 static TAILQ_HEAD(, svc) gc_list  = TAILQ_HEAD_INITIALIZER(gc_list);
+static TAILQ_HEAD(svcq, svc) step_list = TAILQ_HEAD_INITIALIZER(step_list);
+static TAILQ_HEAD(, svc) plan_list = TAILQ_HEAD_INITIALIZER(plan_list);
+static int plan_stops;
+
+/* Services and inetd connections come and go, keep them in a pool */
+static struct pool svc_pool = POOL_INIT("svc", svc_t, 16);
+
+/*
+ * PID hash, used by service_monitor() to find the svc_t of a collected
+ * child without walking svc_list.  Only services with a PID > 0 are in
+ * the hash, which is maintained by svc_set_pid().
+ */
+#define PID_HASH_SIZE   256
+#define PID_HASH(pid)   ((unsigned int)(pid) & (PID_HASH_SIZE - 1))
+static LIST_HEAD(, svc) pid_hash[PID_HASH_SIZE];
+
+/*
+ * Lookup hashes for svc_find(), svc_find_by_nameid(), and
+ * svc_find_by_jobid().  Keyed on cmd, name, and job respectively, the
+ * instance :ID is compared when walking a bucket.  Each registered
+ * service is in all three, in registration order, until svc_del().
+ */
+#define SVC_HASH_SIZE   256
+static TAILQ_HEAD(svc_bucket, svc) cmd_hash[SVC_HASH_SIZE];
+static struct svc_bucket name_hash[SVC_HASH_SIZE];
+static struct svc_bucket job_hash[SVC_HASH_SIZE];
+
+/*
+ * PID file hash for svc_find_by_pidfile(), keyed on the canonical path
+ * of each service's pid_file().  Maintained by svc_set_pidfile(), which
+ * service_register() calls every time a service is (re)loaded.
+ */
+static struct svc_bucket pidfile_hash[SVC_HASH_SIZE];
+
+static unsigned int str_hash(const char *str)
+{
+	unsigned int hash = 5381;
+
+	while (*str)
+		hash = ((hash << 5) + hash) + (unsigned char)*str++;
+
+	return hash & (SVC_HASH_SIZE - 1);
+}
+
+static unsigned int job_hash_key(int job)
+{
+	return (unsigned int)job & (SVC_HASH_SIZE - 1);
+}
+
+static void svc_hash_init(void)
+{
+	static int done = 0;
+	int i;
+
+	if (done)
+		return;
+
+	for (i = 0; i < SVC_HASH_SIZE; i++) {
+		TAILQ_INIT(&cmd_hash[i]);
+		TAILQ_INIT(&name_hash[i]);
+		TAILQ_INIT(&job_hash[i]);
+		TAILQ_INIT(&pidfile_hash[i]);
+	}
+	done = 1;
+}
+
+/* Drop reference to arguments, freed with the last reference */
+static void svc_put_args(svc_t *svc)
+{
+	struct svc_args *args = svc->args;
+
+	svc->args = NULL;
+	if (args && --args->refcnt <= 0)
+		free(args);
+}
+
+/* Drop reference to executable, closed with the last reference */
+static void svc_put_exec(svc_t *svc)
+{
+	struct svc_exec *exec = svc->exec;
+
+	svc->exec = NULL;
+	if (!exec || --exec->refcnt > 0)
+		return;
+
+	if (exec->fd >= 0)
+		close(exec->fd);
+	free(exec);
+}
+
+/* Drop reference to shared configuration, freed with the last reference */
+static void svc_put_config(svc_t *svc)
+{
+	struct svc_config *config = svc->config;
+
+	svc->config = NULL;
+	if (config && --config->refcnt <= 0)
+		free(config);
+}
 
 static void svc_gc(void *arg)
 {
@@ -63,7 +177,20 @@ static void svc_gc(void *arg)
 		TAILQ_REMOVE(&gc_list, svc, link);
 		_d("Cleaning out %s, clearing any conditions ...", svc->name);
 		cond_clear(mkcond(svc, cond, sizeof(cond)));
-		free(svc);
+		svc_put_args(svc);
+		svc_put_exec(svc);
+		svc_put_config(svc);
+		cgroup_service_close(svc->cgroup_fd, svc->name, svc->id);
+		free(svc->pidfile);
+		free(svc->respawn.log);
+		free(svc->notify_msg);
+		free(svc->log.file);
+		free(svc->inetd);
+		svc->inetd = NULL;	/* Connections check their parent */
+		free(svc->cgroup);
+		free(svc->prio);
+		free(svc->stats);
+		pool_free(&svc_pool, svc);
 	}
 
 	if (!TAILQ_EMPTY(&gc_list))
@@ -82,10 +209,12 @@ static void svc_gc(void *arg)
 svc_t *svc_new(char *cmd, char *id, int type)
 {
 	int job = -1;
-	svc_t *svc, *iter = NULL;
+	svc_t *svc;
+
+	svc_hash_init();
 
 	/* Find first job n:o if registering multiple instances */
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+	TAILQ_FOREACH(svc, &cmd_hash[str_hash(cmd)], cmd_link) {
 		if (!strcmp(svc->cmd, cmd)) {
 			job = svc->job;
 			break;
@@ -94,33 +223,48 @@ svc_t *svc_new(char *cmd, char *id, int type)
 	if (job == -1)
 		job = jobcounter++;
 
-	svc = calloc(1, sizeof(*svc));
+	svc = pool_alloc(&svc_pool);
 	if (!svc)
 		return NULL;
 
+	svc->config = calloc(1, sizeof(*svc->config));
+	if (!svc->config) {
+		pool_free(&svc_pool, svc);
+		return NULL;
+	}
+	svc->config->refcnt = 1;
+
 	svc->type = type;
 	svc->job  = job;
+	svc->seq  = seqcounter++;
 	if (id && id[0])
 		strlcpy(svc->id, id, sizeof(svc->id));
 	strlcpy(svc->cmd, cmd, sizeof(svc->cmd));
 
-	/* Default description, if missing */
-	strlcpy(svc->desc, svc->name, sizeof(svc->desc));
-
 	/* Default HALT signal to send */
 	svc->sighalt = SIGTERM;
 
 	/* Default delay between SIGTERM and SIGKILL */
 	svc->killdelay = SVC_TERM_TIMEOUT;
 
+	/* Opened by service_register(), or on first start */
+	svc->cgroup_fd = -1;
+
+	/* Opened by svc_set_pid() */
+	svc->pidfd = -1;
+
 	TAILQ_INSERT_TAIL(&svc_list, svc, link);
+	TAILQ_INSERT_TAIL(&cmd_hash[str_hash(svc->cmd)], svc, cmd_link);
+	TAILQ_INSERT_TAIL(&name_hash[str_hash(svc->name)], svc, name_link);
+	TAILQ_INSERT_TAIL(&job_hash[job_hash_key(svc->job)], svc, job_link);
 
 	return svc;
 }
 
 static struct wq work = {
 	.cb    = svc_gc,
-	.delay = SVC_TERM_TIMEOUT
+	.delay = SVC_TERM_TIMEOUT,
+	.name  = "svc_gc"
 };
 
 /**
@@ -132,6 +276,27 @@ static struct wq work = {
  */
 int svc_del(svc_t *svc)
 {
+	cond_svc_detach(svc);
+	svc_set_pid(svc, 0);
+	shm_svc_del(svc);
+	lazy_free(svc);
+	health_free(svc);
+	sock_close(svc);
+	sock_store_remove(svc, NULL);
+	logmux_release(svc);
+	if (svc->queued) {
+		TAILQ_REMOVE(&step_list, svc, step_link);
+		svc->queued = 0;
+	}
+	svc_plan_clear(svc);
+	TAILQ_REMOVE(&cmd_hash[str_hash(svc->cmd)], svc, cmd_link);
+	TAILQ_REMOVE(&name_hash[str_hash(svc->name)], svc, name_link);
+	TAILQ_REMOVE(&job_hash[job_hash_key(svc->job)], svc, job_link);
+	if (svc->pidfile_key) {
+		TAILQ_REMOVE(&pidfile_hash[str_hash(svc->pidfile_key)], svc, pidfile_link);
+		free(svc->pidfile_key);
+		svc->pidfile_key = NULL;
+	}
 	TAILQ_REMOVE(&svc_list, svc, link);
 	TAILQ_INSERT_TAIL(&gc_list, svc, link);
 
@@ -277,6 +442,208 @@ void svc_foreach_type(int types, int (*cb)(svc_t *))
 	}
 }
 
+/**
+ * svc_stats - Timestamps and state changes of a service
+ * @svc: Pointer to &svc_t object
+ *
+ * Most services are never started, e.g., not in the runlevel, so these
+ * are allocated on first use.  Freed in svc_gc().
+ *
+ * Returns:
+ * Pointer to the &struct svc_stats of @svc, or %NULL on out of memory.
+ */
+struct svc_stats *svc_stats(svc_t *svc)
+{
+	if (!svc->stats)
+		svc->stats = calloc(1, sizeof(*svc->stats));
+
+	return svc->stats;
+}
+
+/**
+ * svc_stamp - Record time of a start, ready, stop, or exit
+ * @svc:  Pointer to &svc_t object
+ * @what: One of %SVC_STAMP_START, %SVC_STAMP_READY, ...
+ *
+ * The timestamps of a service are always from the same, last, start.
+ * So a new start clears the others, it has not been ready, stopped, or
+ * exited yet.
+ */
+void svc_stamp(svc_t *svc, svc_stamp_t what)
+{
+	struct svc_stats *st;
+
+	if (!svc || what >= SVC_STAMP_MAX)
+		return;
+
+	st = svc_stats(svc);
+	if (!st)
+		return;
+
+	if (what == SVC_STAMP_START)
+		memset(st->stamp, 0, sizeof(st->stamp));
+	st->stamp[what] = jiffies_ns();
+}
+
+/**
+ * svc_history - Record a state change of a service
+ * @svc: Pointer to &svc_t object, in its new state
+ *
+ * Only the last %SVC_HIST_MAX changes are kept, the oldest is replaced.
+ */
+void svc_history(svc_t *svc)
+{
+	struct svc_stats *st;
+	struct svc_hist *h;
+
+	if (!svc)
+		return;
+
+	st = svc_stats(svc);
+	if (!st)
+		return;
+
+	h = &st->hist[st->pos];
+	h->ns    = jiffies_ns();
+	h->pid   = svc->pid;
+	h->state = svc->state;
+	h->block = svc->block;
+
+	st->pos = (st->pos + 1) % SVC_HIST_MAX;
+}
+
+/**
+ * svc_enqueue - Queue service to be stepped
+ * @svc: Pointer to &svc_t object
+ *
+ * Services whose inputs have changed, e.g., a condition they depend on,
+ * are queued here and stepped by service_worker().  A service is only
+ * queued once, no matter how many times it is enqueued.  The queue is
+ * sorted by @svc->weight, highest first, and otherwise in order queued.
+ */
+void svc_enqueue(svc_t *svc)
+{
+	svc_t *prev;
+
+	if (!svc || svc->queued)
+		return;
+
+	svc->queued = 1;
+	TAILQ_FOREACH_REVERSE(prev, &step_list, svcq, step_link) {
+		if (prev->weight >= svc->weight)
+			break;
+	}
+
+	if (prev)
+		TAILQ_INSERT_AFTER(&step_list, prev, svc, step_link);
+	else
+		TAILQ_INSERT_HEAD(&step_list, svc, step_link);
+}
+
+/**
+ * svc_dequeue - Get next service to step
+ *
+ * Returns:
+ * The first service queued by svc_enqueue(), or %NULL when empty.
+ */
+svc_t *svc_dequeue(void)
+{
+	svc_t *svc;
+
+	svc = TAILQ_FIRST(&step_list);
+	if (svc) {
+		TAILQ_REMOVE(&step_list, svc, step_link);
+		svc->queued = 0;
+	}
+
+	return svc;
+}
+
+/**
+ * svc_plan - Add service to the plan of a runlevel change
+ * @svc:   Pointer to &svc_t object
+ * @flags: One or more of %SVC_PLAN_STOP, %SVC_PLAN_WAIT, ...
+ *
+ * Services with %SVC_PLAN_WAIT are counted, so the state machine does
+ * not have to walk all services to see if they have been collected.
+ */
+void svc_plan(svc_t *svc, int flags)
+{
+	if (!svc)
+		return;
+
+	if (!svc->plan)
+		TAILQ_INSERT_TAIL(&plan_list, svc, plan_link);
+	if ((flags & SVC_PLAN_WAIT) && !(svc->plan & SVC_PLAN_WAIT))
+		plan_stops++;
+
+	svc->plan |= flags;
+}
+
+/**
+ * svc_plan_clear - Remove service from the plan
+ * @svc: Pointer to &svc_t object
+ */
+void svc_plan_clear(svc_t *svc)
+{
+	if (!svc || !svc->plan)
+		return;
+
+	svc_plan_stopped(svc);
+	TAILQ_REMOVE(&plan_list, svc, plan_link);
+	svc->plan = 0;
+}
+
+/**
+ * svc_plan_stopped - A planned stop has completed
+ * @svc: Pointer to &svc_t object, halted or done
+ */
+void svc_plan_stopped(svc_t *svc)
+{
+	if (!(svc->plan & SVC_PLAN_WAIT))
+		return;
+
+	svc->plan &= ~SVC_PLAN_WAIT;
+	plan_stops--;
+}
+
+/**
+ * svc_plan_stopping - Number of planned stops not yet completed
+ */
+int svc_plan_stopping(void)
+{
+	return plan_stops;
+}
+
+/**
+ * svc_plan_iterator - Iterator over services in the plan
+ * @iter:  Iterator, must be a valid pointer
+ * @first: If set, get first &svc_t, otherwise get next
+ *
+ * Safe to use with svc_plan_clear() on the returned &svc_t.
+ *
+ * Returns:
+ * An &svc_t pointer, or %NULL when no more entries can be found.
+ */
+svc_t *svc_plan_iterator(svc_t **iter, int first)
+{
+	svc_t *svc;
+
+	if (!iter) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (first)
+		svc = TAILQ_FIRST(&plan_list);
+	else
+		svc = *iter;
+
+	if (svc)
+		*iter = TAILQ_NEXT(svc, plan_link);
+
+	return svc;
+}
 
 /**
  * svc_stop_completed - Have all stopped services been collected?
@@ -307,12 +674,12 @@ svc_t *svc_stop_completed(void)
  */
 svc_t *svc_find(char *cmd, char *id)
 {
-	svc_t *svc, *iter = NULL;
+	svc_t *svc;
 
 	if (!id)
 		id = "";
 
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+	TAILQ_FOREACH(svc, &cmd_hash[str_hash(cmd)], cmd_link) {
 		if (!strcmp(svc->cmd, cmd) && !strcmp(svc->id, id))
 			return svc;
 	}
@@ -329,9 +696,12 @@ svc_t *svc_find(char *cmd, char *id)
  */
 svc_t *svc_find_by_pid(pid_t pid)
 {
-	svc_t *svc, *iter = NULL;
+	svc_t *svc;
 
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+	if (pid <= 0)
+		return NULL;
+
+	LIST_FOREACH(svc, &pid_hash[PID_HASH(pid)], pid_link) {
 		if (svc->pid == pid)
 			return svc;
 	}
@@ -339,6 +709,119 @@ svc_t *svc_find_by_pid(pid_t pid)
 	return NULL;
 }
 
+static void svc_pidfd_close(svc_t *svc)
+{
+	if (svc->pidfd == -1)
+		return;
+
+	uev_io_stop(&svc->pidfd_watcher);
+	close(svc->pidfd);
+	svc->pidfd = -1;
+}
+
+/*
+ * Process exited, collect it directly instead of waiting for SIGCHLD.
+ * Forking daemons, with the PID from a PID file, may not be our child,
+ * then there is no exit status.
+ */
+static void svc_pidfd_exit(uev_t *w, void *arg, int events)
+{
+	svc_t *svc = (svc_t *)arg;
+	pid_t pid = svc->pid;
+	int status = 0;
+
+	/* Already collected on SIGCHLD */
+	if (pid <= 0 || w->fd != svc->pidfd)
+		return;
+
+	if (UEV_ERROR != events) {
+		pid_t rc;
+
+		rc = waitpid(pid, &status, WNOHANG);
+		if (rc == pid || (rc == -1 && errno == ECHILD))
+			service_monitor(pid, status);
+	}
+
+	/* Not changed by service_monitor(), or not yet reaped */
+	if (svc->pid == pid)
+		svc_pidfd_close(svc);
+}
+
+/* Collecting is the hot path, accounted by metric_stop() */
+static void svc_pidfd_cb(uev_t *w, void *arg, int events)
+{
+	uint64_t start = metric_start();
+
+	svc_pidfd_exit(w, arg, events);
+	metric_stop("pidfd", start);
+}
+
+/**
+ * svc_set_pid - Update PID of a service object
+ * @svc: Pointer to an &svc_t object
+ * @pid: New PID, or zero when the process has been collected
+ *
+ * All updates of @svc->pid must go through this function to keep the
+ * PID hash used by svc_find_by_pid() in sync.  Also opens a pidfd for
+ * @pid, watched in the event loop for the exit of the process, and
+ * used by svc_signal().  On kernels without pidfd, the process is only
+ * collected on SIGCHLD, which is handled regardless.
+ */
+void svc_set_pid(svc_t *svc, pid_t pid)
+{
+	if (!svc || svc->pid == pid)
+		return;
+
+	if (svc->pid > 0)
+		LIST_REMOVE(svc, pid_link);
+	svc_pidfd_close(svc);
+
+	svc->pid = pid;
+	shm_svc(svc);
+	if (pid <= 0)
+		return;
+
+	LIST_INSERT_HEAD(&pid_hash[PID_HASH(pid)], svc, pid_link);
+
+	/* Our child cannot be reaped before this, so the PID is still its */
+	svc->pidfd = pid_open(pid);
+	if (svc->pidfd == -1)
+		return;
+
+	if (!ctx || uev_io_init(ctx, &svc->pidfd_watcher, svc_pidfd_cb, svc, svc->pidfd, UEV_READ)) {
+		close(svc->pidfd);
+		svc->pidfd = -1;
+	}
+}
+
+/**
+ * svc_signal - Send a signal to the main process of a service
+ * @svc:   Pointer to an &svc_t object
+ * @signo: Signal to send
+ *
+ * Uses the pidfd of @svc, when available, so the signal cannot reach
+ * an unrelated process that has been given a recycled PID.
+ *
+ * Returns:
+ * POSIX OK(0), or -1 on error with errno set, like kill(2).
+ */
+int svc_signal(svc_t *svc, int signo)
+{
+	if (!svc || svc->pid <= 1) {
+		errno = ESRCH;
+		return -1;
+	}
+
+	if (svc->pidfd != -1) {
+		if (!pid_signal(svc->pidfd, signo))
+			return 0;
+		if (errno == ESRCH)
+			return -1;
+	}
+
+	return kill(svc->pid, signo);
+}
+
 /**
  * svc_find_by_jobid - Find an service object by its JOB:ID
  * @job: Job n:o
@@ -349,12 +832,12 @@ svc_t *svc_find_by_pid(pid_t pid)
  */
 svc_t *svc_find_by_jobid(int job, char *id)
 {
-	svc_t *svc, *iter = NULL;
+	svc_t *svc;
 
 	if (!id)
 		id = "";
 
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+	TAILQ_FOREACH(svc, &job_hash[job_hash_key(job)], job_link) {
 		if (svc->job == job && !strcmp(svc->id, id))
 			return svc;
 	}
@@ -372,12 +855,12 @@ svc_t *svc_find_by_jobid(int job, char *id)
  */
 svc_t *svc_find_by_nameid(char *name, char *id)
 {
-	svc_t *svc, *iter = NULL;
+	svc_t *svc;
 
 	if (!id)
 		id = "";
 
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+	TAILQ_FOREACH(svc, &name_hash[str_hash(name)], name_link) {
 		if (!strcmp(svc->id, id) && !strcmp(name, svc->name))
 			return svc;
 	}
@@ -385,6 +868,485 @@ svc_t *svc_find_by_nameid(char *name, char *id)
 	return NULL;
 }
 
+/**
+ * svc_set_name - Update the name of a service object
+ * @svc:  Pointer to an &svc_t object
+ * @name: New name, used by svc_find_by_nameid()
+ *
+ * All updates of @svc->name must go through this function to keep the
+ * name hash in sync.
+ */
+void svc_set_name(svc_t *svc, char *name)
+{
+	if (!svc || !name)
+		return;
+
+	TAILQ_REMOVE(&name_hash[str_hash(svc->name)], svc, name_link);
+	strlcpy(svc->name, name, sizeof(svc->name));
+	TAILQ_INSERT_TAIL(&name_hash[str_hash(svc->name)], svc, name_link);
+}
+
+/**
+ * svc_set_args - Update the command line arguments of a service object
+ * @svc:  Pointer to an &svc_t object
+ * @argv: Arguments, including the command as @argv[0]
+ * @argc: Number of arguments in @argv
+ *
+ * The arguments are copied into a single allocation, only as large as
+ * needed, replacing any previous arguments of @svc.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int svc_set_args(svc_t *svc, char *argv[], int argc)
+{
+	struct svc_args *args;
+	size_t len = 0;
+	char *ptr;
+	int i;
+
+	if (!svc || argc < 0)
+		return errno = EINVAL;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+
+	args = malloc(sizeof(*args) + (argc + 1) * sizeof(char *) + len);
+	if (!args)
+		return errno;
+
+	args->refcnt = 1;
+	args->argc   = argc;
+
+	ptr = (char *)&args->argv[argc + 1];
+	for (i = 0; i < argc; i++) {
+		len = strlen(argv[i]) + 1;
+		args->argv[i] = memcpy(ptr, argv[i], len);
+		ptr += len;
+	}
+	args->argv[argc] = NULL;
+
+	svc_put_args(svc);
+	svc->args = args;
+
+	return 0;
+}
+
+/**
+ * svc_share_args - Reference arguments of another service object
+ * @svc:  Pointer to an &svc_t object
+ * @from: Pointer to &svc_t object to share arguments with
+ *
+ * Used for inetd connections, which run the same command line as their
+ * inetd service, to avoid a copy for each connection.
+ */
+void svc_share_args(svc_t *svc, svc_t *from)
+{
+	if (!svc || !from || svc->args == from->args)
+		return;
+
+	svc_put_args(svc);
+	svc->args = from->args;
+	if (svc->args)
+		svc->args->refcnt++;
+}
+
+/* Copy @arg to @buf, with any %i replaced by @id, returns length */
+static size_t expand_id(const char *arg, const char *id, char *buf, size_t len)
+{
+	size_t pos = 0, ilen = strlen(id);
+
+	if (!len)
+		return 0;
+
+	while (*arg && pos + 1 < len) {
+		if (arg[0] == '%' && arg[1] == 'i') {
+			if (pos + ilen >= len)
+				break;
+			memcpy(&buf[pos], id, ilen);
+			pos += ilen;
+			arg += 2;
+		} else
+			buf[pos++] = *arg++;
+	}
+	buf[pos] = 0;
+
+	return pos;
+}
+
+/**
+ * svc_get_argv - Command line arguments of a service object, for exec()
+ * @svc:  Pointer to an &svc_t object
+ * @argv: Array of %MAX_NUM_SVC_ARGS + 1 pointers, for template instances
+ * @buf:  Buffer for the arguments of a template instance
+ * @len:  Size of @buf
+ *
+ * All instances of a template share one set of arguments, with any %i
+ * left as-is.  They are expanded to the ID of the instance here, when
+ * it is started, into @argv and @buf.  Call before any vfork().
+ *
+ * Returns:
+ * %NULL terminated arguments of @svc, or %NULL if it has none.
+ */
+char **svc_get_argv(svc_t *svc, char *argv[], char *buf, size_t len)
+{
+	size_t pos = 0;
+	int i;
+
+	if (!svc || !svc->args)
+		return NULL;
+	if (!svc->tmpl)
+		return svc->args->argv;
+
+	for (i = 0; i < svc->args->argc && i < MAX_NUM_SVC_ARGS; i++) {
+		char *arg = svc->args->argv[i];
+
+		if (!strstr(arg, "%i") || pos >= len) {
+			argv[i] = arg;
+			continue;
+		}
+
+		argv[i] = &buf[pos];
+		pos += expand_id(arg, svc->id, &buf[pos], len - pos) + 1;
+	}
+	argv[i] = NULL;
+
+	return argv;
+}
+
+/**
+ * svc_args_str - Format command line arguments of a service object
+ * @svc:   Pointer to an &svc_t object
+ * @first: First argument to include, 0 for the command, 1 to skip it
+ * @buf:   Buffer to write space separated arguments to
+ * @len:   Size of @buf
+ *
+ * Any %i in the arguments of a template instance is expanded, as when
+ * it is started, see svc_get_argv().
+ *
+ * Returns:
+ * Always @buf, truncated if @len is too small.
+ */
+char *svc_args_str(svc_t *svc, int first, char *buf, size_t len)
+{
+	size_t pos = 0;
+	int i;
+
+	if (!buf || !len)
+		return buf;
+
+	buf[0] = 0;
+	if (!svc || !svc->args)
+		return buf;
+
+	for (i = first; i < svc->args->argc && pos + 1 < len; i++) {
+		if (i > first)
+			buf[pos++] = ' ';
+		if (svc->tmpl)
+			pos += expand_id(svc->args->argv[i], svc->id, &buf[pos], len - pos);
+		else
+			pos += strlcpy(&buf[pos], svc->args->argv[i], len - pos);
+		if (pos >= len)
+			pos = len - 1;
+	}
+	buf[pos] = 0;
+
+	return buf;
+}
+
+/* Make the shared configuration of @svc its own, before changing it */
+static struct svc_config *config_own(svc_t *svc)
+{
+	struct svc_config *config = svc->config;
+
+	if (config->refcnt == 1)
+		return config;
+
+	config = malloc(sizeof(*config));
+	if (!config)
+		return NULL;
+
+	memcpy(config, svc->config, sizeof(*config));
+	config->refcnt = 1;
+	svc_put_config(svc);
+	svc->config = config;
+
+	return config;
+}
+
+/**
+ * svc_set_cond - Set conditions of a service object
+ * @svc:  Pointer to an &svc_t object
+ * @cond: Comma separated conditions, see conf_parse_cond()
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, e.g. %ENOMEM.
+ */
+int svc_set_cond(svc_t *svc, const char *cond)
+{
+	struct svc_config *config;
+
+	if (!strcmp(svc->config->cond, cond))
+		return 0;
+
+	config = config_own(svc);
+	if (!config)
+		return errno = ENOMEM;
+
+	strlcpy(config->cond, cond, sizeof(config->cond));
+
+	return 0;
+}
+
+/**
+ * svc_set_desc - Set description of a service object
+ * @svc:  Pointer to an &svc_t object
+ * @desc: Description, shown at start and stop
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, e.g. %ENOMEM.
+ */
+int svc_set_desc(svc_t *svc, const char *desc)
+{
+	struct svc_config *config;
+
+	if (!strcmp(svc->config->desc, desc))
+		return 0;
+
+	config = config_own(svc);
+	if (!config)
+		return errno = ENOMEM;
+
+	strlcpy(config->desc, desc, sizeof(config->desc));
+
+	return 0;
+}
+
+/**
+ * svc_set_rlimit - Set resource limits of a service object
+ * @svc:    Pointer to an &svc_t object
+ * @rlimit: Array of %RLIMIT_NLIMITS limits
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, e.g. %ENOMEM.
+ */
+int svc_set_rlimit(svc_t *svc, struct rlimit rlimit[])
+{
+	struct svc_config *config;
+
+	if (!memcmp(svc->config->rlimit, rlimit, sizeof(svc->config->rlimit)))
+		return 0;
+
+	config = config_own(svc);
+	if (!config)
+		return errno = ENOMEM;
+
+	memcpy(config->rlimit, rlimit, sizeof(config->rlimit));
+
+	return 0;
+}
+
+/**
+ * svc_share_config - Reference configuration of another service object
+ * @svc:  Pointer to an &svc_t object
+ * @from: Pointer to &svc_t object to share configuration with
+ *
+ * Used for template instances and inetd connections.  Any following
+ * svc_set_cond() et al. that changes the value gives @svc its own.
+ */
+void svc_share_config(svc_t *svc, svc_t *from)
+{
+	if (!svc || !from || svc->config == from->config)
+		return;
+
+	svc_put_config(svc);
+	svc->config = from->config;
+	svc->config->refcnt++;
+}
+
+/**
+ * svc_resolve - Resolve executable of a service object
+ * @svc: Pointer to an &svc_t object
+ *
+ * Looks up @svc->cmd in $PATH, unless it is a path already, and opens
+ * it for use with fexecve().  Called when a service is registered and
+ * by svc_get_exec() when the file has changed, so a (re)start only has
+ * to stat(), not walk $PATH.  If the file cannot be opened, e.g., out
+ * of descriptors, the path is used instead.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if @svc->cmd is not an executable.
+ */
+int svc_resolve(svc_t *svc)
+{
+	struct svc_exec *exec;
+	struct stat st;
+	char *path;
+
+	if (!svc)
+		return errno = EINVAL;
+
+	svc_put_exec(svc);
+
+	if (strchr(svc->cmd, '/'))
+		path = strdup(svc->cmd);
+	else
+		path = which(svc->cmd);
+	if (!path)
+		return errno = ENOENT;
+
+	if (stat(path, &st) || !S_ISREG(st.st_mode) || access(path, X_OK)) {
+		free(path);
+		return errno = ENOENT;
+	}
+
+	exec = malloc(sizeof(*exec) + strlen(path) + 1);
+	if (!exec) {
+		free(path);
+		return errno = ENOMEM;
+	}
+
+	exec->refcnt = 1;
+	exec->dev    = st.st_dev;
+	exec->ino    = st.st_ino;
+	exec->mtime  = st.st_mtim;
+	strcpy(exec->path, path);
+	free(path);
+
+	/* The interpreter of a script cannot open an O_CLOEXEC /dev/fd/N */
+	exec->fd = open(exec->path, O_RDONLY | O_CLOEXEC);
+	if (exec->fd >= 0) {
+		char magic[2];
+
+		if (pread(exec->fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+		    !memcmp(magic, "#!", sizeof(magic))) {
+			close(exec->fd);
+			exec->fd = -1;
+		}
+	}
+
+	svc->exec = exec;
+
+	return 0;
+}
+
+/**
+ * svc_get_exec - Get resolved executable of a service object
+ * @svc: Pointer to an &svc_t object
+ *
+ * Revalidates the cached executable with a single stat(), resolving it
+ * again if it has been replaced, e.g., by a package upgrade, modified,
+ * or was not available when the service was registered.
+ *
+ * Returns:
+ * Pointer to &struct svc_exec, or %NULL if @svc->cmd does not exist.
+ */
+struct svc_exec *svc_get_exec(svc_t *svc)
+{
+	struct svc_exec *exec;
+	struct stat st;
+
+	if (!svc)
+		return NULL;
+
+	exec = svc->exec;
+	if (exec && !stat(exec->path, &st) &&
+	    st.st_dev == exec->dev && st.st_ino == exec->ino &&
+	    st.st_mtim.tv_sec  == exec->mtime.tv_sec &&
+	    st.st_mtim.tv_nsec == exec->mtime.tv_nsec)
+		return exec;
+
+	if (exec)
+		_d("%s: executable %s changed, resolving again", svc->name, exec->path);
+	if (svc_resolve(svc))
+		return NULL;
+
+	return svc->exec;
+}
+
+/**
+ * svc_share_exec - Reference executable of another service object
+ * @svc:  Pointer to an &svc_t object
+ * @from: Pointer to &svc_t object to share executable with
+ *
+ * Used for inetd connections, which run the same command as their inetd
+ * service, to not have to resolve it for each connection.
+ */
+void svc_share_exec(svc_t *svc, svc_t *from)
+{
+	if (!svc || !from || svc->exec == from->exec)
+		return;
+
+	svc_put_exec(svc);
+	svc->exec = from->exec;
+	if (svc->exec)
+		svc->exec->refcnt++;
+}
+
+/*
+ * Canonical form of a PID file path, used as key in the PID file hash.
+ * The file itself usually does not exist when a service is registered,
+ * so only the directory is resolved, e.g. /var/run -> /run symlinks.
+ */
+static char *pidfile_canon(const char *fn, char *buf, size_t len)
+{
+	char adjpath[strlen(fn) + 10]; /* + sizeof("/var/run/") */
+	char dir[PATH_MAX];
+	char *ptr;
+
+	pid_runpath(fn, adjpath, sizeof(adjpath));
+	ptr = strrchr(adjpath, '/');
+	if (!ptr || ptr == adjpath)
+		goto done;
+
+	*ptr = 0;
+	if (!realpath(adjpath, dir)) {
+		*ptr = '/';
+		goto done;
+	}
+	*ptr++ = '/';
+
+	snprintf(buf, len, "%s/%s", dir, ptr);
+	return buf;
+done:
+	strlcpy(buf, adjpath, len);
+	return buf;
+}
+
+/**
+ * svc_set_pidfile - Update PID file hash for a service object
+ * @svc: Pointer to an &svc_t object
+ *
+ * Must be called whenever @svc->pidfile, or @svc->cmd which the default
+ * PID file name is derived from, has been changed.  Resolves the path
+ * once, so PID file events need not resolve the path of every service.
+ */
+void svc_set_pidfile(svc_t *svc)
+{
+	char key[PATH_MAX];
+	char *pidfn;
+
+	if (!svc)
+		return;
+
+	if (svc->pidfile_key) {
+		TAILQ_REMOVE(&pidfile_hash[str_hash(svc->pidfile_key)], svc, pidfile_link);
+		free(svc->pidfile_key);
+		svc->pidfile_key = NULL;
+	}
+
+	pidfn = pid_file(svc);
+	if (!pidfn || !pidfn[0])
+		return;
+
+	svc->pidfile_key = strdup(pidfile_canon(pidfn, key, sizeof(key)));
+	if (!svc->pidfile_key) {
+		_pe("%s: failed saving PID file %s", svc->name, pidfn);
+		return;
+	}
+	TAILQ_INSERT_TAIL(&pidfile_hash[str_hash(svc->pidfile_key)], svc, pidfile_link);
+}
+
 /**
  * svc_find_by_plidfile - Find an service object by its PID file
  * @fn: PID file, can be absolute path or relative to /run
@@ -402,33 +1364,26 @@ svc_t *svc_find_by_nameid(char *name, char *id)
  */
 svc_t *svc_find_by_pidfile(char *fn)
 {
-	svc_t *svc, *iter = NULL;
-	char adjpath[strlen(fn) + 10]; /* + sizeof("/var/run/") */
-	char fnpath[PATH_MAX];
+	char key[PATH_MAX];
+	pid_t pid = 0;
+	svc_t *svc;
 
-	pid_runpath(fn, adjpath, sizeof(adjpath));
-	if (!realpath(adjpath, fnpath)) {
-		if (errno != ENOENT)
-			_pe("adjpath: %s, errno %d", adjpath, errno);
-		return NULL;
-	}
+	svc_hash_init();
+	pidfile_canon(fn, key, sizeof(key));
 
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
-		char path[PATH_MAX];
-		char *pidfn;
-		pid_t pid;
-
-		pidfn = pid_file(svc);
-		if (!pidfn || !realpath(pidfn, path)) {
-			if (errno != ENOENT)
-				_pe("pidfn: %s, errno %d", pidfn ?: "<NULL>", errno);
+	TAILQ_FOREACH(svc, &pidfile_hash[str_hash(key)], pidfile_link) {
+		if (strcmp(svc->pidfile_key, key))
 			continue;
-		}
 
-		if (!string_compare(fnpath, path))
-			continue;
+		if (!pid) {
+			pid = pid_file_read(key);
+			if (pid < 0) {
+				if (errno != ENOENT)
+					_pe("pidfn: %s, errno %d", key, errno);
+				return NULL;
+			}
+		}
 
-		pid = pid_file_read(path);
 		if (svc->pid != pid)
 			continue;
 
@@ -440,15 +1395,17 @@ svc_t *svc_find_by_pidfile(char *fn)
 
 /**
  * svc_mark_dynamic - Mark dynamically loaded services for deletion.
+ * @changed: Optional filter, only mark services from .conf files it accepts
  *
  * This function traverses the list of known services, marking all that
  * have been loaded from /etc/finit.d/ for deletion.  If a .conf file
  * has been removed svc_cleanup_dynamic() will stop and delete the
  * service.
  *
- * This function is called from sighup_cb().
+ * This function is called from conf_reload(), which uses @changed to
+ * only mark services from .conf files it is about to re-read.
  */
-void svc_mark_dynamic(void)
+void svc_mark_dynamic(int (*changed)(char *file))
 {
 	svc_t *svc, *iter = NULL;
 
@@ -457,19 +1414,21 @@ void svc_mark_dynamic(void)
 			continue;
 		if (svc_is_inetd_conn(svc))
 			continue;
+		if (changed && !changed(svc->conf))
+			continue;
 
-		*((int *)&svc->dirty) = -1;
+		svc->dirty = -1;
 	}
 }
 
 void svc_mark_dirty(svc_t *svc)
 {
-	*((int *)&svc->dirty) = 1;
+	svc->dirty = 1;
 }
 
 void svc_mark_clean(svc_t *svc)
 {
-	*((int *)&svc->dirty) = 0;
+	svc->dirty = 0;
 }
 
 /**
@@ -499,7 +1458,6 @@ void svc_clean_dynamic(void (*cb)(svc_t *))
 int svc_clean_bootstrap(svc_t *svc)
 {
 	if (!ISOTHER(svc->runlevels, 0)) {
-		svc->pid = 0;
 		svc_del(svc);
 		return 1;
 	}
@@ -591,6 +1549,26 @@ int svc_is_unique(svc_t *svc)
 	return unique;
 }
 
+/* Services with name, and optional id, matching shell wildcard patterns */
+static int svc_glob(char *name, char *id, int (*found)(svc_t *), int *result)
+{
+	svc_t *svc, *iter = NULL;
+	int num = 0;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (fnmatch(name, svc->name, 0))
+			continue;
+		if (id && fnmatch(id, svc->id, 0))
+			continue;
+
+		num++;
+		if (found)
+			*result += found(svc);
+	}
+
+	return num;
+}
+
 /* break up "job:id job:id job:id ..." into several "job:id" tokens */
 static char *tokstr(char *str, size_t len)
 {
@@ -677,6 +1655,14 @@ int svc_parse_jobstr(char *str, size_t len, int (*found)(svc_t *), int (not_foun
 				else if (found)
 					result += found(svc);
 			}
+		} else if (strpbrk(token, "*?[")) {
+			if (ptr) {
+				*ptr++ = 0;
+				id  = ptr;
+			}
+
+			if (!svc_glob(token, id, found, &result) && not_found)
+				result += not_found(token, id);
 		} else {
 			if (!ptr) {
 				svc = svc_named_iterator(&iter, 1, token);
@@ -25,6 +25,7 @@
 #ifndef FINIT_SVC_H_
 #define FINIT_SVC_H_
 
+#include <sched.h>		/* cpu_set_t */
 #include <sys/ipc.h>		/* IPC_CREAT */
 #include <sys/resource.h>
 #include <sys/types.h>		/* pid_t */
@@ -35,12 +36,15 @@
 #include "helpers.h"
 
 typedef int svc_cmd_t;
+struct cond_dep;
+struct svc_lazy;
+struct svc_health;
 
 typedef enum {
 	SVC_TYPE_FREE       = 0,	/* Free to allocate */
 	SVC_TYPE_SERVICE    = 1,	/* Monitored, will be respawned */
 	SVC_TYPE_TASK       = 2,	/* One-shot, runs in parallell */
-	SVC_TYPE_RUN        = 4,	/* Like task, but wait for completion */
+	SVC_TYPE_RUN        = 4,	/* Like task, but later jobs wait for completion */
 	SVC_TYPE_INETD      = 8,	/* Classic inetd service */
 	SVC_TYPE_INETD_CONN = 16,	/* Single inetd connection */
 	SVC_TYPE_SYSV       = 32,	/* SysV style init.d script w/ start/stop */
@@ -72,12 +76,132 @@ typedef enum {
 #define MAX_STR_LEN      64
 #define MAX_COND_LEN     (MAX_ARG_LEN * 3)
 #define MAX_USER_LEN     16
+#define MAX_CGROUP_LEN   128
 #define MAX_NUM_FDS      64	     /* Max number of I/O plugins */
 #define MAX_NUM_SVC_ARGS 64
 
 /* Default kill delay (msec) after SIGTERM (svc->sighalt) that we SIGKILL processes */
 #define SVC_TERM_TIMEOUT 3000
 
+/* Default respawn policy, see service_retry() */
+#define SVC_RESPAWN_DELAY   2000     /* msec, doubled for each crash */
+#define SVC_RESPAWN_MAX     60000    /* msec */
+#define SVC_RESPAWN_LIMIT   10	     /* Max restarts within window */
+#define SVC_RESPAWN_WINDOW  300	     /* sec */
+#define SVC_RESPAWN_HEALTHY 30	     /* sec, uptime to reset back-off */
+#define SVC_RESPAWN_LOG     32	     /* Max limit, size of log */
+
+#define SVC_MAX_SOCK        16	     /* Max sockets passed to a service */
+#define SVC_MAX_STORE       16	     /* Max fdstore:NUM */
+#define SVC_HIST_MAX        8	     /* State changes kept, see svc_history() */
+
+/* Timestamps of the last start of a service, see svc_stamp() */
+typedef enum {
+	SVC_STAMP_START = 0,	/* Forked */
+	SVC_STAMP_READY,	/* PID file created, or READY=1 */
+	SVC_STAMP_STOP,		/* Stop signal sent */
+	SVC_STAMP_EXIT,		/* Collected */
+	SVC_STAMP_MAX
+} svc_stamp_t;
+
+/* State change, also the wire format, see SVC_FIELD_HISTORY */
+struct svc_hist {
+	int64_t        ns;	       /* jiffies_ns() */
+	int32_t        pid;
+	int16_t        state;	       /* svc_state_t */
+	int16_t        block;	       /* svc_block_t */
+};
+
+/*
+ * Timestamps and state changes of a service, allocated on the first
+ * start, see svc_stamp() and svc_history().
+ */
+struct svc_stats {
+	long long      stamp[SVC_STAMP_MAX]; /* jiffies_ns(), 0 if not yet */
+	struct svc_hist hist[SVC_HIST_MAX]; /* Ring of last state changes */
+	int            pos;	       /* Next slot in hist[] */
+};
+
+/* Listening sockets, socket:, allocated by sock_parse(), see sock.c */
+struct svc_sock {
+	char           spec[MAX_ARG_LEN * 2];
+	int            fd[SVC_MAX_SOCK];
+	int            num;
+};
+
+/* Stored descriptors, FDSTORE=1, allocated by sock_store() */
+struct svc_store {
+	int            fd[SVC_MAX_STORE];
+	char           name[SVC_MAX_STORE][MAX_ID_LEN * 2]; /* FDNAME= */
+	int            num;
+};
+
+/* Runlevel change plan, see service_plan() */
+#define SVC_PLAN_STOP       0x01     /* Not allowed in new runlevel */
+#define SVC_PLAN_WAIT       0x02     /* Stopping, the change waits for it */
+#define SVC_PLAN_EARLY      0x04     /* Start without waiting for the stops */
+#define SVC_PLAN_HOLD       0x08     /* Start when the stops are done */
+
+/*
+ * Command line arguments of a service, packed into one allocation and
+ * shared between an inetd service and its connections.  See
+ * svc_set_args() and svc_share_args().
+ */
+struct svc_args {
+	int            refcnt;
+	int            argc;
+	char          *argv[];	       /* NULL terminated, strings follow */
+};
+
+/*
+ * Resolved executable of a service, shared like &struct svc_args.  The
+ * file is kept open for fexecve(), except for scripts, and revalidated
+ * with a single stat() at start, see svc_get_exec().
+ */
+struct svc_exec {
+	int            refcnt;
+	int            fd;	       /* -1 for #! scripts, use path */
+	dev_t          dev;
+	ino_t          ino;
+	struct timespec mtime;
+	char           path[];
+};
+
+/*
+ * Configuration shared, read-only, by the instances of a template, see
+ * register_template(), and by an inetd service with its connections.
+ * Always set with svc_set_cond(), svc_set_desc(), or svc_set_rlimit(),
+ * which give the service a copy of its own first, when it differs.
+ */
+struct svc_config {
+	int            refcnt;
+	struct rlimit  rlimit[RLIMIT_NLIMITS];
+	char           cond[MAX_COND_LEN];
+	char           desc[MAX_STR_LEN];
+};
+
+/*
+ * CPU and I/O scheduling of a service, applied in the child before it
+ * drops privileges, see prio.c.  Only options in @set are applied, the
+ * rest are inherited from Finit as usual.
+ */
+#define SVC_PRIO_CPUS     0x01	       /* cpus:LIST */
+#define SVC_PRIO_SCHED    0x02	       /* sched:POLICY[:PRIO] */
+#define SVC_PRIO_NICE     0x04	       /* nice:NUM */
+#define SVC_PRIO_IO       0x08	       /* ioprio:CLASS[:LEVEL] */
+#define SVC_PRIO_OOM      0x10	       /* oom:ADJ */
+
+struct svc_prio {
+	int            set;	       /* SVC_PRIO_* */
+	cpu_set_t      cpus;
+	int            policy;	       /* SCHED_OTHER, SCHED_FIFO, ... */
+	int            rtprio;	       /* 1-99, SCHED_FIFO and SCHED_RR only */
+	int            nice;
+	int            ioclass;	       /* IOPRIO_CLASS_* */
+	int            iolevel;	       /* 0-7 */
+	int            oom;	       /* oom_score_adj, -1000 to 1000 */
+};
+
 /*
  * Default enable for all services, can be stopped by means
  * of issuing an initctl call. E.g.
@@ -86,48 +210,121 @@ typedef enum {
  */
 typedef struct svc {
 	TAILQ_ENTRY(svc) link;
+	LIST_ENTRY(svc)  pid_link;     /* PID hash, see svc_set_pid() */
+	TAILQ_ENTRY(svc) cmd_link;     /* Lookup hashes, see svc_find() */
+	TAILQ_ENTRY(svc) name_link;
+	TAILQ_ENTRY(svc) job_link;
+	TAILQ_ENTRY(svc) pidfile_link; /* PID file hash, see svc_set_pidfile() */
+	TAILQ_ENTRY(svc) step_link;    /* Pending step, see svc_enqueue() */
+	int              queued;
+	long long        weight;       /* Step order, see boot_learned() */
+	TAILQ_ENTRY(svc) plan_link;    /* Runlevel change, see svc_plan() */
+	int              plan;
+	int              shm;	       /* Status page slot + 1, see shm_svc() */
 
 	/* Instance specifics */
+	unsigned int   seq;	       /* Registration order, see svc_new() */
+	int            boot_id;	       /* Bootstrap job, see boot.c */
+	int            boot_job;       /* Counted in boot_active */
 	int            job;	       /* JOB: */
 	char           id[MAX_ID_LEN]; /* :ID */
+	int            tmpl;	       /* Template instance, %i in args is :ID */
 
-	/* Limits and scoping */
-	struct rlimit  rlimit[RLIMIT_NLIMITS];
+	/* Limits, conditions and description, see svc_set_cond() et al */
+	struct svc_config *config;
+
+	/* Scoping, cpus:, sched:, nice:, ioprio:, oom:, see prio_update() */
+	struct svc_prio *prio;
 
 	/* Service details */
 	int            sighalt;        /* Signal to stop prorcess, default: SIGTERM */
 	int            killdelay;      /* Delay in msec before sending SIGKILL */
-	pid_t          pid;
-	char           pidfile[256];
+	pid_t          pid;	       /* Use svc_set_pid() to keep hash in sync */
+	int            pidfd;	       /* Of pid, or -1, maintained by svc_set_pid() */
+	uev_t          pidfd_watcher;  /* Exit notification, see svc_set_pid() */
+	char          *pidfile;	       /* pid:, or NULL for the default, see pid_file() */
+	char          *pidfile_key;    /* Canonical path of pid_file(), or NULL */
+
+	/* Origin, for incremental reload, see conf_reload() */
+	char           conf[MAX_ARG_LEN]; /* Basename of .conf, if any */
+	uint64_t       conf_hash;      /* Of definition, see service_register() */
+	int            cgroup_fd;      /* cgroup v2 group, or -1, see cgroup_service_open() */
+	char          *cgroup;	       /* cgroup:cpu.weight:50,..., or NULL */
 	long           start_time;     /* Start time, as seconds since boot, from sysinfo() */
+	struct svc_stats *stats;       /* See svc_stamp() and svc_history() */
 	int            started;	       /* Set for run/task/sysv to track if started */
 	int            status;	       /* From waitpid() when process is collected */
-	const svc_state_t state;       /* Paused, Reloading, Restart, Running, ... */
+	svc_state_t    state;	       /* Paused, Reloading, Restart, Running, ... */
 	svc_type_t     type;	       /* Service, run, task, inetd, ... */
 	int            protect;        /* Services like dbus-daemon & udev by Finit */
-	const int      dirty;	       /* -1: removal, 0: unmodified, 1: modified */
+	int            dirty;	       /* -1: removal, 0: unmodified, 1: modified */
 	int            starting;       /* ... waiting for pidfile to be re-asserted */
+	int            stop_deferred;  /* Held back at shutdown, for dependents to stop */
 	int	       runlevels;
 	int            sighup;	       /* This service supports SIGHUP :) */
 	svc_block_t    block;	       /* Reason that this service is currently stopped */
-	char           cond[MAX_COND_LEN];
-	char           name[MAX_ARG_LEN];
+	struct cond_dep *conds;	       /* Parsed config->cond, see cond_svc_attach() */
+	int            num_conds;
+	unsigned int   cond_seq;       /* Dedup when stepping, see cond_batch_commit() */
+	char           name[MAX_ARG_LEN]; /* Use svc_set_name() to keep hash in sync */
 
 	/* Counters */
 	char           once;	       /* run/task, (at least) once per runlevel */
-	const char     restart_cnt;    /* Incremented for each restart by service monitor. */
+	int            restart_cnt;    /* Restarts since last healthy, see service_retry() */
+
+	/* Readiness notification, notify:systemd, see notify.c */
+	int            notify;
+	char          *notify_msg;     /* STATUS=..., MAX_STR_LEN, or NULL */
+	long           notify_wdog;    /* Last WATCHDOG=1, jiffies() */
+	int            watchdog;       /* sec, watchdog:SEC, max time between WATCHDOG=1 */
 
-	/* For inetd services */
-	inetd_t        inetd;
+	/* Socket activation, socket:[ADDR:]PORT/PROTO,reuseport:NUM, see sock.c */
+	struct svc_sock *sock;
+
+	/* File descriptor store, fdstore:NUM and FDSTORE=1, see sock_store() */
+	int            fdstore;
+	struct svc_store *store;
+	struct svc_lazy *lazy;	       /* idle:SEC, on-demand start, see lazy.c */
+
+	/* Health checks, health:PROBE,interval:SEC,..., see health.c */
+	struct svc_health *health;
+
+	/* Start admission, admit:CLASS and start-jobs, see admit.c */
+	int            admit;	       /* Priority class, admit_class_t */
+	int            admit_wait;     /* Queued, waiting for a start slot */
+	int            admit_slot;     /* Holds a start slot, until ready */
+	long long      admit_time;     /* usec, when queued or admitted */
+
+	/* Load shedding, shed:RES[,RES][,freeze], see pressure.c */
+	int            shed;	       /* PRESSURE_* resources, and freeze */
+	int            frozen;	       /* Paused, 1: cgroup frozen, 2: SIGSTOP */
+
+	/* Respawn policy, respawn:delay:SEC,max:SEC,limit:NUM/SEC,healthy:SEC */
+	struct {
+		int    delay;	       /* msec, back-off after second crash */
+		int    max;	       /* msec, max back-off */
+		int    limit;	       /* Max restarts within window ... */
+		int    window;	       /* ... sec, before giving up */
+		int    healthy;	       /* sec, uptime to reset back-off */
+		int    num;	       /* Restarts recorded in log[] */
+		long  *log;	       /* Time of restarts, jiffies(), on first crash */
+	} respawn;
+
+	/* For inetd services and connections, allocated at registration */
+	inetd_t       *inetd;
 	int            stdin_fd;
-	char           iifname[IF_NAMESIZE + 1]; /* Ingress interface for connection */
+	int            ifindex;	       /* Ingress interface for connection */
 
 	/* Set for services we need to redirect stdout/stderr to syslog */
 	struct {
 		char   enabled;
 		char   null;
 		char   console;
-		char   file[64];
+		char   durable;	       /* fsync() each line to file */
+		int    mux_fd;	       /* pty slave from logmux_open(), while starting */
+		int    ring_size;      /* log:ring:SIZE, 0 default, -1 disabled */
+		struct logring *ring;  /* Last output, for initctl log */
+		char  *file;	       /* log:/path/to/file, or NULL */
 		char   prio[20];
 		char   ident[20];
 	} log;
@@ -138,8 +335,8 @@ typedef struct svc {
 
 	/* Command, arguments and service description */
 	char	       cmd[MAX_ARG_LEN];
-	char	       args[MAX_NUM_SVC_ARGS][MAX_ARG_LEN];
-	char	       desc[MAX_STR_LEN];
+	struct svc_args *args;	       /* Use svc_set_args(), argv[0] is the command */
+	struct svc_exec *exec;	       /* Use svc_get_exec(), resolved cmd */
 
 	/*
 	 * Used to forcefully kill services that won't shutdown on
@@ -157,9 +354,24 @@ int	    svc_del	           (svc_t *svc);
 
 svc_t	   *svc_find	           (char *cmd, char *id);
 svc_t	   *svc_find_by_pid        (pid_t pid);
+void        svc_set_pid            (svc_t *svc, pid_t pid);
+int         svc_signal             (svc_t *svc, int signo);
+void        svc_set_name           (svc_t *svc, char *name);
+int         svc_set_args           (svc_t *svc, char *argv[], int argc);
+void        svc_share_args         (svc_t *svc, svc_t *from);
+char      **svc_get_argv           (svc_t *svc, char *argv[], char *buf, size_t len);
+char       *svc_args_str           (svc_t *svc, int first, char *buf, size_t len);
+int         svc_set_cond           (svc_t *svc, const char *cond);
+int         svc_set_desc           (svc_t *svc, const char *desc);
+int         svc_set_rlimit         (svc_t *svc, struct rlimit rlimit[]);
+void        svc_share_config       (svc_t *svc, svc_t *from);
+int         svc_resolve            (svc_t *svc);
+struct svc_exec *svc_get_exec      (svc_t *svc);
+void        svc_share_exec         (svc_t *svc, svc_t *from);
 svc_t	   *svc_find_by_jobid      (int job, char *id);
 svc_t	   *svc_find_by_nameid     (char *name, char *id);
 svc_t      *svc_find_by_pidfile    (char *fn);
+void        svc_set_pidfile        (svc_t *svc);
 
 svc_t      *svc_iterator           (svc_t **iter, int first);
 svc_t      *svc_inetd_iterator     (svc_t **iter, int first);
@@ -171,7 +383,20 @@ void        svc_foreach_type       (int types, int (*cb)(svc_t *));
 
 svc_t	   *svc_stop_completed	   (void);
 
-void	    svc_mark_dynamic       (void);
+struct svc_stats *svc_stats        (svc_t *svc);
+void        svc_stamp              (svc_t *svc, svc_stamp_t what);
+void        svc_history            (svc_t *svc);
+
+void        svc_enqueue            (svc_t *svc);
+svc_t      *svc_dequeue            (void);
+
+void        svc_plan               (svc_t *svc, int flags);
+void        svc_plan_clear         (svc_t *svc);
+void        svc_plan_stopped       (svc_t *svc);
+int         svc_plan_stopping      (void);
+svc_t      *svc_plan_iterator      (svc_t **iter, int first);
+
+void	    svc_mark_dynamic       (int (*changed)(char *file));
 void	    svc_mark_dirty         (svc_t *svc);
 void	    svc_mark_clean         (svc_t *svc);
 void	    svc_clean_dynamic      (void (*cb)(svc_t *));
@@ -189,16 +414,54 @@ static inline int svc_is_inetd_conn(svc_t *svc) { return svc && SVC_TYPE_INETD_C
 static inline int svc_is_daemon    (svc_t *svc) { return svc && SVC_TYPE_SERVICE    == svc->type; }
 static inline int svc_is_sysv      (svc_t *svc) { return svc && SVC_TYPE_SYSV       == svc->type; }
 static inline int svc_is_runtask   (svc_t *svc) { return svc && (SVC_TYPE_RUNTASK & svc->type);   }
-static inline int svc_is_forking   (svc_t *svc) { return (svc_is_daemon(svc) || svc_is_sysv(svc)) && svc->pidfile[0] == '!'; }
+static inline int svc_is_internal  (svc_t *svc) { return svc && svc->inetd && svc->inetd->cmd;    }
+static inline int svc_is_forking   (svc_t *svc) { return (svc_is_daemon(svc) || svc_is_sysv(svc)) && svc->pidfile && svc->pidfile[0] == '!'; }
 
 static inline int svc_in_runlevel  (svc_t *svc, int runlevel) { return svc && ISSET(svc->runlevels, runlevel); }
 static inline int svc_has_sighup   (svc_t *svc) { return svc &&  0 != svc->sighup; }
-static inline int svc_has_pidfile  (svc_t *svc) { return svc_is_daemon(svc) && svc->pidfile[0] != 0 && svc->pidfile[0] != '!'; }
+static inline int svc_has_pidfile  (svc_t *svc) { return svc_is_daemon(svc) && svc->pidfile && svc->pidfile[0] != '!'; }
 
 static inline void svc_starting    (svc_t *svc) { if (svc) svc->starting = 1;       }
-static inline void svc_started     (svc_t *svc) { if (svc) svc->starting = 0;       }
 static inline int  svc_is_starting (svc_t *svc) { return svc && 0 != svc->starting; }
 
+static inline int svc_sock_num     (svc_t *svc) { return svc->sock  ? svc->sock->num  : 0; }
+static inline int svc_store_num    (svc_t *svc) { return svc->store ? svc->store->num : 0; }
+
+/* Timestamp of last start of @svc, 0 if not yet recorded */
+static inline long long svc_stamp_get(svc_t *svc, svc_stamp_t what)
+{
+	return svc->stats ? svc->stats->stamp[what] : 0;
+}
+
+/* State changes of @svc, oldest first, @hist must fit SVC_HIST_MAX */
+static inline int svc_history_get(svc_t *svc, struct svc_hist *hist)
+{
+	struct svc_stats *st = svc->stats;
+	int num = 0;
+
+	if (!st)
+		return 0;
+
+	for (int i = 0; i < SVC_HIST_MAX; i++) {
+		struct svc_hist *h = &st->hist[(st->pos + i) % SVC_HIST_MAX];
+
+		if (h->ns)
+			hist[num++] = *h;
+	}
+
+	return num;
+}
+
+/* Ready, from PID file or READY=1, only the first call is recorded */
+static inline void svc_started(svc_t *svc)
+{
+	if (!svc_is_starting(svc))
+		return;
+
+	svc->starting = 0;
+	svc_stamp(svc, SVC_STAMP_READY);
+}
+
 static inline int svc_is_removed   (svc_t *svc) { return svc && -1 == svc->dirty; }
 static inline int svc_is_changed   (svc_t *svc) { return svc &&  0 != svc->dirty; }
 static inline int svc_is_updated   (svc_t *svc) { return svc &&  1 == svc->dirty; }
@@ -259,7 +522,7 @@ static inline char *svc_status(svc_t *svc)
 		return "waiting";
 
 	case SVC_READY_STATE:
-		return "ready";
+		return svc->admit_wait ? "queued" : "ready";
 
 	case SVC_RUNNING_STATE:
 		return "running";
@@ -0,0 +1,224 @@
+/* Switch from initramfs to the real root file system
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "helpers.h"
+#include "log.h"
+#include "switchroot.h"
+
+/* API file systems, moved with everything mounted below them */
+static const char *api_mounts[] = { "/dev", "/proc", "/sys", "/run" };
+
+/* Only ever wipe the root file system unpacked from an initramfs */
+static int is_initramfs(int fd)
+{
+	struct statfs sfs;
+
+	if (fstatfs(fd, &sfs))
+		return 0;
+
+	return sfs.f_type == RAMFS_MAGIC || sfs.f_type == TMPFS_MAGIC;
+}
+
+/* Remove everything in @dfd, staying on @dev, closes @dfd */
+static void wipe(int dfd, dev_t dev)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	dir = fdopendir(dfd);
+	if (!dir) {
+		close(dfd);
+		return;
+	}
+
+	while ((d = readdir(dir))) {
+		struct stat st;
+		int fd;
+
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+
+		if (fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) || st.st_dev != dev)
+			continue;
+
+		if (!S_ISDIR(st.st_mode)) {
+			unlinkat(dfd, d->d_name, 0);
+			continue;
+		}
+
+		fd = openat(dfd, d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		wipe(fd, dev);
+		unlinkat(dfd, d->d_name, AT_REMOVEDIR);
+	}
+
+	closedir(dir);
+}
+
+/**
+ * switchroot_pending - Check if Finit should switch to another root
+ *
+ * The switch-root DIR in finit.conf is only honored when running from
+ * an initramfs and something, e.g. /etc/fstab or a run [S] job of the
+ * initramfs, has mounted the real root file system on DIR.
+ *
+ * Returns:
+ * %TRUE(1) if switchroot() should be called, otherwise %FALSE(0).
+ */
+int switchroot_pending(void)
+{
+	struct stat st, root;
+	int fd, rc;
+
+	if (!sysroot || rescue)
+		return 0;
+
+	fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	rc = is_initramfs(fd);
+	close(fd);
+
+	if (!rc) {
+		_d("Not running from an initramfs, skipping switch-root %s", sysroot);
+		return 0;
+	}
+
+	if (stat(sysroot, &st) || stat("/", &root) || st.st_dev == root.st_dev) {
+		logit(LOG_ERR, "New root %s is not mounted, staying on initramfs", sysroot);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * switchroot - Make the file system on switch-root DIR the new root
+ *
+ * Same steps as switch_root(8), but without exec'ing a new init.  All
+ * API file systems are moved to the new root, the contents of the
+ * initramfs are deleted to free its memory, and DIR is then moved to
+ * / and chroot'ed to.  Sockets, descriptors, and the in-memory state
+ * of Finit, e.g., conditions and loaded plugins, are kept as-is.
+ *
+ * Processes started from the initramfs keep running, but any file in
+ * the initramfs they have open only goes away when they exit.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error.
+ */
+int switchroot(void)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	size_t moved = 0;
+	int fd;
+
+	fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		_pe("Cannot open initramfs root");
+		goto fail;
+	}
+
+	/* Check all we can before touching the API file systems */
+	if (chdir(sysroot)) {
+		_pe("Failed changing to %s", sysroot);
+		goto fail;
+	}
+
+	for (moved = 0; moved < NELEMS(api_mounts); moved++) {
+		const char *mnt = api_mounts[moved];
+
+		snprintf(path, sizeof(path), "%s%s", sysroot, mnt);
+		if (!fisdir(path) && mkdir(path, 0755)) {
+			_pe("Failed creating %s", path);
+			goto restore;
+		}
+
+		if (mount(mnt, path, NULL, MS_MOVE, NULL)) {
+			_pe("Failed moving %s to %s, detaching", mnt, path);
+			umount2(mnt, MNT_DETACH);
+		}
+	}
+
+	if (mount(sysroot, "/", NULL, MS_MOVE, NULL)) {
+		_pe("Failed moving %s to /", sysroot);
+		goto restore;
+	}
+
+	/* Point of no return, the new root is mounted on / already */
+	if (chroot(".") || chdir("/"))
+		_pe("Failed chroot to %s", sysroot);
+
+	logit(LOG_NOTICE, "Switched root to %s, freeing initramfs", sysroot);
+	if (is_initramfs(fd))
+		wipe(fd, st.st_dev);
+	else
+		close(fd);
+
+	free(sysroot);
+	sysroot = NULL;
+
+	return 0;
+
+restore:
+	/* Move API file systems back, or PID 1 is left without them */
+	while (moved-- > 0) {
+		const char *mnt = api_mounts[moved];
+
+		snprintf(path, sizeof(path), "%s%s", sysroot, mnt);
+		if (mount(path, mnt, NULL, MS_MOVE, NULL) && errno != EINVAL)
+			_pe("Failed moving %s back to %s", path, mnt);
+	}
+	if (chdir("/"))
+		_pe("Failed changing back to initramfs root");
+fail:
+	if (fd >= 0)
+		close(fd);
+
+	return 1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
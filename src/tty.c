@@ -23,6 +23,7 @@
  */
 
 #include <ctype.h>		/* isdigit() */
+#include <fcntl.h>
 #include <signal.h>
 #include <termios.h>
 #include <sys/ioctl.h>
@@ -34,6 +35,9 @@
 #include "finit.h"
 #include "conf.h"
 #include "helpers.h"
+#include "metrics.h"
+#include "pool.h"
+#include "sig.h"
 #include "tty.h"
 #include "util.h"
 #include "utmp-api.h"
@@ -42,6 +46,44 @@
 static pid_t fallback = 0;
 #endif
 static LIST_HEAD(, tty) tty_list = LIST_HEAD_INITIALIZER();
+static struct pool tty_pool = POOL_INIT("tty", struct tty, 8);
+
+/* PID hash, only TTYs with an active PID are in here */
+#define PID_HASH_SIZE   32
+#define PID_HASH(pid)   ((unsigned int)(pid) & (PID_HASH_SIZE - 1))
+static LIST_HEAD(, tty) pid_hash[PID_HASH_SIZE];
+
+/* Device hash, for tty_find(), all registered TTYs are in here */
+#define NAME_HASH_SIZE  32
+static LIST_HEAD(, tty) name_hash[NAME_HASH_SIZE];
+
+/* Retry interval, msec, for a lazy TTY lost to a hangup */
+#define TTY_RETRY       2000
+
+static unsigned int name_hash_key(const char *name)
+{
+	unsigned int hash = 5381;
+
+	while (*name)
+		hash = ((hash << 5) + hash) + (unsigned char)*name++;
+
+	return hash & (NAME_HASH_SIZE - 1);
+}
+
+static void tty_set_pid(struct tty *tty, pid_t pid)
+{
+	if (tty->pid == pid)
+		return;
+
+	if (tty->pid > 0)
+		LIST_REMOVE(tty, pid_link);
+
+	tty->pid = pid;
+	if (pid > 0)
+		LIST_INSERT_HEAD(&pid_hash[PID_HASH(pid)], tty, pid_link);
+}
+
+static void tty_unwatch(struct tty *tty);
 
 static char *canonicalize(char *tty)
 {
@@ -70,12 +112,15 @@ static char *canonicalize(char *tty)
 	return path;
 }
 
-void tty_mark(void)
+void tty_mark(int (*changed)(char *file))
 {
 	struct tty *tty;
 
-	LIST_FOREACH(tty, &tty_list, link)
+	LIST_FOREACH(tty, &tty_list, link) {
+		if (changed && !changed(tty->conf))
+			continue;
 		tty->dirty = -1;
+	}
 }
 
 void tty_sweep(void)
@@ -108,12 +153,12 @@ void tty_sweep(void)
  * a leading '/dev' is encountered the remaining options must be in
  * the following sequence:
  *
- *     tty [!1-9,S] <DEV> [BAUD[,BAUD,...]] [noclear] [nowait] [TERM]
+ *     tty [!1-9,S] <DEV> [BAUD[,BAUD,...]] [noclear] [nowait] [lazy] [TERM]
  *
  * Otherwise the leading prefix must be the full path to an existing
  * getty implementation, with it's arguments following:
  *
- *     tty [!1-9,S] </path/to/getty> [ARGS] [noclear] [nowait]
+ *     tty [!1-9,S] </path/to/getty> [ARGS] [noclear] [nowait] [lazy]
  *
  * Different getty implementations prefer the TTY device argument in
  * different order, so take care to investigate this first.
@@ -125,7 +170,7 @@ int tty_register(char *line, struct rlimit rlimit[], char *file)
 	char       *tok, *cmd = NULL, *args[TTY_MAX_ARGS], buf[256];
 	char             *dev = NULL, *baud = NULL;
 	char       *runlevels = NULL, *term = NULL;
-	int         insert = 0, noclear = 0, nowait = 0, nologin = 0, atcon = 0;
+	int         insert = 0, noclear = 0, nowait = 0, nologin = 0, lazy = 0, atcon = 0;
 
 	if (!line) {
 		_e("Missing argument");
@@ -145,6 +190,8 @@ int tty_register(char *line, struct rlimit rlimit[], char *file)
 			nowait = 1;
 		else if (!strcmp(tok, "nologin"))
 			nologin = 1;
+		else if (!strcmp(tok, "lazy"))
+			lazy = 1;
 		else
 			args[num++] = tok;
 
@@ -221,9 +268,10 @@ again:
 
 	entry = tty_find(dev);
 	if (!entry) {
-		entry = calloc(1, sizeof(*entry));
+		entry = pool_alloc(&tty_pool);
 		if (!entry)
 			return errno = ENOMEM;
+		entry->fd = -1;
 		insert = 1;
 	} else {
 		if (entry->cmd) {
@@ -244,6 +292,7 @@ again:
 	entry->noclear   = noclear;
 	entry->nowait    = nowait;
 	entry->nologin   = nologin;
+	entry->lazy      = lazy;
 	entry->runlevels = conf_parse_runlevels(runlevels);
 
 	/* External getty */
@@ -273,8 +322,10 @@ again:
 	_d("Registering %s getty on TTY %s at %s baud with term %s on runlevels %s",
 	   cmd ? "external" : "built-in", dev, baud ?: "NULL", term ?: "N/A", runlevels ?: "[2-5]");
 
-	if (insert)
+	if (insert) {
 		LIST_INSERT_HEAD(&tty_list, entry, link);
+		LIST_INSERT_HEAD(&name_hash[name_hash_key(entry->name)], entry, name_link);
+	}
 
 	/* Register configured limits */
 	memcpy(entry->rlimit, rlimit, sizeof(entry->rlimit));
@@ -283,6 +334,7 @@ again:
 		entry->dirty = 1; /* Modified, restart */
 	else
 		entry->dirty = 0; /* Not modified */
+	strlcpy(entry->conf, file ? basename(file) : "", sizeof(entry->conf));
 	_d("TTY %s is %sdirty", dev, entry->dirty ? "" : "NOT ");
 
 	if (atcon) {
@@ -303,7 +355,10 @@ int tty_unregister(struct tty *tty)
 		return errno = EINVAL;
 	}
 
+	tty_unwatch(tty);
 	LIST_REMOVE(tty, link);
+	LIST_REMOVE(tty, name_link);
+	tty_set_pid(tty, 0);
 
 	if (tty->cmd) {
 		int i;
@@ -315,7 +370,7 @@ int tty_unregister(struct tty *tty)
 			tty->args[i] = NULL;
 		}
 	}
-	free(tty);
+	pool_free(&tty_pool, tty);
 
 	return 0;
 }
@@ -324,7 +379,7 @@ struct tty *tty_find(char *dev)
 {
 	struct tty *entry;
 
-	LIST_FOREACH(entry, &tty_list, link) {
+	LIST_FOREACH(entry, &name_hash[name_hash_key(dev)], name_link) {
 		if (!strcmp(dev, entry->name))
 			return entry;
 	}
@@ -343,13 +398,14 @@ size_t tty_num(void)
 	return num;
 }
 
+/* Lazy TTYs waiting for input also count, they are only a key away */
 size_t tty_num_active(void)
 {
 	size_t num = 0;
 	struct tty *entry;
 
 	LIST_FOREACH(entry, &tty_list, link) {
-		if (entry->pid)
+		if (entry->pid || entry->fd >= 0)
 			num++;
 	}
 
@@ -360,7 +416,10 @@ struct tty *tty_find_by_pid(pid_t pid)
 {
 	struct tty *entry;
 
-	LIST_FOREACH(entry, &tty_list, link) {
+	if (pid <= 0)
+		return NULL;
+
+	LIST_FOREACH(entry, &pid_hash[PID_HASH(pid)], pid_link) {
 		if (entry->pid == pid)
 			return entry;
 	}
@@ -368,6 +427,23 @@ struct tty *tty_find_by_pid(pid_t pid)
 	return NULL;
 }
 
+/* Active TTYs as "tty NAME PID" lines, for a re-exec, see reexec.c */
+void tty_save(int fd)
+{
+	struct tty *entry;
+
+	LIST_FOREACH(entry, &tty_list, link) {
+		if (entry->pid > 0)
+			dprintf(fd, "tty %s %d\n", entry->name, entry->pid);
+	}
+}
+
+/* Take over a getty started by Finit before a re-exec */
+void tty_adopt(struct tty *tty, pid_t pid)
+{
+	tty_set_pid(tty, pid);
+}
+
 static int tty_exist(char *dev)
 {
 	int fd, result;
@@ -384,6 +460,131 @@ static int tty_exist(char *dev)
 	return result;
 }
 
+static void tty_spawn(struct tty *tty, char *dev, int nowait)
+{
+	/* The child writes its own UTMP records, after ours */
+	utmp_flush();
+
+	if (tty->nologin) {
+		_d("%s: Starting /bin/sh ...", dev);
+		tty_set_pid(tty, run_sh(dev, tty->noclear, nowait, tty->rlimit));
+		return;
+	}
+
+	_d("%s: Starting %sgetty ...", dev, !tty->cmd ? "built-in " : "");
+	if (!tty->cmd)
+		tty_set_pid(tty, run_getty(dev, tty->baud, tty->term, tty->noclear, nowait, tty->rlimit));
+	else
+		tty_set_pid(tty, run_getty2(dev, tty->cmd, tty->args, tty->noclear, nowait, tty->rlimit));
+}
+
+static void tty_unwatch(struct tty *tty)
+{
+	uev_timer_stop(&tty->retry);
+	if (tty->fd < 0)
+		return;
+
+	uev_io_stop(&tty->watcher);
+	close(tty->fd);
+	tty->fd = -1;
+}
+
+/*
+ * Lazy TTY lost to a hangup, e.g. a USB serial adapter unplugged.  The
+ * tty plugin restarts it when the device node is created again, this
+ * covers a hangup without one, retrying until it can be watched again.
+ */
+static void tty_retry(uev_t *w, void *arg, int events)
+{
+	struct tty *tty = arg;
+
+	if (UEV_ERROR == events)
+		return;
+
+	if (!tty->lazy || !tty_enabled(tty) || tty->pid || tty->fd >= 0) {
+		uev_timer_stop(w);
+		return;
+	}
+
+	tty_start(tty);
+}
+
+/*
+ * Input on an idle lazy TTY, fork its getty.  The input only wakes us
+ * up, it is discarded, and the getty does not ask for Enter again.
+ */
+static void tty_activity(uev_t *w, void *arg, int events)
+{
+	struct tty *tty = arg;
+	char buf[64], *dev;
+
+	if (events & (UEV_ERROR | UEV_HUP)) {
+		_d("%s: lost TTY, waiting for it to return", tty->name);
+		tty_unwatch(tty);
+		if (uev_timer_init(ctx, &tty->retry, tty_retry, tty, TTY_RETRY, TTY_RETRY))
+			_pe("%s: Failed starting TTY retry timer", tty->name);
+		return;
+	}
+
+	while (read(w->fd, buf, sizeof(buf)) > 0)
+		;
+
+	/* Same as activate_console(), ignore input while stopped */
+	if (fexist(SYNC_SHUTDOWN) || fexist(SYNC_STOPPED))
+		return;
+
+	tty_unwatch(tty);
+	dev = canonicalize(tty->name);
+	if (!dev)
+		return;
+
+	_d("%s: input on lazy TTY", dev);
+	tty_spawn(tty, dev, 1);
+}
+
+/*
+ * Lazy TTY, instead of a getty waiting for Enter we watch the TTY in
+ * the event loop, with all other idle TTYs, and show the same prompt.
+ */
+static void tty_watch(struct tty *tty, char *dev)
+{
+	static const char msg[] = "\nPlease press Enter to activate this console.";
+	struct termios c;
+	int fd;
+
+	if (tty->fd >= 0)
+		return;
+
+	fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		_pe("%s: Failed opening TTY", dev);
+		return;
+	}
+
+	stty(fd, stty_parse_speed(tty->baud));
+	if (!tcgetattr(fd, &c)) {
+		c.c_iflag &= ~(BRKINT|ICRNL|INPCK|ISTRIP|IXON|IXOFF);
+		c.c_oflag &= ~(OPOST);
+		c.c_lflag &= ~(ECHO|ICANON|IEXTEN|ISIG);
+		tcsetattr(fd, TCSAFLUSH, &c);
+	}
+
+	if (!tty->noclear)
+		(void)write(fd, "\e[r\e[H\e[J", 9);
+	if (!tty->nowait)
+		(void)write(fd, msg, strlen(msg));
+
+	if (uev_io_init(ctx, &tty->watcher, tty_activity, tty, fd, UEV_READ)) {
+		_pe("%s: Failed watching TTY", dev);
+		close(fd);
+		return;
+	}
+
+	_d("%s: waiting for input on lazy TTY", dev);
+	uev_timer_stop(&tty->retry);
+	tty->fd = fd;
+}
+
 void tty_start(struct tty *tty)
 {
 	char *dev;
@@ -393,6 +594,10 @@ void tty_start(struct tty *tty)
 		return;
 	}
 
+	/* No longer lazy after reload */
+	if (!tty->lazy)
+		tty_unwatch(tty);
+
 	dev = canonicalize(tty->name);
 	if (!dev) {
 		_d("%s: Cannot find TTY device: %s", tty->name, strerror(errno));
@@ -404,21 +609,15 @@ void tty_start(struct tty *tty)
 		return;
 	}
 
-	if (tty->nologin) {
-		_d("%s: Starting /bin/sh ...", dev);
-		tty->pid = run_sh(dev, tty->noclear, tty->nowait, tty->rlimit);
-		return;
-	}
-
-	_d("%s: Starting %sgetty ...", dev, !tty->cmd ? "built-in " : "");
-	if (!tty->cmd)
-		tty->pid = run_getty(dev, tty->baud, tty->term, tty->noclear, tty->nowait, tty->rlimit);
+	if (tty->lazy)
+		tty_watch(tty, dev);
 	else
-		tty->pid = run_getty2(dev, tty->cmd, tty->args, tty->noclear, tty->nowait, tty->rlimit);
+		tty_spawn(tty, dev, tty->nowait);
 }
 
 void tty_stop(struct tty *tty)
 {
+	tty_unwatch(tty);
 	if (!tty->pid)
 		return;
 
@@ -431,7 +630,7 @@ void tty_stop(struct tty *tty)
 	_d("Stopping TTY %s", tty->name);
 	kill(tty->pid, SIGKILL);
 	waitpid(tty->pid, NULL, 0);
-	tty->pid = 0;
+	tty_set_pid(tty, 0);
 }
 
 int tty_enabled(struct tty *tty)
@@ -463,6 +662,7 @@ int tty_fallback(pid_t lost)
 	if (fallback != lost || tty_num_active())
 		return 0;
 
+	metric_inc(METRIC_FORK);
 	fallback = fork();
 	if (fallback)
 		return 1;
@@ -504,7 +704,7 @@ int tty_respawn(pid_t pid)
 	utmp_set_dead(pid);
 
 	/* Clear PID to be able to respawn it. */
-	tty->pid = 0;
+	tty_set_pid(tty, 0);
 	tty_action(tty);
 
 	return 1;
@@ -28,12 +28,15 @@
 #include <limits.h>
 #include <sys/resource.h>
 #include <lite/queue.h>		/* BSD sys/queue.h API */
+#include <uev/uev.h>
 
 #define TTY_MAX_ARGS 16
 #define EVENT_SIZE ((sizeof(struct inotify_event) + NAME_MAX + 1))
 
 struct tty {
 	LIST_ENTRY(tty) link;
+	LIST_ENTRY(tty) pid_link;	/* PID hash, see tty_set_pid() */
+	LIST_ENTRY(tty) name_link;	/* Device hash, see tty_find() */
 
 	char   name[42];
 	char   baud[10];
@@ -41,21 +44,26 @@ struct tty {
 	int    noclear;
 	int    nowait;
 	int    nologin;
+	int    lazy;		/* Fork getty only on input, see tty_watch() */
 	int    runlevels;
 
 	char  *cmd;		/* NULL when running built-in getty */
 	char  *args[TTY_MAX_ARGS];
 
 	int    pid;
+	int    fd;		/* Idle lazy TTY watched by Finit, or -1 */
+	uev_t  watcher;
+	uev_t  retry;		/* Watch again after hangup, see tty_activity() */
 
 	/* Limits and scoping */
 	struct rlimit rlimit[RLIMIT_NLIMITS];
 
 	/* Set if modified => reloaded, or -1 when marked for removal */
 	int    dirty;
+	char   conf[64];	/* Basename of .conf, if any */
 };
 
-void	    tty_mark	    (void);
+void	    tty_mark	    (int (*changed)(char *file));
 void	    tty_sweep	    (void);
 
 int	    tty_register    (char *line, struct rlimit rlimit[], char *file);
@@ -65,6 +73,8 @@ struct tty *tty_find	    (char *dev);
 size_t	    tty_num	    (void);
 size_t      tty_num_active  (void);
 struct tty *tty_find_by_pid (pid_t pid);
+void	    tty_save	    (int fd);
+void	    tty_adopt	    (struct tty *tty, pid_t pid);
 void	    tty_start	    (struct tty *tty);
 void	    tty_stop	    (struct tty *tty);
 int	    tty_enabled	    (struct tty *tty);
@@ -0,0 +1,247 @@
+/* Per-service resource usage, for initctl
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usage.h"
+
+#define CGROUP_SYSTEM "/sys/fs/cgroup/finit/system"
+
+static FILE *cg_open(svc_t *svc, const char *file)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), CGROUP_SYSTEM "/%s:%s/%s", svc->name, svc->id, file);
+
+	return fopen(path, "r");
+}
+
+/* Read single value file, e.g. memory.current */
+static int cg_value(svc_t *svc, const char *file, uint64_t *val)
+{
+	FILE *fp;
+	int rc;
+
+	fp = cg_open(svc, file);
+	if (!fp)
+		return 1;
+
+	rc = fscanf(fp, "%" SCNu64, val) != 1;
+	fclose(fp);
+
+	return rc;
+}
+
+/* Read "key value" from flat keyed file, e.g. cpu.stat */
+static int cg_keyed(svc_t *svc, const char *file, const char *key, uint64_t *val)
+{
+	char buf[128];
+	size_t len = strlen(key);
+	int rc = 1;
+	FILE *fp;
+
+	fp = cg_open(svc, file);
+	if (!fp)
+		return 1;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (strncmp(buf, key, len) || buf[len] != ' ')
+			continue;
+
+		rc = sscanf(&buf[len + 1], "%" SCNu64, val) != 1;
+		break;
+	}
+	fclose(fp);
+
+	return rc;
+}
+
+/* Sum of rbytes= and wbytes= for all devices in io.stat */
+static void cg_io(svc_t *svc, struct svc_usage *usage)
+{
+	char buf[256];
+	FILE *fp;
+
+	fp = cg_open(svc, "io.stat");
+	if (!fp)
+		return;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		uint64_t val;
+		char *ptr;
+
+		ptr = strstr(buf, "rbytes=");
+		if (ptr && sscanf(ptr + 7, "%" SCNu64, &val) == 1)
+			usage->io_read += val;
+		ptr = strstr(buf, "wbytes=");
+		if (ptr && sscanf(ptr + 7, "%" SCNu64, &val) == 1)
+			usage->io_write += val;
+	}
+	fclose(fp);
+}
+
+/* All processes in the group, requires cgroup v2 with controllers */
+static int usage_cgroup(svc_t *svc, struct svc_usage *usage)
+{
+	if (cg_keyed(svc, "cpu.stat", "usage_usec", &usage->cpu_usec))
+		return 1;
+
+	cg_value(svc, "memory.current", &usage->mem);
+	cg_value(svc, "memory.peak", &usage->mem_peak);
+	cg_io(svc, usage);
+	usage->cgroup = 1;
+
+	return 0;
+}
+
+/* Main process only, when cgroup v2 is not available */
+static int usage_proc(svc_t *svc, struct svc_usage *usage)
+{
+	unsigned long utime, stime;
+	char path[64], buf[128], line[1024];
+	long hz;
+	FILE *fp;
+	int rc;
+
+	if (svc->pid <= 0)
+		return 1;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", svc->pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 1;
+
+	/* Fields 14 and 15, utime and stime, comm may contain spaces */
+	rc = 1;
+	if (fgets(line, sizeof(line), fp)) {
+		char *ptr;
+
+		ptr = strrchr(line, ')');
+		if (ptr && sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+				  &utime, &stime) == 2)
+			rc = 0;
+	}
+	fclose(fp);
+	if (rc)
+		return 1;
+
+	hz = sysconf(_SC_CLK_TCK);
+	if (hz <= 0)
+		hz = 100;
+	usage->cpu_usec = (uint64_t)(utime + stime) * 1000000 / hz;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", svc->pid);
+	fp = fopen(path, "r");
+	if (fp) {
+		uint64_t kb;
+
+		while (fgets(buf, sizeof(buf), fp)) {
+			if (sscanf(buf, "VmRSS: %" SCNu64, &kb) == 1)
+				usage->mem = kb * 1024;
+			else if (sscanf(buf, "VmHWM: %" SCNu64, &kb) == 1)
+				usage->mem_peak = kb * 1024;
+		}
+		fclose(fp);
+	}
+
+	/* Only readable by root, or the owner of the process */
+	snprintf(path, sizeof(path), "/proc/%d/io", svc->pid);
+	fp = fopen(path, "r");
+	if (fp) {
+		while (fgets(buf, sizeof(buf), fp)) {
+			sscanf(buf, "read_bytes: %" SCNu64, &usage->io_read);
+			sscanf(buf, "write_bytes: %" SCNu64, &usage->io_write);
+		}
+		fclose(fp);
+	}
+
+	return 0;
+}
+
+/**
+ * usage_get - Get resource usage of a service
+ * @svc:   Service, from client_svc_list() or client_svc_find()
+ * @usage: Pointer to &struct svc_usage to fill in
+ *
+ * Prefers the cgroup of the service, which covers all its processes.
+ * Otherwise /proc of the main PID is used.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if no usage could be read.
+ */
+int usage_get(svc_t *svc, struct svc_usage *usage)
+{
+	memset(usage, 0, sizeof(*usage));
+
+	if (!usage_cgroup(svc, usage))
+		return 0;
+
+	memset(usage, 0, sizeof(*usage));
+	if (!usage_proc(svc, usage))
+		return 0;
+
+	return errno = ENOENT;
+}
+
+/* Human readable size, e.g., 1.5M */
+char *usage_bytes(uint64_t bytes, char *buf, size_t len)
+{
+	const char *unit = "KMGT";
+	double val = bytes;
+	int i = -1;
+
+	while (val >= 1024 && i < 3) {
+		val /= 1024;
+		i++;
+	}
+
+	if (i < 0)
+		snprintf(buf, len, "%" PRIu64, bytes);
+	else
+		snprintf(buf, len, "%.1f%c", val, unit[i]);
+
+	return buf;
+}
+
+/* CPU time, e.g., 1:02.34 (min:sec) */
+char *usage_cpu(uint64_t usec, char *buf, size_t len)
+{
+	uint64_t csec = usec / 10000;
+
+	snprintf(buf, len, "%" PRIu64 ":%02" PRIu64 ".%02" PRIu64,
+		 csec / 6000, (csec / 100) % 60, csec % 100);
+
+	return buf;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
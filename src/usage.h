@@ -0,0 +1,51 @@
+/* Per-service resource usage, for initctl
+ *
+ * Copyright (c) 2019  Joachim Nilsson <troglobit@gmail.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_USAGE_H_
+#define FINIT_USAGE_H_
+
+#include <stdint.h>
+#include "svc.h"
+
+struct svc_usage {
+	int      cgroup;		/* Set if read from cgroup, else /proc */
+	uint64_t cpu_usec;		/* User + system time */
+	uint64_t mem;			/* Current memory use, or RSS, bytes */
+	uint64_t mem_peak;		/* Peak memory use, or max RSS, 0 if N/A */
+	uint64_t io_read;		/* Bytes read from storage */
+	uint64_t io_write;		/* Bytes written to storage */
+};
+
+int   usage_get    (svc_t *svc, struct svc_usage *usage);
+char *usage_bytes  (uint64_t bytes, char *buf, size_t len);
+char *usage_cpu    (uint64_t usec, char *buf, size_t len);
+
+#endif /* FINIT_USAGE_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -125,6 +125,21 @@ long jiffies(void)
 	return 0;
 }
 
+/*
+ * Nanoseconds since boot, same clock as jiffies(), including time in
+ * suspend.  For timestamps that must tell apart events within the same
+ * second, e.g., a crashing service restarted.
+ */
+long long jiffies_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_BOOTTIME, &ts))
+		return 0;
+
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 char *uptime(long secs, char *buf, size_t len)
 {
 	long mins, hours, days, years;
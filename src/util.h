@@ -44,6 +44,7 @@ int   strtobytes   (char *arg);
 void  do_sleep     (unsigned int sec);
 
 long  jiffies      (void);
+long long jiffies_ns(void);
 char *uptime       (long secs, char *buf, size_t len);
 
 char *sanitize     (char *arg, size_t len);
@@ -23,6 +23,7 @@
 
 #include "config.h"
 
+#include <fcntl.h>
 #include <paths.h>
 #include <time.h>
 #include <utmp.h>
@@ -30,7 +31,9 @@
 #include <sys/utsname.h>
 #include <lite/lite.h>
 
+#include "finit.h"
 #include "helpers.h"
+#include "utmp-api.h"
 
 #ifndef _PATH_BTMP
 #define _PATH_BTMP "/var/log/btmp"
@@ -39,6 +42,19 @@
 #define MAX_NO 5
 #define MAX_SZ 100 * 1024
 
+/*
+ * In PID 1 records are queued and written in one go, by a timer in the
+ * event loop, when the queue is full, or by utmp_flush().  Processes
+ * forked by Finit, e.g., getty, write their records directly.
+ */
+#define UTMP_BATCH_MAX   32
+#define UTMP_BATCH_DELAY 100	/* msec */
+
+static struct utmp batch[UTMP_BATCH_MAX];
+static int         batch_num;
+static uev_t       batch_timer;
+static int         batch_armed;
+
 static void utmp_strncpy(char *dst, const char *src, size_t dlen)
 {
 	size_t i;
@@ -132,9 +148,99 @@ void utmp_logrotate(void)
 #endif /* LOGROTATE_ENABLED */
 }
 
-int utmp_set(int type, int pid, char *line, char *id, char *user)
+/* All records go to wtmp, appended with one write() under one lock */
+static void wtmp_write(struct utmp *ut, int num)
+{
+	struct flock fl = {
+		.l_type   = F_WRLCK,
+		.l_whence = SEEK_SET,
+	};
+	int fd;
+
+	fd = open(_PATH_WTMP, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	if (!fcntl(fd, F_SETLKW, &fl)) {
+		if (write(fd, ut, num * sizeof(*ut)) != (ssize_t)(num * sizeof(*ut)))
+			_pe("Failed writing %s", _PATH_WTMP);
+
+		fl.l_type = F_UNLCK;
+		fcntl(fd, F_SETLK, &fl);
+	}
+	close(fd);
+}
+
+/* In order, utmp is only opened once, and only rotated once per batch */
+static int utmp_write(struct utmp *ut, int num)
 {
 	int result = 0;
+	int i;
+
+	setutent();
+	for (i = 0; i < num; i++) {
+		if (ut[i].ut_type != DEAD_PROCESS)
+			result += pututline(&ut[i]) ? 0 : 1;
+	}
+	endutent();
+
+	utmp_logrotate();
+	wtmp_write(ut, num);
+
+	return result;
+}
+
+/**
+ * utmp_flush - Write queued UTMP/WTMP records
+ *
+ * Called by the batch timer, and before anything that must see the
+ * records on disk: forking a getty, which writes its own records, and
+ * halt, reboot, or re-exec.
+ */
+void utmp_flush(void)
+{
+	if (batch_armed) {
+		uev_timer_stop(&batch_timer);
+		batch_armed = 0;
+	}
+
+	if (!batch_num)
+		return;
+
+	_d("Writing %d UTMP records", batch_num);
+	utmp_write(batch, batch_num);
+	batch_num = 0;
+}
+
+static void batch_cb(uev_t *w, void *arg, int events)
+{
+	batch_armed = 0;
+	utmp_flush();
+}
+
+/* Queue @ut, only in PID 1 and only after the event loop is set up */
+static int utmp_queue(struct utmp *ut)
+{
+	if (getpid() != 1 || !ctx)
+		return 1;
+
+	if (batch_num == UTMP_BATCH_MAX)
+		utmp_flush();
+	batch[batch_num++] = *ut;
+
+	if (!batch_armed) {
+		if (uev_timer_init(ctx, &batch_timer, batch_cb, NULL, UTMP_BATCH_DELAY, 0)) {
+			utmp_flush();
+			return 0;
+		}
+		batch_armed = 1;
+	}
+
+	return 0;
+}
+
+int utmp_set(int type, int pid, char *line, char *id, char *user)
+{
 	struct utmp ut;
 	struct utsname uts;
 
@@ -162,16 +268,10 @@ int utmp_set(int type, int pid, char *line, char *id, char *user)
 		utmp_strncpy(ut.ut_host, uts.release, sizeof(ut.ut_host));
 	ut.ut_tv.tv_sec = time(NULL);
 
-	if (type != DEAD_PROCESS) {
-		setutent();
-		result += pututline(&ut) ? 0 : 1;
-		endutent();
-	}
-
-	utmp_logrotate();
-	updwtmp(_PATH_WTMP, &ut);
+	if (!utmp_queue(&ut))
+		return 0;
 
-	return result;
+	return utmp_write(&ut, 1);
 }
 
 int utmp_set_boot(void)
@@ -179,9 +279,15 @@ int utmp_set_boot(void)
 	return utmp_set(BOOT_TIME, 0, NULL, NULL, "reboot");
 }
 
+/* Last record before file systems are unmounted, flush everything */
 int utmp_set_halt(void)
 {
-	return utmp_set(RUN_LVL, 0, NULL, NULL, "shutdown");
+	int rc;
+
+	rc = utmp_set(RUN_LVL, 0, NULL, NULL, "shutdown");
+	utmp_flush();
+
+	return rc;
 }
 
 static int set_getty(int type, char *tty, char *id, char *user)
@@ -32,6 +32,7 @@ int utmp_set_login   (char *tty, char *id);
 int utmp_set_dead    (int pid);
 int utmp_set_runlevel(int pre, int now);
 int utmp_show        (char *file);
+void utmp_flush      (void);
 
 void runlevel_set    (int pre, int now);
 
@@ -22,40 +22,50 @@
  */
 
 #include <config.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
 #include <syslog.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <linux/watchdog.h>
 
 #include "watchdog.h"
 
 int running  = 1;
 int handover = 0;
-int shutdown = 0;
+int powerdown = 0;
 
 static void sighandler(int signo)
 {
 	if (signo == SIGTERM)
 		handover = 1;
 	if (signo == SIGPWR)
-		shutdown = 1;
+		powerdown = 1;
 
 	running = 0;
 }
 
 static int init(char *progname, char *devnode)
 {
+	struct sigaction sa = { .sa_handler = sighandler };
 	int fd;
 
 	sprintf(progname, "@finit-watchdog");
-	signal(SIGTERM, sighandler);
-	signal(SIGPWR,  sighandler);
+
+	/* No SA_RESTART, poll() must return on signals */
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGPWR,  &sa, NULL);
 
 	openlog(&progname[1], LOG_CONS | LOG_PID, LOG_DAEMON);
 	syslog(LOG_INFO, "Finit v%s basic watchdogd starting ...", VERSION);
@@ -67,20 +77,137 @@ static int init(char *progname, char *devnode)
 	return fd;
 }
 
+/* Socket to receive heartbeats from Finit on, or -1 for basic mode */
+static int heartbeat_init(void)
+{
+	struct sockaddr_un sun = {
+		.sun_family = AF_UNIX,
+		.sun_path   = WDT_HEARTBEAT,
+	};
+	int sd;
+
+	sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+		return -1;
+
+	unlink(WDT_HEARTBEAT);
+	if (bind(sd, (struct sockaddr *)&sun, sizeof(sun))) {
+		syslog(LOG_WARNING, "Failed binding %s, not supervising Finit: %m", WDT_HEARTBEAT);
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+/* Read all pending heartbeats, returns 1 if the last one was OK */
+static int heartbeat_read(int sd, int healthy)
+{
+	char buf[128];
+	ssize_t len;
+
+	while ((len = recv(sd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = 0;
+		if (!strcmp(buf, "OK")) {
+			if (!healthy)
+				syslog(LOG_NOTICE, "Finit healthy, kicking %s", WDT_DEVNODE);
+			healthy = 1;
+		} else {
+			if (healthy)
+				syslog(LOG_ALERT, "Finit reports %s, no longer kicking %s", buf, WDT_DEVNODE);
+			healthy = 0;
+		}
+	}
+
+	return healthy;
+}
+
+static time_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Kick the watchdog every timeout/2 seconds.  In supervised mode, i.e.,
+ * after the first heartbeat from Finit, only as long as Finit's event
+ * loop keeps sending OK heartbeats.  A stalled PID 1, or a critical
+ * service not sending WATCHDOG=1, then means a reboot.
+ */
 static int loop(int fd, int timeout)
 {
-	int dummy = 0;
+	struct itimerspec its = { 0 };
+	struct pollfd pfd[2];
 	int period = timeout / 2;
+	int supervised = 0;
+	int healthy = 1;
+	int stalled = 0;
+	time_t last = 0;
+	int dummy = 0;
+	int tfd, sd;
 
 	ioctl(fd, WDIOC_SETTIMEOUT, &timeout);
 
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd == -1) {
+		syslog(LOG_ERR, "Failed creating timer: %m");
+		return 1;
+	}
+	its.it_value.tv_sec    = period;
+	its.it_interval.tv_sec = period;
+	timerfd_settime(tfd, 0, &its, NULL);
+
+	sd = heartbeat_init();
+
+	pfd[0].fd     = tfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd     = sd;
+	pfd[1].events = POLLIN;
+
+	ioctl(fd, WDIOC_KEEPALIVE, &dummy);
 	while (running) {
+		uint64_t expired;
+
+		if (poll(pfd, sd == -1 ? 1 : 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (sd != -1 && (pfd[1].revents & POLLIN)) {
+			healthy = heartbeat_read(sd, healthy);
+			if (!supervised)
+				syslog(LOG_INFO, "Got first heartbeat from Finit, supervising it.");
+			supervised = 1;
+			if (healthy)
+				last = now();
+		}
+
+		if (!(pfd[0].revents & POLLIN) || read(tfd, &expired, sizeof(expired)) <= 0)
+			continue;
+
+		if (supervised && (!healthy || now() - last > period)) {
+			if (healthy && !stalled)
+				syslog(LOG_ALERT, "No heartbeat from Finit in %d sec, not kicking %s",
+				       period, WDT_DEVNODE);
+			stalled = 1;
+			continue;
+		}
+
 		ioctl(fd, WDIOC_KEEPALIVE, &dummy);
-		sleep(period);
+		stalled = 0;
+	}
+
+	if (sd != -1) {
+		close(sd);
+		unlink(WDT_HEARTBEAT);
 	}
+	close(tfd);
 
 	/* System is going down, prepare to reboot system on TERM */
-	if (shutdown) {
+	if (powerdown) {
 		timeout /= 3;
 		ioctl(fd, WDIOC_SETTIMEOUT, &timeout);
 	}
@@ -114,7 +241,7 @@ int main(int argc, char *argv[])
 		sleep(1);
 
 		/* Set lowest possible timeout on SIGTERM */
-		ioctl(fd, WDIOC_SETTIMEOUT, &shutdown);
+		ioctl(fd, WDIOC_SETTIMEOUT, &powerdown);
 	}
 	close(fd);
 
@@ -23,9 +23,20 @@
 
 #include "config.h"		/* Generated by configure script */
 
+#include <paths.h>
+
 #define WDT_DEVNODE "/dev/watchdog"
 #define WDT_TIMEOUT 30
 
+/*
+ * Finit sends a heartbeat datagram to watchdogd on this socket from its
+ * event loop, "OK" when all services with watchdog:SEC are healthy, or
+ * "SICK name" when not.  Once the first heartbeat has been received,
+ * watchdogd only kicks the device as long as it receives OK heartbeats.
+ */
+#define WDT_HEARTBEAT      _PATH_VARRUN "finit-wdog.sock"
+#define WDT_HEARTBEAT_MSEC 1000
+
 #ifdef BUILTIN_WATCHDOG
 int     watchdog(char *progname);
 #else